@@ -0,0 +1,228 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+
+#include "node/service/admission_control.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <utility>
+
+#include <base/logging.h>
+
+#include "node/service/constants.h"
+#include "node/service/hash.h"
+
+namespace node {
+
+namespace {
+
+// The smallest size of the hash table.
+const size_t kMinTableSize = 64;
+
+// Adds to |tokens| what a bucket that is refilled at |rate| per second
+// earns in |seconds|, without going above a second worth of tokens.
+void Refill(double* tokens, int64 rate, double seconds) {
+  *tokens = std::min(*tokens + seconds * rate, static_cast<double>(rate));
+}
+
+}  // namespace
+
+AdmissionControl::AdmissionControl()
+  : count_(0),
+    max_tracked_keys_(kAdmissionMaxTrackedKeys),
+    idle_timeout_(base::TimeDelta::FromMilliseconds(kAdmissionIdleTimeout)),
+    rejected_count_(0),
+    overflow_count_(0) {
+}
+
+AdmissionControl::~AdmissionControl() {
+}
+
+void AdmissionControl::SetDefaultLimits(const Limits& limits) {
+  default_limits_ = limits;
+  UpdateLimits();
+}
+
+bool AdmissionControl::SetLimits(const std::string& key,
+  const Limits& limits) {
+  std::map<std::string, Limits>::iterator it = key_limits_.find(key);
+  if (limits.Equals(default_limits_)) {
+    if (it != key_limits_.end()) {
+      key_limits_.erase(it);
+      UpdateLimits();
+    }
+    return true;
+  }
+
+  if (it == key_limits_.end()) {
+    if (key_limits_.size() >= kAdmissionMaxKeys) {
+      return false;
+    }
+    it = key_limits_.insert(std::make_pair(key, limits)).first;
+  }
+  it->second = limits;
+  UpdateLimits();
+  return true;
+}
+
+bool AdmissionControl::Admit(const char* key, size_t key_size, size_t size,
+  base::TimeTicks now) {
+  if (!enabled()) {
+    return true;
+  }
+
+  Entry* entry = FindOrInsert(key, key_size, Hash(key, key_size), now);
+  const Limits& limits = entry->limits;
+  double seconds = (now - entry->last_seen).InSecondsF();
+  if (seconds > 0) {
+    Refill(&entry->messages, limits.messages_per_second, seconds);
+    Refill(&entry->bytes, limits.bytes_per_second, seconds);
+    entry->last_seen = now;
+  }
+
+  if (limits.unlimited()) {
+    return true;
+  }
+  if ((limits.messages_per_second && entry->messages < 1) ||
+    (limits.bytes_per_second && entry->bytes <= 0)) {
+    ++rejected_count_;
+    return false;
+  }
+  entry->messages -= 1;
+  entry->bytes -= size;
+  return true;
+}
+
+AdmissionControl::Entry* AdmissionControl::FindOrInsert(const char* key,
+  size_t key_size, uint32 hash, base::TimeTicks now) {
+  // A full table is not rebuilt by the inserts, so it is rebuilt once every
+  // idle timeout to evict the keys that has gone idle.
+  if (entries_.empty() || (count_ + 1) * 4 > entries_.size() * 3 ||
+    (count_ >= max_tracked_keys_ && now - rebuilt_time_ >= idle_timeout_)) {
+    Rebuild(now);
+  }
+
+  // Linear probing, the table always has empty entries.
+  size_t mask = entries_.size() - 1;
+  size_t i = hash & mask;
+  while (entries_[i].used) {
+    Entry& entry = entries_[i];
+    if (entry.hash == hash && entry.key.size() == key_size &&
+      memcmp(entry.key.data(), key, key_size) == 0) {
+      return &entry;
+    }
+    i = (i + 1) & mask;
+  }
+
+  // The table is full of active keys, only the keys that has limits of their
+  // own are still tracked on their own. The overflow bucket is refilled
+  // like the others.
+  if (count_ >= max_tracked_keys_ && !HasOwnLimits(key, key_size)) {
+    if (!overflow_.used) {
+      overflow_.used = true;
+      overflow_.limits = default_limits_;
+      overflow_.messages =
+        static_cast<double>(default_limits_.messages_per_second);
+      overflow_.bytes = static_cast<double>(default_limits_.bytes_per_second);
+      overflow_.last_seen = now;
+    }
+    ++overflow_count_;
+    return &overflow_;
+  }
+
+  // A new key starts with full buckets.
+  Entry& entry = entries_[i];
+  entry.used = true;
+  entry.hash = hash;
+  entry.key.assign(key, key_size);
+  entry.limits = GetLimits(entry.key);
+  entry.messages = static_cast<double>(entry.limits.messages_per_second);
+  entry.bytes = static_cast<double>(entry.limits.bytes_per_second);
+  entry.last_seen = now;
+  ++count_;
+  return &entry;
+}
+
+void AdmissionControl::Rebuild(base::TimeTicks now) {
+  size_t live = 0;
+  for (size_t i = 0; i < entries_.size(); ++i) {
+    Entry& entry = entries_[i];
+    if (entry.used && now - entry.last_seen < idle_timeout_) {
+      ++live;
+    } else {
+      entry.used = false;
+    }
+  }
+
+  // The table is kept at most half full after a rebuild, so it is not
+  // rebuilt again too soon.
+  size_t size = kMinTableSize;
+  while (size < (live + 1) * 2) {
+    size *= 2;
+  }
+
+  std::vector<Entry> entries(size);
+  size_t mask = size - 1;
+  for (size_t i = 0; i < entries_.size(); ++i) {
+    Entry& entry = entries_[i];
+    if (!entry.used) {
+      continue;
+    }
+    size_t j = entry.hash & mask;
+    while (entries[j].used) {
+      j = (j + 1) & mask;
+    }
+    Entry& moved = entries[j];
+    moved.used = true;
+    moved.hash = entry.hash;
+    moved.key.swap(entry.key);
+    moved.limits = entry.limits;
+    moved.messages = entry.messages;
+    moved.bytes = entry.bytes;
+    moved.last_seen = entry.last_seen;
+  }
+
+  if (count_ != live) {
+    VLOG(1) << "Evicted " << count_ - live << " idle admission keys";
+  }
+  entries_.swap(entries);
+  count_ = live;
+  rebuilt_time_ = now;
+}
+
+bool AdmissionControl::HasOwnLimits(const char* key, size_t key_size) const {
+  return !key_limits_.empty() &&
+    key_limits_.find(std::string(key, key_size)) != key_limits_.end();
+}
+
+const AdmissionControl::Limits& AdmissionControl::GetLimits(
+  const std::string& key) const {
+  std::map<std::string, Limits>::const_iterator it = key_limits_.find(key);
+  if (it != key_limits_.end()) {
+    return it->second;
+  }
+  return default_limits_;
+}
+
+void AdmissionControl::UpdateLimits() {
+  // The buckets keep their tokens, but never more than the new limits
+  // allows.
+  for (size_t i = 0; i < entries_.size(); ++i) {
+    Entry& entry = entries_[i];
+    if (!entry.used) {
+      continue;
+    }
+    entry.limits = GetLimits(entry.key);
+    Refill(&entry.messages, entry.limits.messages_per_second, 0);
+    Refill(&entry.bytes, entry.limits.bytes_per_second, 0);
+  }
+  if (overflow_.used) {
+    overflow_.limits = default_limits_;
+    Refill(&overflow_.messages, overflow_.limits.messages_per_second, 0);
+    Refill(&overflow_.bytes, overflow_.limits.bytes_per_second, 0);
+  }
+}
+
+}  // namespace node
@@ -0,0 +1,160 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+
+#ifndef NODE_SERVICE_ADMISSION_CONTROL_H_
+#define NODE_SERVICE_ADMISSION_CONTROL_H_
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <base/basictypes.h>
+#include <base/time.h>
+
+namespace node {
+
+// AdmissionControl limits the rate at which each peer could feed the node,
+// so a single misbehaving client could not saturate the message receiver
+// and starve the others.
+//
+// The traffic is accounted by key, which is the identity of the sender or
+// the value of a fact of the packet header, such as the tenant or the
+// service name. Each key has two token buckets, one for the messages and
+// one for the bytes per second, which could hold up to one second of
+// traffic. A message is admitted only if both buckets has tokens, and the
+// bytes bucket could go into debt so a message larger than a second of
+// traffic is still admitted once in a while.
+//
+// The buckets live in an open addressing hash table that is rebuilt when it
+// fills up. The keys that was not seen for longer than the idle timeout are
+// evicted by the rebuild, so the table tracks only the active peers. The
+// table tracks up to kAdmissionMaxTrackedKeys keys; while it is full, the
+// new keys that has no limits of their own are charged to a single overflow
+// bucket that has the default limits, so a client that rotates the values
+// of the admission fact could neither grow the table without bound nor get
+// a fresh bucket for every value.
+//
+// This class is not thread safe, it is used only by the message receiver
+// thread.
+class AdmissionControl {
+ public:
+  // The rates that are allowed for a key. Zero means no limit.
+  struct Limits {
+    Limits() : messages_per_second(0), bytes_per_second(0) {}
+
+    bool unlimited() const {
+      return !messages_per_second && !bytes_per_second;
+    }
+
+    bool Equals(const Limits& other) const {
+      return messages_per_second == other.messages_per_second &&
+        bytes_per_second == other.bytes_per_second;
+    }
+
+    int64 messages_per_second;
+    int64 bytes_per_second;
+  };
+
+  AdmissionControl();
+  ~AdmissionControl();
+
+  // Returns true if some key is limited. The messages are not accounted
+  // while no limit is set.
+  bool enabled() const {
+    return !default_limits_.unlimited() || !key_limits_.empty();
+  }
+
+  // Sets the name of the fact that keys the traffic. The packets that does
+  // not have the fact, and all the packets when the name is empty, are
+  // keyed by their sender.
+  void set_fact(const std::string& fact) { fact_ = fact; }
+  const std::string& fact() const { return fact_; }
+
+  // Sets how long a key should be idle before it could be evicted.
+  void set_idle_timeout(base::TimeDelta timeout) { idle_timeout_ = timeout; }
+
+  // Sets the limits of every key that has no limits of its own.
+  void SetDefaultLimits(const Limits& limits);
+
+  // Sets the limits of |key|, which overrides the default limits for it.
+  // The limits that are equal to the default ones are forgotten. Returns
+  // false if |key| has no limits of its own and there are already
+  // kAdmissionMaxKeys keys that has, in which case nothing is changed.
+  bool SetLimits(const std::string& key, const Limits& limits);
+
+  // Accounts a message of |size| bytes that was received at |now| for the
+  // key of |key_size| bytes pointed by |key|. Returns true if the message
+  // is admitted or false if the key is over its limits, in which case the
+  // message should be discarded.
+  bool Admit(const char* key, size_t key_size, size_t size,
+    base::TimeTicks now);
+
+  // Sets the maximum number of keys that are tracked on their own.
+  void set_max_tracked_keys(size_t count) { max_tracked_keys_ = count; }
+
+  // The number of messages that was not admitted.
+  int64 rejected_count() const { return rejected_count_; }
+
+  // The number of messages that was charged to the overflow bucket.
+  int64 overflow_count() const { return overflow_count_; }
+
+ private:
+  struct Entry {
+    Entry() : used(false), hash(0), messages(0), bytes(0) {}
+
+    bool used;
+    uint32 hash;
+    std::string key;
+    Limits limits;
+
+    // The tokens of the buckets and the last time they was refilled.
+    double messages;
+    double bytes;
+    base::TimeTicks last_seen;
+  };
+
+  // Finds the entry of |key|, inserting it when it is not found. Returns
+  // the overflow entry when |key| is not found and the table is full.
+  Entry* FindOrInsert(const char* key, size_t key_size, uint32 hash,
+    base::TimeTicks now);
+
+  // Returns true if the key of |key_size| bytes pointed by |key| has limits
+  // of its own.
+  bool HasOwnLimits(const char* key, size_t key_size) const;
+
+  // Moves the entries that are not idle at |now| into a table that has room
+  // for at least one more entry.
+  void Rebuild(base::TimeTicks now);
+
+  // Gets the limits of |key|.
+  const Limits& GetLimits(const std::string& key) const;
+
+  // Applies the current limits to the entries of the table.
+  void UpdateLimits();
+
+  // The hash table, whose size is always a power of two, and the number of
+  // its entries that are in use.
+  std::vector<Entry> entries_;
+  size_t count_;
+  size_t max_tracked_keys_;
+  base::TimeTicks rebuilt_time_;
+
+  // The bucket that is shared by the keys that does not fit in the table.
+  Entry overflow_;
+
+  Limits default_limits_;
+  std::map<std::string, Limits> key_limits_;
+  std::string fact_;
+  base::TimeDelta idle_timeout_;
+
+  int64 rejected_count_;
+  int64 overflow_count_;
+
+  DISALLOW_COPY_AND_ASSIGN(AdmissionControl);
+};
+
+}  // namespace node
+
+#endif  // NODE_SERVICE_ADMISSION_CONTROL_H_
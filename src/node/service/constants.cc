@@ -5,6 +5,7 @@
 #include "node/service/constants.h"
 
 #include "base/file_path.h"
+#include "build/build_config.h"
 
 #define FPL FILE_PATH_LITERAL
 
@@ -13,6 +14,92 @@ namespace node {
 // The port used to listen for commands.
 const long kMessageChannelPort = 8520;
 
+// The maximum number of messages that the message channel queues for a
+// single peer. This bounds the memory used by slow peers.
+const int kMessageChannelHighWaterMark = 10000;
+
+// How long, in milliseconds, the message channel tries to deliver the pending
+// messages when the node is stopping.
+const int kMessageChannelLinger = 1000;
+
+// The ipc:// endpoint that is bound by the message channel for the local
+// service hosts. The zeromq ipc transport is not available on Windows, so
+// there is no default ipc endpoint there.
+#if defined(OS_POSIX)
+const char kMessageChannelIpcEndpoint[] = "ipc:///tmp/ruby-node";
+#else
+const char kMessageChannelIpcEndpoint[] = "";
+#endif
+
+// The greatest size, in bytes, of the shared memory rings that is created
+// for a local service host.
+const int kSharedMemoryMaxRingSize = 16 * 1024 * 1024;
+
+// The maximum number of shared memory channels that are waiting for their
+// hosts to open them, and how long, in milliseconds, a channel waits before
+// it is discarded.
+const size_t kSharedMemoryMaxPendingChannels = 16;
+const int kSharedMemoryHandshakeTimeout = 30 * 1000;
+
+// How long, in milliseconds, a sender or fact should be idle before its rate
+// limits stops being tracked.
+const int kAdmissionIdleTimeout = 60 * 1000;
+
+// The maximum number of keys that could have limits of their own.
+const size_t kAdmissionMaxKeys = 4096;
+
+// The maximum number of senders or facts whose rate limits are tracked on
+// their own. The keys that are seen while this many are active share a
+// single overflow bucket.
+const size_t kAdmissionMaxTrackedKeys = 64 * 1024;
+
+// The maximum number of packets and bytes that are queued for a destination
+// that could not receive them right away.
+const size_t kMailboxMaxMessages = 10000;
+const size_t kMailboxMaxBytes = 64 * 1024 * 1024;
+
+// The number of packets that are sent to a host that has announced a service
+// before it grants more credits. The message channel drops the packets
+// above its high water mark silently, so this should not be above it.
+const int kInitialCredits = 1000;
+
+// How long, in milliseconds, the flow control window of a peer that has no
+// routes should be idle before it is removed.
+const int kCreditIdleTimeout = 60 * 1000;
+
+// The maximum number of messages that are routed together.
+const int kMaxRoutingBatchSize = 4096;
+
+// The maximum number of threads that routes the received messages.
+const int kMaxRoutingWorkers = 64;
+
+// The maximum number of requests that are waiting for a reply from a load
+// balanced service, and how long, in milliseconds, a request could wait for
+// its reply before it stops being accounted as outstanding.
+const size_t kMaxPendingRequests = 64 * 1024;
+const int kPendingRequestTimeout = 30 * 1000;
+
+// The number of requests that an instance could let expire in a row before
+// it is reported, and taken out of rotation when the node is asked to.
+const int kMaxInstanceExpiries = 3;
+
+// How often, in milliseconds, the node pings the instances that has
+// announced themselves, and how long an instance could stay silent before
+// it is taken out of rotation.
+const int kHeartbeatInterval = 10 * 1000;
+const int kHeartbeatTimeout = 30 * 1000;
+
+// The number of points of each instance of a partitioned service on its
+// consistent hash ring. More points spread the keys more evenly.
+const int kPartitionVirtualNodes = 128;
+
+// The maximum number of sets of facts whose routes are cached.
+const size_t kRouteCacheMaxSize = 4096;
+
+// The smallest packet, in bytes, that is sent through shared memory to the
+// hosts that use it. Smaller packets are cheaper to send over the socket.
+const int kSharedMemoryMinPacketSize = 16 * 1024;
+
 // The address of the service tracker.
 const char kServiceTrackerAddress[] = "tcp://127.0.0.1:8520";
 
@@ -20,8 +107,23 @@ const wchar_t kRubyServiceName[] = L"NohrosRuby";
 
 const char kNodeServiceName[] = "ruby";
 
+// The route address of the node control message loop. The loop is reached
+// in-process, so this address is never seen on the wire. It starts with a
+// zero byte, like the identities generated by zeromq, but it is shorter than
+// them so it cannot clash with a real peer.
+const char kNodeControlRoute[] = "\0node-control";
+const size_t kNodeControlRouteSize = sizeof(kNodeControlRoute) - 1;
+
 const char kServiceNameFact[] = "service";
 
+// The fact that selects how a request is routed to the instances of a
+// service. It is never matched against the facts of the services.
+const char kRoutingPolicyFact[] = "routing-policy";
+
+// The default name of the fact whose value is the partition key of a
+// request. It is never matched against the facts of the services.
+const char kPartitionKeyFact[] = "partition-key";
+
 const FilePath::CharType kServicesDatabaseFilename[] = FPL("services.db");
 
 const FilePath::CharType kServicesDirname[] = FPL("services");
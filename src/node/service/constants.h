@@ -13,10 +13,37 @@
 namespace node {
 
 extern const long kMessageChannelPort;
+extern const int kMessageChannelHighWaterMark;
+extern const int kMessageChannelLinger;
+extern const char kMessageChannelIpcEndpoint[];
+extern const int kAdmissionIdleTimeout;
+extern const size_t kAdmissionMaxKeys;
+extern const size_t kAdmissionMaxTrackedKeys;
+extern const size_t kMailboxMaxBytes;
+extern const size_t kMailboxMaxMessages;
+extern const int kInitialCredits;
+extern const int kCreditIdleTimeout;
+extern const int kMaxRoutingBatchSize;
+extern const int kMaxRoutingWorkers;
+extern const size_t kMaxPendingRequests;
+extern const int kPendingRequestTimeout;
+extern const int kMaxInstanceExpiries;
+extern const int kHeartbeatInterval;
+extern const int kHeartbeatTimeout;
+extern const int kPartitionVirtualNodes;
+extern const size_t kRouteCacheMaxSize;
+extern const int kSharedMemoryMaxRingSize;
+extern const size_t kSharedMemoryMaxPendingChannels;
+extern const int kSharedMemoryHandshakeTimeout;
+extern const int kSharedMemoryMinPacketSize;
 extern const wchar_t kRubyServiceName[];
 extern const char kServiceTrackerAddress[];
 extern const char kNodeServiceName[];
+extern const char kNodeControlRoute[];
+extern const size_t kNodeControlRouteSize;
 extern const char kServiceNameFact[];
+extern const char kRoutingPolicyFact[];
+extern const char kPartitionKeyFact[];
 
 // filenames
 extern const FilePath::CharType kServicesDatabaseFilename[];
@@ -0,0 +1,241 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+
+#include "node/service/fact_index.h"
+
+#include <algorithm>
+
+#include <base/logging.h>
+
+#include "build/build_config.h"
+
+#if defined(ARCH_CPU_X86_FAMILY)
+#include <emmintrin.h>
+#endif
+
+namespace node {
+
+namespace {
+
+// The ratio between the sizes of two posting lists above which the shortest
+// list is searched into the longest one instead of merged with it.
+const size_t kGallopingRatio = 32;
+
+// Appends to |result| the IDs of |a| that are found in |b|, by searching
+// each one of them with an exponential search that starts where the search
+// of the previous one has ended.
+void GallopingIntersect(const int* a, size_t a_size, const int* b,
+  size_t b_size, std::vector<int>* result) {
+  size_t low = 0;
+  for (size_t i = 0; i < a_size && low < b_size; ++i) {
+    int id = a[i];
+    size_t step = 1;
+    size_t high = low;
+    while (high < b_size && b[high] < id) {
+      low = high + 1;
+      high += step;
+      step *= 2;
+    }
+    high = std::min(high + 1, b_size);
+    low = std::lower_bound(b + low, b + high, id) - b;
+    if (low < b_size && b[low] == id) {
+      result->push_back(id);
+      ++low;
+    }
+  }
+}
+
+// Appends to |result| the IDs that are in both |a| and |b|, starting at
+// |i| and |j|.
+void MergeIntersect(const int* a, size_t a_size, const int* b,
+  size_t b_size, size_t i, size_t j, std::vector<int>* result) {
+  while (i < a_size && j < b_size) {
+    if (a[i] < b[j]) {
+      ++i;
+    } else if (b[j] < a[i]) {
+      ++j;
+    } else {
+      result->push_back(a[i]);
+      ++i;
+      ++j;
+    }
+  }
+}
+
+#if defined(ARCH_CPU_X86_FAMILY)
+// Compares a block of four IDs of |a| against every rotation of a block of
+// four IDs of |b|, and advances the block whose greatest ID is the smallest.
+// The IDs of the lists are unique, so an ID of |a| matches at most one ID of
+// the blocks of |b|.
+void SimdIntersect(const int* a, size_t a_size, const int* b, size_t b_size,
+  std::vector<int>* result) {
+  size_t i = 0, j = 0;
+  while (i + 4 <= a_size && j + 4 <= b_size) {
+    __m128i block_a =
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+    __m128i block_b =
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + j));
+    __m128i matches = _mm_or_si128(
+      _mm_or_si128(
+        _mm_cmpeq_epi32(block_a, block_b),
+        _mm_cmpeq_epi32(block_a,
+          _mm_shuffle_epi32(block_b, _MM_SHUFFLE(0, 3, 2, 1)))),
+      _mm_or_si128(
+        _mm_cmpeq_epi32(block_a,
+          _mm_shuffle_epi32(block_b, _MM_SHUFFLE(1, 0, 3, 2))),
+        _mm_cmpeq_epi32(block_a,
+          _mm_shuffle_epi32(block_b, _MM_SHUFFLE(2, 1, 0, 3)))));
+    int mask = _mm_movemask_ps(_mm_castsi128_ps(matches));
+    for (int k = 0; mask; ++k, mask >>= 1) {
+      if (mask & 1) {
+        result->push_back(a[i + k]);
+      }
+    }
+
+    int a_max = a[i + 3];
+    int b_max = b[j + 3];
+    if (a_max <= b_max) {
+      i += 4;
+    }
+    if (b_max <= a_max) {
+      j += 4;
+    }
+  }
+
+  // The IDs that was matched already are smaller than the ones that
+  // remains in |b|, so the tails could be merged as usual.
+  MergeIntersect(a, a_size, b, b_size, i, j, result);
+}
+#endif
+
+}  // namespace
+
+void IntersectPostings(const int* a, size_t a_size, const int* b,
+  size_t b_size, std::vector<int>* result) {
+  DCHECK(result);
+  if (a_size > b_size) {
+    std::swap(a, b);
+    std::swap(a_size, b_size);
+  }
+  if (!a_size) {
+    return;
+  }
+
+  if (b_size / a_size >= kGallopingRatio) {
+    GallopingIntersect(a, a_size, b, b_size, result);
+    return;
+  }
+#if defined(ARCH_CPU_X86_FAMILY)
+  SimdIntersect(a, a_size, b, b_size, result);
+#else
+  MergeIntersect(a, a_size, b, b_size, 0, 0, result);
+#endif
+}
+
+FactIndex::FactIndex() {
+}
+
+FactIndex::~FactIndex() {
+}
+
+void FactIndex::Add(int service_id, const std::vector<uint32>& fact_hashes) {
+  Remove(service_id);
+
+  std::vector<uint32>& facts = service_facts_[service_id];
+  facts = fact_hashes;
+  std::sort(facts.begin(), facts.end());
+  facts.erase(std::unique(facts.begin(), facts.end()), facts.end());
+
+  // The IDs of the new services are usually greater than the ones that are
+  // already indexed, so they are appended to the posting lists.
+  for (size_t i = 0; i < facts.size(); ++i) {
+    PostingList& posting = postings_[facts[i]];
+    if (posting.empty() || posting.back() < service_id) {
+      posting.push_back(service_id);
+    } else {
+      posting.insert(
+        std::lower_bound(posting.begin(), posting.end(), service_id),
+        service_id);
+    }
+  }
+}
+
+void FactIndex::Remove(int service_id) {
+  std::map<int, std::vector<uint32> >::iterator service =
+    service_facts_.find(service_id);
+  if (service == service_facts_.end()) {
+    return;
+  }
+
+  const std::vector<uint32>& facts = service->second;
+  for (size_t i = 0; i < facts.size(); ++i) {
+    std::map<uint32, PostingList>::iterator posting =
+      postings_.find(facts[i]);
+    if (posting == postings_.end()) {
+      continue;
+    }
+    PostingList& ids = posting->second;
+    PostingList::iterator id =
+      std::lower_bound(ids.begin(), ids.end(), service_id);
+    if (id != ids.end() && *id == service_id) {
+      ids.erase(id);
+    }
+    if (ids.empty()) {
+      postings_.erase(posting);
+    }
+  }
+  service_facts_.erase(service);
+}
+
+void FactIndex::Clear() {
+  postings_.clear();
+  service_facts_.clear();
+}
+
+bool FactIndex::Find(const uint32* fact_hashes, size_t count,
+  std::vector<int>* service_ids) const {
+  DCHECK(service_ids);
+  service_ids->clear();
+  if (!count) {
+    return false;
+  }
+
+  // A fact that is not indexed matches no service.
+  std::vector<const PostingList*> postings(count);
+  for (size_t i = 0; i < count; ++i) {
+    std::map<uint32, PostingList>::const_iterator posting =
+      postings_.find(fact_hashes[i]);
+    if (posting == postings_.end()) {
+      return false;
+    }
+    postings[i] = &posting->second;
+  }
+
+  // Intersecting from the shortest list keeps the intermediate results as
+  // small as possible.
+  for (size_t i = 1; i < count; ++i) {
+    for (size_t k = i; k > 0 && postings[k]->size() <
+      postings[k - 1]->size(); --k) {
+      std::swap(postings[k], postings[k - 1]);
+    }
+  }
+
+  if (count == 1) {
+    *service_ids = *postings[0];
+    return true;
+  }
+
+  IntersectPostings(&(*postings[0])[0], postings[0]->size(),
+    &(*postings[1])[0], postings[1]->size(), service_ids);
+  std::vector<int> intersection;
+  for (size_t i = 2; i < count && !service_ids->empty(); ++i) {
+    intersection.clear();
+    IntersectPostings(&(*service_ids)[0], service_ids->size(),
+      &(*postings[i])[0], postings[i]->size(), &intersection);
+    service_ids->swap(intersection);
+  }
+  return !service_ids->empty();
+}
+
+}  // namespace node
@@ -0,0 +1,68 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+
+#ifndef NODE_SERVICE_FACT_INDEX_H_
+#define NODE_SERVICE_FACT_INDEX_H_
+#pragma once
+
+#include <map>
+#include <vector>
+
+#include <base/basictypes.h>
+
+namespace node {
+
+// Intersects the sorted lists of service IDs |a| and |b|, whose sizes are
+// |a_size| and |b_size|, appending the IDs that are in both of them to
+// |result|. The lists should not have duplicates. The shortest list is
+// searched into the longest one by galloping when their sizes are far apart,
+// otherwise the lists are merged four IDs at a time with SIMD instructions,
+// when available.
+void IntersectPostings(const int* a, size_t a_size, const int* b,
+  size_t b_size, std::vector<int>* result);
+
+// FactIndex is an in-memory inverted index from the hash of a service fact
+// to the sorted list of the IDs of the services that has the fact, which is
+// called its posting list. A query for a set of facts is answered by
+// intersecting their posting lists, from the shortest to the longest, so
+// the cost of a query depends on the size of its rarest fact instead of on
+// the number of registered services.
+//
+// An index could be copied, so a new version of it could be built while the
+// old one is still read. This class is not thread safe.
+class FactIndex {
+ public:
+  FactIndex();
+  ~FactIndex();
+
+  // Indexes the service whose ID is |service_id| under the |fact_hashes|.
+  void Add(int service_id, const std::vector<uint32>& fact_hashes);
+
+  // Removes the service whose ID is |service_id| from the index.
+  void Remove(int service_id);
+
+  // Removes all the services from the index.
+  void Clear();
+
+  // Finds the services that has all the |count| facts whose hashes are
+  // pointed by |fact_hashes|, storing their IDs into |service_ids| in
+  // ascending order. Returns true if at least one service was found.
+  bool Find(const uint32* fact_hashes, size_t count,
+    std::vector<int>* service_ids) const;
+
+  // The number of services that are indexed.
+  size_t size() const { return service_facts_.size(); }
+
+ private:
+  typedef std::vector<int> PostingList;
+
+  // The posting list of each fact, and the facts of each service, which are
+  // needed to remove the service from the postings lists.
+  std::map<uint32, PostingList> postings_;
+  std::map<int, std::vector<uint32> > service_facts_;
+};
+
+}  // namespace node
+
+#endif  // NODE_SERVICE_FACT_INDEX_H_
@@ -0,0 +1,419 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+
+#include "node/service/load_balancer.h"
+
+#include <algorithm>
+#include <iterator>
+
+#include <base/logging.h>
+#include <base/string_number_conversions.h>
+
+#include "node/service/constants.h"
+#include "node/service/hash.h"
+
+namespace node {
+
+namespace {
+
+// The weight of the older replies in the moving average of the latency of
+// a route is 7/8, like the smoothed round trip time of TCP.
+const int64 kLatencyDecay = 8;
+
+// Gets the next number of a xorshift random number generator whose state is
+// |seed|.
+uint32 NextRandom(uint32* seed) {
+  uint32 x = *seed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *seed = x;
+  return x;
+}
+
+}  // namespace
+
+const char* RoutingPolicyToString(RoutingPolicy policy) {
+  switch (policy) {
+    case kServiceRouting:
+      return "service";
+
+    case kBroadcastRouting:
+      return "broadcast";
+
+    case kRoundRobinRouting:
+      return "round-robin";
+
+    case kLeastOutstandingRouting:
+      return "least-outstanding";
+
+    case kLatencyRouting:
+      return "latency";
+
+    case kPartitionedRouting:
+      return "partitioned";
+  }
+  return "unknown";
+}
+
+bool StringToRoutingPolicy(const std::string& name, RoutingPolicy* policy) {
+  DCHECK(policy);
+  for (int i = kBroadcastRouting; i <= kPartitionedRouting; ++i) {
+    if (name == RoutingPolicyToString(static_cast<RoutingPolicy>(i))) {
+      *policy = static_cast<RoutingPolicy>(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+RouteStats::RouteStats(const std::string& address)
+  : address_(address),
+    outstanding_(0),
+    queued_(0),
+    latency_(0),
+    expired_in_row_(0) {
+}
+
+RouteStats::~RouteStats() {
+}
+
+int64 RouteStats::GetCost(RoutingPolicy policy) const {
+  // An instance that has not replied yet costs only its outstanding and
+  // queued requests, so it is tried soon after it starts.
+  int64 cost = outstanding() + queued() + 1;
+  if (policy == kLatencyRouting) {
+    cost *= latency() + 1;
+  }
+  return cost;
+}
+
+void RouteStats::OnRequestSent() {
+  base::subtle::NoBarrier_AtomicIncrement(&outstanding_, 1);
+}
+
+void RouteStats::OnReplyReceived(base::TimeDelta latency) {
+  base::subtle::NoBarrier_AtomicIncrement(&outstanding_, -1);
+  base::subtle::NoBarrier_Store(&expired_in_row_, 0);
+
+  // Two replies that are received at once could lose one of the samples,
+  // which does not change the average much.
+  int64 sample = std::max<int64>(latency.InMicroseconds(), 0);
+  int64 average = base::subtle::NoBarrier_Load(&latency_);
+  average = average ? average + (sample - average) / kLatencyDecay : sample;
+  base::subtle::NoBarrier_Store(&latency_, static_cast<base::subtle::Atomic32>(
+    std::min<int64>(average, kint32max)));
+}
+
+bool RouteStats::OnRequestExpired() {
+  base::subtle::NoBarrier_AtomicIncrement(&outstanding_, -1);
+
+  // Only the request that reaches the limit reports it, so the instance is
+  // reported once until it replies again.
+  return base::subtle::NoBarrier_AtomicIncrement(&expired_in_row_, 1) ==
+    kMaxInstanceExpiries;
+}
+
+void RouteStats::OnRequestQueued() {
+  base::subtle::NoBarrier_AtomicIncrement(&queued_, 1);
+}
+
+void RouteStats::OnRequestDequeued() {
+  base::subtle::NoBarrier_AtomicIncrement(&queued_, -1);
+}
+
+RoutedRequest::RoutedRequest(LoadBalancer* load_balancer, RouteStats* route,
+  const std::string& requester, const std::string& request_id)
+  : load_balancer_(load_balancer),
+    route_(route),
+    requester_(requester),
+    request_id_(request_id),
+    queued_(true) {
+  DCHECK(load_balancer);
+  DCHECK(route);
+  route->OnRequestQueued();
+}
+
+RoutedRequest::~RoutedRequest() {
+  // A request that was never sent is forgotten.
+  if (queued_) {
+    route_->OnRequestDequeued();
+  }
+}
+
+void RoutedRequest::Sent(base::TimeTicks now) {
+  if (!queued_) {
+    return;
+  }
+  queued_ = false;
+  route_->OnRequestDequeued();
+  load_balancer_->OnRequestSent(route_.get(), requester_, request_id_, now);
+}
+
+RoutedRequest* FindRoutedRequest(const RoutedRequests& requests,
+  const std::string& destination) {
+  for (size_t i = 0; i < requests.size(); ++i) {
+    if (requests[i]->route()->address() == destination) {
+      return requests[i].get();
+    }
+  }
+  return NULL;
+}
+
+ServiceRoutes::ServiceRoutes(RoutingPolicy policy,
+  const ServiceRoutes* previous)
+  : policy_(policy),
+    next_(0) {
+  DCHECK_NE(policy, kServiceRouting);
+  if (previous) {
+    instances_ = previous->instances_;
+    ring_ = previous->ring_;
+  }
+}
+
+ServiceRoutes::~ServiceRoutes() {
+}
+
+RouteStats* ServiceRoutes::Find(const std::string& address) const {
+  for (size_t i = 0; i < instances_.size(); ++i) {
+    if (instances_[i]->address() == address) {
+      return instances_[i].get();
+    }
+  }
+  return NULL;
+}
+
+bool ServiceRoutes::RingPointLess(const RingPoint& a, const RingPoint& b) {
+  if (a.hash != b.hash) {
+    return a.hash < b.hash;
+  }
+  return a.route->address() < b.route->address();
+}
+
+bool ServiceRoutes::RingPointHashLess(const RingPoint& a,
+  const RingPoint& b) {
+  return a.hash < b.hash;
+}
+
+void ServiceRoutes::Add(RouteStats* route) {
+  DCHECK(route);
+  instances_.push_back(route);
+
+  // The points of an instance are the hashes of its address followed by the
+  // number of the point, so they are the same on every node.
+  Ring points(kPartitionVirtualNodes);
+  std::string point_key(route->address());
+  point_key.push_back('#');
+  size_t prefix_size = point_key.size();
+  for (int i = 0; i < kPartitionVirtualNodes; ++i) {
+    point_key.resize(prefix_size);
+    point_key.append(base::IntToString(i));
+    points[i].hash = Hash(point_key);
+    points[i].route = route;
+  }
+  std::sort(points.begin(), points.end(), RingPointLess);
+
+  Ring ring;
+  ring.reserve(ring_.size() + points.size());
+  std::merge(ring_.begin(), ring_.end(), points.begin(), points.end(),
+    std::back_inserter(ring), RingPointLess);
+  ring_.swap(ring);
+}
+
+void ServiceRoutes::Remove(const std::string& address) {
+  std::vector<scoped_refptr<RouteStats> > instances;
+  for (size_t i = 0; i < instances_.size(); ++i) {
+    if (instances_[i]->address() != address) {
+      instances.push_back(instances_[i]);
+    }
+  }
+  instances_.swap(instances);
+
+  Ring ring;
+  ring.reserve(ring_.size());
+  for (size_t i = 0; i < ring_.size(); ++i) {
+    if (ring_[i].route->address() != address) {
+      ring.push_back(ring_[i]);
+    }
+  }
+  ring_.swap(ring);
+}
+
+RouteStats* ServiceRoutes::Choose(RoutingPolicy policy,
+  const std::string& partition_key, uint32* seed) {
+  DCHECK_NE(policy, kBroadcastRouting);
+  DCHECK(seed && *seed);
+  size_t count = instances_.size();
+  DCHECK(count);
+  if (count == 1) {
+    return instances_[0].get();
+  }
+
+  if (policy == kPartitionedRouting) {
+    if (!partition_key.empty()) {
+      return FindPartition(partition_key);
+    }
+    policy = kRoundRobinRouting;
+  }
+
+  if (policy == kRoundRobinRouting) {
+    uint32 next = static_cast<uint32>(
+      base::subtle::NoBarrier_AtomicIncrement(&next_, 1));
+    return instances_[next % count].get();
+  }
+
+  // Comparing two instances picked at random is almost as good as choosing
+  // the least loaded one, and it does not send every request to the same
+  // instance while its load is not updated yet.
+  size_t first = NextRandom(seed) % count;
+  size_t second = NextRandom(seed) % (count - 1);
+  if (second >= first) {
+    ++second;
+  }
+  RouteStats* a = instances_[first].get();
+  RouteStats* b = instances_[second].get();
+  return b->GetCost(policy) < a->GetCost(policy) ? b : a;
+}
+
+RouteStats* ServiceRoutes::FindPartition(
+  const std::string& partition_key) const {
+  DCHECK(!ring_.empty());
+  RingPoint key;
+  key.hash = Hash(partition_key);
+  key.route = NULL;
+  Ring::const_iterator point =
+    std::lower_bound(ring_.begin(), ring_.end(), key, RingPointHashLess);
+  if (point == ring_.end()) {
+    point = ring_.begin();
+  }
+  return point->route;
+}
+
+LoadBalancer::LoadBalancer()
+  : timeout_(base::TimeDelta::FromMilliseconds(kPendingRequestTimeout)),
+    pending_count_(0),
+    replies_count_(0),
+    expired_count_(0) {
+}
+
+LoadBalancer::~LoadBalancer() {
+}
+
+bool LoadBalancer::RequestKey::operator<(const RequestKey& other) const {
+  int compare = route.compare(other.route);
+  if (!compare) {
+    compare = requester.compare(other.requester);
+  }
+  if (!compare) {
+    compare = request_id.compare(other.request_id);
+  }
+  return compare < 0;
+}
+
+void LoadBalancer::OnRequestSent(RouteStats* route,
+  const std::string& requester, const std::string& request_id,
+  base::TimeTicks now) {
+  DCHECK(route);
+  if (request_id.empty()) {
+    return;
+  }
+
+  Shard* shard = GetShard(route->address(), requester, request_id);
+  base::AutoLock lock(shard->lock);
+  if (now - shard->last_sweep >= timeout_ ||
+    shard->requests.size() >= kMaxPendingRequests / kShardCount) {
+    ExpireRequests(shard, now);
+    if (shard->requests.size() >= kMaxPendingRequests / kShardCount) {
+      return;
+    }
+  }
+
+  // A request that reuses the ID of one that is still waiting replaces it.
+  PendingRequest& request = shard->requests[
+    RequestKey(route->address(), requester, request_id)];
+  if (!request.route) {
+    request.route = route;
+    route->OnRequestSent();
+    base::subtle::NoBarrier_AtomicIncrement(&pending_count_, 1);
+  }
+  request.sent_time = now;
+}
+
+void LoadBalancer::OnReplyReceived(const std::string& route,
+  const std::string& requester, const std::string& request_id,
+  base::TimeTicks now) {
+  if (request_id.empty()) {
+    return;
+  }
+
+  Shard* shard = GetShard(route, requester, request_id);
+  base::AutoLock lock(shard->lock);
+  PendingRequestMap::iterator request =
+    shard->requests.find(RequestKey(route, requester, request_id));
+  if (request == shard->requests.end()) {
+    return;
+  }
+  request->second.route->OnReplyReceived(now - request->second.sent_time);
+  shard->requests.erase(request);
+  base::subtle::NoBarrier_AtomicIncrement(&pending_count_, -1);
+  base::subtle::NoBarrier_AtomicIncrement(&replies_count_, 1);
+}
+
+void LoadBalancer::ExpireRequests(base::TimeTicks now) {
+  for (size_t i = 0; i < kShardCount; ++i) {
+    Shard* shard = &shards_[i];
+    base::AutoLock lock(shard->lock);
+    ExpireRequests(shard, now);
+  }
+}
+
+void LoadBalancer::RemoveRoute(const std::string& route) {
+  for (size_t i = 0; i < kShardCount; ++i) {
+    Shard* shard = &shards_[i];
+    base::AutoLock lock(shard->lock);
+    PendingRequestMap::iterator request = shard->requests.begin();
+    while (request != shard->requests.end()) {
+      if (request->first.route != route) {
+        ++request;
+        continue;
+      }
+      shard->requests.erase(request++);
+      base::subtle::NoBarrier_AtomicIncrement(&pending_count_, -1);
+    }
+  }
+}
+
+void LoadBalancer::TakeUnresponsiveRoutes(std::vector<std::string>* routes) {
+  DCHECK(routes);
+  base::AutoLock lock(unresponsive_lock_);
+  routes->swap(unresponsive_);
+  unresponsive_.clear();
+}
+
+LoadBalancer::Shard* LoadBalancer::GetShard(const std::string& route,
+  const std::string& requester, const std::string& request_id) {
+  return &shards_[(Hash(request_id) ^ Hash(route) ^ Hash(requester)) %
+    kShardCount];
+}
+
+void LoadBalancer::ExpireRequests(Shard* shard, base::TimeTicks now) {
+  shard->last_sweep = now;
+  PendingRequestMap::iterator request = shard->requests.begin();
+  while (request != shard->requests.end()) {
+    if (now - request->second.sent_time < timeout_) {
+      ++request;
+      continue;
+    }
+    RouteStats* route = request->second.route.get();
+    if (route->OnRequestExpired()) {
+      base::AutoLock unresponsive_lock(unresponsive_lock_);
+      unresponsive_.push_back(route->address());
+    }
+    shard->requests.erase(request++);
+    base::subtle::NoBarrier_AtomicIncrement(&pending_count_, -1);
+    base::subtle::NoBarrier_AtomicIncrement(&expired_count_, 1);
+  }
+}
+
+}  // namespace node
@@ -0,0 +1,349 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+
+#ifndef NODE_SERVICE_LOAD_BALANCER_H_
+#define NODE_SERVICE_LOAD_BALANCER_H_
+#pragma once
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <base/atomicops.h>
+#include <base/basictypes.h>
+#include <base/memory/ref_counted.h>
+#include <base/synchronization/lock.h>
+#include <base/time.h>
+
+namespace node {
+
+class LoadBalancer;
+
+// How a request is routed to the instances of a service. The values are the
+// same as the ones of ruby.protocol.RoutingPolicy.
+enum RoutingPolicy {
+  // The request is routed with the policy of the service.
+  kServiceRouting = 0,
+
+  // Every instance receives the request.
+  kBroadcastRouting = 1,
+
+  // The instances receives the requests in turn.
+  kRoundRobinRouting = 2,
+
+  // The least loaded of two instances picked at random receives the
+  // request.
+  kLeastOutstandingRouting = 3,
+
+  // Like kLeastOutstandingRouting, but the load of an instance is weighted
+  // by the time it takes to reply.
+  kLatencyRouting = 4,
+
+  // The requests that has the same partition key are routed to the same
+  // instance.
+  kPartitionedRouting = 5
+};
+
+// Returns a human readable name for |policy|.
+const char* RoutingPolicyToString(RoutingPolicy policy);
+
+// Gets the policy whose name is |name|, as returned by
+// RoutingPolicyToString(). Returns false if no policy has that name.
+bool StringToRoutingPolicy(const std::string& name, RoutingPolicy* policy);
+
+// The load of the route to an instance of a service: the number of requests
+// that was sent through it and are waiting for a reply, the number of the
+// ones that was routed to it and are not sent yet, and the moving average
+// of the time it takes to reply. The load is updated by any thread without
+// locks, so it is only an estimate.
+class RouteStats : public base::RefCountedThreadSafe<RouteStats> {
+ public:
+  explicit RouteStats(const std::string& address);
+
+  const std::string& address() const { return address_; }
+
+  int outstanding() const {
+    return base::subtle::NoBarrier_Load(&outstanding_);
+  }
+
+  int queued() const {
+    return base::subtle::NoBarrier_Load(&queued_);
+  }
+
+  // The average time, in microseconds, the instance takes to reply, or zero
+  // if it has not replied yet. The average is clamped to kint32max, which
+  // is about 35 minutes.
+  int32 latency() const {
+    return base::subtle::NoBarrier_Load(&latency_);
+  }
+
+  // Gets the cost of sending one more request to the instance, when it is
+  // routed by |policy|.
+  int64 GetCost(RoutingPolicy policy) const;
+
+  // Accounts a request that was sent to the instance, and its reply, which
+  // was received after |latency|, or its expiration. OnRequestExpired()
+  // returns true when the instance has let kMaxInstanceExpiries requests
+  // expire in a row, without replying to any of them.
+  void OnRequestSent();
+  void OnReplyReceived(base::TimeDelta latency);
+  bool OnRequestExpired();
+
+  // Accounts a request that was routed to the instance and is waiting to be
+  // sent, and its departure, whether it was sent or dropped.
+  void OnRequestQueued();
+  void OnRequestDequeued();
+
+ private:
+  friend class base::RefCountedThreadSafe<RouteStats>;
+
+  ~RouteStats();
+
+  std::string address_;
+  volatile base::subtle::Atomic32 outstanding_;
+  volatile base::subtle::Atomic32 queued_;
+  volatile base::subtle::Atomic32 latency_;
+
+  // The number of requests that has expired since the last reply.
+  volatile base::subtle::Atomic32 expired_in_row_;
+
+  DISALLOW_COPY_AND_ASSIGN(RouteStats);
+};
+
+// The routes to the running instances of a service and the policy that is
+// used to choose between them. The instances are never changed once the
+// object is shared, a new object is created when they change instead.
+//
+// The instances are also placed on a consistent hash ring, at a fixed number
+// of points each, which maps a partition key to the instance whose point
+// follows the hash of the key. When an instance is added or removed, the
+// ring of the new object is built from the ring of the previous one, so only
+// the keys that falls on the points of that instance are moved. The instances
+// that disconnects or stops answering are removed by
+// MessageRouter::RemoveInstance().
+class ServiceRoutes : public base::RefCountedThreadSafe<ServiceRoutes> {
+ public:
+  // Creates a copy of the instances of |previous|, which could be NULL,
+  // that are routed by |policy|.
+  ServiceRoutes(RoutingPolicy policy, const ServiceRoutes* previous);
+
+  RoutingPolicy policy() const { return policy_; }
+
+  size_t size() const { return instances_.size(); }
+  RouteStats* instance(size_t index) const {
+    return instances_[index].get();
+  }
+
+  // Gets the route to the instance whose address is |address|, or NULL if
+  // it is not found.
+  RouteStats* Find(const std::string& address) const;
+
+  // Adds the route to an instance, or removes the route to the instance
+  // whose address is |address|. Should be called only before the object is
+  // shared.
+  void Add(RouteStats* route);
+  void Remove(const std::string& address);
+
+  // Chooses the instance that should receive a request routed by |policy|,
+  // which could not be kBroadcastRouting. |partition_key| is the partition
+  // key of the request, which could be empty. |seed| is the state of the
+  // random number generator of the calling thread, which should not be zero.
+  RouteStats* Choose(RoutingPolicy policy, const std::string& partition_key,
+    uint32* seed);
+
+ private:
+  friend class base::RefCountedThreadSafe<ServiceRoutes>;
+
+  // A point of an instance on the hash ring.
+  struct RingPoint {
+    uint32 hash;
+    RouteStats* route;
+  };
+  typedef std::vector<RingPoint> Ring;
+
+  ~ServiceRoutes();
+
+  // Orders the points by their hashes, and the points that has the same
+  // hash by the address of their instances, so the ring is the same
+  // whatever the order the instances was added.
+  static bool RingPointLess(const RingPoint& a, const RingPoint& b);
+  static bool RingPointHashLess(const RingPoint& a, const RingPoint& b);
+
+  // Gets the instance that owns |partition_key|.
+  RouteStats* FindPartition(const std::string& partition_key) const;
+
+  RoutingPolicy policy_;
+  std::vector<scoped_refptr<RouteStats> > instances_;
+
+  // The points of the instances, sorted by their hashes. The instances are
+  // owned by |instances_|.
+  Ring ring_;
+
+  // The number of requests that was routed in turn.
+  volatile base::subtle::Atomic32 next_;
+
+  DISALLOW_COPY_AND_ASSIGN(ServiceRoutes);
+};
+
+// A request that was routed to an instance of a balanced service and is
+// waiting to be sent. The request is accounted as outstanding by the load
+// balancer only when Sent() is called, so the requests that the node drops
+// before they leave it, because they has expired or their mailbox is full,
+// are never outstanding. Until then it is counted as queued by its
+// instance, so the requests that are routed at once are still spread over
+// the instances.
+//
+// The object could outlive the load balancer, but Sent() could not be
+// called after the load balancer is destroyed. It is used by one thread at
+// a time.
+class RoutedRequest : public base::RefCountedThreadSafe<RoutedRequest> {
+ public:
+  RoutedRequest(LoadBalancer* load_balancer, RouteStats* route,
+    const std::string& requester, const std::string& request_id);
+
+  RouteStats* route() const { return route_.get(); }
+
+  // Accounts the request, which was sent at |now|. Only the first call
+  // does something.
+  void Sent(base::TimeTicks now);
+
+ private:
+  friend class base::RefCountedThreadSafe<RoutedRequest>;
+
+  ~RoutedRequest();
+
+  LoadBalancer* load_balancer_;
+  scoped_refptr<RouteStats> route_;
+  std::string requester_;
+  std::string request_id_;
+  bool queued_;
+
+  DISALLOW_COPY_AND_ASSIGN(RoutedRequest);
+};
+
+// The requests that was routed to the instances of the balanced services.
+typedef std::vector<scoped_refptr<RoutedRequest> > RoutedRequests;
+
+// Gets the request of |requests| that was routed to |destination|, or NULL
+// if none was.
+RoutedRequest* FindRoutedRequest(const RoutedRequests& requests,
+  const std::string& destination);
+
+// LoadBalancer correlates the replies of the service instances with the
+// requests that was routed to them, by the address of the instance, the
+// address of the peer that sent the request and the message ID, so the
+// number of outstanding requests and the latency of each route are known.
+// The message IDs are chosen by the clients, so the ID alone does not tell
+// the requests of two clients apart.
+//
+// The requests that are waiting for a reply are spread over a fixed number
+// of shards, each one with its own lock, so the routing threads rarely
+// contend. A request whose reply does not come before the pending request
+// timeout stops being outstanding, and no more than a fixed number of
+// requests are tracked at once. The shards are swept as the requests are
+// sent and by ExpireRequests(), which should be called periodically so the
+// requests that are never answered does not stay outstanding while no
+// request is sent.
+//
+// This class is thread safe.
+class LoadBalancer {
+ public:
+  LoadBalancer();
+  ~LoadBalancer();
+
+  // Returns true if some request is waiting for its reply.
+  bool has_pending_requests() const {
+    return base::subtle::NoBarrier_Load(&pending_count_) != 0;
+  }
+
+  // Accounts a request whose ID is |request_id| that was sent by
+  // |requester| to |route| at |now|, which is usually done through
+  // RoutedRequest::Sent(). The requests that has no ID are not accounted.
+  void OnRequestSent(RouteStats* route, const std::string& requester,
+    const std::string& request_id, base::TimeTicks now);
+
+  // Accounts a reply to the request whose ID is |request_id| that was sent
+  // by |requester|, which was received at |now| from the instance whose
+  // address is |route|.
+  void OnReplyReceived(const std::string& route, const std::string& requester,
+    const std::string& request_id, base::TimeTicks now);
+
+  // Expires the requests of every shard that was sent before |now| minus
+  // the pending request timeout.
+  void ExpireRequests(base::TimeTicks now);
+
+  // Forgets the requests that are waiting for the reply of the instance
+  // whose address is |route|, which has stopped.
+  void RemoveRoute(const std::string& route);
+
+  // Gets the addresses of the instances that has let kMaxInstanceExpiries
+  // requests expire in a row since the last call, storing them into
+  // |routes|.
+  void TakeUnresponsiveRoutes(std::vector<std::string>* routes);
+
+  // The number of replies that was correlated with a request, and the number
+  // of requests that has expired before their reply came. The counts wrap
+  // around at 2^32 and could be read from any thread.
+  uint32 replies_count() const {
+    return static_cast<uint32>(base::subtle::NoBarrier_Load(&replies_count_));
+  }
+  uint32 expired_count() const {
+    return static_cast<uint32>(base::subtle::NoBarrier_Load(&expired_count_));
+  }
+
+ private:
+  struct PendingRequest {
+    scoped_refptr<RouteStats> route;
+    base::TimeTicks sent_time;
+  };
+
+  // The pending requests are keyed by the address of the instance, the
+  // address of the requester and the ID of the request.
+  struct RequestKey {
+    RequestKey(const std::string& route, const std::string& requester,
+      const std::string& request_id)
+      : route(route), requester(requester), request_id(request_id) {}
+
+    bool operator<(const RequestKey& other) const;
+
+    std::string route;
+    std::string requester;
+    std::string request_id;
+  };
+  typedef std::map<RequestKey, PendingRequest> PendingRequestMap;
+
+  struct Shard {
+    base::Lock lock;
+    PendingRequestMap requests;
+    base::TimeTicks last_sweep;
+  };
+
+  static const size_t kShardCount = 16;
+
+  Shard* GetShard(const std::string& route, const std::string& requester,
+    const std::string& request_id);
+
+  // Expires the requests of |shard| that was sent before |now| minus the
+  // pending request timeout. Must be called with the lock of |shard| held.
+  void ExpireRequests(Shard* shard, base::TimeTicks now);
+
+  Shard shards_[kShardCount];
+  base::TimeDelta timeout_;
+
+  // The instances that has let too many requests expire, which are reported
+  // by TakeUnresponsiveRoutes().
+  base::Lock unresponsive_lock_;
+  std::vector<std::string> unresponsive_;
+
+  volatile base::subtle::Atomic32 pending_count_;
+  volatile base::subtle::Atomic32 replies_count_;
+  volatile base::subtle::Atomic32 expired_count_;
+
+  DISALLOW_COPY_AND_ASSIGN(LoadBalancer);
+};
+
+}  // namespace node
+
+#endif  // NODE_SERVICE_LOAD_BALANCER_H_
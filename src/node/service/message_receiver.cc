@@ -4,56 +4,640 @@
 
 #include "node/service/message_receiver.h"
 
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
 #include <base/logging.h>
 #include <base/string_number_conversions.h>
+#include <base/stringprintf.h>
 #include <ruby_protos.pb.h>
+#include <control.pb.h>
 
 #include "node/zeromq/context.h"
 #include "node/zeromq/socket.h"
 #include "node/zeromq/message.h"
+#include "node/zeromq/message_pool.h"
 #include "node/service/constants.h"
+#include "node/service/hash.h"
 #include "node/service/message_router.h"
+#include "node/service/packet_channel.h"
+#include "node/service/packet_deadline.h"
+#include "node/service/packet_view.h"
+#include "node/service/routing_worker.h"
+#include "node/service/shared_memory_channel.h"
 
 namespace node {
 
 namespace rp = ruby::protocol;
+namespace rpc = ::ruby::protocol::control;
+
+namespace {
+
+// The maximum number of messages that are received from the router socket
+// at once, when the batch size is not specified.
+const int kReceiveBatchSize = 64;
+
+// The token of the errors that are sent to the sender of a packet that was
+// discarded, and the codes of the errors.
+const char kErrorToken[] = "node-error";
+const int kDestinationOverloadedError = 205;
+const int kDeadlineExceededError = 206;
+
+// Creates the frame of the error packet that tells the sender of the message
+// whose ID is |message_id| that the message was discarded.
+scoped_refptr<zmq::Message> CreateErrorFrame(const std::string& message_id,
+  int code, const char* description) {
+  rpc::ErrorMessage error;
+  ruby::ExceptionMessage* exception = error.add_errors();
+  exception->set_code(code);
+  exception->set_message(description);
+  exception->set_source(kNodeServiceName);
+
+  rp::RubyMessagePacket packet;
+  rp::RubyMessage* ruby_message = packet.mutable_message();
+  ruby_message->set_id(message_id);
+  ruby_message->set_type(rpc::kNodeError);
+  ruby_message->set_token(kErrorToken);
+  ruby_message->set_message(error.SerializeAsString());
+  ruby_message->set_sender(kNodeServiceName);
+
+  rp::RubyMessageHeader* header = packet.mutable_header();
+  header->set_id(message_id);
+  header->set_priority(rp::kControlPriority);
+  header->set_size(ruby_message->ByteSize());
+  packet.set_header_size(header->ByteSize());
+  packet.set_size(packet.ByteSize());
+
+  int packet_size = packet.ByteSize();
+  scoped_refptr<zmq::Message> frame(new zmq::Message(packet_size));
+  packet.SerializeToArray(frame->mutable_data(), packet_size);
+  return frame;
+}
+
+// Assigns |frame|, or a message that shares its data, to each one of the
+// |count| |packet_frames| that was not created yet. The frames whose data
+// could not be shared are left NULL, and are not sent.
+void ShareFrame(zmq::Message* frame,
+  scoped_refptr<zmq::Message>* packet_frames, size_t count) {
+  bool shared = false;
+  for (size_t i = 0; i < count; ++i) {
+    if (packet_frames[i]) {
+      continue;
+    }
+    if (shared) {
+      packet_frames[i] = frame->Share();
+    } else {
+      packet_frames[i] = frame;
+      shared = true;
+    }
+  }
+}
+
+// Returns true if |destination| is reached without the message channel.
+bool IsLocalRoute(const std::string& destination) {
+  return IsNodeControlRoute(destination) ||
+    PacketListener::IsListenerRoute(destination);
+}
+
+// Returns true if the packet scanned by |view|, which was received from a
+// peer and is routed to |destinations|, should be dispatched before the
+// others. Only the packets that are sent to the node itself are, whatever
+// the priority that the peer has asked for.
+bool IsControlPacket(const PacketView& view, const RouteSet& destinations) {
+  return destinations.size() == 1 && IsNodeControlRoute(destinations[0]);
+}
+
+}  // namespace
 
 MessageReceiver::MessageReceiver(zmq::Context* context, MessageRouter* router)
   : context_(context),
     router_(router),
     message_channel_port_(node::kMessageChannelPort),
-    running_(false) {
+    running_(false),
+    poller_(new zmq::Poller(context)),
+    control_channel_(NULL),
+    packet_listener_port_(0),
+    routing_workers_count_(0),
+    shared_memory_channels_(NULL),
+    batch_size_(kReceiveBatchSize),
+    batch_timer_(0),
+    windows_timer_(0),
+    batches_count_(0),
+    batched_messages_count_(0),
+    watching_output_(false),
+    notify_expired_(false),
+    expired_count_(0),
+    expired_before_send_count_(0),
+    unshared_count_(0) {
   DCHECK(context);
   DCHECK(router);
+  channel_.reset(new PacketChannel(poller_.get()));
+  poller_->set_wakeup_delegate(this);
 }
 
 MessageReceiver::~MessageReceiver() {
 }
 
-void MessageReceiver::Run() {
+bool MessageReceiver::Bind() {
+  DCHECK(!socket_.get());
+
   std::string endpoint("tcp://*:");
   endpoint.append(base::IntToString(message_channel_port_));
 
-  scoped_ptr<zmq::Socket> router(
+  scoped_ptr<zmq::Socket> socket(
     new zmq::Socket(context_->CreateSocket(zmq::kRouter)));
-  if (router.get() && router->Bind(endpoint.c_str())) {
-    MessageParts parts;
-    while (!running_ && !context_->is_terminating()) {
-      if (router->Receive(&parts, zmq::kNoFlags)) {
-        OnMessageReceived(router.get(), parts);
-      }
-      parts.clear();
+  if (!socket->SetOptions(message_channel_options_) ||
+    !socket->Bind(endpoint.c_str())) {
+    return false;
+  }
+
+  // The local peers could talk with us through a unix domain socket, which
+  // is cheaper than the loopback TCP. A single router socket is bound to
+  // both endpoints, so replies reach the peers through the transport they
+  // used to connect.
+  bound_ipc_endpoint_.clear();
+  if (!message_channel_ipc_endpoint_.empty()) {
+    if (socket->Bind(message_channel_ipc_endpoint_.c_str())) {
+      bound_ipc_endpoint_ = message_channel_ipc_endpoint_;
+    } else {
+      LOG(WARNING) << "The message channel ipc endpoint "
+                   << message_channel_ipc_endpoint_
+                   << " could not be bound. The local peers will use TCP.";
     }
   }
+
+  // The packet listener is optional, the node works without it.
+  if (packet_listener_port_ > 0) {
+    packet_listener_.reset(new PacketListener(router_, this));
+    if (!packet_listener_->Listen(packet_listener_port_)) {
+      packet_listener_.reset();
+    }
+  }
+
+  socket_.swap(socket);
+  return true;
+}
+
+void MessageReceiver::Run() {
+  // The socket could be bound by another thread, zeromq allows a socket to
+  // migrate between threads as long as a memory barrier is issued, which is
+  // done when the receiver thread is started.
+  if (socket_.get() || Bind()) {
+    running_ = true;
+    poller_->WatchSocket(socket_.get(), zmq::kPollIn, this);
+    if (packet_listener_.get()) {
+      packet_listener_->Start(poller_.get());
+    }
+    if (routing_workers_count_ > 0 && !StartRoutingWorkers()) {
+      StopRoutingWorkers();
+    }
+    windows_timer_ = poller_->AddTimer(
+      base::TimeDelta::FromMilliseconds(kCreditIdleTimeout), true, this);
+    poller_->Run();
+    if (batch_timer_) {
+      poller_->CancelTimer(batch_timer_);
+      batch_timer_ = 0;
+    }
+    poller_->CancelTimer(windows_timer_);
+    windows_timer_ = 0;
+    batch_.Clear();
+    StopRoutingWorkers();
+    if (packet_listener_.get()) {
+      packet_listener_->Stop();
+    }
+    poller_->StopWatchingSocket(socket_.get());
+    watching_output_ = false;
+    running_ = false;
+  }
+
+  // The socket should be closed by the thread that used it.
+  socket_.reset();
+
+  if (admission_.rejected_count()) {
+    VLOG(1) << "Discarded " << admission_.rejected_count()
+            << " messages above the admission limits";
+  }
+  if (admission_.overflow_count()) {
+    VLOG(1) << "Charged " << admission_.overflow_count()
+            << " messages to the admission overflow bucket";
+  }
+
+  if (mailboxes_.dropped_count()) {
+    VLOG(1) << "Dropped " << mailboxes_.dropped_count()
+            << " packets because of full mailboxes";
+  }
+
+  if (expired_count() || expired_before_send_count()) {
+    VLOG(1) << "Dropped " << expired_count() << " expired packets before "
+            << "routing them and " << expired_before_send_count()
+            << " before sending them";
+  }
+  if (unshared_count_) {
+    VLOG(1) << "Failed to send " << unshared_count_ << " packets whose "
+            << "frames could not be shared";
+  }
+  lane_stats_.Log();
+
+  // Report how well the messages was batched.
+  if (batches_count_) {
+    VLOG(1) << "Routed " << batched_messages_count_ << " messages in "
+            << batches_count_ << " batches, "
+            << batched_messages_count_ / batches_count_
+            << " messages per batch";
+  }
+
+  // Report how well the message pool of the receiver thread is performing.
+  zmq::MessagePool::Stats stats = zmq::MessagePool::Current()->GetStats();
+  for (int i = 0; i < zmq::MessagePool::kNumberOfSizeClasses; ++i) {
+    VLOG(1) << "Message pool class " << i << ": "
+            << stats.classes[i].hits << " hits, "
+            << stats.classes[i].misses << " misses, "
+            << stats.classes[i].cached << " cached";
+  }
+  VLOG(1) << "Message pool unpooled allocations: " << stats.unpooled;
 }
 
 void MessageReceiver::Stop() {
-  running_ = false;
+  poller_->Quit();
+}
+
+uint32 MessageReceiver::expired_count() const {
+  return static_cast<uint32>(base::subtle::NoBarrier_Load(&expired_count_));
+}
+
+uint32 MessageReceiver::expired_before_send_count() const {
+  return static_cast<uint32>(
+    base::subtle::NoBarrier_Load(&expired_before_send_count_)) +
+    mailboxes_.expired_count();
+}
+
+bool MessageReceiver::StartRoutingWorkers() {
+  // The inproc endpoints must be bound before the workers connect to them.
+  std::string sink_endpoint(
+    base::StringPrintf("inproc://routing-workers-%p", this));
+  workers_sink_.reset(new zmq::Socket(context_->CreateSocket(zmq::kPull)));
+  if (!workers_sink_->Bind(sink_endpoint)) {
+    return false;
+  }
+
+  for (int i = 0; i < routing_workers_count_; ++i) {
+    std::string worker_endpoint(
+      base::StringPrintf("inproc://routing-worker-%p-%d", this, i));
+    zmq::Socket* worker_socket =
+      new zmq::Socket(context_->CreateSocket(zmq::kExclusivePair));
+    worker_sockets_.push_back(worker_socket);
+    if (!worker_socket->Bind(worker_endpoint)) {
+      return false;
+    }
+
+    RoutingWorker* worker = new RoutingWorker(context_, router_,
+      channel_.get(), shared_memory_channels_, &expired_count_);
+    routing_workers_.push_back(worker);
+    if (!worker->Start(worker_endpoint, sink_endpoint)) {
+      return false;
+    }
+  }
+
+  poller_->WatchSocket(workers_sink_.get(), zmq::kPollIn, this);
+  LOG(INFO) << "Routing messages with " << routing_workers_count_
+            << " workers";
+  return true;
+}
+
+void MessageReceiver::StopRoutingWorkers() {
+  for (size_t i = 0; i < routing_workers_.size(); ++i) {
+    routing_workers_[i]->Stop();
+  }
+  routing_workers_.reset();
+
+  // The frontend sockets should be closed by the thread that used them.
+  if (workers_sink_.get()) {
+    poller_->StopWatchingSocket(workers_sink_.get());
+  }
+  workers_batch_.Clear();
+  worker_sockets_.reset();
+  workers_sink_.reset();
 }
 
-void MessageReceiver::OnMessageReceived(zmq::Socket* socket,
-  const MessageParts& message_parts) {
-  int no_of_parts = message_parts.size();
+void MessageReceiver::OnSocketReady(zmq::Socket* socket, int events) {
+  if (socket == workers_sink_.get()) {
+    OnWorkersReady();
+    return;
+  }
+
+  if (events & zmq::kPollOut) {
+    SendMailboxes();
+    if (!(events & zmq::kPollIn)) {
+      return;
+    }
+  }
+
+  // Process a single batch per notification, so the poller has a chance to
+  // service its timers and the stop request under heavy load.
+  if (!routing_workers_.empty()) {
+    if (socket->ReceiveBatch(kReceiveBatchSize, &batch_, zmq::kNoBlock)) {
+      received_time_ = base::TimeTicks::Now();
+      for (size_t i = 0; i < batch_.size(); ++i) {
+        const scoped_refptr<zmq::Message>* parts = batch_.frames(i);
+        size_t no_of_parts = batch_.frames_count(i);
+        if (!AdmitMessage(parts, no_of_parts, NULL)) {
+          continue;
+        }
+
+        // The shared memory rings are read only by this thread, so the
+        // packets that are described by them are never forwarded.
+        if (no_of_parts > 2 &&
+          SharedMemoryChannel::IsDescriptor(parts[2].get())) {
+          OnMessageReceived(parts, no_of_parts);
+        } else {
+          ForwardToWorker(parts, no_of_parts);
+        }
+      }
+      SendPacketFrames();
+    }
+    batch_.Clear();
+    return;
+  }
+
+  // A batch that is not full waits for more messages, but no longer than
+  // the batch delay.
+  // The deadlines of the packets are counted from the time the first
+  // message of the batch was received.
+  bool was_empty = batch_.empty();
+  int room = batch_size_ - static_cast<int>(batch_.size());
+  if (room > 0) {
+    socket->ReceiveBatch(room, &batch_, zmq::kNoBlock);
+  }
+  if (batch_.empty()) {
+    return;
+  }
+  if (was_empty) {
+    batch_received_time_ = base::TimeTicks::Now();
+  }
+  if (batch_.size() >= static_cast<size_t>(batch_size_) ||
+    batch_delay_ <= base::TimeDelta()) {
+    RouteBatch();
+  } else if (!batch_timer_) {
+    batch_timer_ = poller_->AddTimer(batch_delay_, false, this);
+  }
+}
+
+void MessageReceiver::OnTimer(int timer_id) {
+  if (timer_id == windows_timer_) {
+    RemoveIdleWindows();
+    return;
+  }
+  DCHECK_EQ(timer_id, batch_timer_);
+  batch_timer_ = 0;
+  RouteBatch();
+}
+
+void MessageReceiver::RouteBatch() {
+  if (batch_timer_) {
+    poller_->CancelTimer(batch_timer_);
+    batch_timer_ = 0;
+  }
+
+  // Scan the headers of the whole batch before looking up the routes, so
+  // the routes are looked up at once. The packets that are over the rate
+  // limits of their sender are discarded before they are scanned, except
+  // the ones that are in shared memory, which are admitted after they are
+  // read. The ones that has expired are dropped before they are routed.
+  received_time_ = batch_received_time_;
+  base::TimeTicks now = base::TimeTicks::Now();
+  size_t count = batch_.size();
+  while (batch_views_.size() < count) {
+    batch_views_.push_back(new PacketView());
+  }
+  bool admit_by_fact = !admission_.fact().empty();
+  std::vector<bool> rejected(count), scanned(count), expired(count);
+  std::vector<std::string> senders;
+  std::vector<PacketView*> views;
+  for (size_t i = 0; i < count; ++i) {
+    const scoped_refptr<zmq::Message>* parts = batch_.frames(i);
+    size_t no_of_parts = batch_.frames_count(i);
+    if (!admit_by_fact && !AdmitMessage(parts, no_of_parts, NULL)) {
+      rejected[i] = true;
+      continue;
+    }
+    zmq::Message* message = no_of_parts == 3 ? parts[2].get() : NULL;
+    scanned[i] = message && !SharedMemoryChannel::IsDescriptor(message) &&
+      batch_views_[i]->Parse(message->mutable_data(), message->size());
+    if (admit_by_fact && !AdmitMessage(parts, no_of_parts,
+      scanned[i] ? batch_views_[i] : NULL)) {
+      rejected[i] = true;
+      scanned[i] = false;
+      continue;
+    }
+    expired[i] = scanned[i] && IsExpired(
+      GetPacketDeadline(batch_views_[i]->header(), received_time_), now);
+    if (scanned[i] && !expired[i]) {
+      senders.push_back(parts[0]->data());
+      views.push_back(batch_views_[i]);
+    }
+  }
+
+  std::vector<RouteSet> routes;
+  std::vector<RoutedRequests> requests;
+  if (!views.empty()) {
+    router_->GetRoutes(senders, views, &routes, &requests);
+  }
+
+  // The control packets of the batch are dispatched first, so they never
+  // wait behind the bulk data that was received with them. The others are
+  // dispatched in the order they was received.
+  for (int pass = 0; pass < 2; ++pass) {
+    bool control_pass = pass == 0;
+    for (size_t i = 0, j = 0; i < count; ++i) {
+      const scoped_refptr<zmq::Message>* parts = batch_.frames(i);
+      if (rejected[i]) {
+        continue;
+      }
+      if (expired[i]) {
+        // A packet without a sender is a request from the peer that sent
+        // it.
+        if (!control_pass) {
+          PacketView* view = batch_views_[i];
+          ExpirePacket(view->has_sender() ? std::string() : parts[0]->data(),
+            view->message_id());
+        }
+        continue;
+      }
+      if (!scanned[i]) {
+        if (!control_pass) {
+          OnMessageReceived(parts, batch_.frames_count(i));
+        }
+        continue;
+      }
+      const RouteSet& message_routes = routes[j];
+      const RoutedRequests& message_requests = requests[j++];
+      if (IsControlPacket(*batch_views_[i], message_routes) == control_pass) {
+        DispatchPacket(message_routes, message_requests, parts[0]->data(),
+          batch_views_[i], parts[2]);
+      }
+    }
+  }
+  SendPacketFrames();
+
+  ++batches_count_;
+  batched_messages_count_ += count;
+  batch_.Clear();
+}
+
+bool MessageReceiver::AdmitMessage(
+  const scoped_refptr<zmq::Message>* message_parts, size_t no_of_parts,
+  const PacketView* view) {
+  if (!admission_.enabled() || !no_of_parts) {
+    return true;
+  }
+
+  // A descriptor that is discarded would leave its records in the ring
+  // until a later descriptor skips them, and its size is not the size of
+  // the packet, so the packet is admitted only after it is read.
+  if (no_of_parts == 3 &&
+    SharedMemoryChannel::IsDescriptor(message_parts[2].get())) {
+    return true;
+  }
+
+  size_t size = 0;
+  for (size_t i = 0; i < no_of_parts; ++i) {
+    size += message_parts[i]->size();
+  }
+
+  if (!admission_.fact().empty() && !view && no_of_parts == 3) {
+    if (!admission_view_.get()) {
+      admission_view_.reset(new PacketView());
+    }
+    zmq::Message* message = message_parts[2].get();
+    if (admission_view_->Parse(message->mutable_data(), message->size())) {
+      view = admission_view_.get();
+    }
+  }
+  return AdmitPacket(message_parts[0].get(), view ? &view->header() : NULL,
+    size);
+}
+
+bool MessageReceiver::AdmitPacket(zmq::Message* sender,
+  const rp::RubyMessageHeader* header, size_t size) {
+  if (!admission_.enabled()) {
+    return true;
+  }
+
+  const char* key = static_cast<const char*>(sender->mutable_data());
+  size_t key_size = sender->size();
+  if (!admission_.fact().empty() && header) {
+    for (int i = 0; i < header->facts_size(); ++i) {
+      if (header->facts(i).key() == admission_.fact()) {
+        key = header->facts(i).value().data();
+        key_size = header->facts(i).value().size();
+        break;
+      }
+    }
+  }
+  return admission_.Admit(key, key_size, size, received_time_);
+}
+
+void MessageReceiver::ForwardToWorker(
+  const scoped_refptr<zmq::Message>* message_parts, size_t no_of_parts) {
+  // The messages of a sender are always routed by the same worker, so they
+  // leave the node in the order they arrived.
+  zmq::Message* sender = message_parts[0].get();
+  uint32 hash = Hash(static_cast<const char*>(sender->mutable_data()),
+    sender->size());
+  zmq::Socket* worker_socket = worker_sockets_[hash % worker_sockets_.size()];
+  worker_socket->Send(zmq::Envelope(message_parts, no_of_parts),
+    zmq::kNoFlags);
+}
+
+void MessageReceiver::OnWorkersReady() {
+  if (!workers_sink_->ReceiveBatch(kReceiveBatchSize, &workers_batch_,
+    zmq::kNoBlock)) {
+    workers_batch_.Clear();
+    return;
+  }
+
+  // The envelopes of the workers are sent like the ones that are routed by
+  // this thread, so they go through the same mailboxes. The workers does
+  // not keep the views of the packets, so their packets are never rejected
+  // to the sender. The second frame holds the lane, the deadline and the
+  // balanced request of the packet when it is not carried by the normal lane,
+  // has a deadline or carries a request.
+  //   [DESTINATION ADDRESS][RoutedPacketInfo OR EMPTY FRAME][DATA]
+  base::TimeTicks now = base::TimeTicks::Now();
+  size_t envelopes_count = workers_batch_.size();
+  for (size_t i = 0; i < envelopes_count; ++i) {
+    if (workers_batch_.frames_count(i) != 3) {
+      continue;
+    }
+    const scoped_refptr<zmq::Message>* frames = workers_batch_.frames(i);
+    output_packets_.push_back(OutboundPacket());
+    OutboundPacket& packet = output_packets_.back();
+    packet.destination = frames[0]->data();
+    packet.frame = frames[2];
+    packet.lane = kNormalLane;
+    if (frames[1] && frames[1]->size() == sizeof(RoutedPacketInfo)) {
+      RoutedPacketInfo info;
+      memcpy(&info, frames[1]->mutable_data(), sizeof(info));
+      if (info.lane < kNumberOfLanes) {
+        packet.lane = static_cast<PacketLane>(info.lane);
+      }
+      packet.deadline = base::TimeTicks::FromInternalValue(info.deadline);
+
+      // The reference that the worker has handed over is adopted.
+      if (info.request) {
+        packet.request = info.request;
+        info.request->Release();
+      }
+    }
+    packet.time = now;
+  }
+  workers_batch_.Clear();
+  SendPacketFrames();
+}
+
+void MessageReceiver::OnWakeup() {
+  std::string address;
+  scoped_ptr<rp::RubyMessagePacket> packet;
+  scoped_refptr<RoutedRequest> request;
+  received_time_ = base::TimeTicks::Now();
+  while (channel_->Take(&address, &packet, &request)) {
+    // The routing workers post the packets that they receive for the local
+    // routes, and set the sender of the ones that are sent to the node to
+    // the transport identity of the peer that sent them. The others are
+    // built by the node control loop.
+    std::string peer;
+    if (IsLocalRoute(address)) {
+      peer = packet->message().sender();
+    }
+    RoutedRequests requests;
+    if (request) {
+      requests.push_back(request);
+    }
+    DispatchMessage(RouteSet(1, address), requests, peer, packet.get());
+  }
+  SendPacketFrames();
+}
+
+void MessageReceiver::OnPacketReceived(const std::string& peer,
+  const RouteSet& routes, const RoutedRequests& requests,
+  rp::RubyMessagePacket* packet) {
+  received_time_ = base::TimeTicks::Now();
+  DispatchMessage(routes, requests, peer, packet);
+  SendPacketFrames();
+}
+
+void MessageReceiver::OnPacketFrameReceived(const std::string& peer,
+  const RouteSet& routes, const RoutedRequests& requests, PacketView* view,
+  zmq::Message* frame) {
+  received_time_ = base::TimeTicks::Now();
+  DispatchPacket(routes, requests, peer, view, frame);
+  SendPacketFrames();
+}
+
+void MessageReceiver::OnMessageReceived(
+  const scoped_refptr<zmq::Message>* message_parts, size_t no_of_parts) {
   if (no_of_parts % 3 != 0) {
     LOG (WARNING) << "Received message has a invalid number of parts."
               << "No of parts: " << no_of_parts;
@@ -64,9 +648,42 @@ void MessageReceiver::OnMessageReceived(zmq::Socket* socket,
   //   [sender id][empty frame][message]
   scoped_refptr<zmq::Message> message = message_parts[2];
   rp::RubyMessagePacket packet;
-  if (!packet.ParseFromArray(message->mutable_data(), message->size())) {
-    LOG (WARNING) << "The received message is not a valid ruby message packet.";
-    return;
+  RoutedRequests requests;
+  if (SharedMemoryChannel::IsDescriptor(message.get())) {
+    // The packet was written by a local host into its shared memory channel.
+    scoped_refptr<SharedMemoryChannel> channel;
+    if (shared_memory_channels_) {
+      channel = shared_memory_channels_->Find(message_parts[0]->data());
+    }
+    if (!channel || !channel->ReadPacket(message.get(), &packet)) {
+      LOG (WARNING) << "The received shared memory packet is not valid.";
+      return;
+    }
+
+    // The records of the packet are consumed, so it could be discarded now.
+    if (admission_.enabled() && !AdmitPacket(message_parts[0].get(),
+      packet.has_header() ? &packet.header() : NULL, packet.ByteSize())) {
+      return;
+    }
+  } else {
+    // Only the header and the sender are needed to route the packet, the
+    // rest of it is forwarded verbatim.
+    PacketView view;
+    if (view.Parse(message->mutable_data(), message->size())) {
+      RouteSet routes =
+        router_->GetRoutes(message_parts[0]->data(), &view, &requests);
+      DispatchPacket(routes, requests, message_parts[0]->data(), &view,
+        message.get());
+      return;
+    }
+
+    // The packet could not be scanned, let the full parser decide if it is
+    // a valid packet.
+    if (!packet.ParseFromArray(message->mutable_data(), message->size())) {
+      LOG (WARNING) << "The received message is not a valid ruby message "
+                    << "packet.";
+      return;
+    }
   }
 
   if (!packet.has_message()) {
@@ -74,41 +691,443 @@ void MessageReceiver::OnMessageReceived(zmq::Socket* socket,
     return;
   }
 
-  DispatchMessage(
-    socket,
-    router_->GetRoutes(message_parts[0]->data(), &packet),
-    &packet);
+  RouteSet routes =
+    router_->GetRoutes(message_parts[0]->data(), &packet, &requests);
+  DispatchMessage(routes, requests, message_parts[0]->data(), &packet);
+}
+
+scoped_refptr<zmq::Message> MessageReceiver::CreateSharedMemoryFrame(
+  const std::string& destination, const rp::RubyMessagePacket& packet,
+  int packet_size) {
+  scoped_refptr<SharedMemoryChannel> channel =
+    FindSharedMemoryChannel(destination, packet_size);
+  if (channel) {
+    scoped_refptr<zmq::Message> slot = channel->AllocatePacket(packet_size);
+    if (slot) {
+      packet.SerializeToArray(slot->mutable_data(), packet_size);
+      return channel->CommitPacket(slot.get());
+    }
+    // The ring is full, the packet goes through the socket.
+  }
+  return NULL;
+}
+
+scoped_refptr<zmq::Message> MessageReceiver::CreateSharedMemoryFrame(
+  const std::string& destination, const PacketView& view) {
+  int packet_size = view.ByteSize();
+  scoped_refptr<SharedMemoryChannel> channel =
+    FindSharedMemoryChannel(destination, packet_size);
+  if (channel) {
+    scoped_refptr<zmq::Message> slot = channel->AllocatePacket(packet_size);
+    if (slot) {
+      view.SerializeToArray(slot->mutable_data());
+      return channel->CommitPacket(slot.get());
+    }
+  }
+  return NULL;
+}
+
+void MessageReceiver::DispatchLocally(const std::string& destination,
+  RoutedRequest* request, const std::string& peer,
+  const rp::RubyMessagePacket& packet) {
+  // The packets that are routed to the node itself are handed to the control
+  // message loop without leaving the process, and the ones that are routed
+  // to the clients of the packet listener are written to their connections.
+  if (IsNodeControlRoute(destination)) {
+    // The credits are granted by the receiver thread itself, which is the
+    // one that sends the packets, and so are the rate limits applied by the
+    // thread that receives them. The windows are keyed by the transport
+    // identity of the peer, since the sender of a message is set by the
+    // peer itself.
+    if (packet.message().type() == rpc::kNodeCredit) {
+      OnCreditReceived(peer, packet.message());
+    } else if (packet.message().type() == rpc::kNodeAdmission) {
+      OnAdmissionReceived(peer, packet.message());
+    } else {
+      if (packet.message().type() == rpc::kNodeAnnounce) {
+        OnAnnounceReceived(peer);
+      }
+      if (control_channel_) {
+        control_channel_->Post(peer,
+          new rp::RubyMessagePacket(packet), NULL);
+      }
+    }
+  } else if (PacketListener::IsListenerRoute(destination)) {
+    if (packet_listener_.get() &&
+      packet_listener_->Send(destination, packet) && request) {
+      request->Sent(base::TimeTicks::Now());
+    }
+  }
+}
+
+void MessageReceiver::OnCreditReceived(const std::string& peer,
+  const rp::RubyMessage& message) {
+  rpc::CreditMessage credit;
+  if (peer.empty() || !credit.ParseFromString(message.message())) {
+    LOG (WARNING) << "The received credit message is not valid.";
+    return;
+  }
+  mailboxes_.GrantCredits(peer, credit.messages(), received_time_);
+}
+
+void MessageReceiver::OnAnnounceReceived(const std::string& peer) {
+  // The message channel drops the packets above its high water mark
+  // silently, so the hosts that serve requests are always under flow
+  // control. The clients of the packet listener are not reached through it.
+  if (!peer.empty() && !IsLocalRoute(peer)) {
+    mailboxes_.OpenWindow(peer, kInitialCredits, received_time_);
+  }
+}
+
+void MessageReceiver::RemoveIdleWindows() {
+  // A peer that is still routed could be a host that has nothing to say,
+  // its window is kept.
+  std::vector<std::string> idle;
+  mailboxes_.GetIdleWindows(base::TimeTicks::Now() -
+    base::TimeDelta::FromMilliseconds(kCreditIdleTimeout), &idle);
+  for (size_t i = 0; i < idle.size(); ++i) {
+    if (!router_->HasRoute(idle[i])) {
+      mailboxes_.RemoveDestination(idle[i]);
+    }
+  }
+}
+
+void MessageReceiver::OnAdmissionReceived(const std::string& peer,
+  const rp::RubyMessage& message) {
+  // The limits of a key could be used to throttle the other tenants, or to
+  // lift the limits of the sender, so only the packets that was built by
+  // the node, whose peer is empty, and the trusted peers could change them.
+  if (!peer.empty() &&
+    admission_control_peers_.find(peer) == admission_control_peers_.end()) {
+    LOG(WARNING) << "An admission message was received from a peer that is "
+                 << "not trusted to change the admission limits.";
+    return;
+  }
+
+  rpc::AdmissionMessage admission;
+  if (!admission.ParseFromString(message.message())) {
+    LOG (WARNING) << "The received admission message is not valid.";
+    return;
+  }
+
+  AdmissionControl::Limits limits;
+  limits.messages_per_second = std::max<int64>(
+    admission.messages_per_second(), 0);
+  limits.bytes_per_second = std::max<int64>(admission.bytes_per_second(), 0);
+  if (admission.has_key()) {
+    if (!admission_.SetLimits(admission.key(), limits)) {
+      LOG(WARNING) << "The admission limits of a key was not set, there is "
+                   << "already " << kAdmissionMaxKeys << " keys with limits.";
+      return;
+    }
+  } else {
+    admission_.SetDefaultLimits(limits);
+  }
+  LOG(INFO) << "Admission limits of "
+            << (admission.has_key() ? "a single key" : "every key")
+            << " set to " << limits.messages_per_second
+            << " messages/s and " << limits.bytes_per_second << " bytes/s";
 }
 
-void MessageReceiver::DispatchMessage(zmq::Socket* socket,
-  const RouteSet& destinations,
-  const rp::RubyMessagePacket* packet) {
+void MessageReceiver::ExpirePacket(const std::string& reply_to,
+  const std::string& message_id) {
+  base::subtle::NoBarrier_AtomicIncrement(&expired_count_, 1);
+  if (!notify_expired_ || reply_to.empty() || IsLocalRoute(reply_to)) {
+    return;
+  }
+
+  output_packets_.push_back(OutboundPacket());
+  OutboundPacket& packet = output_packets_.back();
+  packet.destination = reply_to;
+  packet.frame = CreateErrorFrame(message_id, kDeadlineExceededError,
+    "Deadline exceeded.");
+  packet.lane = kControlLane;
+  packet.time = base::TimeTicks::Now();
+}
+
+void MessageReceiver::DispatchMessage(const RouteSet& destinations,
+  const RoutedRequests& requests, const std::string& peer,
+  rp::RubyMessagePacket* packet) {
   DCHECK(destinations.size());
 
+  // The sender of a fully parsed packet could not be told apart from the
+  // original sender of a response, so the expired packets are dropped
+  // without notice.
+  base::TimeTicks deadline;
+  if (!CheckPacketDeadline(packet, received_time_, &deadline)) {
+    ExpirePacket(std::string(), std::string());
+    return;
+  }
+
+  RouteSet socket_destinations;
+  socket_destinations.reserve(destinations.size());
+  for (RouteSet::const_iterator destination = destinations.begin();
+    destination != destinations.end(); ++destination) {
+    if (IsLocalRoute(*destination)) {
+      DispatchLocally(*destination, FindRoutedRequest(requests, *destination),
+        peer, *packet);
+    } else {
+      socket_destinations.push_back(*destination);
+    }
+  }
+
+  size_t destinations_count = socket_destinations.size();
+  if (!destinations_count) {
+    return;
+  }
+
+  // The packet is serialized only once, and the resulting frame is shared by
+  // all the destinations that does not use shared memory. The lane could
+  // change the packet, so it is chosen before.
+  PacketLane lane = peer.empty() ? GetPacketLane(packet->header()) :
+    GetReceivedPacketLane(packet);
+  std::vector<scoped_refptr<zmq::Message> > packet_frames(destinations_count);
   int packet_size = packet->ByteSize();
+  if (!CreateSharedMemoryFrames(socket_destinations, *packet, packet_size,
+    &packet_frames[0])) {
+    scoped_refptr<zmq::Message> frame(new zmq::Message(packet_size));
+    packet->SerializeToArray(frame->mutable_data(), packet_size);
+    ShareFrame(frame.get(), &packet_frames[0], destinations_count);
+  }
+  QueuePacketFrames(socket_destinations, requests, &packet_frames[0], NULL,
+    lane, deadline);
+}
+
+void MessageReceiver::DispatchPacket(const RouteSet& destinations,
+  const RoutedRequests& requests, const std::string& peer, PacketView* view,
+  zmq::Message* frame) {
+  DCHECK(destinations.size());
+
+  // The relative timeout of the packet is updated to the budget that
+  // remains before it is dispatched.
+  base::TimeTicks deadline;
+  if (!CheckPacketDeadline(view, received_time_, &deadline)) {
+    ExpirePacket(view->sender_modified() ? view->sender() : std::string(),
+      view->message_id());
+    return;
+  }
+
+  // The local destinations needs a packet object, which is parsed only when
+  // the packet is routed to one of them.
+  scoped_ptr<rp::RubyMessagePacket> packet;
+  RouteSet socket_destinations;
+  socket_destinations.reserve(destinations.size());
   for (RouteSet::const_iterator destination = destinations.begin();
     destination != destinations.end(); ++destination) {
+    if (!IsLocalRoute(*destination)) {
+      socket_destinations.push_back(*destination);
+      continue;
+    }
+
+    if (!packet.get()) {
+      packet.reset(new rp::RubyMessagePacket());
+      if (!view->ParsePacket(packet.get())) {
+        LOG (WARNING) << "The received message is not a valid ruby message "
+                      << "packet.";
+        return;
+      }
+    }
+    DispatchLocally(*destination, FindRoutedRequest(requests, *destination),
+      peer, *packet);
+  }
+
+  size_t destinations_count = socket_destinations.size();
+  if (!destinations_count) {
+    return;
+  }
+
+  // A packet that was not modified is forwarded in the frame it was
+  // received with, the others are serialized only once. The lane could
+  // change the packet, so it is chosen before.
+  PacketLane lane = GetReceivedPacketLane(view);
+  std::vector<scoped_refptr<zmq::Message> > packet_frames(destinations_count);
+  if (!CreateSharedMemoryFrames(socket_destinations, *view,
+    &packet_frames[0])) {
+    scoped_refptr<zmq::Message> packet_frame(frame);
+    if (view->modified()) {
+      packet_frame = new zmq::Message(view->ByteSize());
+      view->SerializeToArray(packet_frame->mutable_data());
+    }
+    ShareFrame(packet_frame.get(), &packet_frames[0], destinations_count);
+  }
+  QueuePacketFrames(socket_destinations, requests, &packet_frames[0], view,
+    lane, deadline);
+}
+
+bool MessageReceiver::CreateSharedMemoryFrames(const RouteSet& destinations,
+  const rp::RubyMessagePacket& packet, int packet_size,
+  scoped_refptr<zmq::Message>* packet_frames) {
+  bool all_created = true;
+  for (size_t i = 0; i < destinations.size(); ++i) {
+    packet_frames[i] =
+      CreateSharedMemoryFrame(destinations[i], packet, packet_size);
+    all_created &= packet_frames[i].get() != NULL;
+  }
+  return all_created;
+}
+
+bool MessageReceiver::CreateSharedMemoryFrames(const RouteSet& destinations,
+  const PacketView& view, scoped_refptr<zmq::Message>* packet_frames) {
+  bool all_created = true;
+  for (size_t i = 0; i < destinations.size(); ++i) {
+    packet_frames[i] = CreateSharedMemoryFrame(destinations[i], view);
+    all_created &= packet_frames[i].get() != NULL;
+  }
+  return all_created;
+}
+
+void MessageReceiver::QueuePacketFrames(const RouteSet& destinations,
+  const RoutedRequests& requests,
+  const scoped_refptr<zmq::Message>* packet_frames, const PacketView* view,
+  PacketLane lane, base::TimeTicks deadline) {
+  // Only the requests are rejected to their sender, which is set by the
+  // router when the request is received. The sender of a packet that comes
+  // from a local route could not be reached through the message channel.
+  std::string reply_to;
+  if (view && view->sender_modified() &&
+    mailboxes_.overflow_policy() == kRejectToSenderPolicy &&
+    !IsLocalRoute(view->sender())) {
+    reply_to = view->sender();
+  }
+
+  base::TimeTicks now = base::TimeTicks::Now();
+  for (size_t i = 0; i < destinations.size(); ++i) {
+    if (!packet_frames[i]) {
+      ++unshared_count_;
+      continue;
+    }
+    output_packets_.push_back(OutboundPacket());
+    OutboundPacket& packet = output_packets_.back();
+    packet.destination = destinations[i];
+    packet.frame = packet_frames[i];
+    packet.lane = lane;
+    packet.time = now;
+    packet.deadline = deadline;
+    if (!requests.empty()) {
+      packet.request = FindRoutedRequest(requests, destinations[i]);
+    }
+    if (!reply_to.empty()) {
+      packet.reply_to = reply_to;
+      packet.message_id = view->message_id();
+    }
+  }
+}
+
+void MessageReceiver::SendPacketFrames() {
+  if (output_packets_.empty() || !socket_.get()) {
+    output_packets_.clear();
+    return;
+  }
+
+  // The packets to a destination that has queued packets in the same lane
+  // are queued after them, so the packets of a lane are delivered in order.
+  // So are the packets to a destination that has no credits left, except
+  // for the control packets, which are sent before the others.
+  std::vector<const OutboundPacket*> packets;
+  packets.reserve(output_packets_.size());
+  base::TimeTicks now = base::TimeTicks::Now();
+  for (int pass = 0; pass < 2; ++pass) {
+    bool control_pass = pass == 0;
+    for (size_t i = 0; i < output_packets_.size(); ++i) {
+      const OutboundPacket& packet = output_packets_[i];
+      bool control = packet.lane == kControlLane;
+      if (control != control_pass) {
+        continue;
+      }
+      if (IsExpired(packet.deadline, now)) {
+        base::subtle::NoBarrier_AtomicIncrement(
+          &expired_before_send_count_, 1);
+        continue;
+      }
+      if (mailboxes_.HasQueued(packet.destination, packet.lane) ||
+        (!control && !mailboxes_.TakeCredit(packet.destination))) {
+        QueueToMailbox(packet);
+      } else {
+        packets.push_back(&packet);
+      }
+    }
+  }
+
+  // The message envelope to send a message over a ROUTER->REP/REQ should be.
+  //  [DESTINATION ADDRESS]
+  //  [EMPTY FRAME]
+  //  [DATA]
+  // The empty frame is represented by a NULL message.
+  const size_t kEnvelopeSize = 3;
+  size_t destinations_count = packets.size();
+  std::vector<scoped_refptr<zmq::Message> > frames(
+    destinations_count * kEnvelopeSize);
+  std::vector<zmq::Envelope> envelopes(destinations_count);
+
+  for (size_t i = 0; i < destinations_count; ++i) {
+    const std::string& destination = packets[i]->destination;
+    scoped_refptr<zmq::Message>* envelope_frames = &frames[i * kEnvelopeSize];
+
     // Write the destination address to the router socket as the first
     // message part.
-    int destination_address_size = destination->size();
-    scoped_refptr<zmq::Message> address(
-      new zmq::Message(destination_address_size));
-    memcpy(address->mutable_data(), destination->data(),
-      destination_address_size);
+    envelope_frames[0] = new zmq::Message(
+      static_cast<int>(destination.size()));
+    memcpy(envelope_frames[0]->mutable_data(), destination.data(),
+      destination.size());
+
+    envelope_frames[2] = packets[i]->frame;
 
-    // Serialize the message packet into a zmq::Message.
-    scoped_refptr<zmq::Message> packet_data(new zmq::Message(packet_size));
-    packet->SerializeToArray(packet_data->mutable_data(), packet_size);
+    envelopes[i] = zmq::Envelope(envelope_frames, kEnvelopeSize);
+  }
+
+  // The socket stops on the first packet that it refuses, the remaining
+  // packets wait in the mailboxes.
+  size_t sent = 0;
+  if (destinations_count) {
+    sent = socket_->SendBatch(&envelopes[0], destinations_count,
+      zmq::kNoBlock);
+  }
+  now = base::TimeTicks::Now();
+  for (size_t i = 0; i < sent; ++i) {
+    lane_stats_.Add(packets[i]->lane, now - packets[i]->time);
+    if (packets[i]->request) {
+      packets[i]->request->Sent(now);
+    }
+  }
+  for (size_t i = sent; i < destinations_count; ++i) {
+    if (packets[i]->lane != kControlLane) {
+      mailboxes_.ReturnCredit(packets[i]->destination);
+    }
+    QueueToMailbox(*packets[i]);
+  }
+
+  output_packets_.clear();
+
+  SendMailboxes();
+}
+
+void MessageReceiver::QueueToMailbox(const OutboundPacket& packet) {
+  OutboundMailboxes::QueueResult result =
+    mailboxes_.Queue(packet.destination, packet.lane, packet.frame.get(),
+      packet.time, packet.deadline, packet.request.get());
+  if (result != OutboundMailboxes::kRejected || packet.reply_to.empty()) {
+    return;
+  }
+
+  // The error is queued like any other packet, but it is never rejected
+  // itself, so a full mailbox could not produce an error storm.
+  mailboxes_.Queue(packet.reply_to, kControlLane,
+    CreateErrorFrame(packet.message_id, kDestinationOverloadedError,
+      "Destination overloaded.").get(),
+    base::TimeTicks::Now(), base::TimeTicks(), NULL);
+}
 
-    // The message envelope to send a message over a ROUTER->REP/REQ should be.
-    //  [DESTINATION ADDRESS]
-    //  [EMPTY FRAME]
-    //  [DATA]
-    socket->Send(address, destination_address_size, zmq::kSendMore);
-    socket->Send(scoped_refptr<zmq::Message>(new zmq::Message()), 0,
-      zmq::kSendMore);
-    socket->Send(packet_data, packet_size, zmq::kNoFlags);
+void MessageReceiver::SendMailboxes() {
+  // The message channel is watched for writability only while it refuses
+  // the queued packets. The packets that wait for credits are sent when the
+  // credits are granted, otherwise the poller would wake up continuously.
+  bool watch_output = !mailboxes_.empty() &&
+    !mailboxes_.Send(socket_.get(), &lane_stats_);
+  if (watch_output != watching_output_) {
+    poller_->WatchSocket(socket_.get(),
+      zmq::kPollIn | (watch_output ? zmq::kPollOut : 0), this);
+    watching_output_ = watch_output;
   }
 }
 
-}  // namespace node
\ No newline at end of file
+}  // namespace node
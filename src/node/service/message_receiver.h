@@ -6,60 +6,439 @@
 #define NODE_SERVICE_MESSAGE_RECEIVER_H_
 #pragma once
 
+#include <set>
 #include <vector>
 #include <string>
 
+#include <base/atomicops.h>
+#include <base/compiler_specific.h>
 #include <base/memory/ref_counted.h>
+#include <base/memory/scoped_ptr.h>
+#include <base/memory/scoped_vector.h>
+#include <base/time.h>
+
+#include "node/service/admission_control.h"
+#include "node/service/outbound_mailboxes.h"
+#include "node/service/packet_listener.h"
+#include "node/service/priority_lanes.h"
+#include "node/zeromq/poller.h"
+#include "node/zeromq/socket.h"
 
 namespace ruby {
 namespace protocol {
+class RubyMessage;
 class RubyMessagePacket;
 class RubyMessageHeader;
 }
 }
 
-namespace zmq {
-class Socket;
-class Message;
-class Context;
-}
-
 namespace node {
 class MessageRouter;
+class PacketChannel;
+class PacketView;
+class RoutingWorker;
+class SharedMemoryChannel;
+class SharedMemoryChannelMap;
 
-class MessageReceiver {
+class MessageReceiver
+  : public zmq::Poller::Watcher,
+    public zmq::Poller::TimerDelegate,
+    public zmq::Poller::WakeupDelegate,
+    public PacketListener::Delegate {
  public:
   MessageReceiver(zmq::Context* context, MessageRouter* message_router);
-  ~MessageReceiver();
+  virtual ~MessageReceiver();
+
+  // Binds the message channel endpoints. Returns false if the TCP endpoint
+  // could not be bound. A failure to bind the ipc endpoint is not fatal, the
+  // local peers will use the TCP endpoint in that case. This is called by
+  // Run() when it was not called before.
+  bool Bind();
 
   // Start the MessageReceiver. This blocks until Stop is called.
   void Run();
 
   // Stop an earlier call to Start(), causing the receiver to stop receiving
-  // messages.
+  // messages. Stop could be called from any thread and does not wait for the
+  // next message to arrive.
   void Stop();
 
+  // zmq::Poller::Watcher implementation.
+  virtual void OnSocketReady(zmq::Socket* socket, int events) OVERRIDE;
+
+  // zmq::Poller::TimerDelegate implementation.
+  virtual void OnTimer(int timer_id) OVERRIDE;
+
+  // zmq::Poller::WakeupDelegate implementation.
+  virtual void OnWakeup() OVERRIDE;
+
+  // PacketListener::Delegate implementation.
+  virtual void OnPacketReceived(const std::string& peer,
+    const RouteSet& routes, const RoutedRequests& requests,
+    ruby::protocol::RubyMessagePacket* packet) OVERRIDE;
+  virtual void OnPacketFrameReceived(const std::string& peer,
+    const RouteSet& routes, const RoutedRequests& requests, PacketView* view,
+    zmq::Message* frame) OVERRIDE;
+
+  // The channel used by the in-process components of the node to send
+  // packets through the message channel. The packets are sent to the
+  // address they are posted with.
+  PacketChannel* channel() const { return channel_.get(); }
+
+  // Sets the channel that receives the packets that are routed to the node
+  // control route. Must be called before Run().
+  void set_control_channel(PacketChannel* control_channel) {
+    control_channel_ = control_channel;
+  }
+
+  // Sets the map of the shared memory channels of the local service hosts.
+  // The large packets that are sent to a host that has a shared memory
+  // channel are written into the channel instead of the socket. Must be
+  // called before Run().
+  void set_shared_memory_channels(SharedMemoryChannelMap* channels) {
+    shared_memory_channels_ = channels;
+  }
+
+  // Sets the number of threads that parses and routes the received
+  // messages. If not called or zero, the messages are routed by the thread
+  // that calls Run(). Must be called before Run().
+  void set_routing_workers(int count) { routing_workers_count_ = count; }
+
+  // Sets the maximum number of messages that are received and routed
+  // together. The headers of a batch are scanned at once, the messages with
+  // the same facts are routed by a single lookup and the envelopes of the
+  // whole batch are sent at once. Must be called before Run().
+  void set_batch_size(int size) { batch_size_ = size; }
+
+  // Sets how long a batch that is not full could wait for more messages
+  // before it is routed. If not called or zero, the messages that are
+  // available are routed at once. Must be called before Run().
+  void set_batch_delay(base::TimeDelta delay) { batch_delay_ = delay; }
+
+  // Sets the maximum number of packets and bytes that are queued for a
+  // destination that could not receive them right away, and what happens to
+  // the packets that does not fit. Must be called before Run().
+  void set_mailbox_max_messages(size_t max_messages) {
+    mailboxes_.set_max_messages(max_messages);
+  }
+  void set_mailbox_max_bytes(size_t max_bytes) {
+    mailboxes_.set_max_bytes(max_bytes);
+  }
+  void set_mailbox_overflow_policy(MailboxOverflowPolicy policy) {
+    mailboxes_.set_overflow_policy(policy);
+  }
+
+  // Sets the rates that each sender, or each value of the admission fact,
+  // could feed the node with. The limits could be changed later through the
+  // node-admission control message. Must be called before Run().
+  void set_admission_limits(const AdmissionControl::Limits& limits) {
+    admission_.SetDefaultLimits(limits);
+  }
+
+  // Sets the name of the fact whose values are rate limited instead of the
+  // senders. Must be called before Run().
+  void set_admission_fact(const std::string& fact) {
+    admission_.set_fact(fact);
+  }
+
+  // Sets the transport identities of the peers that are trusted to change
+  // the admission limits. The node-admission messages that comes from any
+  // other peer are discarded. Must be called before Run().
+  void set_admission_control_peers(const std::set<std::string>& peers) {
+    admission_control_peers_ = peers;
+  }
+
+  // Sets whether the sender of a request that has expired before it was
+  // delivered is notified with an error. Must be called before Run().
+  void set_notify_expired(bool notify) { notify_expired_ = notify; }
+
+  // Gets the number of packets that was dropped because they had expired
+  // before they was routed, by the receiver thread or by the routing
+  // workers, and before they was sent. The counts wrap around at 2^32 and
+  // could be read from any thread.
+  uint32 expired_count() const;
+  uint32 expired_before_send_count() const;
+
   // Sets the ports numbers that is used by sockets to receives commands
   // from clients and services. If not called the default port will be used.
   void set_message_channel_port (int port) { message_channel_port_ = port; }
 
+  // Sets the port where the clients that does not use zeromq could send
+  // length-prefixed packets. If not called or zero, the packet listener is
+  // disabled.
+  void set_packet_listener_port(int port) { packet_listener_port_ = port; }
+
+  // Sets the ipc:// endpoint that should be bound in addition to the TCP
+  // endpoint. If not called or empty, only the TCP endpoint is bound.
+  void set_message_channel_ipc_endpoint(const std::string& endpoint) {
+    message_channel_ipc_endpoint_ = endpoint;
+  }
+
+  // Gets the ipc:// endpoint that was bound by Bind(), or an empty string
+  // if there is no ipc endpoint.
+  const std::string& bound_ipc_endpoint() const {
+    return bound_ipc_endpoint_;
+  }
+
+  // Sets the options that is applied to the message channel socket before
+  // it is bound. Must be called before Run().
+  void set_message_channel_options(const zmq::SocketOptions& options) {
+    message_channel_options_ = options;
+  }
+
  private:
-  typedef std::vector<scoped_refptr<zmq::Message>> MessageParts;
+  // A packet frame that should be sent through the message channel.
+  struct OutboundPacket {
+    OutboundPacket() : lane(kNormalLane) {}
+
+    std::string destination;
+    scoped_refptr<zmq::Message> frame;
+
+    // The lane that carries the packet, the time it was dispatched and the
+    // time it expires, which is null if it never expires.
+    PacketLane lane;
+    base::TimeTicks time;
+    base::TimeTicks deadline;
+
+    // The address that is notified when the packet is rejected because the
+    // mailbox of its destination is full, and the ID of the rejected
+    // message. Empty if no one should be notified.
+    std::string reply_to;
+    std::string message_id;
+
+    // The request that the packet carries to an instance of a balanced
+    // service, which is marked as sent when the packet is sent, or NULL.
+    scoped_refptr<RoutedRequest> request;
+  };
+
+  // Starts the routing workers and binds the sockets that feeds them.
+  // Returns false if the workers could not be started, in which case the
+  // messages are routed by the receiver thread.
+  bool StartRoutingWorkers();
+  void StopRoutingWorkers();
+
+  // Forwards the |no_of_parts| message parts pointed by |message_parts| to
+  // the routing worker that is responsible for its sender.
+  void ForwardToWorker(const scoped_refptr<zmq::Message>* message_parts,
+    size_t no_of_parts);
+
+  // Sends the envelopes that was routed by the workers through the message
+  // channel.
+  void OnWorkersReady();
+
+  // Returns true if the message of |no_of_parts| parts pointed by
+  // |message_parts| is within the rate limits of its sender, or of its
+  // admission fact. |view| is the view of the scanned packet, or NULL if it
+  // was not scanned yet, in which case the packet is scanned only when it is
+  // limited by a fact. The messages that are not admitted should be
+  // discarded. The shared memory descriptors are always admitted, since
+  // their records must be read from the ring anyway; their packets are
+  // admitted by AdmitPacket after they are read.
+  bool AdmitMessage(const scoped_refptr<zmq::Message>* message_parts,
+    size_t no_of_parts, const PacketView* view);
+
+  // Returns true if the packet of |size| bytes that was received from
+  // |sender| is within the rate limits of its sender, or of its admission
+  // fact. |header| is the header of the packet, or NULL if the packet could
+  // not be scanned.
+  bool AdmitPacket(zmq::Message* sender,
+    const ruby::protocol::RubyMessageHeader* header, size_t size);
 
-  // Process the message parts.
-  void OnMessageReceived(zmq::Socket* socket,
-    const MessageParts& message_parts);
+  // Routes the messages of |batch_| and sends their envelopes.
+  void RouteBatch();
+
+  // Process the |no_of_parts| message parts pointed by |message_parts|. The
+  // packets that are read from shared memory are admitted here.
+  void OnMessageReceived(const scoped_refptr<zmq::Message>* message_parts,
+    size_t no_of_parts);
   
-  // Dispatches a message packet to its destiantion.
-  void DispatchMessage(zmq::Socket* socket,
-    const std::vector<std::string>& destinations,
-    const ruby::protocol::RubyMessagePacket* packet);
+  // Creates the frame that carries |packet|, whose serialized size is
+  // |packet_size|, to |destination| through its shared memory channel. The
+  // packet is written into the channel and the returned frame is just a
+  // descriptor of it. Returns NULL if the packet should be sent through the
+  // socket.
+  scoped_refptr<zmq::Message> CreateSharedMemoryFrame(
+    const std::string& destination,
+    const ruby::protocol::RubyMessagePacket& packet, int packet_size);
+
+  // Creates the frame that carries the packet scanned by |view| to
+  // |destination| through its shared memory channel.
+  scoped_refptr<zmq::Message> CreateSharedMemoryFrame(
+    const std::string& destination, const PacketView& view);
+
+  // Creates the shared memory frames of the packet for each one of the
+  // |destinations|, storing them at the same index of |packet_frames|.
+  // Returns true if all the destinations was reached through shared memory.
+  bool CreateSharedMemoryFrames(const std::vector<std::string>& destinations,
+    const ruby::protocol::RubyMessagePacket& packet, int packet_size,
+    scoped_refptr<zmq::Message>* packet_frames);
+  bool CreateSharedMemoryFrames(const std::vector<std::string>& destinations,
+    const PacketView& view, scoped_refptr<zmq::Message>* packet_frames);
+
+  // Gets the shared memory channel that should carry a packet of
+  // |packet_size| bytes to |destination|, or NULL if the packet should be
+  // sent through the socket.
+  scoped_refptr<SharedMemoryChannel> FindSharedMemoryChannel(
+    const std::string& destination, int packet_size);
+
+  // Dispatches |packet| to a destination that is not reached through the
+  // message channel, such as the node control loop or a packet listener
+  // connection. |peer| is the transport identity of the peer that sent the
+  // packet, which the messages sent to the node are attributed to, whatever
+  // their sender says. |request| is the request that the packet carries to
+  // an instance of a balanced service, or NULL.
+  void DispatchLocally(const std::string& destination,
+    RoutedRequest* request, const std::string& peer,
+    const ruby::protocol::RubyMessagePacket& packet);
+
+  // Grants the credits of the credit message |message| to |peer|. The
+  // queued packets are sent by the next call to SendPacketFrames().
+  void OnCreditReceived(const std::string& peer,
+    const ruby::protocol::RubyMessage& message);
+
+  // Opens the flow control window of |peer|, which has announced a service.
+  void OnAnnounceReceived(const std::string& peer);
+
+  // Removes the flow control windows of the peers that are gone, which are
+  // the ones that was idle for a while and has no routes.
+  void RemoveIdleWindows();
+
+  // Applies the limits of the admission message |message| that was sent by
+  // |peer|, if the node itself or a trusted control peer has sent it.
+  void OnAdmissionReceived(const std::string& peer,
+    const ruby::protocol::RubyMessage& message);
+
+  // Counts a packet that has expired and notifies |reply_to|, which could
+  // be empty, that the message whose ID is |message_id| has expired.
+  void ExpirePacket(const std::string& reply_to,
+    const std::string& message_id);
+
+  // Dispatches a message packet that was received from |peer| to its
+  // destiantion. An empty |peer| means that the packet was built by the node
+  // itself, which is the only one that could send packets through the
+  // control lane. |requests| are the requests that the packet carries to
+  // the instances of the balanced services, which are marked as sent when
+  // the packet leaves the node.
+  void DispatchMessage(const std::vector<std::string>& destinations,
+    const RoutedRequests& requests, const std::string& peer,
+    ruby::protocol::RubyMessagePacket* packet);
+
+  // Dispatches the packet scanned by |view|, which was received in |frame|
+  // from |peer|, to its destinations. The packet is parsed only if it is
+  // dispatched locally.
+  void DispatchPacket(const std::vector<std::string>& destinations,
+    const RoutedRequests& requests, const std::string& peer,
+    PacketView* view, zmq::Message* frame);
+
+  // Queues the |packet_frames| to be sent to the |destinations| with the
+  // same index through |lane| by the next call to SendPacketFrames(). |view|
+  // is the view of the packet that is sent, or NULL if it is not known.
+  // The packets are discarded if they are not sent before |deadline|.
+  void QueuePacketFrames(const std::vector<std::string>& destinations,
+    const RoutedRequests& requests,
+    const scoped_refptr<zmq::Message>* packet_frames, const PacketView* view,
+    PacketLane lane, base::TimeTicks deadline);
+
+  // Sends the queued packet frames through the message channel, without
+  // blocking. The frames that could not be sent are queued into the
+  // mailboxes of their destinations.
+  void SendPacketFrames();
+
+  // Queues |packet| into the mailbox of its destination, notifying its
+  // sender when the packet is rejected.
+  void QueueToMailbox(const OutboundPacket& packet);
+
+  // Sends the packets that are queued into the mailboxes and watches the
+  // message channel for writability while some of them remain queued.
+  void SendMailboxes();
 
   zmq::Context* context_;
   MessageRouter* router_;
 
+  // Waits for messages on the router socket and for the stop request.
+  scoped_ptr<zmq::Poller> poller_;
+
+  // The router socket. Valid only while running.
+  scoped_ptr<zmq::Socket> socket_;
+
+  // The channel that receives the packets that should be sent by us. It must
+  // be destroyed before the poller.
+  scoped_ptr<PacketChannel> channel_;
+  PacketChannel* control_channel_;
+  SharedMemoryChannelMap* shared_memory_channels_;
+
+  // Accepts the clients that does not use zeromq. NULL if disabled.
+  scoped_ptr<PacketListener> packet_listener_;
+  int packet_listener_port_;
+
+  // The routing workers and the frontend sockets that feeds them, in the
+  // same order. Empty when the messages are routed by the receiver thread.
+  int routing_workers_count_;
+  ScopedVector<RoutingWorker> routing_workers_;
+  ScopedVector<zmq::Socket> worker_sockets_;
+
+  // Receives the envelopes that was routed by the workers.
+  scoped_ptr<zmq::Socket> workers_sink_;
+  zmq::MessageBatch workers_batch_;
+
+  // The batch is reused accross receives, so its storage is allocated only
+  // once. So are the views of the packets of the batch.
+  zmq::MessageBatch batch_;
+  ScopedVector<PacketView> batch_views_;
+  int batch_size_;
+  base::TimeDelta batch_delay_;
+
+  // The timer that routes a batch that is not full, or zero.
+  int batch_timer_;
+
+  // The timer that removes the flow control windows of the peers that are
+  // gone, or zero.
+  int windows_timer_;
+
+  // The time the first message of the batch was received, and the time the
+  // messages that are being dispatched was received. The deadlines of the
+  // packets are counted from them.
+  base::TimeTicks batch_received_time_;
+  base::TimeTicks received_time_;
+
+  // Limits the rate of the incoming messages, before they are parsed. The
+  // view scans the packets that are limited by a fact when they are not
+  // scanned for routing.
+  AdmissionControl admission_;
+  scoped_ptr<PacketView> admission_view_;
+  std::set<std::string> admission_control_peers_;
+
+  // The packets that was dropped because they have expired before they was
+  // routed or sent.
+  bool notify_expired_;
+  volatile base::subtle::Atomic32 expired_count_;
+  volatile base::subtle::Atomic32 expired_before_send_count_;
+
+  // The packet frames that was not sent because their data could not be
+  // shared with the other destinations.
+  int64 unshared_count_;
+
+  // Used to report how effective the batching is.
+  int64 batches_count_;
+  int64 batched_messages_count_;
+
+  // The packet frames that should be sent through the message channel.
+  std::vector<OutboundPacket> output_packets_;
+
+  // The packets that the message channel could not send right away or that
+  // wait for the credits of their destinations, and whether the message
+  // channel is watched for writability because of them.
+  OutboundMailboxes mailboxes_;
+  bool watching_output_;
+
+  // Shows how well the lanes are isolated from each other.
+  LaneLatencyStats lane_stats_;
+
   bool running_;
   int message_channel_port_;
+  std::string message_channel_ipc_endpoint_;
+  std::string bound_ipc_endpoint_;
+  zmq::SocketOptions message_channel_options_;
 };
 
 }  // namespace node
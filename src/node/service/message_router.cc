@@ -4,11 +4,17 @@
 
 #include "node/service/message_router.h"
 
+#include <algorithm>
+#include <map>
+
 #include <base/logging.h>
+#include <base/rand_util.h>
 #include <sql/connection.h>
 #include <google/protobuf/repeated_field.h>
 #include <ruby_protos.pb.h>
 
+#include "node/service/constants.h"
+#include "node/service/packet_view.h"
 #include "node/service/routing_database.h"
 
 namespace node {
@@ -18,52 +24,114 @@ namespace rp = ::ruby::protocol;
 typedef 
   google::protobuf::RepeatedPtrField<ruby::KeyValuePair> KeyValuePairSet;
 
+namespace {
+
+// Gets the hashes of |facts|, in the same order.
+void GetFactHashes(const ServiceFactSet& facts,
+  std::vector<uint32>* fact_hashes) {
+  fact_hashes->reserve(facts.size());
+  for (ServiceFactSet::const_iterator fact = facts.begin();
+    fact != facts.end(); ++fact) {
+    fact_hashes->push_back(GetServiceFactHash(*fact));
+  }
+}
+
+}  // namespace
+
+bool IsNodeControlRoute(const std::string& route) {
+  return route.size() == kNodeControlRouteSize &&
+    route.compare(0, kNodeControlRouteSize, kNodeControlRoute,
+      kNodeControlRouteSize) == 0;
+}
+
+MessageRouter::Reader::Reader()
+  : hazard(0),
+    seed(static_cast<uint32>(base::RandUint64()) | 1),
+    hits(0),
+    misses(0),
+    invalidations(0) {
+}
+
 MessageRouter::MessageRouter(ServicesDatabase* services_database,
   RoutingDatabase* routing_database)
   : services_database_(services_database),
-    routing_database_(routing_database) {
+    routing_database_(routing_database),
+    current_(0),
+    partition_fact_(kPartitionKeyFact),
+    evict_unresponsive_(false) {
   DCHECK(services_database);
   DCHECK(routing_database);
+  base::subtle::NoBarrier_Store(&current_,
+    reinterpret_cast<base::subtle::AtomicWord>(
+      new RoutingSnapshot(services_database->table().get())));
 }
 
 MessageRouter::~MessageRouter() {
+  int64 hits = 0, misses = 0, invalidations = 0;
+  for (size_t i = 0; i < readers_.size(); ++i) {
+    hits += readers_[i]->hits;
+    misses += readers_[i]->misses;
+    invalidations += readers_[i]->invalidations;
+  }
+  if (hits || misses) {
+    VLOG(1) << "Route cache: " << hits << " hits, " << misses << " misses ("
+            << hits * 100 / (hits + misses) << "% hit rate), "
+            << invalidations << " invalidated entries";
+  }
+  VLOG(1) << "Load balancer: " << load_balancer_.replies_count()
+          << " replies correlated, " << load_balancer_.expired_count()
+          << " requests expired";
+
+  // No one routes messages anymore.
+  for (size_t i = 0; i < retired_.size(); ++i) {
+    delete retired_[i];
+  }
+  delete current_snapshot();
 }
 
 RouteSet MessageRouter::GetRoutes(const std::string& sender,
-  rp::RubyMessagePacket* packet) {
+  rp::RubyMessagePacket* packet, RoutedRequests* requests) {
   DCHECK(packet);
 
-  RouteSet routes;
-
   // A empty sender means that the message is a request sent to one of
   // the hosted services. In that case we need to set the |sender| value
-  // to the address of the message sender and search for the service that
-  // should receive the message.
-  if (!packet->message().has_sender()) {
-    // Set the address of the sender, so message receiver could send a
-    // reply back.
+  // to the address of the message sender, so message receiver could send a
+  // reply back.
+  bool has_sender = packet->message().has_sender();
+  if (!has_sender) {
     packet->mutable_message()->set_sender(sender);
+  }
+  return GetRoutes(sender, packet->header(), packet->message().id(),
+    has_sender, packet->message().sender(), requests);
+}
 
-    // Search for the service(s) that should receive the message. If no
-    // services are found, reply to the sender with the sent message (modified
-    // with the sender address).
-    ServiceFactSet service_facts;
-    if (GetServiceFacts(packet->header(), &service_facts)) {
-      ServicesMetadataSet services;
-      if (services_database_->GetServicesMetadata(service_facts, &services)) {
-        // We found services that matches the given facts, in our database,
-        // now we need to check if the found services are running and get its
-        // addresses.
-        for (ServicesMetadataSet::iterator service = services.begin();
-          service != services.end(); ++service) {
-          std::string address;
-          if (routing_database_->GetRoute(
-            service->get()->service_id(), &address)) {
-            routes.push_back(address);
-          }
-        }
-      }
-    }
+RouteSet MessageRouter::GetRoutes(const std::string& sender,
+  PacketView* view, RoutedRequests* requests) {
+  DCHECK(view);
+  bool has_sender = view->has_sender();
+  if (!has_sender) {
+    view->set_sender(sender);
+  }
+  return GetRoutes(sender, view->header(), view->message_id(), has_sender,
+    view->sender(), requests);
+}
+
+RouteSet MessageRouter::GetRoutes(const std::string& sender,
+  const rp::RubyMessageHeader& header, const std::string& message_id,
+  bool has_sender, const std::string& requester, RoutedRequests* requests) {
+  RouteSet routes;
+
+  // Search for the service(s) that should receive a request. If no services
+  // are found, reply to the sender with the sent message (modified with the
+  // sender address).
+  if (!has_sender) {
+    Reader* reader = GetReader();
+    const RoutingSnapshot* snapshot = AcquireSnapshot(reader);
+    FindServiceRoutes(header, sender, message_id, reader, snapshot, &routes,
+      requests);
+    ReleaseSnapshot(reader);
+  } else {
+    GetReplyRoutes(sender, requester, message_id, &routes);
   }
 
   // If no routes are found, we need to send the message back to the sender.
@@ -73,32 +141,449 @@ RouteSet MessageRouter::GetRoutes(const std::string& sender,
   return routes;
 }
 
+void MessageRouter::GetRoutes(const std::vector<std::string>& senders,
+  const std::vector<PacketView*>& views, std::vector<RouteSet>* routes,
+  std::vector<RoutedRequests>* requests) {
+  DCHECK_EQ(senders.size(), views.size());
+  DCHECK(routes);
+  DCHECK(requests);
+  routes->resize(views.size());
+  requests->resize(views.size());
+
+  // The messages of the batch that has the same facts are routed by the
+  // same entry of the route cache.
+  Reader* reader = GetReader();
+  const RoutingSnapshot* snapshot = AcquireSnapshot(reader);
+  for (size_t i = 0; i < views.size(); ++i) {
+    PacketView* view = views[i];
+    RouteSet& message_routes = (*routes)[i];
+    message_routes.clear();
+    (*requests)[i].clear();
+
+    // The requests are routed like GetRoutes() does, the replies are sent
+    // back to the sender.
+    if (!view->has_sender()) {
+      view->set_sender(senders[i]);
+      FindServiceRoutes(view->header(), senders[i], view->message_id(),
+        reader, snapshot, &message_routes, &(*requests)[i]);
+    } else {
+      GetReplyRoutes(senders[i], view->sender(), view->message_id(),
+        &message_routes);
+    }
+
+    if (message_routes.empty()) {
+      message_routes.push_back(senders[i]);
+    }
+  }
+  ReleaseSnapshot(reader);
+}
+
+bool MessageRouter::GetServiceRoutes(const rp::RubyMessageHeader& header,
+  RouteSet* routes) {
+  Reader* reader = GetReader();
+  const RoutingSnapshot* snapshot = AcquireSnapshot(reader);
+  bool found = FindServiceRoutes(header, std::string(), std::string(),
+    reader, snapshot, routes, NULL);
+  ReleaseSnapshot(reader);
+  return found;
+}
+
+MessageRouter::Reader* MessageRouter::GetReader() {
+  Reader* reader = thread_reader_.Get();
+  if (!reader) {
+    reader = new Reader();
+    base::AutoLock lock(readers_lock_);
+    readers_.push_back(reader);
+    thread_reader_.Set(reader);
+  }
+  return reader;
+}
+
+const RoutingSnapshot* MessageRouter::AcquireSnapshot(Reader* reader) {
+  // The snapshot is protected once the hazard pointer is visible to the
+  // writers. The current snapshot is read again after that, since a writer
+  // could have replaced it and scanned the hazard pointers in between.
+  base::subtle::AtomicWord snapshot;
+  do {
+    snapshot = base::subtle::Acquire_Load(&current_);
+    base::subtle::NoBarrier_Store(&reader->hazard, snapshot);
+    base::subtle::MemoryBarrier();
+  } while (snapshot != base::subtle::Acquire_Load(&current_));
+  return reinterpret_cast<const RoutingSnapshot*>(snapshot);
+}
+
+void MessageRouter::ReleaseSnapshot(Reader* reader) {
+  base::subtle::Release_Store(&reader->hazard, 0);
+}
+
+void MessageRouter::PublishSnapshot(RoutingSnapshot* snapshot) {
+  retired_.push_back(const_cast<RoutingSnapshot*>(current_snapshot()));
+  base::subtle::Release_Store(&current_,
+    reinterpret_cast<base::subtle::AtomicWord>(snapshot));
+
+  // The new snapshot must be visible before the hazard pointers are read,
+  // otherwise a reader that has not seen it yet could be missed.
+  base::subtle::MemoryBarrier();
+  std::vector<base::subtle::AtomicWord> hazards;
+  {
+    base::AutoLock lock(readers_lock_);
+    for (size_t i = 0; i < readers_.size(); ++i) {
+      hazards.push_back(base::subtle::Acquire_Load(&readers_[i]->hazard));
+    }
+  }
+
+  std::vector<RoutingSnapshot*> retired;
+  for (size_t i = 0; i < retired_.size(); ++i) {
+    base::subtle::AtomicWord address =
+      reinterpret_cast<base::subtle::AtomicWord>(retired_[i]);
+    if (std::find(hazards.begin(), hazards.end(), address) !=
+      hazards.end()) {
+      retired.push_back(retired_[i]);
+    } else {
+      delete retired_[i];
+    }
+  }
+  retired_.swap(retired);
+}
+
+bool MessageRouter::FindServiceRoutes(const rp::RubyMessageHeader& header,
+  const std::string& requester, const std::string& message_id,
+  Reader* reader, const RoutingSnapshot* snapshot, RouteSet* routes,
+  RoutedRequests* requests) {
+  DCHECK(routes);
+  ServiceFactSet service_facts;
+  if (!GetServiceFacts(header, &service_facts)) {
+    return false;
+  }
+
+  // The facts are sorted, so a set of facts is cached and resolved the same
+  // way whatever the order the sender has used. The cached routes are
+  // validated against the snapshot, which is cheap when it has not changed
+  // since they was resolved.
+  std::sort(service_facts.begin(), service_facts.end());
+  std::string key(GetFactsKey(service_facts));
+  RouteCache& cache = reader->cache;
+  RouteCache::iterator entry = cache.find(key);
+  if (entry != cache.end() && snapshot->Validate(&entry->second)) {
+    ++reader->hits;
+  } else {
+    ++reader->misses;
+    if (entry != cache.end()) {
+      ++reader->invalidations;
+    } else {
+      // The facts comes from the network, so the cache is bounded. It is
+      // filled again from scratch when it is full.
+      if (cache.size() >= kRouteCacheMaxSize) {
+        reader->invalidations += cache.size();
+        cache.clear();
+      }
+      entry = cache.insert(std::make_pair(key, ResolvedRoutes())).first;
+    }
+
+    std::vector<uint32> fact_hashes;
+    GetFactHashes(service_facts, &fact_hashes);
+    snapshot->Resolve(fact_hashes, &entry->second);
+  }
+
+  // The request is sent to every instance unless it or one of the services
+  // asks to choose one of them.
+  const ResolvedRoutes& resolved = entry->second;
+  RoutingPolicy policy = GetRoutingPolicy(header);
+  if (policy == kBroadcastRouting ||
+    (policy == kServiceRouting && !resolved.balanced)) {
+    routes->insert(routes->end(), resolved.routes.begin(),
+      resolved.routes.end());
+    return !resolved.routes.empty();
+  }
+
+  base::TimeTicks now;
+  std::string partition_key;
+  bool has_partition_key = false;
+  for (size_t i = 0; i < resolved.services.size(); ++i) {
+    ServiceRoutes* service = resolved.services[i].get();
+    RoutingPolicy service_policy =
+      policy == kServiceRouting ? service->policy() : policy;
+    if (service_policy == kBroadcastRouting) {
+      for (size_t j = 0; j < service->size(); ++j) {
+        routes->push_back(service->instance(j)->address());
+      }
+      continue;
+    }
+
+    if (service_policy == kPartitionedRouting && !has_partition_key) {
+      partition_key = GetPartitionKey(header);
+      has_partition_key = true;
+    }
+    RouteStats* route =
+      service->Choose(service_policy, partition_key, &reader->seed);
+    routes->push_back(route->address());
+    if (message_id.empty()) {
+      continue;
+    }
+
+    // The request is accounted when it leaves the node, unless the caller
+    // could not tell when it does.
+    if (requests) {
+      requests->push_back(
+        new RoutedRequest(&load_balancer_, route, requester, message_id));
+    } else {
+      if (now.is_null()) {
+        now = base::TimeTicks::Now();
+      }
+      load_balancer_.OnRequestSent(route, requester, message_id, now);
+    }
+  }
+  return !resolved.services.empty();
+}
+
+void MessageRouter::GetReplyRoutes(const std::string& sender,
+  const std::string& requester, const std::string& message_id,
+  RouteSet* routes) {
+  if (!message_id.empty() && load_balancer_.has_pending_requests()) {
+    load_balancer_.OnReplyReceived(sender, requester, message_id,
+      base::TimeTicks::Now());
+  }
+
+  // The messages of the node are sent with the name of the node service as
+  // their sender, such as the pings whose pongs tells that a host is alive.
+  if (requester == kNodeServiceName) {
+    routes->push_back(std::string(kNodeControlRoute, kNodeControlRouteSize));
+  }
+}
+
 bool MessageRouter::AddRoute(const std::string& address,
-  const ServiceFactSet& facts) {
+  const ServiceFactSet& facts, RouteTransport transport,
+  RoutingPolicy policy) {
   DCHECK(facts.size());
+  DCHECK_NE(policy, kServiceRouting);
+  base::AutoLock lock(lock_);
   ServicesMetadataSet services;
   if (!services_database_->GetServicesMetadata(facts, &services)) {
     LOG(WARNING) << "Attempt to add a route to an unregistered service";
     return false;
   }
 
+  RoutingSnapshot* snapshot = new RoutingSnapshot(current_snapshot());
+  bool added = true;
   for (ServicesMetadataSet::iterator service = services.begin();
     service != services.end(); ++service) {
-    if (!routing_database_->AddRoute(service->get()->service_id(), address)) {
-      return false;
+    int service_id = service->get()->service_id();
+    if (!routing_database_->AddRoute(service_id, address, transport)) {
+      added = false;
+      break;
     }
+    snapshot->AddRoute(service_id, address, policy);
+    LOG(INFO) << "Service " << service->get()->service_name()
+              << " is reached through the "
+              << RouteTransportToString(transport) << " transport";
   }
+  PublishSnapshot(snapshot);
+  return added;
+}
+
+bool MessageRouter::RemoveRoute(const ServiceFactSet& facts) {
+  DCHECK(facts.size());
+  base::AutoLock lock(lock_);
+  ServicesMetadataSet services;
+  if (!services_database_->GetServicesMetadata(facts, &services)) {
+    return false;
+  }
+
+  RoutingSnapshot* snapshot = new RoutingSnapshot(current_snapshot());
+  bool removed = true;
+  for (ServicesMetadataSet::iterator service = services.begin();
+    service != services.end(); ++service) {
+    int service_id = service->get()->service_id();
+    if (routing_database_->RemoveRoute(service_id)) {
+      snapshot->RemoveRoute(service_id);
+    } else {
+      removed = false;
+    }
+  }
+  PublishSnapshot(snapshot);
+  return removed;
+}
+
+bool MessageRouter::RemoveRoute(const std::string& address,
+  const ServiceFactSet& facts) {
+  DCHECK(facts.size());
+  base::AutoLock lock(lock_);
+  ServicesMetadataSet services;
+  if (!services_database_->GetServicesMetadata(facts, &services)) {
+    return false;
+  }
+
+  RoutingSnapshot* snapshot = new RoutingSnapshot(current_snapshot());
+  bool removed = true;
+  for (ServicesMetadataSet::iterator service = services.begin();
+    service != services.end(); ++service) {
+    int service_id = service->get()->service_id();
+    if (routing_database_->RemoveRoute(service_id, address)) {
+      snapshot->RemoveRoute(service_id, address);
+    } else {
+      removed = false;
+    }
+  }
+  PublishSnapshot(snapshot);
+  return removed;
+}
+
+bool MessageRouter::RemoveInstance(const std::string& address) {
+  // The node itself is never removed.
+  if (IsNodeControlRoute(address)) {
+    return false;
+  }
+
+  base::AutoLock lock(lock_);
+  std::vector<int> service_ids;
+  if (!routing_database_->GetServices(address, &service_ids)) {
+    return false;
+  }
+
+  RoutingSnapshot* snapshot = new RoutingSnapshot(current_snapshot());
+  bool removed = false;
+  for (size_t i = 0; i < service_ids.size(); ++i) {
+    if (routing_database_->RemoveRoute(service_ids[i], address)) {
+      snapshot->RemoveRoute(service_ids[i], address);
+      removed = true;
+    }
+  }
+  PublishSnapshot(snapshot);
+
+  // The requests that are waiting for the instance will never be answered.
+  load_balancer_.RemoveRoute(address);
+  LOG(INFO) << "An instance of " << service_ids.size() << " services was "
+            << "taken out of rotation";
+  return removed;
+}
+
+bool MessageRouter::HasRoute(const std::string& address) {
+  Reader* reader = GetReader();
+  const RoutingSnapshot* snapshot = AcquireSnapshot(reader);
+  bool found = snapshot->HasAddress(address);
+  ReleaseSnapshot(reader);
+  return found;
+}
+
+void MessageRouter::ExpirePendingRequests() {
+  load_balancer_.ExpireRequests(base::TimeTicks::Now());
+  std::vector<std::string> unresponsive;
+  load_balancer_.TakeUnresponsiveRoutes(&unresponsive);
+  for (size_t i = 0; i < unresponsive.size(); ++i) {
+    LOG(WARNING) << "An instance has let " << kMaxInstanceExpiries
+                 << " requests expire in a row.";
+    if (evict_unresponsive_) {
+      RemoveInstance(unresponsive[i]);
+    }
+  }
+}
+
+bool MessageRouter::AddService(const ServiceFactSet& facts,
+  const ServiceMetadata* metadata) {
+  DCHECK(facts.size());
+  base::AutoLock lock(lock_);
+  if (services_database_->Exists(facts)) {
+    return true;
+  }
+
+  if (!services_database_->Add(facts, metadata)) {
+    return false;
+  }
+
+  std::vector<uint32> fact_hashes;
+  GetFactHashes(facts, &fact_hashes);
+  RoutingSnapshot* snapshot = new RoutingSnapshot(current_snapshot());
+  snapshot->SetServices(services_database_->table().get(), fact_hashes,
+    std::vector<int>());
+  PublishSnapshot(snapshot);
   return true;
 }
 
+bool MessageRouter::DeleteServices(const ServiceFactSet& facts) {
+  DCHECK(facts.size());
+  base::AutoLock lock(lock_);
+  ServicesMetadataSet services;
+  if (!services_database_->GetServicesMetadata(facts, &services)) {
+    return false;
+  }
+
+  RoutingSnapshot* snapshot = new RoutingSnapshot(current_snapshot());
+  std::vector<int> service_ids;
+  for (ServicesMetadataSet::iterator service = services.begin();
+    service != services.end(); ++service) {
+    int service_id = service->get()->service_id();
+    routing_database_->RemoveRoute(service_id);
+    snapshot->RemoveRoute(service_id);
+    service_ids.push_back(service_id);
+  }
+  bool deleted = services_database_->Delete(facts);
+
+  std::vector<uint32> fact_hashes;
+  GetFactHashes(facts, &fact_hashes);
+  snapshot->SetServices(services_database_->table().get(), fact_hashes,
+    service_ids);
+  PublishSnapshot(snapshot);
+  return deleted;
+}
+
 bool MessageRouter::GetServiceFacts(
   const rp::RubyMessageHeader& header, ServiceFactSet* set) {
   KeyValuePairSet facts = header.facts();
   for (KeyValuePairSet::iterator fact = facts.begin();
     fact != facts.end(); ++fact) {
-    set->push_back(std::make_pair(fact->key(), fact->value()));
+    if (fact->key() != kRoutingPolicyFact &&
+      fact->key() != partition_fact_) {
+      set->push_back(std::make_pair(fact->key(), fact->value()));
+    }
   }
   return set->size() != 0;
 }
 
+RoutingPolicy MessageRouter::GetRoutingPolicy(
+  const rp::RubyMessageHeader& header) {
+  if (header.has_routing_policy()) {
+    return static_cast<RoutingPolicy>(header.routing_policy());
+  }
+
+  RoutingPolicy policy = kServiceRouting;
+  for (int i = 0; i < header.facts_size(); ++i) {
+    const ruby::KeyValuePair& fact = header.facts(i);
+    if (fact.key() == kRoutingPolicyFact) {
+      if (!StringToRoutingPolicy(fact.value(), &policy)) {
+        policy = kServiceRouting;
+      }
+      break;
+    }
+  }
+  return policy;
+}
+
+std::string MessageRouter::GetPartitionKey(
+  const rp::RubyMessageHeader& header) {
+  if (header.has_partition_key()) {
+    return header.partition_key();
+  }
+
+  for (int i = 0; i < header.facts_size(); ++i) {
+    const ruby::KeyValuePair& fact = header.facts(i);
+    if (fact.key() == partition_fact_) {
+      return fact.value();
+    }
+  }
+  return std::string();
+}
+
+std::string MessageRouter::GetFactsKey(const ServiceFactSet& facts) {
+  // The facts are text, so a zero byte could be used as a separator.
+  std::string key;
+  for (ServiceFactSet::const_iterator fact = facts.begin();
+    fact != facts.end(); ++fact) {
+    key.append(fact->first);
+    key.push_back('\0');
+    key.append(fact->second);
+    key.push_back('\0');
+  }
+  return key;
+}
+
 }  // namesapce node
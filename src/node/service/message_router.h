@@ -6,11 +6,20 @@
 #define NODE_SERVICE_MESSAGE_ROUTER_H_
 #pragma once
 
+#include <map>
 #include <string>
 #include <vector>
 
+#include <base/atomicops.h>
+#include <base/basictypes.h>
 #include <base/memory/ref_counted.h>
+#include <base/memory/scoped_vector.h>
+#include <base/synchronization/lock.h>
+#include <base/threading/thread_local.h>
 
+#include "node/service/load_balancer.h"
+#include "node/service/routing_database.h"
+#include "node/service/routing_snapshot.h"
 #include "node/service/services_database.h"
 
 namespace ruby {
@@ -25,10 +34,11 @@ class Connection;
 }
 
 namespace node {
+class PacketView;
 class ServicesDatabase;
-class RoutingDatabase;
 
-typedef std::vector<std::string> RouteSet;
+// Returns true if |route| is the address of the node control message loop.
+bool IsNodeControlRoute(const std::string& route);
 
 // The message router handles all incoming messages sent to the node service
 // by routing them to the correct service. Routing is based on service facts.
@@ -38,6 +48,39 @@ typedef std::vector<std::string> RouteSet;
 // set of routes to find the services address. If a route is not found the
 // message is sent back to the sender.
 //
+// The routing state is published as immutable, versioned snapshots. The
+// writers, which registers services and adds routes, are serialized. Each
+// of them updates the databases, builds the next snapshot from the current
+// one and swaps it in atomically. The readers route the messages against
+// the snapshot that was current when they started, so any number of threads
+// could route messages at once without taking any lock while the services
+// keep coming and going.
+//
+// A snapshot is reclaimed only when no reader uses it. Each routing thread
+// publishes the snapshot it is reading in a hazard pointer, which the
+// writers check before deleting the snapshots that they have replaced.
+//
+// A service could have several running instances. By default every
+// instance receives the requests sent to the service, but the service, or
+// the request itself, could choose a policy that routes each request to
+// only one of the instances. The replies of the instances are correlated
+// with the requests by their sender and message ID, so the router knows how
+// many requests each instance has yet to reply and how fast it replies. An
+// instance whose host stops answering the pings of the node, or that stops
+// replying when set_evict_unresponsive() was set, is removed through
+// RemoveInstance(). The
+// requests sent to a partitioned service are routed by their partition key
+// instead, so the requests that has the same key always reach the same
+// instance while it is running.
+//
+// The routes that are found for a set of facts are also cached by each
+// routing thread, so the facts are not resolved again for each message. A
+// cached entry is still valid in a newer snapshot unless a route was added
+// or removed for one of the services it was resolved from, or a service
+// that shares some of its facts was registered or unregistered. The
+// services and the routes should be changed only through the router.
+//
+// This class is thread safe.
 class MessageRouter {
  public:
   MessageRouter(ServicesDatabase* service_database,
@@ -45,22 +88,189 @@ class MessageRouter {
   ~MessageRouter();
 
   // Gets the routes for a message. |sender| is the the sender ID and |packet|
-  // is the message packet that need to be routed.
+  // is the message packet that need to be routed. The requests that are
+  // routed to an instance of a balanced service are stored into
+  // |requests|, and should be marked as sent when they leave the node; if
+  // |requests| is NULL they are accounted as sent at once.
   RouteSet GetRoutes(const std::string& sender,
-    ruby::protocol::RubyMessagePacket* packet);
+    ruby::protocol::RubyMessagePacket* packet, RoutedRequests* requests);
+
+  // Gets the routes for the message packet scanned by |view|. This does the
+  // same as the method above without parsing the whole packet.
+  RouteSet GetRoutes(const std::string& sender, PacketView* view,
+    RoutedRequests* requests);
+
+  // Gets the routes for a batch of messages. |senders| and |views| are the
+  // sender IDs and the scanned packets of the messages, in the same order,
+  // and the routes and the routed requests of each message are stored at
+  // the same index of |routes| and |requests|. The whole batch is routed
+  // against the same snapshot.
+  void GetRoutes(const std::vector<std::string>& senders,
+    const std::vector<PacketView*>& views, std::vector<RouteSet>* routes,
+    std::vector<RoutedRequests>* requests);
+
+  // Appends to |routes| the addresses of the running services that matches
+  // the facts of |header|. Unlike GetRoutes(), this needs only the packet
+  // header, so it could be called before the rest of the packet arrives.
+  // Returns true if at least one route was found.
+  bool GetServiceRoutes(const ruby::protocol::RubyMessageHeader& header,
+    RouteSet* routes);
+
+  // Adds a route for the specified service facts. |transport| is the
+  // transport used to reach |route| and |policy| is the policy that chooses
+  // between the instances of the services, which could not be
+  // kServiceRouting.
+  bool AddRoute(const std::string& route, const ServiceFactSet& facts,
+    RouteTransport transport, RoutingPolicy policy);
+
+  // Removes the routes to all the instances of the services that matches
+  // |facts|.
+  bool RemoveRoute(const ServiceFactSet& facts);
 
-  // Adds a route for the specified service facts.
-  bool AddRoute(const std::string& route, const ServiceFactSet& facts);
+  // Removes the route to the instance of the services that matches |facts|
+  // whose address is |route|.
+  bool RemoveRoute(const std::string& route, const ServiceFactSet& facts);
+
+  // Removes the routes to the instances of every service that are reached
+  // through |address|, whose host has stopped or is not responding.
+  // Returns true if some route was removed.
+  bool RemoveInstance(const std::string& address);
+
+  // Returns true if an instance of some service is reached through
+  // |address|.
+  bool HasRoute(const std::string& address);
+
+  // Expires the requests that are waiting for a reply for longer than the
+  // pending request timeout, and removes the instances that has let too
+  // many of them expire in a row when set_evict_unresponsive() was set.
+  // Should be called periodically.
+  void ExpirePendingRequests();
+
+  // Registers a service that has |facts| and |metadata| against the services
+  // database, unless a service that has the same facts is already
+  // registered. Returns true if the service is registered.
+  bool AddService(const ServiceFactSet& facts,
+    const ServiceMetadata* metadata);
+
+  // Unregisters the services that matches |facts| and removes their routes.
+  bool DeleteServices(const ServiceFactSet& facts);
+
+  // Sets the name of the fact whose value is the partition key of a
+  // request. Must be called before any message is routed.
+  void set_partition_fact(const std::string& fact) { partition_fact_ = fact; }
+
+  // Sets whether the instances that let kMaxInstanceExpiries requests
+  // expire in a row are taken out of rotation. They are not by default.
+  void set_evict_unresponsive(bool evict) { evict_unresponsive_ = evict; }
 
  private:
+  typedef std::map<std::string, ResolvedRoutes> RouteCache;
+
+  // The state of a thread that routes messages: the snapshot that it is
+  // reading, or zero, its route cache and the state of its random number
+  // generator. The readers are deleted only with the router.
+  struct Reader {
+    Reader();
+
+    base::subtle::AtomicWord hazard;
+    RouteCache cache;
+    uint32 seed;
+    int64 hits;
+    int64 misses;
+    int64 invalidations;
+  };
+
+  // Gets the state of the calling thread, creating it on the first call.
+  Reader* GetReader();
+
+  // Gets the current snapshot and protects it from reclamation until
+  // ReleaseSnapshot() is called by |reader|.
+  const RoutingSnapshot* AcquireSnapshot(Reader* reader);
+  void ReleaseSnapshot(Reader* reader);
+
+  // Gets the routes of a message whose header is |header| and whose ID is
+  // |message_id|. |has_sender| is true if the sender of the message was
+  // already set to |requester|, which means that the message is a reply that
+  // should be sent back to |sender|.
+  RouteSet GetRoutes(const std::string& sender,
+    const ruby::protocol::RubyMessageHeader& header,
+    const std::string& message_id, bool has_sender,
+    const std::string& requester, RoutedRequests* requests);
+
+  // Gets the routes of a reply whose ID is |message_id| that was received
+  // from |sender| for a request of |requester|. The replies to the messages
+  // of the node are routed to the node control loop.
+  void GetReplyRoutes(const std::string& sender,
+    const std::string& requester, const std::string& message_id,
+    RouteSet* routes);
+
+  // Gets the facts of |header| that are matched against the facts of the
+  // services.
   bool GetServiceFacts(const ruby::protocol::RubyMessageHeader& header,
     ServiceFactSet* set);
 
+  // Gets the policy that |header| asks to route its message with, or
+  // kServiceRouting if it does not ask for one.
+  RoutingPolicy GetRoutingPolicy(
+    const ruby::protocol::RubyMessageHeader& header);
+
+  // Gets the partition key of |header|, which is empty if it has none.
+  std::string GetPartitionKey(
+    const ruby::protocol::RubyMessageHeader& header);
+
+  // Gets a string that identifies the set of |facts|, which should be
+  // sorted.
+  std::string GetFactsKey(const ServiceFactSet& facts);
+
+  // Implements GetServiceRoutes() for |reader|, against |snapshot|. The
+  // requests of |requester| whose ID is |message_id| that are routed to a
+  // single instance are stored into |requests|, or accounted as sent at
+  // once if it is NULL.
+  bool FindServiceRoutes(const ruby::protocol::RubyMessageHeader& header,
+    const std::string& requester, const std::string& message_id,
+    Reader* reader, const RoutingSnapshot* snapshot, RouteSet* routes,
+    RoutedRequests* requests);
+
+  // Gets the snapshot that was published last. Must be called with |lock_|
+  // held.
+  const RoutingSnapshot* current_snapshot() const {
+    return reinterpret_cast<const RoutingSnapshot*>(
+      base::subtle::NoBarrier_Load(&current_));
+  }
+
+  // Publishes |snapshot| as the current one and reclaims the snapshots that
+  // are no longer read. Must be called with |lock_| held.
+  void PublishSnapshot(RoutingSnapshot* snapshot);
+
+  // Serializes the writers and the access to the databases, which are not
+  // thread safe. The readers never take it.
+  base::Lock lock_;
+
   // The database used to store information about the installed services.
   ServicesDatabase* services_database_;
 
   // Stores the routing address of the running services.
   RoutingDatabase* routing_database_;
+
+  // The current snapshot, and the ones that was replaced but could still be
+  // read.
+  base::subtle::AtomicWord current_;
+  std::vector<RoutingSnapshot*> retired_;
+
+  // The readers of every thread that has routed a message. |readers_lock_|
+  // is taken only when a thread routes its first message and by the
+  // writers.
+  base::ThreadLocalPointer<Reader> thread_reader_;
+  base::Lock readers_lock_;
+  ScopedVector<Reader> readers_;
+
+  // Tracks the requests that are waiting for the reply of an instance.
+  LoadBalancer load_balancer_;
+
+  // The name of the fact that carries the partition key of a request.
+  std::string partition_fact_;
+
+  bool evict_unresponsive_;
 };
 
 }  // namesapce node
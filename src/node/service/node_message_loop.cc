@@ -2,23 +2,25 @@
 // Use of this source code is governed by BSD-style license that can be found
 // in the LICENCE file.
 
+#include <algorithm>
 #include <vector>
 
 #include "node/service/node_message_loop.h"
 
 #include <base/logging.h>
-#include <base/string_number_conversions.h>
+#include <base/process_util.h>
+#include <base/rand_util.h>
+#include <base/stringprintf.h>
 #include <google/protobuf/repeated_field.h>
 
 #include <ruby_protos.pb.h>
 #include <control.pb.h>
 #include "node/zeromq/context.h"
-#include "node/zeromq/socket.h"
-#include "node/zeromq/message.h"
 #include "node/service/constants.h"
 #include "node/service/message_router.h"
-#include "node/service/zero_copy_message.h"
+#include "node/service/packet_channel.h"
 #include "node/service/services_database.h"
+#include "node/service/shared_memory_channel.h"
 
 namespace node {
 
@@ -34,18 +36,64 @@ namespace gpb = google::protobuf;
 
 class ServicesDatabase;
 
+namespace {
+
+// The token of the hello and ping messages that is sent by the node.
+const char kHelloToken[] = "node-hello";
+const char kPingToken[] = "node-ping";
+
+// Converts the transport of an announce message to a route transport.
+RouteTransport ToRouteTransport(rpc::TransportType transport) {
+  switch (transport) {
+    case rpc::kTransportIpc:
+      return kIpcTransport;
+
+    case rpc::kTransportTcp:
+      return kTcpTransport;
+  }
+  return kTcpTransport;
+}
+
+RoutingPolicy ToRoutingPolicy(rp::RoutingPolicy policy) {
+  switch (policy) {
+    case rp::kBroadcastRouting:
+      return kBroadcastRouting;
+
+    case rp::kRoundRobinRouting:
+      return kRoundRobinRouting;
+
+    case rp::kLeastOutstandingRouting:
+      return kLeastOutstandingRouting;
+
+    case rp::kLatencyRouting:
+      return kLatencyRouting;
+
+    case rp::kPartitionedRouting:
+      return kPartitionedRouting;
+  }
+  return kBroadcastRouting;
+}
+
+}  // namespace
+
 MessageLoop::MessageLoop(zmq::Context* context, MessageRouter* message_router,
   ServicesDatabase* services_db)
   : context_(context),
     message_router_(message_router),
-    message_channel_port_(node::kMessageChannelPort),
+    reply_channel_(NULL),
+    message_channel_port_(kMessageChannelPort),
+    shared_memory_channels_(NULL),
+    heartbeat_timer_(0),
     run_called_(false),
     quit_called_(false),
     running_(false),
-    services_db_(services_db) {
+    services_db_(services_db),
+    poller_(new zmq::Poller(context)) {
   DCHECK(context);
   DCHECK(message_router);
   DCHECK(services_db);
+  channel_.reset(new PacketChannel(poller_.get()));
+  poller_->set_wakeup_delegate(this);
 }
 
 MessageLoop::~MessageLoop() {
@@ -55,64 +103,73 @@ void MessageLoop::Run() {
   DCHECK(!run_called_);
   run_called_ = true;
 
-  std::string endpoint("tcp://127.0.0.1:");
-  endpoint.append(base::IntToString(message_channel_port_));
-
   // Allow Quit to be called before Run.
   if (quit_called_) {
     return;
   }
 
-  dealer_.reset(new zmq::Socket(context_->CreateSocket(zmq::kDealer)));
-  if (dealer_.get() && dealer_->Connect(endpoint.c_str())) {
-    // register ourself into the routing database.
-    if (!RegisterRoute()) {
-      LOG(ERROR) << "The node message receiver cannot be registered.";
-      return;
-    }
-
-    // Loop for control messages
-    MessageParts parts;
-    while (!quit_called_ && !context_->is_terminating()) {
-      if (dealer_->Receive(&parts, zmq::kNoFlags)) {
-        OnMessageReceived(parts);
-      }
-      parts.clear();
-    }
+  // register ourself into the routing database.
+  if (!RegisterRoute()) {
+    LOG(ERROR) << "The node message receiver cannot be registered.";
+    return;
   }
 
+  // Loop for control messages
+  running_ = true;
+  heartbeat_timer_ = poller_->AddTimer(
+    base::TimeDelta::FromMilliseconds(kHeartbeatInterval), true, this);
+  poller_->Run();
+  poller_->CancelTimer(heartbeat_timer_);
+  heartbeat_timer_ = 0;
   running_ = false;
 }
 
 void MessageLoop::Quit() {
   quit_called_ = true;
-  if (dealer_.get()) {
-    dealer_->Close();
-  }
+  poller_->Quit();
 }
 
-void MessageLoop::OnMessageReceived(const MessageParts& message_parts) {
-  int no_of_parts = message_parts.size();
-  if (no_of_parts % 3 != 0) {
-    LOG (WARNING) << "Received message has a invalid number of parts."
-              << "No of parts: " << no_of_parts;
-    return;
+void MessageLoop::OnWakeup() {
+  std::string sender;
+  scoped_ptr<rp::RubyMessagePacket> packet;
+  while (channel_->Take(&sender, &packet, NULL)) {
+    if (!packet->has_message()) {
+      LOG(WARNING) << "Received a packet with no message associated.";
+      continue;
+    }
+    ProcessMessage(sender, packet->message());
   }
+}
 
-  // The received message envelope pattern should be: [EMPTY FRAME] [DATA]
-  for (MessageParts::const_iterator i = message_parts.begin() + 1;
-    i != message_parts.end(); i += 2) {
-    zmq::Message* message = i->get();
-    rp::RubyMessagePacket packet;
-    if (!packet.ParseFromArray(message->mutable_data(), message->size())) {
-      LOG(WARNING) << "The received message is not a valid ruby message packet.";
+void MessageLoop::OnTimer(int timer_id) {
+  DCHECK_EQ(timer_id, heartbeat_timer_);
+  message_router_->ExpirePendingRequests();
+  SendHeartbeats(base::TimeTicks::Now());
+}
+
+void MessageLoop::SendHeartbeats(base::TimeTicks now) {
+  base::TimeDelta timeout =
+    base::TimeDelta::FromMilliseconds(kHeartbeatTimeout);
+  std::map<std::string, base::TimeTicks>::iterator instance =
+    instances_.begin();
+  while (instance != instances_.end()) {
+    // The router could have removed the instance already, in which case it
+    // is pinged again only after it announces itself again.
+    if (!message_router_->HasRoute(instance->first)) {
+      instances_.erase(instance++);
       continue;
     }
 
-    if (!packet.has_message()) {
-      LOG(WARNING) << "Received a packet with no message associated.";
+    if (now - instance->second >= timeout) {
+      LOG(WARNING) << "A service host has not answered the pings of the "
+                   << "node for " << timeout.InSeconds() << " seconds.";
+      message_router_->RemoveInstance(instance->first);
+      instances_.erase(instance++);
       continue;
     }
+
+    SendMessage(instance->first, rpc::kNodePing, kPingToken, std::string());
+    ++instance;
   }
 }
 
@@ -121,53 +178,33 @@ bool MessageLoop::RegisterRoute() {
   ServiceFactSet facts;
   facts.push_back(std::make_pair(kServiceNameFact, kNodeServiceName));
 
-  // Ensure that the ruby service is registered against the services database.
-  if (!services_db_->Exists(facts)) {
-    scoped_refptr<ServiceMetadata> node_metadata(new ServiceMetadata());
-    node_metadata->set_service_name(node::kNodeServiceName);
-    services_db_->Add(facts, node_metadata.get());
-  }
-
-  // We need to send a message to the message receiver to discover our
-  // routing address.
-  rp::RubyMessagePacket packet;
-  rp::RubyMessage* msg = packet.mutable_message();
-  msg->set_id(std::string());
-
-  int zmq_message_size = packet.ByteSize();
-  scoped_refptr<ZeroCopyMessage> zero_copy_message(
-    new ZeroCopyMessage(zmq_message_size));
-  packet.SerializeToZeroCopyStream(zero_copy_message);
-
-  //  Packet pattern should be [EMPTY FRAME] [DATA]
-  if (!dealer_->Send(zmq::kSendMore) ||
-    !dealer_->Send(zero_copy_message, zmq_message_size, zmq::kNoFlags)) {
-    return false;
-  }
-
-  MessageParts parts;
-  if (!dealer_->Receive(&parts, zmq::kNoFlags)) {
-    return false;
-  }
-
-  DCHECK(parts.size() == 2);
-
-  // Get the address from the reply and store it on routing database.
-  packet.Clear();
-  scoped_refptr<zmq::Message> message = parts[1];
-  if (!packet.ParseFromArray(message->mutable_data(), message->size())) {
-    return false;
-  }
-
-  DCHECK(packet.has_message());
+  // Ensure that the ruby service is registered against the services
+  // database. The service is registered through the router, so the routes
+  // that it has cached are kept up to date.
+  scoped_refptr<ServiceMetadata> node_metadata(new ServiceMetadata());
+  node_metadata->set_service_name(node::kNodeServiceName);
+  message_router_->AddService(facts, node_metadata.get());
 
   // Route all message sent to the service named [kNodeServiceName] to the
   // node message loop.
-  return
-    message_router_->AddRoute(packet.message().sender(), facts);
+  return message_router_->AddRoute(
+    std::string(kNodeControlRoute, kNodeControlRouteSize), facts,
+    kInProcessTransport, kBroadcastRouting);
 }
 
-void MessageLoop::ProcessMessage(const rp::RubyMessage& ruby_message) {
+void MessageLoop::ProcessMessage(const std::string& sender,
+  const rp::RubyMessage& ruby_message) {
+  // Any message, such as the pongs that has no body, tells that the host
+  // that has sent it is alive.
+  std::map<std::string, base::TimeTicks>::iterator instance =
+    instances_.find(sender);
+  if (instance != instances_.end()) {
+    instance->second = base::TimeTicks::Now();
+  }
+  if (ruby_message.type() == rpc::kNodePong) {
+    return;
+  }
+
   if (!ruby_message.has_message()) {
     ReportError(RUBY_CONTROL_INVALID_MESSAGE);
     return;
@@ -179,12 +216,16 @@ void MessageLoop::ProcessMessage(const rp::RubyMessage& ruby_message) {
       break;
 
     case rpc::kNodeAnnounce:
-      Announce(ruby_message.sender(), message);
+      Announce(sender, message);
       break;
 
     case rpc::kNodeQuery:
       QueryService(message);
       break;
+
+    case rpc::kNodeHello:
+      Hello(sender, message);
+      break;
   }
 }
 
@@ -202,7 +243,134 @@ void MessageLoop::Announce(const std::string& sender,
     fact != facts.end(); ++fact) {
     facts_set.push_back(std::make_pair(fact->key(), fact->value()));
   }
-  message_router_->AddRoute(sender, facts_set);
+  if (message_router_->AddRoute(sender, facts_set,
+    ToRouteTransport(announce_message.transport()),
+    ToRoutingPolicy(announce_message.routing_policy())) && !sender.empty()) {
+    instances_[sender] = base::TimeTicks::Now();
+  }
+}
+
+void MessageLoop::Hello(const std::string& sender,
+  const std::string& message) {
+  rpc::HelloMessage request;
+  if (!request.ParseFromString(message)) {
+    ReportError(RUBY_CONTROL_INVALID_MESSAGE);
+    return;
+  }
+
+  rpc::HelloMessage hello;
+  hello.set_port(message_channel_port_);
+  if (!message_channel_ipc_endpoint_.empty()) {
+    hello.set_ipc_endpoint(message_channel_ipc_endpoint_);
+  }
+
+  // A hello that names a shared memory channel tells that the host has
+  // opened it, otherwise the host is asking for a new one.
+  if (shared_memory_channels_) {
+    scoped_refptr<SharedMemoryChannel> channel;
+    if (request.has_shared_memory_name()) {
+      channel = PublishSharedMemoryChannel(sender,
+        request.shared_memory_name());
+    } else if (request.shared_memory_size() > 0) {
+      channel = CreateSharedMemoryChannel(sender,
+        request.shared_memory_size());
+    }
+    if (channel) {
+      hello.set_shared_memory_name(channel->name());
+      hello.set_shared_memory_size(static_cast<int>(channel->capacity()));
+    }
+  }
+
+  SendMessage(sender, rpc::kNodeHello, kHelloToken,
+    hello.SerializeAsString());
+}
+
+scoped_refptr<SharedMemoryChannel> MessageLoop::CreateSharedMemoryChannel(
+  const std::string& sender, int size) {
+  // A host that asks for a channel again has started over, the channel that
+  // it was using is abandoned.
+  shared_memory_channels_->Remove(sender);
+  pending_shared_memory_channels_.erase(sender);
+
+  base::TimeTicks now = base::TimeTicks::Now();
+  ExpirePendingSharedMemoryChannels(now);
+  if (pending_shared_memory_channels_.size() >=
+    kSharedMemoryMaxPendingChannels) {
+    LOG(WARNING) << "Too many shared memory channels are waiting for their "
+                 << "hosts.";
+    return NULL;
+  }
+
+  // The segments are named after the node process and a random number, so
+  // they are unique on the machine and each request gets new ones.
+  uint64 nonce = base::RandUint64();
+  std::string name(base::StringPrintf("ruby-node-%d-%08x%08x",
+    base::GetCurrentProcId(), static_cast<uint32>(nonce >> 32),
+    static_cast<uint32>(nonce)));
+  int ring_size = std::min(size, kSharedMemoryMaxRingSize);
+  scoped_refptr<SharedMemoryChannel> channel(new SharedMemoryChannel());
+  if (!channel->Create(name, static_cast<uint32>(ring_size))) {
+    return NULL;
+  }
+
+  PendingSharedMemoryChannel& pending =
+    pending_shared_memory_channels_[sender];
+  pending.channel = channel;
+  pending.created_time = now;
+  return channel;
+}
+
+scoped_refptr<SharedMemoryChannel> MessageLoop::PublishSharedMemoryChannel(
+  const std::string& sender, const std::string& name) {
+  PendingSharedMemoryChannels::iterator pending =
+    pending_shared_memory_channels_.find(sender);
+  if (pending == pending_shared_memory_channels_.end() ||
+    pending->second.channel->name() != name) {
+    LOG(WARNING) << "The shared memory channel " << name
+                 << " is not waiting for the host.";
+    return NULL;
+  }
+
+  scoped_refptr<SharedMemoryChannel> channel(pending->second.channel);
+  pending_shared_memory_channels_.erase(pending);
+  shared_memory_channels_->Add(sender, channel.get());
+  return channel;
+}
+
+void MessageLoop::ExpirePendingSharedMemoryChannels(base::TimeTicks now) {
+  base::TimeDelta timeout =
+    base::TimeDelta::FromMilliseconds(kSharedMemoryHandshakeTimeout);
+  PendingSharedMemoryChannels::iterator pending =
+    pending_shared_memory_channels_.begin();
+  while (pending != pending_shared_memory_channels_.end()) {
+    if (now - pending->second.created_time >= timeout) {
+      pending_shared_memory_channels_.erase(pending++);
+    } else {
+      ++pending;
+    }
+  }
+}
+
+void MessageLoop::SendMessage(const std::string& address, int type,
+  const std::string& token, const std::string& message) {
+  if (!reply_channel_) {
+    return;
+  }
+
+  rp::RubyMessagePacket* packet = new rp::RubyMessagePacket();
+  rp::RubyMessage* ruby_message = packet->mutable_message();
+  ruby_message->set_type(type);
+  ruby_message->set_token(token);
+  ruby_message->set_message(message);
+  ruby_message->set_sender(kNodeServiceName);
+
+  // The messages of the node are carried by the control lane.
+  rp::RubyMessageHeader* header = packet->mutable_header();
+  header->set_priority(rp::kControlPriority);
+  header->set_size(ruby_message->ByteSize());
+  packet->set_header_size(header->ByteSize());
+  packet->set_size(packet->ByteSize());
+  reply_channel_->Post(address, packet, NULL);
 }
 
 void MessageLoop::QueryService(const std::string& message) {
@@ -6,21 +6,26 @@
 #define NODE_SERVICE_NODE_MESSAGE_LOOP_H_
 #pragma once
 
+#include <map>
+#include <string>
+
 #include <base/basictypes.h>
 #include <base/compiler_specific.h>
 #include <base/threading/platform_thread.h>
 #include <base/file_path.h>
 #include <base/memory/scoped_ptr.h>
 #include <base/memory/ref_counted.h>
+#include <base/time.h>
+
+#include "node/zeromq/poller.h"
 
 namespace zmq {
 class Context;
-class Socket;
-class Message;
 }
 
 namespace ruby {
 namespace protocol {
+class RubyMessagePacket;
 namespace control {
 class AnnounceMessage;
 class QueryMessage;
@@ -33,15 +38,27 @@ class FilePath;
 
 namespace node {
 class MessageRouter;
+class PacketChannel;
 class ServicesDatabase;
+class SharedMemoryChannel;
+class SharedMemoryChannelMap;
 
 // A NodeMessageLoop is used to process messages sent to the service node. It
 // waits a message to be sent over the message channel, process it and delivers
 // it to the appropriate service if needed.
-class MessageLoop {
+//
+// The message loop lives in the same process as the message receiver, so the
+// messages are exchanged through in-process packet channels instead of a
+// socket: the receiver posts the packets addressed to the node into channel()
+// and the loop posts its replies into the reply channel.
+//
+// The loop also pings the instances that has announced themselves and takes
+// out of rotation the ones whose hosts stays silent for longer than the
+// heartbeat timeout, and periodically expires the requests that are never
+// answered.
+class MessageLoop : public zmq::Poller::WakeupDelegate,
+                    public zmq::Poller::TimerDelegate {
  public:
-  typedef std::vector<scoped_refptr<zmq::Message>> MessageParts;
-
   // Error codes during message processing.
   enum ProcessingError {
     RUBY_CONTROL_NO_ERROR = 0,
@@ -54,38 +71,101 @@ class MessageLoop {
 
   MessageLoop(zmq::Context* context, MessageRouter* message_router,
     ServicesDatabase* services_db);
-  ~MessageLoop();
+  virtual ~MessageLoop();
 
   // Run the NodeMessageLoop. This blocks until Quit is called.
   void Run();
 
+  // zmq::Poller::WakeupDelegate implementation.
+  virtual void OnWakeup() OVERRIDE;
+
+  // zmq::Poller::TimerDelegate implementation.
+  virtual void OnTimer(int timer_id) OVERRIDE;
+
   bool running() const { return running_; }
   
   // Quit an earlier call to Run(). Quit can be called before, during or after
-  // Run. If called before Run, Run will return imediately when called. Calling
-  // Quit after the NodeMessageLoop has already finished running has no
-  // effect.
+  // Run and from any thread. If called before Run, Run will return imediately
+  // when called. Calling Quit after the NodeMessageLoop has already finished
+  // running has no effect.
   void Quit();
 
-  // Set the port number that is used to receives commands from clients and
-  // service. If this method not called the default port will be used.
-  void set_message_channel_port (int port) { message_channel_port_ = port; }
+  // The channel that receives the packets addressed to the node.
+  PacketChannel* channel() const { return channel_.get(); }
+
+  // Sets the channel that is used to send replies to the message senders.
+  // Must be called before Run().
+  void set_reply_channel(PacketChannel* reply_channel) {
+    reply_channel_ = reply_channel;
+  }
+
+  // Sets the endpoints of the message channel that is advertised to the
+  // service hosts through the hello handshake. |ipc_endpoint| could be
+  // empty, in which case only the TCP port is advertised. Must be called
+  // before Run().
+  void set_message_channel_endpoints(int port,
+    const std::string& ipc_endpoint) {
+    message_channel_port_ = port;
+    message_channel_ipc_endpoint_ = ipc_endpoint;
+  }
+
+  // Sets the map where the shared memory channels that is created for the
+  // local service hosts are stored. If not called, or NULL, the hosts are
+  // told that shared memory is not available. Must be called before Run().
+  void set_shared_memory_channels(SharedMemoryChannelMap* channels) {
+    shared_memory_channels_ = channels;
+  }
 
  private:
   // Register ourself into the routing database. We need to be registered
-  // into the routing database in order to start receiving messages.
+  // into the routing database in order to start receiving messages. The node
+  // is reached through the well known kNodeControlRoute address.
   bool RegisterRoute();
 
-  // Method that is called when a message is received.
-  void OnMessageReceived(const MessageParts& message_parts);
-
-  // The message processing entry point.
-  void ProcessMessage(const ruby::protocol::RubyMessage& message);
+  // The message processing entry point. |sender| is the transport identity
+  // of the peer that sent |message|, which is the address that is announced
+  // and greeted, whatever the sender of the message says.
+  void ProcessMessage(const std::string& sender,
+    const ruby::protocol::RubyMessage& message);
 
   // Process the Announce message, which informs to the external world that
   // a service is beign hosted bythe service node.
   void Announce(const std::string& sender, const std::string& message);
 
+  // Process the Hello message, which is sent by a service host when it
+  // connects to the node. The node replies with the endpoints of its message
+  // channel, so local hosts could switch to the ipc endpoint, and with the
+  // shared memory channel that was created for the host, if it asked for
+  // one. The channel is used only after the host says hello again with the
+  // name of the channel, telling that it has opened it.
+  void Hello(const std::string& sender, const std::string& message);
+
+  // Creates a shared memory channel whose rings have at least |size| bytes
+  // for the host whose address is |sender|, replacing the channels that was
+  // created for it before. The channel waits for the host to open it.
+  // Returns NULL if the channel could not be created.
+  scoped_refptr<SharedMemoryChannel> CreateSharedMemoryChannel(
+    const std::string& sender, int size);
+
+  // Starts using the shared memory channel named |name| that was created for
+  // the host whose address is |sender|. Returns NULL if no channel with that
+  // name is waiting for the host.
+  scoped_refptr<SharedMemoryChannel> PublishSharedMemoryChannel(
+    const std::string& sender, const std::string& name);
+
+  // Discards the shared memory channels whose hosts has not opened them
+  // in time.
+  void ExpirePendingSharedMemoryChannels(base::TimeTicks now);
+
+  // Pings the instances that was heard of in the heartbeat timeout before
+  // |now|, and removes the others.
+  void SendHeartbeats(base::TimeTicks now);
+
+  // Sends the |message| of type |type| to |address| through the reply
+  // channel.
+  void SendMessage(const std::string& address, int type,
+    const std::string& token, const std::string& message);
+
   // Process query messages, which is used to check if the service node is
   // hosting a particular service.
   void QueryService(const std::string& message);
@@ -101,12 +181,37 @@ class MessageLoop {
   MessageRouter* message_router_;
   ServicesDatabase* services_db_;
 
-  // The zeromq socket that is used as a message router.
-  scoped_ptr<zmq::Socket> dealer_;
+  // Waits for packets and for the quit request.
+  scoped_ptr<zmq::Poller> poller_;
+
+  // The channel that receives the packets addressed to the node. It must be
+  // destroyed before the poller.
+  scoped_ptr<PacketChannel> channel_;
+  PacketChannel* reply_channel_;
+
+  // The message channel endpoints that is advertised to the service hosts.
+  int message_channel_port_;
+  std::string message_channel_ipc_endpoint_;
+
+  SharedMemoryChannelMap* shared_memory_channels_;
+
+  // The shared memory channels that are waiting for their hosts to open
+  // them, keyed by the address of the host.
+  struct PendingSharedMemoryChannel {
+    scoped_refptr<SharedMemoryChannel> channel;
+    base::TimeTicks created_time;
+  };
+  typedef std::map<std::string, PendingSharedMemoryChannel>
+    PendingSharedMemoryChannels;
+  PendingSharedMemoryChannels pending_shared_memory_channels_;
+
+  // The last time each instance that has announced itself was heard of,
+  // keyed by its address, and the timer that pings them.
+  std::map<std::string, base::TimeTicks> instances_;
+  int heartbeat_timer_;
 
   // The directory where the services are stored.
   const FilePath services_base_dir_;
-  int message_channel_port_;
 
   bool running_;
   bool run_called_;
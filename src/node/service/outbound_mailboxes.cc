@@ -0,0 +1,266 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+
+#include "node/service/outbound_mailboxes.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <utility>
+
+#include <base/logging.h>
+
+#include "node/service/constants.h"
+#include "node/service/packet_deadline.h"
+#include "node/zeromq/message.h"
+#include "node/zeromq/socket.h"
+
+namespace node {
+
+OutboundMailboxes::OutboundMailboxes()
+  : max_messages_(kMailboxMaxMessages),
+    max_bytes_(kMailboxMaxBytes),
+    overflow_policy_(kDropNewestPolicy),
+    dropped_count_(0),
+    expired_count_(0) {
+}
+
+OutboundMailboxes::~OutboundMailboxes() {
+  for (MailboxMap::iterator i = mailboxes_.begin(); i != mailboxes_.end();
+    ++i) {
+    delete i->second;
+  }
+}
+
+bool OutboundMailboxes::HasQueued(const std::string& destination,
+  PacketLane lane) const {
+  if (mailboxes_.empty()) {
+    return false;
+  }
+  MailboxMap::const_iterator i = mailboxes_.find(destination);
+  return i != mailboxes_.end() && !i->second->lanes[lane].empty();
+}
+
+OutboundMailboxes::QueueResult OutboundMailboxes::Queue(
+  const std::string& destination, PacketLane lane, zmq::Message* frame,
+  base::TimeTicks time, base::TimeTicks deadline, RoutedRequest* request) {
+  DCHECK(frame);
+  Mailbox*& mailbox = mailboxes_[destination];
+  if (!mailbox) {
+    mailbox = new Mailbox();
+  }
+
+  // The packets of the lower priority lanes always make room for the new
+  // packet. The ones of its own lane does only when the oldest packets
+  // should be dropped.
+  size_t size = frame->size();
+  PacketLane first_droppable = overflow_policy_ == kDropOldestPolicy ?
+    lane : static_cast<PacketLane>(lane + 1);
+  while (!Fits(*mailbox, size) && DropOldest(mailbox, first_droppable)) {
+    ++dropped_count_;
+  }
+
+  // A packet that still does not fit is discarded according to the policy.
+  if (!Fits(*mailbox, size)) {
+    if (!mailbox->count) {
+      delete mailbox;
+      mailboxes_.erase(destination);
+    }
+    ++dropped_count_;
+    return overflow_policy_ == kRejectToSenderPolicy ? kRejected : kDropped;
+  }
+
+  Packet packet;
+  packet.frame = frame;
+  packet.time = time;
+  packet.deadline = deadline;
+  packet.request = request;
+  mailbox->lanes[lane].push_back(packet);
+  ++mailbox->count;
+  mailbox->bytes += size;
+  return kQueued;
+}
+
+bool OutboundMailboxes::Send(zmq::Socket* socket, LaneLatencyStats* stats) {
+  DCHECK(socket);
+
+  // The message envelope is the same that is used by the message receiver.
+  const size_t kEnvelopeSize = 3;
+  scoped_refptr<zmq::Message> frames[kEnvelopeSize];
+  base::TimeTicks now = base::TimeTicks::Now();
+  bool progress = true;
+  while (progress) {
+    progress = false;
+    MailboxMap::iterator i = mailboxes_.begin();
+    while (i != mailboxes_.end()) {
+      Mailbox* mailbox = i->second;
+      const std::string& destination = i->first;
+      DropExpired(mailbox, now);
+      if (!mailbox->count) {
+        delete mailbox;
+        mailboxes_.erase(i++);
+        continue;
+      }
+
+      // The service lanes of a destination that has no credits left wait,
+      // the control lane does not.
+      bool has_credit = HasCredit(destination);
+      size_t head_sizes[kNumberOfLanes];
+      for (int lane = kControlLane; lane < kNumberOfLanes; ++lane) {
+        const std::deque<Packet>& packets = mailbox->lanes[lane];
+        head_sizes[lane] =
+          (packets.empty() || (lane != kControlLane && !has_credit)) ? 0 :
+            std::max<size_t>(packets.front().frame->size(), 1);
+      }
+      PacketLane lane = mailbox->scheduler.Next(head_sizes);
+      if (lane == kNumberOfLanes) {
+        ++i;
+        continue;
+      }
+      if (lane != kControlLane) {
+        TakeCredit(destination);
+      }
+
+      std::deque<Packet>& packets = mailbox->lanes[lane];
+      frames[0] = new zmq::Message(static_cast<int>(destination.size()));
+      memcpy(frames[0]->mutable_data(), destination.data(),
+        destination.size());
+      frames[2] = packets.front().frame;
+      bool sent = socket->Send(zmq::Envelope(frames, kEnvelopeSize),
+        zmq::kNoBlock);
+      frames[0] = NULL;
+      frames[2] = NULL;
+      if (!sent) {
+        if (lane != kControlLane) {
+          ReturnCredit(destination);
+        }
+        return false;
+      }
+
+      progress = true;
+      if (stats) {
+        stats->Add(lane, now - packets.front().time);
+      }
+      if (packets.front().request) {
+        packets.front().request->Sent(now);
+      }
+      mailbox->bytes -= packets.front().frame->size();
+      --mailbox->count;
+      packets.pop_front();
+      if (!mailbox->count) {
+        delete mailbox;
+        mailboxes_.erase(i++);
+      } else {
+        ++i;
+      }
+    }
+  }
+  return true;
+}
+
+void OutboundMailboxes::GrantCredits(const std::string& destination,
+  int credits, base::TimeTicks now) {
+  // Zero credits puts the destination under flow control without granting
+  // it anything.
+  Window& window = credits_[destination];
+  if (credits > 0) {
+    window.credits += credits;
+  }
+  window.updated_time = now;
+}
+
+void OutboundMailboxes::OpenWindow(const std::string& destination,
+  int credits, base::TimeTicks now) {
+  DCHECK_GE(credits, 0);
+  std::pair<CreditMap::iterator, bool> inserted =
+    credits_.insert(std::make_pair(destination, Window()));
+  if (inserted.second) {
+    inserted.first->second.credits = credits;
+  }
+  inserted.first->second.updated_time = now;
+}
+
+void OutboundMailboxes::GetIdleWindows(base::TimeTicks time,
+  std::vector<std::string>* destinations) const {
+  DCHECK(destinations);
+  for (CreditMap::const_iterator i = credits_.begin(); i != credits_.end();
+    ++i) {
+    if (i->second.updated_time <= time) {
+      destinations->push_back(i->first);
+    }
+  }
+}
+
+void OutboundMailboxes::RemoveDestination(const std::string& destination) {
+  credits_.erase(destination);
+  MailboxMap::iterator i = mailboxes_.find(destination);
+  if (i != mailboxes_.end()) {
+    dropped_count_ += i->second->count;
+    delete i->second;
+    mailboxes_.erase(i);
+  }
+}
+
+bool OutboundMailboxes::HasCredit(const std::string& destination) const {
+  if (credits_.empty()) {
+    return true;
+  }
+  CreditMap::const_iterator i = credits_.find(destination);
+  return i == credits_.end() || i->second.credits > 0;
+}
+
+bool OutboundMailboxes::TakeCredit(const std::string& destination) {
+  if (credits_.empty()) {
+    return true;
+  }
+  CreditMap::iterator i = credits_.find(destination);
+  if (i == credits_.end()) {
+    return true;
+  }
+  if (!i->second.credits) {
+    return false;
+  }
+  --i->second.credits;
+  return true;
+}
+
+void OutboundMailboxes::ReturnCredit(const std::string& destination) {
+  CreditMap::iterator i = credits_.find(destination);
+  if (i != credits_.end()) {
+    ++i->second.credits;
+  }
+}
+
+bool OutboundMailboxes::Fits(const Mailbox& mailbox, size_t size) const {
+  return mailbox.count < max_messages_ && mailbox.bytes + size <= max_bytes_;
+}
+
+bool OutboundMailboxes::DropOldest(Mailbox* mailbox, PacketLane lane) {
+  for (int i = kNumberOfLanes - 1; i >= lane; --i) {
+    std::deque<Packet>& packets = mailbox->lanes[i];
+    if (!packets.empty()) {
+      mailbox->bytes -= packets.front().frame->size();
+      --mailbox->count;
+      packets.pop_front();
+      return true;
+    }
+  }
+  return false;
+}
+
+void OutboundMailboxes::DropExpired(Mailbox* mailbox, base::TimeTicks now) {
+  // Only the heads are checked, the packets behind them are checked when
+  // they reach the head.
+  for (int lane = kControlLane; lane < kNumberOfLanes; ++lane) {
+    std::deque<Packet>& packets = mailbox->lanes[lane];
+    while (!packets.empty() && IsExpired(packets.front().deadline, now)) {
+      mailbox->bytes -= packets.front().frame->size();
+      --mailbox->count;
+      packets.pop_front();
+      base::subtle::NoBarrier_AtomicIncrement(&expired_count_, 1);
+    }
+  }
+}
+
+}  // namespace node
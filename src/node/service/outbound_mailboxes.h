@@ -0,0 +1,227 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+
+#ifndef NODE_SERVICE_OUTBOUND_MAILBOXES_H_
+#define NODE_SERVICE_OUTBOUND_MAILBOXES_H_
+#pragma once
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <base/atomicops.h>
+#include <base/basictypes.h>
+#include <base/memory/ref_counted.h>
+#include <base/time.h>
+
+#include "node/service/load_balancer.h"
+#include "node/service/priority_lanes.h"
+
+namespace zmq {
+class Message;
+class Socket;
+}
+
+namespace node {
+
+// The policy applied when a packet is sent to a destination whose mailbox
+// is full.
+enum MailboxOverflowPolicy {
+  // The oldest queued packets are discarded to make room for the new one.
+  kDropOldestPolicy = 1,
+
+  // The new packet is discarded.
+  kDropNewestPolicy = 2,
+
+  // The new packet is discarded and its sender is notified with an error
+  // packet.
+  kRejectToSenderPolicy = 3
+};
+
+// OutboundMailboxes holds the packets that are sent through the message
+// channel to the destinations that could not receive them right away, in a
+// bounded mailbox per destination.
+//
+// The packets are sent without blocking. When the message channel refuses a
+// packet, the packet is queued into the mailbox of its destination and the
+// packets that follows it to the same destination are queued after it, so
+// the packets of a destination are always delivered in order. The mailboxes
+// are drained when the message channel becomes writable again. The mailbox
+// of a slow destination is bounded by a number of packets and bytes, so it
+// never stalls the delivery to the other destinations nor grows without
+// limit.
+//
+// Each mailbox has a queue per lane. The packets of a lane are delivered in
+// order, but the control lane is drained before the others and the service
+// lanes share the delivery by their weights, so the control packets never
+// wait behind the bulk data of the same destination.
+//
+// The destinations could also control the flow of their packets by granting
+// credits. Once a destination is under flow control, each packet that is
+// sent to it takes one credit, and the packets that finds no credit are
+// queued into its mailbox until more credits are granted. Only the
+// destinations that opt in are put under flow control: the hosts that
+// announces services get an initial window, which they replenish by
+// granting credits, and a destination that grants credits is under flow
+// control from then on. The destinations that never announced a service
+// nor granted credits, like the clients that only receive replies, are
+// limited only by the message channel. The window of a destination that is
+// gone should be removed, since nothing else tells it apart from a
+// destination that stopped granting credits.
+//
+// This class is not thread safe, it is used only by the message receiver
+// thread.
+class OutboundMailboxes {
+ public:
+  // The result of Queue().
+  enum QueueResult {
+    // The packet was queued, possibly after dropping older packets.
+    kQueued,
+
+    // The packet was discarded.
+    kDropped,
+
+    // The packet was discarded and its sender should be notified.
+    kRejected
+  };
+
+  OutboundMailboxes();
+  ~OutboundMailboxes();
+
+  // Sets the maximum number of packets and bytes that could be queued for a
+  // single destination.
+  void set_max_messages(size_t max_messages) { max_messages_ = max_messages; }
+  void set_max_bytes(size_t max_bytes) { max_bytes_ = max_bytes; }
+
+  void set_overflow_policy(MailboxOverflowPolicy policy) {
+    overflow_policy_ = policy;
+  }
+  MailboxOverflowPolicy overflow_policy() const { return overflow_policy_; }
+
+  // Returns true if no packet is queued.
+  bool empty() const { return mailboxes_.empty(); }
+
+  // Returns true if packets are queued for |destination| in |lane|, in
+  // which case the new packets of |lane| to |destination| should be queued
+  // after them.
+  bool HasQueued(const std::string& destination, PacketLane lane) const;
+
+  // Queues |frame| into the |lane| of the mailbox of |destination|. The
+  // packets of the lower priority lanes are discarded to make room for it
+  // when the mailbox is full, and then the overflow policy is applied.
+  // |time| is the time the packet was dispatched and |deadline| the time it
+  // expires, or a null time if it never expires. The packets that expires
+  // while they are queued are discarded. |request| is the request that the
+  // packet carries to an instance of a balanced service, which is marked as
+  // sent when the packet is sent, or NULL.
+  QueueResult Queue(const std::string& destination, PacketLane lane,
+    zmq::Message* frame, base::TimeTicks time, base::TimeTicks deadline,
+    RoutedRequest* request);
+
+  // Sends the queued packets through |socket| without blocking, taking one
+  // packet of each mailbox at a time, until all the mailboxes are empty or
+  // out of credits, or the socket refuses a packet. Returns false if the
+  // socket refused a packet, in which case Send() should be called again
+  // when the socket becomes writable. The latency of the sent packets is
+  // added to |stats|, which could be NULL.
+  bool Send(zmq::Socket* socket, LaneLatencyStats* stats);
+
+  // Grants |credits| more packets to |destination|, putting it under flow
+  // control if it was not. |now| is the time the credits was received.
+  void GrantCredits(const std::string& destination, int credits,
+    base::TimeTicks now);
+
+  // Puts |destination| under flow control with a window of |credits|
+  // packets, unless it is already under flow control. |now| is the time the
+  // window was asked to be opened.
+  void OpenWindow(const std::string& destination, int credits,
+    base::TimeTicks now);
+
+  // Gets the destinations under flow control whose window was neither
+  // opened nor replenished after |time|.
+  void GetIdleWindows(base::TimeTicks time,
+    std::vector<std::string>* destinations) const;
+
+  // Removes the window of |destination| and discards the packets that are
+  // queued for it, which are counted as dropped.
+  void RemoveDestination(const std::string& destination);
+
+  // Takes a credit of |destination|. Returns false if |destination| is under
+  // flow control and has no credits left, in which case its packets should
+  // be queued. The control packets does not need credits.
+  bool TakeCredit(const std::string& destination);
+
+  // Returns true if a credit of |destination| could be taken.
+  bool HasCredit(const std::string& destination) const;
+
+  // Gives back the credit that was taken for a packet that was not sent.
+  void ReturnCredit(const std::string& destination);
+
+  // The number of packets that was discarded because of full mailboxes.
+  int64 dropped_count() const { return dropped_count_; }
+
+  // The number of packets that has expired while they was queued. It wraps
+  // around at 2^32 and could be read from any thread.
+  uint32 expired_count() const {
+    return static_cast<uint32>(base::subtle::NoBarrier_Load(&expired_count_));
+  }
+
+ private:
+  struct Packet {
+    scoped_refptr<zmq::Message> frame;
+    base::TimeTicks time;
+    base::TimeTicks deadline;
+    scoped_refptr<RoutedRequest> request;
+  };
+
+  struct Mailbox {
+    Mailbox() : count(0), bytes(0) {}
+
+    std::deque<Packet> lanes[kNumberOfLanes];
+    LaneScheduler scheduler;
+    size_t count;
+    size_t bytes;
+  };
+
+  // Only the mailboxes that has queued packets are kept.
+  typedef std::map<std::string, Mailbox*> MailboxMap;
+
+  // The credits left of a destination that is under flow control and the
+  // last time its window was opened or replenished.
+  struct Window {
+    Window() : credits(0) {}
+
+    int64 credits;
+    base::TimeTicks updated_time;
+  };
+
+  // The windows of the destinations that are under flow control.
+  typedef std::map<std::string, Window> CreditMap;
+
+  // Returns true if a packet of |size| bytes fits into |mailbox|.
+  bool Fits(const Mailbox& mailbox, size_t size) const;
+
+  // Discards the oldest packet of the lowest priority lane of |mailbox|
+  // that is not above |lane|. Returns false if those lanes are empty.
+  bool DropOldest(Mailbox* mailbox, PacketLane lane);
+
+  // Discards the packets at the head of the lanes of |mailbox| that has
+  // expired at |now|.
+  void DropExpired(Mailbox* mailbox, base::TimeTicks now);
+
+  MailboxMap mailboxes_;
+  CreditMap credits_;
+  size_t max_messages_;
+  size_t max_bytes_;
+  MailboxOverflowPolicy overflow_policy_;
+  int64 dropped_count_;
+  volatile base::subtle::Atomic32 expired_count_;
+
+  DISALLOW_COPY_AND_ASSIGN(OutboundMailboxes);
+};
+
+}  // namespace node
+
+#endif  // NODE_SERVICE_OUTBOUND_MAILBOXES_H_
@@ -0,0 +1,96 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+
+#include "node/service/packet_channel.h"
+
+#include <base/logging.h>
+#include <ruby_protos.pb.h>
+
+#include "node/zeromq/poller.h"
+
+namespace node {
+
+namespace rp = ::ruby::protocol;
+namespace subtle = ::base::subtle;
+
+PacketChannel::PacketChannel(zmq::Poller* poller)
+  : poller_(poller),
+    pending_(0) {
+  DCHECK(poller);
+
+  Node* stub = new Node();
+  stub->next = 0;
+  stub->packet = NULL;
+  head_ = reinterpret_cast<subtle::AtomicWord>(stub);
+  tail_ = stub;
+}
+
+PacketChannel::~PacketChannel() {
+  std::string address;
+  scoped_ptr<rp::RubyMessagePacket> packet;
+  while (Take(&address, &packet, NULL)) {
+    packet.reset();
+  }
+  delete tail_;
+}
+
+void PacketChannel::Post(const std::string& address,
+  rp::RubyMessagePacket* packet, RoutedRequest* request) {
+  DCHECK(packet);
+  Node* node = new Node();
+  node->next = 0;
+  node->address = address;
+  node->packet = packet;
+  node->request = request;
+
+  // Swing the head to the new node and then link the previous head to it.
+  // The consumer does not see the new node until the link is published.
+  Node* previous = reinterpret_cast<Node*>(subtle::NoBarrier_AtomicExchange(
+    &head_, reinterpret_cast<subtle::AtomicWord>(node)));
+  subtle::Release_Store(&previous->next,
+    reinterpret_cast<subtle::AtomicWord>(node));
+
+  if (subtle::Barrier_AtomicIncrement(&pending_, 1) == 1) {
+    poller_->Wakeup();
+  }
+}
+
+bool PacketChannel::Take(std::string* address,
+  scoped_ptr<rp::RubyMessagePacket>* packet,
+  scoped_refptr<RoutedRequest>* request) {
+  DCHECK(address);
+  DCHECK(packet);
+
+  Node* next = reinterpret_cast<Node*>(subtle::Acquire_Load(&tail_->next));
+  if (!next) {
+    // The channel is empty, or a producer is between the exchange and the
+    // link. In the latter case the producer could have been preceded by
+    // another one, so it will not wake us up; ask for another try.
+    if (subtle::Acquire_Load(&pending_) != 0) {
+      poller_->Wakeup();
+    }
+    return false;
+  }
+
+  // |next| becomes the new stub. Its packet is moved out and the old stub is
+  // released.
+  address->swap(next->address);
+  packet->reset(next->packet);
+  next->packet = NULL;
+  if (request) {
+    *request = next->request;
+  }
+  next->request = NULL;
+  delete tail_;
+  tail_ = next;
+
+  if (subtle::Barrier_AtomicIncrement(&pending_, -1) != 0) {
+    // More packets are coming, make sure the consumer does not miss them
+    // when one of them is still being linked.
+    poller_->Wakeup();
+  }
+  return true;
+}
+
+}  // namespace node
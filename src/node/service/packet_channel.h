@@ -0,0 +1,84 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+
+#ifndef NODE_SERVICE_PACKET_CHANNEL_H_
+#define NODE_SERVICE_PACKET_CHANNEL_H_
+#pragma once
+
+#include <string>
+
+#include <base/atomicops.h>
+#include <base/basictypes.h>
+#include <base/memory/ref_counted.h>
+#include <base/memory/scoped_ptr.h>
+
+#include "node/service/load_balancer.h"
+
+namespace ruby {
+namespace protocol {
+class RubyMessagePacket;
+}
+}
+
+namespace zmq {
+class Poller;
+}
+
+namespace node {
+
+// A PacketChannel hands parsed message packets from any number of producer
+// threads to a single consumer thread, without serializing or copying them.
+// It is used between the components of the node that lives in the same
+// process, such as the message receiver and the control message loop.
+//
+// The channel is a lock-free multiple-producer single-consumer queue. The
+// consumer is woken up through its zmq::Poller each time the channel goes
+// from empty to non-empty, and should call Take() until it returns false.
+class PacketChannel {
+ public:
+  // Creates a channel whose consumer waits for events using |poller|. The
+  // poller must outlive the channel.
+  explicit PacketChannel(zmq::Poller* poller);
+  ~PacketChannel();
+
+  // Enqueues |packet|, which is addressed to |address|, taking ownership of
+  // it. |request| is the request that the packet carries to an instance of a
+  // balanced service, which the consumer should mark as sent, or NULL. This
+  // method could be called from any thread.
+  void Post(const std::string& address,
+    ruby::protocol::RubyMessagePacket* packet, RoutedRequest* request);
+
+  // Dequeues the oldest packet of the channel, its address and its request.
+  // |request| could be NULL if the consumer does not need it. Returns false
+  // if the channel is empty. Must be called only by the consumer thread.
+  bool Take(std::string* address,
+    scoped_ptr<ruby::protocol::RubyMessagePacket>* packet,
+    scoped_refptr<RoutedRequest>* request);
+
+ private:
+  struct Node {
+    base::subtle::AtomicWord next;
+    std::string address;
+    ruby::protocol::RubyMessagePacket* packet;
+    scoped_refptr<RoutedRequest> request;
+  };
+
+  zmq::Poller* poller_;
+
+  // The queue nodes are linked from |tail_| (the oldest) to |head_| (the
+  // newest). |tail_| always points to a node whose packet was already
+  // taken, or to the initial stub node.
+  base::subtle::AtomicWord head_;
+  Node* tail_;
+
+  // The number of packets that was posted but not taken yet. Used to wake
+  // up the consumer only when the channel becomes non-empty.
+  base::subtle::Atomic32 pending_;
+
+  DISALLOW_COPY_AND_ASSIGN(PacketChannel);
+};
+
+}  // namespace node
+
+#endif  // NODE_SERVICE_PACKET_CHANNEL_H_
@@ -0,0 +1,107 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+
+#include "node/service/packet_deadline.h"
+
+#include <algorithm>
+
+#include <base/logging.h>
+#include <ruby_protos.pb.h>
+
+#include "node/service/packet_view.h"
+
+namespace node {
+
+namespace rp = ::ruby::protocol;
+
+namespace {
+
+// The longest budget, in milliseconds, that a packet could have. It is the
+// longest timeout that a header could carry. The deadlines that are further
+// away are clamped to it, so they could not overflow the clocks.
+const int64 kMaxPacketBudgetMs = kint32max;
+
+// Gets the budget, in milliseconds, that remains to a packet whose deadline
+// is |deadline| at |now|.
+int GetRemainingTimeout(base::TimeTicks deadline, base::TimeTicks now) {
+  return static_cast<int>((deadline - now).InMilliseconds());
+}
+
+}  // namespace
+
+base::TimeTicks GetPacketDeadline(const rp::RubyMessageHeader& header,
+  base::TimeTicks received_time) {
+  base::TimeTicks deadline;
+  if (header.has_timeout()) {
+    // A negative timeout has already expired.
+    deadline = received_time +
+      base::TimeDelta::FromMilliseconds(std::max(header.timeout(), 0));
+  }
+  if (header.has_deadline()) {
+    // A deadline that is before the epoch has already expired, and the
+    // budget that remains is clamped before it is added to the clock.
+    int64 now = (base::Time::Now() - base::Time::FromTimeT(0))
+      .InMilliseconds();
+    int64 absolute_deadline =
+      std::max(header.deadline(), static_cast<int64>(0));
+    int64 budget = std::max(
+      std::min(absolute_deadline - now, kMaxPacketBudgetMs),
+      static_cast<int64>(0));
+    base::TimeTicks local_deadline = base::TimeTicks::Now() +
+      base::TimeDelta::FromMilliseconds(budget);
+    if (deadline.is_null() || local_deadline < deadline) {
+      deadline = local_deadline;
+    }
+  }
+  return deadline;
+}
+
+bool CheckPacketDeadline(PacketView* view, base::TimeTicks received_time,
+  base::TimeTicks* deadline) {
+  DCHECK(view);
+  DCHECK(deadline);
+  *deadline = GetPacketDeadline(view->header(), received_time);
+  if (deadline->is_null()) {
+    return true;
+  }
+
+  base::TimeTicks now = base::TimeTicks::Now();
+  if (IsExpired(*deadline, now)) {
+    return false;
+  }
+
+  // The header is serialized again only when the budget really changed.
+  if (view->header().has_timeout()) {
+    int timeout = GetRemainingTimeout(*deadline, now);
+    if (timeout < view->header().timeout()) {
+      view->set_timeout(timeout);
+    }
+  }
+  return true;
+}
+
+bool CheckPacketDeadline(rp::RubyMessagePacket* packet,
+  base::TimeTicks received_time, base::TimeTicks* deadline) {
+  DCHECK(packet);
+  DCHECK(deadline);
+  *deadline = GetPacketDeadline(packet->header(), received_time);
+  if (deadline->is_null()) {
+    return true;
+  }
+
+  base::TimeTicks now = base::TimeTicks::Now();
+  if (IsExpired(*deadline, now)) {
+    return false;
+  }
+
+  if (packet->header().has_timeout()) {
+    int timeout = GetRemainingTimeout(*deadline, now);
+    if (timeout < packet->header().timeout()) {
+      packet->mutable_header()->set_timeout(timeout);
+    }
+  }
+  return true;
+}
+
+}  // namespace node
@@ -0,0 +1,50 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+
+#ifndef NODE_SERVICE_PACKET_DEADLINE_H_
+#define NODE_SERVICE_PACKET_DEADLINE_H_
+#pragma once
+
+#include <base/time.h>
+
+namespace ruby {
+namespace protocol {
+class RubyMessageHeader;
+class RubyMessagePacket;
+}
+}
+
+namespace node {
+class PacketView;
+
+// Gets the time at which the packet whose header is |header|, and which was
+// received at |received_time|, expires. Returns a null time if the packet
+// has no deadline. The absolute deadline of the header is converted to the
+// local clock, and when the header has both deadlines the earliest wins.
+// A negative timeout or a deadline that has passed expires the packet at
+// once, and the budgets are clamped to the longest timeout a header could
+// carry, about 24 days.
+base::TimeTicks GetPacketDeadline(
+  const ruby::protocol::RubyMessageHeader& header,
+  base::TimeTicks received_time);
+
+// Checks the deadline of the packet scanned by |view|, which was received at
+// |received_time|, and stores it into |deadline|. Returns false if the
+// packet has expired. Otherwise, when the packet has a relative timeout, the
+// timeout is updated to the budget that remains, so the next hop sees how
+// long the packet is still useful.
+bool CheckPacketDeadline(PacketView* view, base::TimeTicks received_time,
+  base::TimeTicks* deadline);
+bool CheckPacketDeadline(ruby::protocol::RubyMessagePacket* packet,
+  base::TimeTicks received_time, base::TimeTicks* deadline);
+
+// Returns true if a packet whose deadline is |deadline| has expired at
+// |now|. A null deadline never expires.
+inline bool IsExpired(base::TimeTicks deadline, base::TimeTicks now) {
+  return !deadline.is_null() && deadline <= now;
+}
+
+}  // namespace node
+
+#endif  // NODE_SERVICE_PACKET_DEADLINE_H_
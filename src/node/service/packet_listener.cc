@@ -0,0 +1,602 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+
+#include "build/build_config.h"
+
+#if defined(OS_WIN)
+#include <winsock2.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "node/service/packet_listener.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+#include <base/stringprintf.h>
+#include <ruby_protos.pb.h>
+
+#include "node/service/packet_view.h"
+#include "node/zeromq/message.h"
+
+namespace node {
+
+namespace rp = ::ruby::protocol;
+
+namespace {
+
+// The routes of the listener connections. The route starts with a zero byte,
+// like the identities generated by zeromq, and is followed by the connection
+// number in hexadecimal.
+const char kListenerRoutePrefix[] = "\0tcp-";
+const size_t kListenerRoutePrefixSize = sizeof(kListenerRoutePrefix) - 1;
+const size_t kListenerRouteSize = kListenerRoutePrefixSize + 8;
+
+// The tags of the RubyMessagePacket fields that precedes the packet message,
+// as they appear on the wire.
+const uint8 kPacketSizeTag = (1 << 3) | 0;    // size, varint.
+const uint8 kHeaderSizeTag = (2 << 3) | 0;    // header_size, varint.
+const uint8 kHeaderTag = (3 << 3) | 2;        // header, length delimited.
+
+// The greatest packet that is accepted from a connection.
+const uint32 kMaxPacketSize = 64 * 1024 * 1024;
+
+// The greatest number of bytes that is queued for a slow connection.
+const size_t kMaxOutputSize = 64 * 1024 * 1024;
+
+// The number of bytes that is written to a connection at once.
+const int kWriteSize = 64 * 1024;
+
+// The size of the buffers the connections are read into. This is the
+// greatest block that is cached by the MessagePool.
+const size_t kInputBufferSize = 64 * 1024;
+
+// The minimum free space of an input buffer that is worth a read.
+const size_t kMinReadSize = 4 * 1024;
+
+// The number of reads performed for a connection per notification, so a
+// busy connection does not starve the other ones.
+const int kMaxReadsPerNotification = 16;
+
+#if defined(OS_WIN)
+const int kSendFlags = 0;
+
+bool WouldBlock() {
+  return WSAGetLastError() == WSAEWOULDBLOCK;
+}
+
+void CloseSocket(int socket) {
+  closesocket(static_cast<SOCKET>(socket));
+}
+
+bool SetNonBlocking(int socket) {
+  u_long non_blocking = 1;
+  return ioctlsocket(static_cast<SOCKET>(socket), FIONBIO, &non_blocking) == 0;
+}
+#else
+#if defined(MSG_NOSIGNAL)
+const int kSendFlags = MSG_NOSIGNAL;
+#else
+const int kSendFlags = 0;
+#endif
+
+bool WouldBlock() {
+  return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
+void CloseSocket(int socket) {
+  close(socket);
+}
+
+bool SetNonBlocking(int socket) {
+  int flags = fcntl(socket, F_GETFL, 0);
+  return flags >= 0 && fcntl(socket, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+#endif
+
+// Reads a base 128 varint from the |available| bytes of |data|. Returns the
+// number of bytes consumed, zero if more bytes are needed or -1 if the
+// varint is malformed.
+int ReadVarint32(const char* data, size_t available, uint32* value) {
+  uint32 result = 0;
+  for (int i = 0; i < 5; ++i) {
+    if (static_cast<size_t>(i) >= available) {
+      return 0;
+    }
+    uint8 byte = static_cast<uint8>(data[i]);
+    result |= static_cast<uint32>(byte & 0x7F) << (7 * i);
+    if (!(byte & 0x80)) {
+      *value = result;
+      return i + 1;
+    }
+  }
+  return -1;
+}
+
+}  // namespace
+
+struct PacketListener::Connection {
+  int socket;
+  std::string route;
+
+  // The buffer the bytes are received into. The bytes from |input_offset|
+  // to |input_size| was received but not consumed yet, and the byte at
+  // |input_offset| is always the first byte of a packet. The packets are
+  // forwarded as slices of the buffer, so the bytes before |input_offset|
+  // could still be referenced and must not be overwritten.
+  scoped_refptr<zmq::Message> input;
+  size_t input_offset;
+  size_t input_size;
+
+  // The total size of the packet that is being received, or zero if its
+  // size is not known yet.
+  size_t packet_size;
+
+  // Set when the header of the packet that is being received was routed.
+  bool header_routed;
+
+  // Set when |routes| holds the routes of the packet that is being received.
+  bool has_routes;
+  RouteSet routes;
+
+  // The bytes that should be sent. The bytes before |output_offset| was
+  // already sent.
+  std::string output;
+  size_t output_offset;
+
+  // The events that is watched for the connection.
+  int watched_events;
+
+  // Set when a write fails outside of a notification for the connection.
+  bool broken;
+};
+
+PacketListener::PacketListener(MessageRouter* router, Delegate* delegate)
+  : router_(router),
+    delegate_(delegate),
+    poller_(NULL),
+    listen_socket_(-1),
+    next_connection_id_(0) {
+  DCHECK(router);
+  DCHECK(delegate);
+}
+
+PacketListener::~PacketListener() {
+  Stop();
+  if (listen_socket_ != -1) {
+    CloseSocket(listen_socket_);
+  }
+}
+
+bool PacketListener::Listen(int port) {
+  DCHECK_EQ(listen_socket_, -1);
+
+#if defined(OS_WIN)
+  SOCKET native_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (native_socket == INVALID_SOCKET) {
+    return false;
+  }
+  int listen_socket = static_cast<int>(native_socket);
+#else
+  int listen_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (listen_socket < 0) {
+    return false;
+  }
+#endif
+
+  int reuse = 1;
+  setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR,
+    reinterpret_cast<const char*>(&reuse), sizeof(reuse));
+
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = htons(static_cast<uint16>(port));
+  if (bind(listen_socket, reinterpret_cast<struct sockaddr*>(&address),
+    sizeof(address)) != 0 ||
+    listen(listen_socket, SOMAXCONN) != 0 ||
+    !SetNonBlocking(listen_socket)) {
+    LOG(ERROR) << "The packet listener could not listen on the port " << port;
+    CloseSocket(listen_socket);
+    return false;
+  }
+
+  listen_socket_ = listen_socket;
+  return true;
+}
+
+void PacketListener::Start(zmq::Poller* poller) {
+  DCHECK(poller);
+  DCHECK_NE(listen_socket_, -1);
+  poller_ = poller;
+  poller_->WatchFileDescriptor(listen_socket_, zmq::kPollIn, this);
+}
+
+void PacketListener::Stop() {
+  while (!connections_.empty()) {
+    Close(connections_.begin()->second);
+  }
+  if (poller_ && listen_socket_ != -1) {
+    poller_->StopWatchingFileDescriptor(listen_socket_);
+  }
+  poller_ = NULL;
+}
+
+// static
+bool PacketListener::IsListenerRoute(const std::string& route) {
+  return route.size() == kListenerRouteSize &&
+    route.compare(0, kListenerRoutePrefixSize, kListenerRoutePrefix,
+      kListenerRoutePrefixSize) == 0;
+}
+
+bool PacketListener::Send(const std::string& route,
+  const rp::RubyMessagePacket& packet) {
+  RouteMap::iterator found = routes_.find(route);
+  if (found == routes_.end()) {
+    return false;
+  }
+
+  Connection* connection = found->second;
+  if (connection->broken ||
+    connection->output.size() - connection->output_offset > kMaxOutputSize) {
+    LOG(WARNING) << "The output of a packet listener connection is full.";
+    return false;
+  }
+
+  // The framing requires the size fields to be present, so they are computed
+  // here instead of relying on the sender.
+  rp::RubyMessagePacket framed(packet);
+  framed.clear_size();
+  framed.set_header_size(framed.header().ByteSize());
+  framed.set_size(framed.ByteSize());
+  framed.AppendToString(&connection->output);
+
+  if (!Write(connection)) {
+    connection->broken = true;
+    return false;
+  }
+  return true;
+}
+
+void PacketListener::OnFileDescriptorReady(int fd, int events) {
+  if (fd == listen_socket_) {
+    Accept();
+    return;
+  }
+
+  ConnectionMap::iterator found = connections_.find(fd);
+  if (found == connections_.end()) {
+    return;
+  }
+
+  Connection* connection = found->second;
+  if ((events & zmq::kPollError) ||
+    ((events & zmq::kPollIn) && !Read(connection)) ||
+    ((events & zmq::kPollOut) && !Write(connection)) ||
+    connection->broken) {
+    Close(connection);
+  }
+}
+
+void PacketListener::Accept() {
+  while (true) {
+#if defined(OS_WIN)
+    SOCKET native_socket = accept(static_cast<SOCKET>(listen_socket_), NULL,
+      NULL);
+    if (native_socket == INVALID_SOCKET) {
+      return;
+    }
+    int socket = static_cast<int>(native_socket);
+#else
+    int socket = accept(listen_socket_, NULL, NULL);
+    if (socket < 0) {
+      return;
+    }
+#endif
+
+    int no_delay = 1;
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY,
+      reinterpret_cast<const char*>(&no_delay), sizeof(no_delay));
+    if (!SetNonBlocking(socket)) {
+      CloseSocket(socket);
+      continue;
+    }
+
+    Connection* connection = new Connection();
+    connection->socket = socket;
+    connection->route.assign(kListenerRoutePrefix, kListenerRoutePrefixSize);
+    connection->route.append(
+      base::StringPrintf("%08x", next_connection_id_++));
+    connection->input_offset = 0;
+    connection->input_size = 0;
+    connection->packet_size = 0;
+    connection->header_routed = false;
+    connection->has_routes = false;
+    connection->output_offset = 0;
+    connection->watched_events = zmq::kPollIn;
+    connection->broken = false;
+
+    connections_[socket] = connection;
+    routes_[connection->route] = connection;
+    poller_->WatchFileDescriptor(socket, zmq::kPollIn, this);
+  }
+}
+
+bool PacketListener::Read(Connection* connection) {
+  for (int i = 0; i < kMaxReadsPerNotification; ++i) {
+    ReserveInput(connection);
+    char* buffer = static_cast<char*>(connection->input->mutable_data()) +
+      connection->input_size;
+    int capacity =
+      static_cast<int>(connection->input->size() - connection->input_size);
+    int received = recv(connection->socket, buffer, capacity, 0);
+    if (received == 0) {
+      // The peer closed the connection.
+      return false;
+    }
+    if (received < 0) {
+      if (WouldBlock()) {
+        break;
+      }
+      return false;
+    }
+
+    connection->input_size += received;
+    if (!ProcessInput(connection)) {
+      LOG(WARNING) << "A packet listener connection sent a malformed packet.";
+      return false;
+    }
+    if (received < capacity) {
+      break;
+    }
+  }
+  return !connection->broken;
+}
+
+void PacketListener::ReserveInput(Connection* connection) {
+  // The buffer should have room for a reasonable read and for the rest of
+  // the packet that is being received.
+  size_t pending = connection->input_size - connection->input_offset;
+  if (connection->input &&
+    connection->input->size() - connection->input_size >= kMinReadSize &&
+    connection->input->size() - connection->input_offset >=
+      connection->packet_size) {
+    return;
+  }
+
+  // The bytes that was consumed could still be referenced by the forwarded
+  // packets, so the pending bytes, which are always a part of a single
+  // packet, are moved to a new buffer instead of the beginning of the
+  // current one.
+  size_t size = std::max(kInputBufferSize,
+    std::max(pending + kMinReadSize, connection->packet_size));
+  scoped_refptr<zmq::Message> input(new zmq::Message(static_cast<int>(size)));
+  if (pending) {
+    memcpy(input->mutable_data(),
+      static_cast<char*>(connection->input->mutable_data()) +
+        connection->input_offset,
+      pending);
+  }
+  connection->input = input;
+  connection->input_offset = 0;
+  connection->input_size = pending;
+}
+
+bool PacketListener::ProcessInput(Connection* connection) {
+  const char* buffer =
+    static_cast<const char*>(connection->input->mutable_data());
+  size_t offset = connection->input_offset;
+  while (true) {
+    const char* data = buffer + offset;
+    size_t available = connection->input_size - offset;
+
+    // The size field is the first field of the packet and tells how many
+    // bytes we should wait for.
+    if (!connection->packet_size) {
+      if (!available) {
+        break;
+      }
+      if (static_cast<uint8>(data[0]) != kPacketSizeTag) {
+        return false;
+      }
+
+      uint32 size;
+      int consumed = ReadVarint32(data + 1, available - 1, &size);
+      if (consumed < 0 || size > kMaxPacketSize) {
+        return false;
+      }
+      if (!consumed) {
+        break;
+      }
+      connection->packet_size = 1 + consumed + size;
+      connection->header_routed = false;
+      connection->has_routes = false;
+      connection->routes.clear();
+    }
+
+    // Route the packet as soon as its header is here.
+    if (!connection->header_routed) {
+      RouteHeader(connection, data, available);
+    }
+
+    if (available < connection->packet_size) {
+      break;
+    }
+
+    int packet_size = static_cast<int>(connection->packet_size);
+    scoped_refptr<zmq::Message> frame =
+      connection->input->Slice(static_cast<int>(offset), packet_size);
+    offset += connection->packet_size;
+    connection->packet_size = 0;
+    if (!frame) {
+      continue;
+    }
+
+    // The packet is forwarded in the bytes it was received with, without
+    // being parsed, when it is possible.
+    PacketView view;
+    if (view.Parse(frame->mutable_data(), packet_size)) {
+      RouteSet routes;
+      RoutedRequests requests;
+      if (connection->has_routes && !view.has_sender()) {
+        view.set_sender(connection->route);
+        routes.swap(connection->routes);
+        if (routes.empty()) {
+          routes.push_back(connection->route);
+        }
+      } else {
+        routes = router_->GetRoutes(connection->route, &view, &requests);
+      }
+      delegate_->OnPacketFrameReceived(connection->route, routes, requests,
+        &view, frame.get());
+      continue;
+    }
+
+    rp::RubyMessagePacket packet;
+    if (!packet.ParseFromArray(data, packet_size)) {
+      return false;
+    }
+
+    if (!packet.has_message()) {
+      LOG(WARNING) << "Received a packet with no message associated.";
+      continue;
+    }
+
+    // The routes are computed like MessageRouter::GetRoutes() does.
+    RouteSet routes;
+    RoutedRequests requests;
+    if (connection->has_routes && !packet.message().has_sender()) {
+      packet.mutable_message()->set_sender(connection->route);
+      routes.swap(connection->routes);
+      if (routes.empty()) {
+        routes.push_back(connection->route);
+      }
+    } else {
+      routes = router_->GetRoutes(connection->route, &packet, &requests);
+    }
+    delegate_->OnPacketReceived(connection->route, routes, requests, &packet);
+  }
+
+  connection->input_offset = offset;
+  return true;
+}
+
+void PacketListener::RouteHeader(Connection* connection, const char* data,
+  size_t available) {
+  // Skip the size field, which was already decoded.
+  uint32 value;
+  int consumed = ReadVarint32(data + 1, available - 1, &value);
+  DCHECK_GT(consumed, 0);
+  size_t position = 1 + consumed;
+
+  // The header could be located only if the header_size field precedes it.
+  // Otherwise the packet is routed after it is fully received.
+  if (position >= available) {
+    return;
+  }
+  if (static_cast<uint8>(data[position]) != kHeaderSizeTag) {
+    connection->header_routed = true;
+    return;
+  }
+  consumed = ReadVarint32(data + position + 1, available - position - 1,
+    &value);
+  if (consumed <= 0) {
+    connection->header_routed = consumed < 0;
+    return;
+  }
+  position += 1 + consumed;
+
+  if (position >= available) {
+    return;
+  }
+  if (static_cast<uint8>(data[position]) != kHeaderTag) {
+    connection->header_routed = true;
+    return;
+  }
+  uint32 header_size;
+  consumed = ReadVarint32(data + position + 1, available - position - 1,
+    &header_size);
+  if (consumed <= 0) {
+    connection->header_routed = consumed < 0;
+    return;
+  }
+  position += 1 + consumed;
+  if (available - position < header_size) {
+    return;
+  }
+
+  connection->header_routed = true;
+  rp::RubyMessageHeader header;
+  if (header.ParseFromArray(data + position, static_cast<int>(header_size))) {
+    router_->GetServiceRoutes(header, &connection->routes);
+    connection->has_routes = true;
+  }
+}
+
+bool PacketListener::Write(Connection* connection) {
+  while (connection->output_offset < connection->output.size()) {
+    size_t pending = connection->output.size() - connection->output_offset;
+    int sent = send(connection->socket,
+      connection->output.data() + connection->output_offset,
+      static_cast<int>(std::min(pending, static_cast<size_t>(kWriteSize))),
+      kSendFlags);
+    if (sent < 0) {
+      if (WouldBlock()) {
+        break;
+      }
+      return false;
+    }
+    connection->output_offset += sent;
+  }
+
+  // Discard the bytes that was sent, but only when it is cheap to do it.
+  if (connection->output_offset == connection->output.size()) {
+    connection->output.clear();
+    connection->output_offset = 0;
+  } else if (connection->output_offset > connection->output.size() / 2) {
+    connection->output.erase(0, connection->output_offset);
+    connection->output_offset = 0;
+  }
+
+  UpdateWatch(connection);
+  return true;
+}
+
+void PacketListener::UpdateWatch(Connection* connection) {
+  int events = zmq::kPollIn;
+  if (!connection->output.empty()) {
+    events |= zmq::kPollOut;
+  }
+  if (events != connection->watched_events && poller_) {
+    poller_->WatchFileDescriptor(connection->socket, events, this);
+    connection->watched_events = events;
+  }
+}
+
+void PacketListener::Close(Connection* connection) {
+  if (poller_) {
+    poller_->StopWatchingFileDescriptor(connection->socket);
+  }
+  CloseSocket(connection->socket);
+
+  // A client that has announced a service is one of its instances, which
+  // could not be reached anymore.
+  if (router_->HasRoute(connection->route)) {
+    router_->RemoveInstance(connection->route);
+  }
+  routes_.erase(connection->route);
+  connections_.erase(connection->socket);
+  delete connection;
+}
+
+}  // namespace node
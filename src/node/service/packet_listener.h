@@ -0,0 +1,153 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+
+#ifndef NODE_SERVICE_PACKET_LISTENER_H_
+#define NODE_SERVICE_PACKET_LISTENER_H_
+#pragma once
+
+#include <map>
+#include <string>
+
+#include <base/basictypes.h>
+#include <base/compiler_specific.h>
+
+#include "node/service/message_router.h"
+#include "node/zeromq/poller.h"
+
+namespace ruby {
+namespace protocol {
+class RubyMessagePacket;
+class RubyMessageHeader;
+}
+}
+
+namespace zmq {
+class Message;
+}
+
+namespace node {
+class PacketView;
+
+// A PacketListener accepts plain TCP connections from clients that does not
+// use zeromq. The clients send and receive serialized RubyMessagePackets
+// using the self-delimiting framing described in ruby_protos.proto:
+//
+//   [TotalPacketSize][HeaderSize][RubyMessageHeader][RubyMessage]
+//
+// which is just a RubyMessagePacket whose size and header_size fields are
+// set, since protocol buffers serializes the fields in the field number
+// order.
+//
+// The framing is incremental: the bytes are consumed as they arrive and the
+// routes of a packet are looked up as soon as its header is received, while
+// the message body is still in transit. The bytes are received directly
+// into zmq::Message buffers and the complete packets are forwarded as
+// slices of them, so the packets are not copied.
+//
+// Each connection is identified by a route that is unique within the node,
+// so the packets received from a connection are routed like the ones that
+// come from the message channel, and the replies addressed to the route are
+// sent back through the connection.
+//
+// The listener runs on the thread of the zmq::Poller that watches its
+// sockets, which is the message receiver thread.
+class PacketListener : public zmq::Poller::Watcher {
+ public:
+  // Receives the packets that arrives on the listener connections.
+  class Delegate {
+   public:
+    // Called when a complete |packet| is received from the connection whose
+    // route is |peer|. |routes| are the routes of the packet computed by the
+    // MessageRouter, and |requests| the requests that it carries to the
+    // instances of the balanced services, which should be marked as sent
+    // when the packet is sent.
+    virtual void OnPacketReceived(const std::string& peer,
+      const RouteSet& routes, const RoutedRequests& requests,
+      ruby::protocol::RubyMessagePacket* packet) = 0;
+
+    // Called when a complete packet that could be forwarded without being
+    // parsed is received. |view| is the packet scanned from |frame|, which
+    // is a slice of the connection input buffer.
+    virtual void OnPacketFrameReceived(const std::string& peer,
+      const RouteSet& routes, const RoutedRequests& requests,
+      PacketView* view, zmq::Message* frame) = 0;
+
+   protected:
+    virtual ~Delegate() {}
+  };
+
+  PacketListener(MessageRouter* router, Delegate* delegate);
+  virtual ~PacketListener();
+
+  // Starts listening for connections on |port|. Returns false if the
+  // listening socket could not be created.
+  bool Listen(int port);
+
+  // Starts watching the listening socket and the connections for events
+  // using |poller|.
+  void Start(zmq::Poller* poller);
+
+  // Stops watching the sockets and closes all the connections.
+  void Stop();
+
+  // Returns true if |route| identifies a connection of a PacketListener.
+  static bool IsListenerRoute(const std::string& route);
+
+  // Sends |packet| to the connection identified by |route|. Returns false
+  // if the connection does not exist or its output buffer is full.
+  bool Send(const std::string& route,
+    const ruby::protocol::RubyMessagePacket& packet);
+
+  // zmq::Poller::Watcher implementation.
+  virtual void OnFileDescriptorReady(int fd, int events) OVERRIDE;
+
+ private:
+  struct Connection;
+  typedef std::map<int, Connection*> ConnectionMap;
+  typedef std::map<std::string, Connection*> RouteMap;
+
+  // Accepts all the pending connections.
+  void Accept();
+
+  // Reads the available bytes of |connection| and processes the packets
+  // that was completed. Returns false if the connection should be closed.
+  bool Read(Connection* connection);
+
+  // Makes sure the input buffer of |connection| has room for a read.
+  void ReserveInput(Connection* connection);
+
+  // Consumes the buffered input of |connection|. Returns false on protocol
+  // errors.
+  bool ProcessInput(Connection* connection);
+
+  // Looks up the routes of the packet that is being received by
+  // |connection|, if its header is within the |available| bytes of |data|,
+  // which points to the beginning of the packet.
+  void RouteHeader(Connection* connection, const char* data,
+    size_t available);
+
+  // Writes as much of the output buffer of |connection| as possible.
+  // Returns false if the connection should be closed.
+  bool Write(Connection* connection);
+
+  // Updates the events that is watched for |connection|.
+  void UpdateWatch(Connection* connection);
+
+  void Close(Connection* connection);
+
+  MessageRouter* router_;
+  Delegate* delegate_;
+  zmq::Poller* poller_;
+
+  int listen_socket_;
+  ConnectionMap connections_;
+  RouteMap routes_;
+  uint32 next_connection_id_;
+
+  DISALLOW_COPY_AND_ASSIGN(PacketListener);
+};
+
+}  // namespace node
+
+#endif  // NODE_SERVICE_PACKET_LISTENER_H_
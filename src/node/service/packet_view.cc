@@ -0,0 +1,382 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+
+#include "node/service/packet_view.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
+#include <google/protobuf/wire_format_lite_inl.h>
+
+namespace node {
+
+namespace rp = ::ruby::protocol;
+
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::io::CodedOutputStream;
+using google::protobuf::internal::WireFormatLite;
+
+namespace {
+
+// The tags of the length delimited fields that are decoded or spliced.
+const uint32 kMessageIdTag = WireFormatLite::MakeTag(
+  rp::RubyMessage::kIdFieldNumber,
+  WireFormatLite::WIRETYPE_LENGTH_DELIMITED);
+const uint32 kHeaderTag = WireFormatLite::MakeTag(
+  rp::RubyMessagePacket::kHeaderFieldNumber,
+  WireFormatLite::WIRETYPE_LENGTH_DELIMITED);
+const uint32 kMessageTag = WireFormatLite::MakeTag(
+  rp::RubyMessagePacket::kMessageFieldNumber,
+  WireFormatLite::WIRETYPE_LENGTH_DELIMITED);
+const uint32 kSenderTag = WireFormatLite::MakeTag(
+  rp::RubyMessage::kSenderFieldNumber,
+  WireFormatLite::WIRETYPE_LENGTH_DELIMITED);
+const uint32 kSizeTag = WireFormatLite::MakeTag(
+  rp::RubyMessagePacket::kSizeFieldNumber, WireFormatLite::WIRETYPE_VARINT);
+const uint32 kHeaderSizeTag = WireFormatLite::MakeTag(
+  rp::RubyMessagePacket::kHeaderSizeFieldNumber,
+  WireFormatLite::WIRETYPE_VARINT);
+
+// Gets the size of a length delimited field whose tag is |tag| and whose
+// value has |size| bytes.
+int LengthDelimitedSize(uint32 tag, int size) {
+  return CodedOutputStream::VarintSize32(tag) +
+    CodedOutputStream::VarintSize32(static_cast<uint32>(size)) + size;
+}
+
+// Gets the size of an int32 field whose tag is |tag| and whose value is
+// |value|.
+int Int32FieldSize(uint32 tag, int32 value) {
+  return CodedOutputStream::VarintSize32(tag) +
+    CodedOutputStream::VarintSize32SignExtended(value);
+}
+
+// A field of the scanned packet that is written again when the packet is
+// serialized, which spans the bytes from |begin| to |end|.
+struct SplicedField {
+  int begin;
+  int end;
+  int field_number;
+};
+
+bool SplicedFieldLess(const SplicedField& a, const SplicedField& b) {
+  return a.begin < b.begin;
+}
+
+}  // namespace
+
+PacketView::PacketView()
+  : data_(NULL),
+    size_(0),
+    size_tag_offset_(0),
+    size_end_offset_(0),
+    size_value_(0),
+    has_size_(false),
+    header_size_tag_offset_(0),
+    header_size_end_offset_(0),
+    header_size_value_(0),
+    has_header_size_(false),
+    header_tag_offset_(0),
+    header_offset_(0),
+    header_size_(0),
+    has_header_(false),
+    message_tag_offset_(0),
+    message_offset_(0),
+    message_size_(0),
+    has_sender_(false),
+    modified_(false),
+    header_modified_(false) {
+}
+
+PacketView::~PacketView() {
+}
+
+bool PacketView::Parse(const void* data, int size) {
+  DCHECK(data || !size);
+  data_ = static_cast<const uint8*>(data);
+  size_ = size;
+  has_size_ = false;
+  has_header_size_ = false;
+  header_.Clear();
+  has_header_ = false;
+  message_id_.clear();
+  has_sender_ = false;
+  sender_.clear();
+  modified_ = false;
+  header_modified_ = false;
+
+  bool has_message = false;
+  CodedInputStream input(data_, size_);
+  while (true) {
+    int tag_offset = input.CurrentPosition();
+    uint32 tag = input.ReadTag();
+    if (!tag) {
+      break;
+    }
+
+    int field_number = WireFormatLite::GetTagFieldNumber(tag);
+    bool length_delimited = WireFormatLite::GetTagWireType(tag) ==
+      WireFormatLite::WIRETYPE_LENGTH_DELIMITED;
+    if (field_number == rp::RubyMessagePacket::kHeaderFieldNumber) {
+      // A repeated embedded message should be merged, which is left to the
+      // full parser.
+      uint32 length;
+      if (!length_delimited || has_header_ || !input.ReadVarint32(&length) ||
+        length > static_cast<uint32>(size_ - input.CurrentPosition()) ||
+        !header_.ParseFromArray(data_ + input.CurrentPosition(), length)) {
+        return false;
+      }
+      header_tag_offset_ = tag_offset;
+      header_offset_ = input.CurrentPosition();
+      header_size_ = static_cast<int>(length);
+      input.Skip(length);
+      has_header_ = true;
+    } else if (tag == kSizeTag || tag == kHeaderSizeTag) {
+      // The sizes are rewritten when the packet is modified, a repeated one
+      // is left to the full parser.
+      bool is_size = tag == kSizeTag;
+      uint32 value;
+      if ((is_size ? has_size_ : has_header_size_) ||
+        !input.ReadVarint32(&value)) {
+        return false;
+      }
+      if (is_size) {
+        size_tag_offset_ = tag_offset;
+        size_end_offset_ = input.CurrentPosition();
+        size_value_ = static_cast<int32>(value);
+        has_size_ = true;
+      } else {
+        header_size_tag_offset_ = tag_offset;
+        header_size_end_offset_ = input.CurrentPosition();
+        header_size_value_ = static_cast<int32>(value);
+        has_header_size_ = true;
+      }
+    } else if (field_number == rp::RubyMessagePacket::kMessageFieldNumber) {
+      uint32 length;
+      if (!length_delimited || has_message || !input.ReadVarint32(&length) ||
+        length > static_cast<uint32>(size_ - input.CurrentPosition())) {
+        return false;
+      }
+      message_tag_offset_ = tag_offset;
+      message_offset_ = input.CurrentPosition();
+      message_size_ = static_cast<int>(length);
+      if (!ParseMessage(data_ + message_offset_, message_size_)) {
+        return false;
+      }
+      input.Skip(length);
+      has_message = true;
+    } else if (!WireFormatLite::SkipField(&input, tag)) {
+      return false;
+    }
+  }
+  return has_message && input.ConsumedEntireMessage();
+}
+
+bool PacketView::ParseMessage(const uint8* data, int size) {
+  // Only the ID and the sender are decoded, the service message is skipped.
+  CodedInputStream input(data, size);
+  while (uint32 tag = input.ReadTag()) {
+    if (tag == kMessageIdTag) {
+      if (!WireFormatLite::ReadBytes(&input, &message_id_)) {
+        return false;
+      }
+    } else if (tag == kSenderTag) {
+      if (!WireFormatLite::ReadBytes(&input, &sender_)) {
+        return false;
+      }
+      has_sender_ = true;
+    } else if (!WireFormatLite::SkipField(&input, tag)) {
+      return false;
+    }
+  }
+  return input.ConsumedEntireMessage();
+}
+
+void PacketView::set_sender(const std::string& sender) {
+  DCHECK(data_);
+  sender_ = sender;
+  has_sender_ = true;
+  modified_ = true;
+}
+
+void PacketView::set_timeout(int timeout) {
+  DCHECK(data_);
+  header_.set_timeout(timeout);
+  header_modified_ = true;
+}
+
+void PacketView::set_priority(rp::MessagePriority priority) {
+  DCHECK(data_);
+  header_.set_priority(priority);
+  header_modified_ = true;
+}
+
+int PacketView::ByteSize() const {
+  if (!modified()) {
+    return size_;
+  }
+  int size = size_ + HeaderFieldGrowth() + MessageFieldGrowth() +
+    HeaderSizeFieldGrowth();
+  if (has_size_) {
+    size += Int32FieldSize(kSizeTag, SizeValue()) -
+      (size_end_offset_ - size_tag_offset_);
+  }
+  return size;
+}
+
+void PacketView::SerializeToArray(void* target) const {
+  uint8* output = static_cast<uint8*>(target);
+  if (!modified()) {
+    memcpy(output, data_, size_);
+    return;
+  }
+
+  // The fields that are rewritten are written in the order they was
+  // scanned, and the bytes between them are copied verbatim. A header that
+  // was not scanned is appended to the packet.
+  SplicedField fields[4];
+  int count = 0;
+  if (has_size_) {
+    SplicedField field = { size_tag_offset_, size_end_offset_,
+      rp::RubyMessagePacket::kSizeFieldNumber };
+    fields[count++] = field;
+  }
+  if (header_modified_ && has_header_size_) {
+    SplicedField field = { header_size_tag_offset_, header_size_end_offset_,
+      rp::RubyMessagePacket::kHeaderSizeFieldNumber };
+    fields[count++] = field;
+  }
+  if (header_modified_ && has_header_) {
+    SplicedField field = { header_tag_offset_, header_offset_ + header_size_,
+      rp::RubyMessagePacket::kHeaderFieldNumber };
+    fields[count++] = field;
+  }
+  if (modified_) {
+    SplicedField field = { message_tag_offset_,
+      message_offset_ + message_size_,
+      rp::RubyMessagePacket::kMessageFieldNumber };
+    fields[count++] = field;
+  }
+  std::sort(fields, fields + count, SplicedFieldLess);
+
+  int offset = 0;
+  for (int i = 0; i < count; ++i) {
+    memcpy(output, data_ + offset, fields[i].begin - offset);
+    output = WriteField(fields[i].field_number,
+      output + fields[i].begin - offset);
+    offset = fields[i].end;
+  }
+  memcpy(output, data_ + offset, size_ - offset);
+  output += size_ - offset;
+  if (header_modified_ && !has_header_) {
+    WriteHeader(output);
+  }
+}
+
+uint8* PacketView::WriteField(int field_number, uint8* output) const {
+  switch (field_number) {
+    case rp::RubyMessagePacket::kSizeFieldNumber:
+      output = CodedOutputStream::WriteTagToArray(kSizeTag, output);
+      return CodedOutputStream::WriteVarint32SignExtendedToArray(SizeValue(),
+        output);
+
+    case rp::RubyMessagePacket::kHeaderSizeFieldNumber:
+      output = CodedOutputStream::WriteTagToArray(kHeaderSizeTag, output);
+      return CodedOutputStream::WriteVarint32SignExtendedToArray(
+        HeaderSizeValue(), output);
+
+    case rp::RubyMessagePacket::kHeaderFieldNumber:
+      return WriteHeader(output);
+  }
+  DCHECK_EQ(field_number, rp::RubyMessagePacket::kMessageFieldNumber);
+  return WriteMessage(output);
+}
+
+uint8* PacketView::WriteHeader(uint8* output) const {
+  output = CodedOutputStream::WriteTagToArray(kHeaderTag, output);
+  output = CodedOutputStream::WriteVarint32ToArray(header_.ByteSize(),
+    output);
+  return header_.SerializeWithCachedSizesToArray(output);
+}
+
+uint8* PacketView::WriteMessage(uint8* output) const {
+  // The original fields of the message are followed by the sender.
+  int message_size =
+    message_size_ + LengthDelimitedSize(kSenderTag, sender_.size());
+  output = CodedOutputStream::WriteTagToArray(kMessageTag, output);
+  output = CodedOutputStream::WriteVarint32ToArray(message_size, output);
+  memcpy(output, data_ + message_offset_, message_size_);
+  output += message_size_;
+  output = CodedOutputStream::WriteTagToArray(kSenderTag, output);
+  return CodedOutputStream::WriteStringWithSizeToArray(sender_, output);
+}
+
+int PacketView::HeaderFieldSize() const {
+  return LengthDelimitedSize(kHeaderTag, header_.ByteSize());
+}
+
+int PacketView::MessageFieldSize() const {
+  int message_size =
+    message_size_ + LengthDelimitedSize(kSenderTag, sender_.size());
+  return LengthDelimitedSize(kMessageTag, message_size);
+}
+
+int PacketView::HeaderFieldGrowth() const {
+  // A header that was not scanned has no bytes in the original packet.
+  if (!header_modified_) {
+    return 0;
+  }
+  return HeaderFieldSize() - (has_header_ ?
+    header_offset_ + header_size_ - header_tag_offset_ : 0);
+}
+
+int PacketView::MessageFieldGrowth() const {
+  if (!modified_) {
+    return 0;
+  }
+  return MessageFieldSize() -
+    (message_offset_ + message_size_ - message_tag_offset_);
+}
+
+int PacketView::HeaderSizeFieldGrowth() const {
+  if (!header_modified_ || !has_header_size_) {
+    return 0;
+  }
+  return Int32FieldSize(kHeaderSizeTag, HeaderSizeValue()) -
+    (header_size_end_offset_ - header_size_tag_offset_);
+}
+
+int32 PacketView::SizeValue() const {
+  // The size does not include its own field.
+  return size_value_ + HeaderFieldGrowth() + MessageFieldGrowth() +
+    HeaderSizeFieldGrowth();
+}
+
+int32 PacketView::HeaderSizeValue() const {
+  if (!header_modified_) {
+    return header_size_value_;
+  }
+  return header_size_value_ + header_.ByteSize() -
+    (has_header_ ? header_size_ : 0);
+}
+
+bool PacketView::ParsePacket(rp::RubyMessagePacket* packet) const {
+  DCHECK(packet);
+  if (!packet->ParseFromArray(data_, size_)) {
+    return false;
+  }
+  if (modified_) {
+    packet->mutable_message()->set_sender(sender_);
+  }
+  if (header_modified_) {
+    packet->mutable_header()->CopyFrom(header_);
+  }
+  return true;
+}
+
+}  // namespace node
@@ -0,0 +1,153 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+
+#ifndef NODE_SERVICE_PACKET_VIEW_H_
+#define NODE_SERVICE_PACKET_VIEW_H_
+#pragma once
+
+#include <string>
+
+#include <base/basictypes.h>
+#include <ruby_protos.pb.h>
+
+namespace node {
+
+// A PacketView decodes only the parts of a serialized RubyMessagePacket that
+// are needed to route it: the packet header and the ID and the sender of the
+// message.
+// The rest of the packet, including the service message, which could be
+// large, is never parsed.
+//
+// The serialized packet is scanned at the wire level, without copying it,
+// and the packet is re-serialized by splicing the sender into the original
+// bytes, so the cost of routing a packet does not depend on the size of its
+// service message:
+//
+//   [...][MESSAGE TAG][LENGTH][ORIGINAL MESSAGE FIELDS][SENDER FIELD][...]
+//
+// The header is small, so when it is modified it is serialized again in
+// place of the original one. The size and the header size of a packet that
+// is modified are rewritten too, adjusted by the number of bytes that the
+// packet or its header has grown or shrunk.
+//
+// Protocol buffers let the last occurrence of a field win, so appending the
+// sender to the message fields produces a packet that parses exactly like the
+// one produced by setting the sender and serializing it again.
+//
+// The view does not copy the serialized packet, which must outlive it.
+class PacketView {
+ public:
+  PacketView();
+  ~PacketView();
+
+  // Scans the |size| bytes serialized packet pointed by |data|. Returns
+  // false if the packet is malformed, has no message, or could not be
+  // represented by a view, such as when a message field is repeated. The
+  // packet should be fully parsed in that case.
+  bool Parse(const void* data, int size);
+
+  const ruby::protocol::RubyMessageHeader& header() const { return header_; }
+
+  // Sets the relative timeout of the packet header, in milliseconds.
+  void set_timeout(int timeout);
+
+  // Sets the priority of the packet header.
+  void set_priority(ruby::protocol::MessagePriority priority);
+
+  // The ID of the message, or an empty string if it has no ID.
+  const std::string& message_id() const { return message_id_; }
+
+  // The sender of the message.
+  bool has_sender() const { return has_sender_; }
+  const std::string& sender() const { return sender_; }
+
+  // Sets the sender of the message. The sender is spliced into the packet
+  // when it is serialized.
+  void set_sender(const std::string& sender);
+
+  // Returns true if the sender was set after the packet was scanned.
+  bool sender_modified() const { return modified_; }
+
+  // Returns true if the serialized packet differs from the one that was
+  // scanned, because the sender or the header was set.
+  bool modified() const { return modified_ || header_modified_; }
+
+  // Gets the size of the serialized packet.
+  int ByteSize() const;
+
+  // Serializes the packet into |target|, which must have at least
+  // ByteSize() bytes.
+  void SerializeToArray(void* target) const;
+
+  // Fully parses the packet into |packet|. This should be used only when a
+  // RubyMessagePacket object is really needed.
+  bool ParsePacket(ruby::protocol::RubyMessagePacket* packet) const;
+
+ private:
+  // Scans the message field whose |size| bytes are pointed by |data|,
+  // looking for the sender.
+  bool ParseMessage(const uint8* data, int size);
+
+  // Writes the field whose number is |field_number| to |output|, as it
+  // should be serialized, and returns a pointer to the byte that follows it.
+  uint8* WriteField(int field_number, uint8* output) const;
+  uint8* WriteHeader(uint8* output) const;
+  uint8* WriteMessage(uint8* output) const;
+
+  // Gets the size of the header or the message field, as they should be
+  // serialized.
+  int HeaderFieldSize() const;
+  int MessageFieldSize() const;
+
+  // Gets the number of bytes that the header field, the message field and
+  // the header size field grows when they are serialized.
+  int HeaderFieldGrowth() const;
+  int MessageFieldGrowth() const;
+  int HeaderSizeFieldGrowth() const;
+
+  // Gets the values of the size and the header size of the packet, as they
+  // should be serialized.
+  int32 SizeValue() const;
+  int32 HeaderSizeValue() const;
+
+  const uint8* data_;
+  int size_;
+
+  // The offset of the tag of the size field, the offset of the byte that
+  // follows it and its value. The same for the header size field.
+  int size_tag_offset_;
+  int size_end_offset_;
+  int32 size_value_;
+  bool has_size_;
+  int header_size_tag_offset_;
+  int header_size_end_offset_;
+  int32 header_size_value_;
+  bool has_header_size_;
+
+  // The offset of the tag of the header field, the offset of the header
+  // fields and the size of the header fields.
+  int header_tag_offset_;
+  int header_offset_;
+  int header_size_;
+  bool has_header_;
+
+  // The offset of the tag of the message field, the offset of the message
+  // fields and the size of the message fields.
+  int message_tag_offset_;
+  int message_offset_;
+  int message_size_;
+
+  ruby::protocol::RubyMessageHeader header_;
+  std::string message_id_;
+  bool has_sender_;
+  std::string sender_;
+  bool modified_;
+  bool header_modified_;
+
+  DISALLOW_COPY_AND_ASSIGN(PacketView);
+};
+
+}  // namespace node
+
+#endif  // NODE_SERVICE_PACKET_VIEW_H_
@@ -0,0 +1,149 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+
+#include "node/service/priority_lanes.h"
+
+#include <string.h>
+
+#include <base/logging.h>
+#include <ruby_protos.pb.h>
+
+#include "node/service/packet_view.h"
+
+namespace node {
+
+namespace rp = ::ruby::protocol;
+
+namespace {
+
+// The weights of the lanes. The control lane is served by strict priority,
+// so it has no weight.
+const size_t kLaneWeights[kNumberOfLanes] = { 0, 4, 2, 1 };
+
+// The bytes that a service lane of weight one could send in a round.
+const size_t kLaneQuantum = 16 * 1024;
+
+const char* kLaneNames[kNumberOfLanes] = { "control", "high", "normal",
+  "low" };
+
+}  // namespace
+
+PacketLane GetPacketLane(const rp::RubyMessageHeader& header) {
+  switch (header.priority()) {
+    case rp::kControlPriority:
+      return kControlLane;
+
+    case rp::kHighPriority:
+      return kHighLane;
+
+    case rp::kLowPriority:
+      return kLowLane;
+  }
+  return kNormalLane;
+}
+
+PacketLane GetReceivedPacketLane(PacketView* view) {
+  DCHECK(view);
+  PacketLane lane = GetPacketLane(view->header());
+  if (lane != kControlLane) {
+    return lane;
+  }
+  view->set_priority(rp::kHighPriority);
+  return kHighLane;
+}
+
+PacketLane GetReceivedPacketLane(rp::RubyMessagePacket* packet) {
+  DCHECK(packet);
+  PacketLane lane = GetPacketLane(packet->header());
+  if (lane != kControlLane) {
+    return lane;
+  }
+  packet->mutable_header()->set_priority(rp::kHighPriority);
+  return kHighLane;
+}
+
+const char* GetLaneName(PacketLane lane) {
+  DCHECK(lane >= kControlLane && lane < kNumberOfLanes);
+  return kLaneNames[lane];
+}
+
+LaneScheduler::LaneScheduler()
+  : current_(kControlLane + 1) {
+  memset(deficits_, 0, sizeof(deficits_));
+}
+
+PacketLane LaneScheduler::Next(const size_t* head_sizes) {
+  if (head_sizes[kControlLane]) {
+    return kControlLane;
+  }
+
+  bool ready = false;
+  for (int lane = kControlLane + 1; lane < kNumberOfLanes; ++lane) {
+    ready |= head_sizes[lane] != 0;
+  }
+  if (!ready) {
+    return kNumberOfLanes;
+  }
+
+  // Deficit round robin: each time a lane is visited it earns its quantum,
+  // and it is served while its head packet fits into what it has earned. A
+  // lane that has nothing to send loses what it has earned.
+  while (true) {
+    size_t size = head_sizes[current_];
+    if (!size) {
+      deficits_[current_] = 0;
+    } else if (size <= deficits_[current_]) {
+      deficits_[current_] -= size;
+      return static_cast<PacketLane>(current_);
+    }
+
+    if (++current_ == kNumberOfLanes) {
+      current_ = kControlLane + 1;
+    }
+    deficits_[current_] += kLaneQuantum * kLaneWeights[current_];
+  }
+}
+
+LaneLatencyStats::LaneLatencyStats() {
+  memset(counts_, 0, sizeof(counts_));
+  memset(samples_, 0, sizeof(samples_));
+}
+
+void LaneLatencyStats::Add(PacketLane lane, base::TimeDelta latency) {
+  // The bucket of a latency is the number of bits of its microseconds.
+  int64 microseconds = latency.InMicroseconds();
+  int bucket = 0;
+  while (microseconds > 0 && bucket < kNumberOfBuckets - 1) {
+    microseconds >>= 1;
+    ++bucket;
+  }
+  ++counts_[lane][bucket];
+  ++samples_[lane];
+}
+
+void LaneLatencyStats::Log() const {
+  const int kPercentiles[] = { 50, 99, 100 };
+  const int kNumberOfPercentiles = arraysize(kPercentiles);
+  for (int lane = kControlLane; lane < kNumberOfLanes; ++lane) {
+    if (!samples_[lane]) {
+      continue;
+    }
+
+    // The percentiles are reported as the upper bound of their buckets.
+    int64 upper_bounds[kNumberOfPercentiles];
+    int64 seen = 0;
+    for (int i = 0, bucket = 0; i < kNumberOfPercentiles; ++i) {
+      int64 rank = (samples_[lane] * kPercentiles[i] + 99) / 100;
+      while (seen + counts_[lane][bucket] < rank) {
+        seen += counts_[lane][bucket++];
+      }
+      upper_bounds[i] = GG_INT64_C(1) << bucket;
+    }
+    VLOG(1) << "Lane " << kLaneNames[lane] << ": " << samples_[lane]
+            << " packets, p50 < " << upper_bounds[0] << "us, p99 < "
+            << upper_bounds[1] << "us, max < " << upper_bounds[2] << "us";
+  }
+}
+
+}  // namespace node
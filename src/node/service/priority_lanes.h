@@ -0,0 +1,90 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+
+#ifndef NODE_SERVICE_PRIORITY_LANES_H_
+#define NODE_SERVICE_PRIORITY_LANES_H_
+#pragma once
+
+#include <base/basictypes.h>
+#include <base/time.h>
+
+namespace ruby {
+namespace protocol {
+class RubyMessageHeader;
+class RubyMessagePacket;
+}
+}
+
+namespace node {
+class PacketView;
+
+// The lanes that carry the packets through the node, from the highest to the
+// lowest priority. The lanes match the MessagePriority of the packet header.
+enum PacketLane {
+  kControlLane = 0,
+  kHighLane,
+  kNormalLane,
+  kLowLane,
+  kNumberOfLanes
+};
+
+// Gets the lane of the packet whose header is |header|, which was built by
+// the node itself.
+PacketLane GetPacketLane(const ruby::protocol::RubyMessageHeader& header);
+
+// Gets the lane of the packet scanned by |view|, or of |packet|, which was
+// received from a peer. The control lane is reserved to the packets that the
+// node builds, so the peers that asks for it are carried by the high lane
+// and the priority of their packets is lowered to match. The hosts tell the
+// control packets, which take none of their credits, by their priority.
+PacketLane GetReceivedPacketLane(PacketView* view);
+PacketLane GetReceivedPacketLane(ruby::protocol::RubyMessagePacket* packet);
+
+// Gets the name of |lane|, used for logging.
+const char* GetLaneName(PacketLane lane);
+
+// A LaneScheduler chooses the lane whose packet should be sent next. The
+// control lane has strict priority over the others, which share the
+// bandwidth by deficit round robin in proportion to their weights, so a
+// burst of bulk packets could not starve the other service lanes either.
+class LaneScheduler {
+ public:
+  LaneScheduler();
+
+  // Returns the lane that should be served next. |head_sizes| holds, for
+  // each lane, the size of the packet at its head, or zero if the lane has
+  // no packet that could be sent. Returns kNumberOfLanes if no lane has a
+  // packet.
+  PacketLane Next(const size_t* head_sizes);
+
+ private:
+  // The service lane that is being served and the bytes that each service
+  // lane could still send in the current round.
+  int current_;
+  size_t deficits_[kNumberOfLanes];
+};
+
+// Records how long the packets of each lane stay in the node, from the time
+// they are dispatched until they are handed to the message channel, in
+// power of two buckets of microseconds.
+class LaneLatencyStats {
+ public:
+  LaneLatencyStats();
+
+  void Add(PacketLane lane, base::TimeDelta latency);
+
+  // Logs the percentiles of each lane that has samples.
+  void Log() const;
+
+ private:
+  // The last bucket counts every latency above 2^30 microseconds.
+  static const int kNumberOfBuckets = 32;
+
+  int64 counts_[kNumberOfLanes][kNumberOfBuckets];
+  int64 samples_[kNumberOfLanes];
+};
+
+}  // namespace node
+
+#endif  // NODE_SERVICE_PRIORITY_LANES_H_
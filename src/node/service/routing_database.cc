@@ -11,6 +11,20 @@
 
 namespace node {
 
+const char* RouteTransportToString(RouteTransport transport) {
+  switch (transport) {
+    case kTcpTransport:
+      return "tcp";
+
+    case kIpcTransport:
+      return "ipc";
+
+    case kInProcessTransport:
+      return "inproc";
+  }
+  return "unknown";
+}
+
 RoutingDatabase::RoutingDatabase()
   : db_(new sql::Connection()) {
 }
@@ -39,11 +53,14 @@ bool RoutingDatabase::Open() {
   return true;
 }
 
-bool RoutingDatabase::AddRoute(int service_id, const std::string& address) {
+bool RoutingDatabase::AddRoute(int service_id, const std::string& address,
+  RouteTransport transport) {
   sql::Statement s(db_->GetUniqueStatement(
-    "INSERT INTO routes(service_id, address) VALUES(?, ?)"));
+    "INSERT OR REPLACE INTO routes(service_id, address, transport) "
+    "VALUES(?, ?, ?)"));
   s.BindInt(0, service_id);
   s.BindBlob(1, address.data(), address.size());
+  s.BindInt(2, transport);
   return s.Run();
 }
 
@@ -54,9 +71,19 @@ bool RoutingDatabase::RemoveRoute(int service_id) {
   return s.Run();
 }
 
+bool RoutingDatabase::RemoveRoute(int service_id,
+  const std::string& address) {
+  sql::Statement s(db_->GetUniqueStatement(
+    "DELETE FROM routes WHERE service_id = ? AND address = ?"));
+  s.BindInt(0, service_id);
+  s.BindBlob(1, address.data(), address.size());
+  return s.Run();
+}
+
 bool RoutingDatabase::GetRoute(int service_id, std::string* address) {
   sql::Statement s(db_->GetCachedStatement(SQL_FROM_HERE,
-    "SELECT address FROM routes WHERE service_id = ?"));
+    "SELECT address FROM routes WHERE service_id = ? LIMIT 1"));
+  s.BindInt(0, service_id);
   if (s.Step()) {
     address->swap(s.ColumnString(0));
     return true;
@@ -64,11 +91,25 @@ bool RoutingDatabase::GetRoute(int service_id, std::string* address) {
   return false;
 }
 
+bool RoutingDatabase::GetServices(const std::string& address,
+  std::vector<int>* service_ids) {
+  DCHECK(service_ids);
+  sql::Statement s(db_->GetCachedStatement(SQL_FROM_HERE,
+    "SELECT service_id FROM routes WHERE address = ?"));
+  s.BindBlob(0, address.data(), address.size());
+  while (s.Step()) {
+    service_ids->push_back(s.ColumnInt(0));
+  }
+  return !service_ids->empty();
+}
+
 bool RoutingDatabase::InitRoutesTable() {
   if (!db_->DoesTableExist("routes")) {
     if (!db_->Execute("CREATE TABLE routes ("
-                      "service_id INTEGER PRIMARY KEY,"
-                      "address BLOB NOT NULL)")) {
+                      "service_id INTEGER NOT NULL,"
+                      "address BLOB NOT NULL,"
+                      "transport INTEGER NOT NULL,"
+                      "PRIMARY KEY(service_id, address))")) {
       LOG(WARNING) << db_->GetErrorMessage();
       return false;
     }
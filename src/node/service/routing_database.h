@@ -7,6 +7,7 @@
 #pragma once
 
 #include <string>
+#include <vector>
 
 #include <base/memory/scoped_ptr.h>
 
@@ -16,6 +17,23 @@ class Connection;
 
 namespace node {
 
+// The transports used by the routes to reach the services.
+enum RouteTransport {
+  // The service is reached through the TCP endpoint of the message channel.
+  kTcpTransport = 1,
+
+  // The service is reached through the ipc:// endpoint of the message
+  // channel.
+  kIpcTransport = 2,
+
+  // The service lives in the node process and is reached without going
+  // through the message channel.
+  kInProcessTransport = 3
+};
+
+// Returns a human readable name for |transport|.
+const char* RouteTransportToString(RouteTransport transport);
+
 // A in-memory sql database used to store the routes to the running services.
 class RoutingDatabase {
  public:
@@ -27,19 +45,32 @@ class RoutingDatabase {
   bool Open();
 
   // Associates the |address| with the service which ID is |service_id|.
-  // Returns true when the association is successfully performed; otherwise,
-  // false.
-  bool AddRoute(int service_id, const std::string& address);
+  // |transport| is the transport used to reach |address|. A service could
+  // be reached through several addresses, one for each of its running
+  // instances. Returns true when the association is successfully
+  // performed; otherwise, false.
+  bool AddRoute(int service_id, const std::string& address,
+    RouteTransport transport);
 
-  // Removes the service associated with the ID |service_id| from the routing
-  // table. Returns true when the entry is successfully removed, false
-  // otherwise.
+  // Removes the routes to all the instances of the service associated with
+  // the ID |service_id| from the routing table. Returns true when the
+  // entries are successfully removed, false otherwise.
   bool RemoveRoute(int service_id);
 
-  // Gets the route address for the service associated with |service_id|.
-  // Returns true when a route exists; otherwise, false.
+  // Removes the route to the instance of the service associated with the ID
+  // |service_id| whose address is |address|.
+  bool RemoveRoute(int service_id, const std::string& address);
+
+  // Gets the route address for one of the instances of the service
+  // associated with |service_id|. Returns true when a route exists;
+  // otherwise, false.
   bool GetRoute(int service_id, std::string* address);
 
+  // Gets the IDs of the services that has an instance whose address is
+  // |address|, storing them into |service_ids|. Returns true when at least
+  // one service is found; otherwise, false.
+  bool GetServices(const std::string& address, std::vector<int>* service_ids);
+
  private:
   // Creates the routes table, returning true if the table already exists or
   // was successfully created.
@@ -0,0 +1,152 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+
+#include "node/service/routing_snapshot.h"
+
+#include <base/logging.h>
+
+namespace node {
+
+RoutingSnapshot::RoutingSnapshot(ServiceTable* services)
+  : version_(1),
+    services_(services) {
+  DCHECK(services);
+}
+
+RoutingSnapshot::RoutingSnapshot(const RoutingSnapshot* previous)
+  : version_(previous->version_ + 1),
+    services_(previous->services_),
+    routes_(previous->routes_),
+    service_versions_(previous->service_versions_),
+    fact_versions_(previous->fact_versions_) {
+}
+
+RoutingSnapshot::~RoutingSnapshot() {
+}
+
+void RoutingSnapshot::SetServices(ServiceTable* services,
+  const std::vector<uint32>& fact_hashes,
+  const std::vector<int>& service_ids) {
+  DCHECK(services);
+  services_ = services;
+  for (size_t i = 0; i < fact_hashes.size(); ++i) {
+    fact_versions_[fact_hashes[i]] = version_;
+  }
+  for (size_t i = 0; i < service_ids.size(); ++i) {
+    service_versions_[service_ids[i]] = version_;
+  }
+}
+
+void RoutingSnapshot::AddRoute(int service_id, const std::string& address,
+  RoutingPolicy policy) {
+  // The load of the instances that was already running is kept, and so are
+  // their places on the hash ring.
+  scoped_refptr<ServiceRoutes>& previous = routes_[service_id];
+  scoped_refptr<ServiceRoutes> service(
+    new ServiceRoutes(policy, previous.get()));
+  if (!service->Find(address)) {
+    service->Add(new RouteStats(address));
+  }
+  previous = service;
+  service_versions_[service_id] = version_;
+}
+
+void RoutingSnapshot::RemoveRoute(int service_id) {
+  routes_.erase(service_id);
+  service_versions_[service_id] = version_;
+}
+
+void RoutingSnapshot::RemoveRoute(int service_id,
+  const std::string& address) {
+  std::map<int, scoped_refptr<ServiceRoutes> >::iterator previous =
+    routes_.find(service_id);
+  if (previous == routes_.end() || !previous->second->Find(address)) {
+    return;
+  }
+
+  scoped_refptr<ServiceRoutes> service(
+    new ServiceRoutes(previous->second->policy(), previous->second.get()));
+  service->Remove(address);
+  if (service->size()) {
+    previous->second = service;
+  } else {
+    routes_.erase(previous);
+  }
+  service_versions_[service_id] = version_;
+}
+
+void RoutingSnapshot::Resolve(const std::vector<uint32>& fact_hashes,
+  ResolvedRoutes* routes) const {
+  DCHECK(routes);
+  routes->routes.clear();
+  routes->services.clear();
+  routes->balanced = false;
+  routes->service_ids.clear();
+  routes->fact_hashes = fact_hashes;
+  routes->version = version_;
+
+  // The services that are not running are remembered too, so the routes
+  // are resolved again when they start.
+  ServicesMetadataSet services;
+  services_->Find(fact_hashes, &services);
+  for (ServicesMetadataSet::const_iterator service = services.begin();
+    service != services.end(); ++service) {
+    int service_id = service->get()->service_id();
+    routes->service_ids.push_back(service_id);
+    std::map<int, scoped_refptr<ServiceRoutes> >::const_iterator route =
+      routes_.find(service_id);
+    if (route == routes_.end()) {
+      continue;
+    }
+
+    ServiceRoutes* instances = route->second.get();
+    routes->services.push_back(instances);
+    for (size_t i = 0; i < instances->size(); ++i) {
+      routes->routes.push_back(instances->instance(i)->address());
+    }
+    routes->balanced = routes->balanced ||
+      instances->policy() != kBroadcastRouting;
+  }
+}
+
+bool RoutingSnapshot::Validate(ResolvedRoutes* routes) const {
+  DCHECK(routes);
+  if (routes->version == version_) {
+    return true;
+  }
+
+  for (size_t i = 0; i < routes->service_ids.size(); ++i) {
+    std::map<int, int64>::const_iterator changed =
+      service_versions_.find(routes->service_ids[i]);
+    if (changed != service_versions_.end() &&
+      changed->second > routes->version) {
+      return false;
+    }
+  }
+
+  // A service that has one of the facts could have been registered.
+  for (size_t i = 0; i < routes->fact_hashes.size(); ++i) {
+    std::map<uint32, int64>::const_iterator changed =
+      fact_versions_.find(routes->fact_hashes[i]);
+    if (changed != fact_versions_.end() &&
+      changed->second > routes->version) {
+      return false;
+    }
+  }
+
+  routes->version = version_;
+  return true;
+}
+
+bool RoutingSnapshot::HasAddress(const std::string& address) const {
+  for (std::map<int, scoped_refptr<ServiceRoutes> >::const_iterator i =
+    routes_.begin(); i != routes_.end(); ++i) {
+    if (i->second->Find(address)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace node
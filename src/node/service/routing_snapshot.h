@@ -0,0 +1,124 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+
+#ifndef NODE_SERVICE_ROUTING_SNAPSHOT_H_
+#define NODE_SERVICE_ROUTING_SNAPSHOT_H_
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <base/basictypes.h>
+#include <base/memory/ref_counted.h>
+
+#include "node/service/load_balancer.h"
+#include "node/service/services_database.h"
+
+namespace node {
+
+typedef std::vector<std::string> RouteSet;
+
+// The routes that was resolved for a set of facts, the hashes of the facts
+// and the IDs of the services that they was resolved from, and the version
+// of the snapshot that they are known to be valid for. The entry is valid
+// even if no route was found.
+//
+// |routes| has the addresses of all the instances of the running services,
+// which are the routes of a broadcast request, and |services| has the
+// instances of each running service, so one of them could be chosen.
+// |balanced| is true if some of the services does not broadcast the
+// requests by default.
+struct ResolvedRoutes {
+  ResolvedRoutes() : balanced(false), version(0) {}
+
+  RouteSet routes;
+  std::vector<scoped_refptr<ServiceRoutes> > services;
+  bool balanced;
+  std::vector<uint32> fact_hashes;
+  std::vector<int> service_ids;
+  int64 version;
+};
+
+// A RoutingSnapshot is an immutable version of the routing state: the
+// registered services, the index of their facts and the routes to the
+// running instances of each service. A new snapshot is built by the writers
+// for each change and published as a whole, so the readers always see a
+// consistent state without taking any lock.
+//
+// Each snapshot remembers the version at which each service and fact was
+// last changed, so the routes that was resolved from an older snapshot could
+// be validated against a newer one instead of resolved again.
+class RoutingSnapshot {
+ public:
+  // Creates the first snapshot, which has the services of |services| and no
+  // routes.
+  explicit RoutingSnapshot(ServiceTable* services);
+
+  // Creates the version that follows |previous|, which starts as a copy of
+  // it.
+  explicit RoutingSnapshot(const RoutingSnapshot* previous);
+
+  ~RoutingSnapshot();
+
+  int64 version() const { return version_; }
+
+  // The methods below changes the snapshot and must be called only before
+  // it is published.
+
+  // Replaces the registered services. |fact_hashes| are the hashes of the
+  // facts of the services that was registered or unregistered, and
+  // |service_ids| are the IDs of the services that was unregistered.
+  void SetServices(ServiceTable* services,
+    const std::vector<uint32>& fact_hashes,
+    const std::vector<int>& service_ids);
+
+  // Adds the route to an instance of the service whose ID is |service_id|,
+  // whose address is |address|. |policy| is the policy that chooses between
+  // the instances of the service from now on.
+  void AddRoute(int service_id, const std::string& address,
+    RoutingPolicy policy);
+
+  // Removes the routes to all the instances of the service whose ID is
+  // |service_id|, or only the one whose address is |address|.
+  void RemoveRoute(int service_id);
+  void RemoveRoute(int service_id, const std::string& address);
+
+  // The methods below could be called by any thread once the snapshot is
+  // published.
+
+  // Resolves the routes of the services that has all the facts whose hashes
+  // are |fact_hashes| into |routes|.
+  void Resolve(const std::vector<uint32>& fact_hashes,
+    ResolvedRoutes* routes) const;
+
+  // Returns true if |routes| are still valid for this snapshot, which is
+  // the case when none of their facts and services has changed since they
+  // was resolved. The version of |routes| is updated so the next validation
+  // is cheap.
+  bool Validate(ResolvedRoutes* routes) const;
+
+  // Returns true if an instance of some service is reached through
+  // |address|.
+  bool HasAddress(const std::string& address) const;
+
+ private:
+  int64 version_;
+  scoped_refptr<ServiceTable> services_;
+
+  // The routes to the instances of each running service, keyed by the
+  // service ID. The routes of a service are shared with the snapshots that
+  // was built before it changed.
+  std::map<int, scoped_refptr<ServiceRoutes> > routes_;
+
+  // The versions at which each service and each fact was last changed.
+  std::map<int, int64> service_versions_;
+  std::map<uint32, int64> fact_versions_;
+
+  DISALLOW_COPY_AND_ASSIGN(RoutingSnapshot);
+};
+
+}  // namespace node
+
+#endif  // NODE_SERVICE_ROUTING_SNAPSHOT_H_
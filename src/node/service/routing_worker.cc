@@ -0,0 +1,312 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+
+#include "node/service/routing_worker.h"
+
+#include <string.h>
+
+#include <base/logging.h>
+#include <ruby_protos.pb.h>
+
+#include "node/zeromq/context.h"
+#include "node/zeromq/message.h"
+#include "node/service/message_router.h"
+#include "node/service/packet_channel.h"
+#include "node/service/packet_deadline.h"
+#include "node/service/packet_listener.h"
+#include "node/service/packet_view.h"
+#include "node/service/priority_lanes.h"
+#include "node/service/shared_memory_channel.h"
+
+namespace node {
+
+namespace rp = ::ruby::protocol;
+
+namespace {
+
+// The maximum number of messages that are received from the frontend at
+// once.
+const int kReceiveBatchSize = 64;
+
+// The envelope of a message that is sent over the message channel:
+//   [DESTINATION ADDRESS][LANE OR EMPTY FRAME][DATA]
+// The frontend replaces the lane frame by an empty frame.
+const size_t kEnvelopeSize = 3;
+
+}  // namespace
+
+RoutingWorker::RoutingWorker(zmq::Context* context, MessageRouter* router,
+  PacketChannel* frontend_channel,
+  SharedMemoryChannelMap* shared_memory_channels,
+  volatile base::subtle::Atomic32* expired_count)
+  : context_(context),
+    router_(router),
+    frontend_channel_(frontend_channel),
+    shared_memory_channels_(shared_memory_channels),
+    started_(false),
+    stop_requested_(false),
+    expired_count_(expired_count) {
+  DCHECK(context);
+  DCHECK(router);
+  DCHECK(frontend_channel);
+  DCHECK(expired_count);
+}
+
+RoutingWorker::~RoutingWorker() {
+  DCHECK(!started_);
+}
+
+bool RoutingWorker::Start(const std::string& input_endpoint,
+  const std::string& output_endpoint) {
+  DCHECK(!started_);
+  input_endpoint_ = input_endpoint;
+  output_endpoint_ = output_endpoint;
+  stop_requested_ = false;
+  if (!base::PlatformThread::Create(0, this, &thread_)) {
+    LOG(ERROR) << "The routing worker thread could not be created.";
+    return false;
+  }
+  started_ = true;
+  return true;
+}
+
+void RoutingWorker::Stop() {
+  if (!started_) {
+    return;
+  }
+
+  // The worker could have not created its poller yet, or could have
+  // already destroyed it.
+  {
+    base::AutoLock lock(poller_lock_);
+    stop_requested_ = true;
+    if (poller_.get()) {
+      poller_->Quit();
+    }
+  }
+  base::PlatformThread::Join(thread_);
+  started_ = false;
+}
+
+void RoutingWorker::ThreadMain() {
+  {
+    base::AutoLock lock(poller_lock_);
+    poller_.reset(new zmq::Poller(context_));
+    if (stop_requested_) {
+      poller_->Quit();
+    }
+  }
+
+  input_.reset(new zmq::Socket(context_->CreateSocket(zmq::kExclusivePair)));
+  output_.reset(new zmq::Socket(context_->CreateSocket(zmq::kPush)));
+
+  // The routed messages that was not delivered to the frontend when the node
+  // is stopping are discarded.
+  output_->SetLinger(0);
+  if (input_->Connect(input_endpoint_.c_str()) &&
+    output_->Connect(output_endpoint_.c_str())) {
+    poller_->WatchSocket(input_.get(), zmq::kPollIn, this);
+    poller_->Run();
+    poller_->StopWatchingSocket(input_.get());
+  }
+
+  // The sockets should be closed by the thread that used them.
+  batch_.Clear();
+  frames_.clear();
+  input_.reset();
+  output_.reset();
+
+  base::AutoLock lock(poller_lock_);
+  poller_.reset();
+}
+
+void RoutingWorker::OnSocketReady(zmq::Socket* socket, int events) {
+  if (!socket->ReceiveBatch(kReceiveBatchSize, &batch_, zmq::kNoBlock)) {
+    batch_.Clear();
+    return;
+  }
+
+  received_time_ = base::TimeTicks::Now();
+  for (size_t i = 0; i < batch_.size(); ++i) {
+    RouteMessage(batch_.frames(i), batch_.frames_count(i));
+  }
+  batch_.Clear();
+
+  // Hand all the envelopes of the batch to the frontend at once.
+  size_t envelopes_count = frames_.size() / kEnvelopeSize;
+  if (envelopes_count) {
+    std::vector<zmq::Envelope> envelopes(envelopes_count);
+    for (size_t i = 0; i < envelopes_count; ++i) {
+      envelopes[i] = zmq::Envelope(&frames_[i * kEnvelopeSize], kEnvelopeSize);
+    }
+    output_->SendBatch(&envelopes[0], envelopes_count, zmq::kNoFlags);
+  }
+  frames_.clear();
+}
+
+void RoutingWorker::RouteMessage(
+  const scoped_refptr<zmq::Message>* message_parts, size_t no_of_parts) {
+  if (no_of_parts % kEnvelopeSize != 0) {
+    LOG (WARNING) << "Received message has a invalid number of parts."
+              << "No of parts: " << no_of_parts;
+    return;
+  }
+
+  // The message format is:
+  //   [sender id][empty frame][message]
+  // The workers drop the expired packets without notifying their senders.
+  zmq::Message* message = message_parts[2].get();
+  base::TimeTicks deadline;
+  PacketView view;
+  if (view.Parse(message->mutable_data(), message->size())) {
+    if (!CheckPacketDeadline(&view, received_time_, &deadline)) {
+      base::subtle::NoBarrier_AtomicIncrement(expired_count_, 1);
+      return;
+    }
+    std::string peer(message_parts[0]->data());
+    RoutedRequests requests;
+    RouteSet destinations = router_->GetRoutes(peer, &view, &requests);
+    RoutePacket(destinations, requests, peer, &view, message, deadline);
+    return;
+  }
+
+  rp::RubyMessagePacket packet;
+  if (!packet.ParseFromArray(message->mutable_data(), message->size())) {
+    LOG (WARNING) << "The received message is not a valid ruby message packet.";
+    return;
+  }
+
+  if (!packet.has_message()) {
+    LOG(WARNING) << "Received a packet with no message associated.";
+    return;
+  }
+
+  if (!CheckPacketDeadline(&packet, received_time_, &deadline)) {
+    base::subtle::NoBarrier_AtomicIncrement(expired_count_, 1);
+    return;
+  }
+
+  RoutedRequests requests;
+  RouteSet destinations = router_->GetRoutes(message_parts[0]->data(),
+    &packet, &requests);
+
+  // The packet is serialized only once, for all the destinations, after the
+  // lane that could change it is chosen.
+  PacketLane lane = GetReceivedPacketLane(&packet);
+  scoped_refptr<zmq::Message> frame;
+  for (RouteSet::const_iterator destination = destinations.begin();
+    destination != destinations.end(); ++destination) {
+    RoutedRequest* request = FindRoutedRequest(requests, *destination);
+    if (IsFrontendRoute(*destination)) {
+      PostToFrontend(*destination, message_parts[0]->data(), packet,
+        request);
+      continue;
+    }
+
+    if (!frame) {
+      int packet_size = packet.ByteSize();
+      frame = new zmq::Message(packet_size);
+      packet.SerializeToArray(frame->mutable_data(), packet_size);
+      AppendEnvelope(*destination, frame, lane, deadline, request);
+      continue;
+    }
+
+    // A destination whose frame could not be shared is skipped.
+    scoped_refptr<zmq::Message> shared = frame->Share();
+    if (shared) {
+      AppendEnvelope(*destination, shared, lane, deadline, request);
+    }
+  }
+}
+
+void RoutingWorker::RoutePacket(const RouteSet& destinations,
+  const RoutedRequests& requests, const std::string& peer, PacketView* view,
+  zmq::Message* frame, base::TimeTicks deadline) {
+  // A packet that was not modified is forwarded in the frame it was
+  // received with, the others are serialized only once.
+  scoped_refptr<zmq::Message> packet_frame;
+  scoped_ptr<rp::RubyMessagePacket> packet;
+  PacketLane lane = GetReceivedPacketLane(view);
+  for (RouteSet::const_iterator destination = destinations.begin();
+    destination != destinations.end(); ++destination) {
+    RoutedRequest* request = FindRoutedRequest(requests, *destination);
+    if (IsFrontendRoute(*destination)) {
+      if (!packet.get()) {
+        packet.reset(new rp::RubyMessagePacket());
+        if (!view->ParsePacket(packet.get())) {
+          LOG (WARNING) << "The received message is not a valid ruby "
+                        << "message packet.";
+          return;
+        }
+      }
+      PostToFrontend(*destination, peer, *packet, request);
+      continue;
+    }
+
+    if (packet_frame) {
+      scoped_refptr<zmq::Message> shared = packet_frame->Share();
+      if (shared) {
+        AppendEnvelope(*destination, shared, lane, deadline, request);
+      }
+      continue;
+    }
+
+    packet_frame = frame;
+    if (view->modified()) {
+      packet_frame = new zmq::Message(view->ByteSize());
+      view->SerializeToArray(packet_frame->mutable_data());
+    }
+    AppendEnvelope(*destination, packet_frame, lane, deadline, request);
+  }
+}
+
+void RoutingWorker::PostToFrontend(const std::string& destination,
+  const std::string& peer, const rp::RubyMessagePacket& packet,
+  RoutedRequest* request) {
+  // The frontend attributes the packets that are sent to the node to their
+  // sender, which is not known to it otherwise.
+  rp::RubyMessagePacket* copy = new rp::RubyMessagePacket(packet);
+  if (IsNodeControlRoute(destination)) {
+    copy->mutable_message()->set_sender(peer);
+  }
+  frontend_channel_->Post(destination, copy, request);
+}
+
+void RoutingWorker::AppendEnvelope(const std::string& destination,
+  const scoped_refptr<zmq::Message>& data, PacketLane lane,
+  base::TimeTicks deadline, RoutedRequest* request) {
+  scoped_refptr<zmq::Message> address(
+    new zmq::Message(static_cast<int>(destination.size())));
+  memcpy(address->mutable_data(), destination.data(), destination.size());
+
+  // Most of the packets use the normal lane, have no deadline and carry no
+  // balanced request, which needs no frame.
+  scoped_refptr<zmq::Message> info_frame;
+  if (lane != kNormalLane || !deadline.is_null() || request) {
+    RoutedPacketInfo info;
+    info.deadline = deadline.ToInternalValue();
+    info.lane = static_cast<uint8>(lane);
+    info.request = request;
+    if (request) {
+      request->AddRef();
+    }
+    info_frame = new zmq::Message(sizeof(info));
+    memcpy(info_frame->mutable_data(), &info, sizeof(info));
+  }
+
+  frames_.push_back(address);
+  frames_.push_back(info_frame);
+  frames_.push_back(data);
+}
+
+bool RoutingWorker::IsFrontendRoute(const std::string& destination) {
+  if (IsNodeControlRoute(destination) ||
+    PacketListener::IsListenerRoute(destination)) {
+    return true;
+  }
+  return shared_memory_channels_ &&
+    shared_memory_channels_->Find(destination).get() != NULL;
+}
+
+}  // namespace node
@@ -0,0 +1,172 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+
+#ifndef NODE_SERVICE_ROUTING_WORKER_H_
+#define NODE_SERVICE_ROUTING_WORKER_H_
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <base/atomicops.h>
+#include <base/basictypes.h>
+#include <base/compiler_specific.h>
+#include <base/memory/ref_counted.h>
+#include <base/memory/scoped_ptr.h>
+#include <base/synchronization/lock.h>
+#include <base/threading/platform_thread.h>
+#include <base/time.h>
+
+#include "node/service/load_balancer.h"
+#include "node/service/priority_lanes.h"
+#include "node/zeromq/poller.h"
+#include "node/zeromq/socket.h"
+
+namespace ruby {
+namespace protocol {
+class RubyMessagePacket;
+}
+}
+
+namespace zmq {
+class Context;
+}
+
+namespace node {
+class MessageRouter;
+class PacketChannel;
+class PacketView;
+class SharedMemoryChannelMap;
+
+// The frame that a routing worker puts between the destination and the
+// packet of the envelopes that it pushes to the frontend, when the packet is
+// not carried by the normal lane, has a deadline or carries a request to an
+// instance of a balanced service. It is copied as is, since the frontend
+// runs in the same process.
+struct RoutedPacketInfo {
+  // The internal value of the time the packet expires, or zero.
+  int64 deadline;
+  uint8 lane;
+
+  // The request that the packet carries, or NULL. The worker hands a
+  // reference of it over to the frontend, which releases it.
+  RoutedRequest* request;
+};
+
+// A RoutingWorker parses and routes the messages received by the message
+// receiver in a dedicated thread, so the routing of the messages could use
+// more than one core.
+//
+// The message receiver is the frontend of a pool of workers. It forwards
+// each message it receives from the message channel to a worker through an
+// inproc PAIR socket, choosing the worker by hashing the sender identity, so
+// the messages of a sender are always routed in order by the same worker.
+// The worker parses the packet, asks the MessageRouter for its routes,
+// serializes it and pushes the resulting envelopes to a PUSH socket that is
+// connected to the frontend, which sends them through the message channel.
+// The lane and the deadline of each packet travel with it, so the frontend
+// sends the packets that are still useful through the right lane.
+// zeromq moves the inproc messages between threads without copying them.
+//
+// The destinations that must be handled by the frontend thread, such as the
+// node control route, the packet listener connections and the hosts that
+// use shared memory, are posted to the frontend packet channel instead.
+class RoutingWorker
+  : public base::PlatformThread::Delegate,
+    public zmq::Poller::Watcher {
+ public:
+  // |frontend_channel| receives the packets whose destinations could be
+  // reached only by the frontend. |shared_memory_channels| could be NULL.
+  // |expired_count| is incremented for each packet that the worker drops
+  // because it has expired, and could be shared by many workers.
+  RoutingWorker(zmq::Context* context, MessageRouter* router,
+    PacketChannel* frontend_channel,
+    SharedMemoryChannelMap* shared_memory_channels,
+    volatile base::subtle::Atomic32* expired_count);
+  virtual ~RoutingWorker();
+
+  // Starts the worker thread. The worker receives messages from the PAIR
+  // socket bound to |input_endpoint| and pushes the routed envelopes to the
+  // PULL socket bound to |output_endpoint|. Both endpoints must be bound
+  // before the worker is started.
+  bool Start(const std::string& input_endpoint,
+    const std::string& output_endpoint);
+
+  // Stops the worker thread and waits for it to finish.
+  void Stop();
+
+  // base::PlatformThread::Delegate implementation.
+  virtual void ThreadMain() OVERRIDE;
+
+  // zmq::Poller::Watcher implementation.
+  virtual void OnSocketReady(zmq::Socket* socket, int events) OVERRIDE;
+
+ private:
+  // Routes the message whose |no_of_parts| parts is pointed by
+  // |message_parts|, appending the envelopes that should be sent to the
+  // message channel to |frames_|.
+  void RouteMessage(const scoped_refptr<zmq::Message>* message_parts,
+    size_t no_of_parts);
+
+  // Routes the packet scanned by |view|, which was received in |frame| from
+  // |peer| and expires at |deadline|, to |destinations|. The packet is
+  // parsed only if it is routed to the frontend.
+  void RoutePacket(const std::vector<std::string>& destinations,
+    const RoutedRequests& requests, const std::string& peer,
+    PacketView* view, zmq::Message* frame, base::TimeTicks deadline);
+
+  // Posts a copy of |packet|, which was received from |peer|, to the
+  // frontend, which dispatches it to |destination|. |request| is the request
+  // that the packet carries to |destination|, or NULL.
+  void PostToFrontend(const std::string& destination, const std::string& peer,
+    const ruby::protocol::RubyMessagePacket& packet, RoutedRequest* request);
+
+  // Appends to |frames_| the envelope that sends |data| to |destination|
+  // through |lane|, unless it is sent after |deadline|. |request| is the
+  // request that the packet carries to |destination|, or NULL.
+  void AppendEnvelope(const std::string& destination,
+    const scoped_refptr<zmq::Message>& data, PacketLane lane,
+    base::TimeTicks deadline, RoutedRequest* request);
+
+  // Returns true if |destination| could be reached only by the frontend.
+  bool IsFrontendRoute(const std::string& destination);
+
+  zmq::Context* context_;
+  MessageRouter* router_;
+  PacketChannel* frontend_channel_;
+  SharedMemoryChannelMap* shared_memory_channels_;
+
+  std::string input_endpoint_;
+  std::string output_endpoint_;
+  base::PlatformThreadHandle thread_;
+  bool started_;
+
+  // The poller is created and destroyed by the worker thread, since its
+  // wakeup socket is read by that thread. |poller_lock_| protects it from
+  // Stop(), which quits it from the frontend thread.
+  base::Lock poller_lock_;
+  scoped_ptr<zmq::Poller> poller_;
+  bool stop_requested_;
+
+  // These are used only by the worker thread.
+  scoped_ptr<zmq::Socket> input_;
+  scoped_ptr<zmq::Socket> output_;
+  zmq::MessageBatch batch_;
+
+  // The time the current batch was received and the counter of the packets
+  // that was dropped because they have expired, which is owned by the
+  // frontend.
+  base::TimeTicks received_time_;
+  volatile base::subtle::Atomic32* expired_count_;
+
+  // The frames of the envelopes that was routed from the current batch.
+  // Every envelope has the same number of frames.
+  std::vector<scoped_refptr<zmq::Message> > frames_;
+
+  DISALLOW_COPY_AND_ASSIGN(RoutingWorker);
+};
+
+}  // namespace node
+
+#endif  // NODE_SERVICE_ROUTING_WORKER_H_
@@ -4,6 +4,7 @@
 
 #include <winsock2.h>
 #include <windows.h>
+#include <set>
 #include <vector>
 
 #include "node/service/ruby_service.h"
@@ -16,6 +17,7 @@
 #include <base/logging.h>
 #include <base/memory/ref_counted.h>
 #include <base/string_number_conversions.h>
+#include <base/string_split.h>
 #include <base/string_util.h>
 #include <base/threading/platform_thread.h>
 #include <sql/connection.h>
@@ -23,17 +25,155 @@
 #include "node/zeromq/socket.h"
 #include "node/zeromq/context.h"
 #include "node/zeromq/diagnostic_error_delegate.h"
+#include "node/service/admission_control.h"
 #include "node/service/constants.h"
 #include "node/service/ruby_switches.h"
 #include "node/service/message_router.h"
 #include "node/service/message_receiver.h"
 #include "node/service/node_message_loop.h"
+#include "node/service/outbound_mailboxes.h"
 #include "node/service/constants.h"
 #include "node/service/services_database.h"
 #include "node/service/routing_database.h"
+#include "node/service/shared_memory_channel.h"
 
 namespace node {
 
+namespace {
+
+// Reads the value of the switch |name| as a 64-bit integer. Returns false if
+// the switch is not present or its value is not a valid integer.
+bool GetInt64Switch(const CommandLine& switches, const char* name,
+  int64* value) {
+  if (!switches.HasSwitch(name)) {
+    return false;
+  }
+
+  std::string switch_value = switches.GetSwitchValueASCII(name);
+  if (!base::StringToInt64(switch_value, value)) {
+    LOG(WARNING) << "Failed to parse the value of the switch " << name
+                 << ": " << switch_value << ". Using the default value.";
+    return false;
+  }
+  return true;
+}
+
+// Returns true if |value|, the value of the switch |name|, is within the
+// range [|min_value|, |max_value|]. Logs an error otherwise.
+bool CheckSwitchRange(const char* name, int64 value, int64 min_value,
+  int64 max_value) {
+  if (value < min_value || value > max_value) {
+    LOG(ERROR) << "The value of the switch " << name << " should be between "
+               << min_value << " and " << max_value << ": " << value;
+    return false;
+  }
+  return true;
+}
+
+// Gets the options of the message channel socket, using the values from the
+// command line when they are specified. Returns false if some value is out
+// of the range accepted by zeromq.
+bool GetMessageChannelOptions(const CommandLine& switches,
+  zmq::SocketOptions* options) {
+  DCHECK(options);
+  options->set_high_water_mark(node::kMessageChannelHighWaterMark);
+  options->set_linger(node::kMessageChannelLinger);
+
+  int64 value;
+  if (GetInt64Switch(switches, switches::kMessageChannelHighWaterMark,
+    &value)) {
+    if (!CheckSwitchRange(switches::kMessageChannelHighWaterMark, value, 0,
+      kint64max)) {
+      return false;
+    }
+
+    // The hosts that announce services are sent up to kInitialCredits
+    // packets before they grant more, which a lower mark would drop.
+    if (value && value < node::kInitialCredits) {
+      LOG(ERROR) << "The value of the switch "
+                 << switches::kMessageChannelHighWaterMark
+                 << " should be zero or at least " << node::kInitialCredits
+                 << ": " << value;
+      return false;
+    }
+    options->set_high_water_mark(value);
+  }
+
+  // A negative linger means to wait for the pending messages forever, and
+  // zeromq accepts only -1 for that.
+  if (GetInt64Switch(switches, switches::kMessageChannelLinger, &value)) {
+    if (!CheckSwitchRange(switches::kMessageChannelLinger, value, -1,
+      kint32max)) {
+      return false;
+    }
+    options->set_linger(static_cast<int>(value));
+  }
+  if (GetInt64Switch(switches, switches::kMessageChannelSendBuffer, &value)) {
+    if (!CheckSwitchRange(switches::kMessageChannelSendBuffer, value, 0,
+      kint64max)) {
+      return false;
+    }
+    options->set_send_buffer_size(value);
+  }
+  if (GetInt64Switch(switches, switches::kMessageChannelReceiveBuffer,
+    &value)) {
+    if (!CheckSwitchRange(switches::kMessageChannelReceiveBuffer, value, 0,
+      kint64max)) {
+      return false;
+    }
+    options->set_receive_buffer_size(value);
+  }
+  return true;
+}
+
+// Gets the number of zeromq I/O threads, using the value from the command
+// line when it is specified.
+int GetIoThreads(const CommandLine& switches) {
+  int64 io_threads;
+  if (GetInt64Switch(switches, switches::kIoThreads, &io_threads) &&
+    io_threads > 0) {
+    if (io_threads > zmq::Context::kMaxIoThreads) {
+      LOG(WARNING) << "The number of I/O threads is limited to "
+                   << zmq::Context::kMaxIoThreads;
+      return zmq::Context::kMaxIoThreads;
+    }
+    return static_cast<int>(io_threads);
+  }
+  return zmq::Context::GetDefaultIoThreads();
+}
+
+// Gets the I/O thread policy from the command line.
+zmq::Context::IoThreadPolicy GetIoThreadPolicy(const CommandLine& switches) {
+  std::string policy = switches.GetSwitchValueASCII(switches::kIoThreadPolicy);
+  if (policy == "round-robin") {
+    return zmq::Context::kRoundRobinIoThreads;
+  }
+  if (!policy.empty() && policy != "shared") {
+    LOG(WARNING) << "Unknown I/O thread policy: " << policy
+                 << ". Using the shared policy.";
+  }
+  return zmq::Context::kSharedIoThreads;
+}
+
+// Gets the mailbox overflow policy from the command line.
+MailboxOverflowPolicy GetMailboxOverflowPolicy(const CommandLine& switches) {
+  std::string policy =
+    switches.GetSwitchValueASCII(switches::kMailboxOverflowPolicy);
+  if (policy == "drop-oldest") {
+    return kDropOldestPolicy;
+  }
+  if (policy == "reject") {
+    return kRejectToSenderPolicy;
+  }
+  if (!policy.empty() && policy != "drop-newest") {
+    LOG(WARNING) << "Unknown mailbox overflow policy: " << policy
+                 << ". Using the drop-newest policy.";
+  }
+  return kDropNewestPolicy;
+}
+
+}  // namespace
+
 RubyService::RubyService()
   : ServiceBase(node::kRubyServiceName) {
 }
@@ -44,18 +184,16 @@ bool RubyService::OnStart(const std::vector<std::wstring>& arguments) {
   const CommandLine& switches = *CommandLine::ForCurrentProcess();
 
   // Override the default message channel port.
+  int message_channel_port = node::kMessageChannelPort;
   if (switches.HasSwitch(switches::kMessageChannelPort)) {
     std::string value =
       switches.GetSwitchValueASCII(switches::kMessageChannelPort);
-
-    int message_channel_port;
     if (!base::StringToInt(value, &message_channel_port)) {
-      message_channel_port = node::kMessageChannelPort;
-    } else {
       LOG(WARNING) << "Failed to parse the request reply port: "
               << value
               << ". Using the default port: "
               << node::kMessageChannelPort;
+      message_channel_port = node::kMessageChannelPort;
     }
   }
 
@@ -89,10 +227,13 @@ bool RubyService::OnStart(const std::vector<std::wstring>& arguments) {
   // Setup the zmq Context.
   context_.reset(new zmq::Context());
   context_->set_error_delegate(new zmq::DiagnosticErrorDelegate());
-  if (!context_->Open(1)) {
+  context_->set_io_thread_policy(GetIoThreadPolicy(switches));
+  int io_threads = GetIoThreads(switches);
+  if (!context_->Open(io_threads)) {
     NOTREACHED() << "zmq::Context failed to open.";
     return false;
   }
+  LOG(INFO) << "zmq::Context opened with " << io_threads << " I/O threads";
 
   message_router_.reset(
     new MessageRouter(services_db_.get(), routing_db_.get()));
@@ -100,6 +241,133 @@ bool RubyService::OnStart(const std::vector<std::wstring>& arguments) {
     new MessageReceiver(context_.get(), message_router_.get()));
   message_loop_.reset(
     new MessageLoop(context_.get(), message_router_.get(), services_db_.get()));
+  if (switches.HasSwitch(switches::kPartitionFact)) {
+    message_router_->set_partition_fact(
+      switches.GetSwitchValueASCII(switches::kPartitionFact));
+  }
+  message_router_->set_evict_unresponsive(
+    switches.HasSwitch(switches::kEvictUnresponsive));
+
+  zmq::SocketOptions message_channel_options;
+  if (!GetMessageChannelOptions(switches, &message_channel_options)) {
+    LOG(ERROR) << "Invalid message channel options.";
+    return false;
+  }
+  message_receiver_->set_message_channel_port(message_channel_port);
+  message_receiver_->set_message_channel_options(message_channel_options);
+
+  // The ipc endpoint is bound only when the platform supports it or when it
+  // is explicitly specified.
+  std::string ipc_endpoint(node::kMessageChannelIpcEndpoint);
+  if (switches.HasSwitch(switches::kMessageChannelIpcEndpoint)) {
+    ipc_endpoint =
+      switches.GetSwitchValueASCII(switches::kMessageChannelIpcEndpoint);
+  }
+  message_receiver_->set_message_channel_ipc_endpoint(ipc_endpoint);
+
+  int64 packet_listener_port;
+  if (GetInt64Switch(switches, switches::kPacketListenerPort,
+    &packet_listener_port)) {
+    message_receiver_->set_packet_listener_port(
+      static_cast<int>(packet_listener_port));
+  }
+
+  int64 batch_size;
+  if (GetInt64Switch(switches, switches::kRoutingBatchSize, &batch_size) &&
+    batch_size > 0) {
+    if (batch_size > node::kMaxRoutingBatchSize) {
+      LOG(WARNING) << "The routing batch size is limited to "
+                   << node::kMaxRoutingBatchSize;
+      batch_size = node::kMaxRoutingBatchSize;
+    }
+    message_receiver_->set_batch_size(static_cast<int>(batch_size));
+  }
+
+  int64 batch_delay;
+  if (GetInt64Switch(switches, switches::kRoutingBatchDelay, &batch_delay) &&
+    batch_delay > 0) {
+    message_receiver_->set_batch_delay(
+      base::TimeDelta::FromMilliseconds(batch_delay));
+  }
+
+  int64 mailbox_max_messages;
+  if (GetInt64Switch(switches, switches::kMailboxMaxMessages,
+    &mailbox_max_messages) && mailbox_max_messages > 0) {
+    message_receiver_->set_mailbox_max_messages(
+      static_cast<size_t>(mailbox_max_messages));
+  }
+
+  int64 mailbox_max_bytes;
+  if (GetInt64Switch(switches, switches::kMailboxMaxBytes,
+    &mailbox_max_bytes) && mailbox_max_bytes > 0) {
+    message_receiver_->set_mailbox_max_bytes(
+      static_cast<size_t>(mailbox_max_bytes));
+  }
+  message_receiver_->set_mailbox_overflow_policy(
+    GetMailboxOverflowPolicy(switches));
+  message_receiver_->set_notify_expired(
+    switches.HasSwitch(switches::kNotifyExpired));
+
+  // The admission limits could be changed later by a control message.
+  AdmissionControl::Limits admission_limits;
+  int64 admission_rate;
+  if (GetInt64Switch(switches, switches::kAdmissionMessagesRate,
+    &admission_rate) && admission_rate > 0) {
+    admission_limits.messages_per_second = admission_rate;
+  }
+  if (GetInt64Switch(switches, switches::kAdmissionBytesRate,
+    &admission_rate) && admission_rate > 0) {
+    admission_limits.bytes_per_second = admission_rate;
+  }
+  message_receiver_->set_admission_limits(admission_limits);
+  message_receiver_->set_admission_fact(
+    switches.GetSwitchValueASCII(switches::kAdmissionFact));
+
+  std::vector<std::string> admission_control_peers;
+  base::SplitString(
+    switches.GetSwitchValueASCII(switches::kAdmissionControlPeers), ',',
+    &admission_control_peers);
+  std::set<std::string> trusted_peers;
+  for (size_t i = 0; i < admission_control_peers.size(); ++i) {
+    if (!admission_control_peers[i].empty()) {
+      trusted_peers.insert(admission_control_peers[i]);
+    }
+  }
+  message_receiver_->set_admission_control_peers(trusted_peers);
+
+  int64 routing_workers;
+  if (GetInt64Switch(switches, switches::kRoutingWorkers, &routing_workers) &&
+    routing_workers > 0) {
+    if (routing_workers > node::kMaxRoutingWorkers) {
+      LOG(WARNING) << "The number of routing workers is limited to "
+                   << node::kMaxRoutingWorkers;
+      routing_workers = node::kMaxRoutingWorkers;
+    }
+    message_receiver_->set_routing_workers(static_cast<int>(routing_workers));
+  }
+
+  // Bind the message channel before the loops start, so the control loop
+  // advertises only the endpoints that are really available.
+  if (!message_receiver_->Bind()) {
+    LOG(ERROR) << "The message channel could not be bound to the port "
+               << message_channel_port;
+    return false;
+  }
+  message_loop_->set_message_channel_endpoints(message_channel_port,
+    message_receiver_->bound_ipc_endpoint());
+
+  // Large packets could be exchanged with the local hosts through shared
+  // memory.
+  if (!switches.HasSwitch(switches::kDisableSharedMemory)) {
+    shared_memory_channels_.reset(new SharedMemoryChannelMap());
+    message_receiver_->set_shared_memory_channels(
+      shared_memory_channels_.get());
+    message_loop_->set_shared_memory_channels(shared_memory_channels_.get());
+  }
+
+  // The receiver and the control loop exchange packets in-process.
+  message_receiver_->set_control_channel(message_loop_->channel());
+  message_loop_->set_reply_channel(message_receiver_->channel());
 
   service_thread_delegate_.reset(new ServiceThreadDelegate(this));
   if (!base::PlatformThread::Create(
@@ -147,13 +415,21 @@ void RubyService::MessageLoopThreadDelegate::ThreadMain() {
 }
 
 void RubyService::OnStop() {
+  // Quit() and Stop() wakes up the loops, so we does not need to wait for
+  // the next message to arrive.
   message_loop_->Quit();
   message_receiver_->Stop();
-  context_->Close();
 
   if (service_thread_) {
     base::PlatformThread::Join(service_thread_);
   }
+
+  // The context could be terminated only after all of its sockets are
+  // closed, including the ones used by the loops to wake up.
+  message_loop_.reset();
+  message_receiver_.reset();
+  shared_memory_channels_.reset();
+  context_->Close();
 }
 
 RubyService::~RubyService() {
@@ -25,6 +25,7 @@ class MessageReceiver;
 class MessageLoop;
 class ServicesDatabase;
 class RoutingDatabase;
+class SharedMemoryChannelMap;
 
 class RubyService : public ServiceBase {
  public:
@@ -65,6 +66,10 @@ class RubyService : public ServiceBase {
 
   // Store it, because it must outlive the thread.
   scoped_ptr<ServiceThreadDelegate> service_thread_delegate_;
+
+  // The shared memory channels of the local hosts. It must outlive the
+  // message loop and the message receiver.
+  scoped_ptr<SharedMemoryChannelMap> shared_memory_channels_;
   scoped_ptr<MessageLoop> message_loop_;
   scoped_ptr<MessageReceiver> message_receiver_;
   scoped_ptr<zmq::Context> context_;
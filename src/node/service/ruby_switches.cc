@@ -12,9 +12,126 @@ namespace switches {
 // all work out.
 // ---------------------------------------------------------------------------
 
+// Sets the maximum number of bytes per second that the node accepts from
+// each sender, or from each value of the admission fact. The messages above
+// the limit are discarded before they are parsed. If not specified the
+// bytes are not limited. The limits could be changed at runtime through the
+// node-admission control message.
+const char kAdmissionBytesRate[] = "admission-bytes-rate";
+
+// Specifies a comma separated list of the transport identities of the peers
+// that could change the admission limits through the node-admission
+// control message. The messages that comes from any other peer are
+// discarded. If not specified the limits could be changed only by the node.
+const char kAdmissionControlPeers[] = "admission-control-peers";
+
+// Specifies the name of the fact, such as a tenant or a service name, whose
+// values are rate limited instead of the senders. The messages that does
+// not have the fact are still limited by their sender.
+const char kAdmissionFact[] = "admission-fact";
+
+// Sets the maximum number of messages per second that the node accepts from
+// each sender, or from each value of the admission fact. If not specified
+// the messages are not limited.
+const char kAdmissionMessagesRate[] = "admission-messages-rate";
+
+// Disables the shared memory transport for local service hosts. The hosts
+// that ask for shared memory are told that it is not available and keep
+// sending their packets over the message channel.
+const char kDisableSharedMemory[] = "disable-shared-memory";
+
+// Takes an instance of a balanced service out of rotation when it lets
+// several requests expire in a row without replying to any of them. A
+// request could expire because it is slow or because the client does not
+// expect a reply, so if not specified the instances are taken out of
+// rotation only when their host stops answering the pings of the node.
+const char kEvictUnresponsive[] = "evict-unresponsive";
+
+// Specifies how the sockets are mapped to the zeromq I/O threads. Could be
+// "shared", which spreads the connections of every socket among all the I/O
+// threads, or "round-robin", which pins each socket to a single I/O thread.
+// Defaults to "shared".
+const char kIoThreadPolicy[] = "io-thread-policy";
+
+// Overrides the number of zeromq I/O threads. If not specified, or zero, the
+// number of I/O threads is computed from the number of processors.
+const char kIoThreads[] = "io-threads";
+
+// Overrides the maximum number of bytes that the node queues for a
+// destination that could not receive its packets right away. Defaults to
+// 64MB.
+const char kMailboxMaxBytes[] = "mailbox-max-bytes";
+
+// Overrides the maximum number of packets that the node queues for a
+// destination that could not receive them right away. Defaults to 10000.
+const char kMailboxMaxMessages[] = "mailbox-max-messages";
+
+// Specifies what happens to a packet that is sent to a destination whose
+// mailbox is full. Could be "drop-oldest", which discards the oldest queued
+// packets to make room for it, "drop-newest", which discards it, or
+// "reject", which discards it and sends an error back to its sender when it
+// is a request. Defaults to "drop-newest".
+const char kMailboxOverflowPolicy[] = "mailbox-overflow-policy";
+
+// Overrides the maximum number of messages that the message channel queues
+// in memory for each connected peer. Zero means no limit, otherwise it
+// should not be below the flow control window of the peers.
+const char kMessageChannelHighWaterMark[] = "message-channel-hwm";
+
+// Overrides the ipc:// endpoint that the message channel binds for the
+// service hosts that run on the same machine, for example
+// "ipc:///var/run/ruby-node". An empty value disables the ipc endpoint. The
+// TCP endpoint is always bound.
+const char kMessageChannelIpcEndpoint[] = "message-channel-ipc-endpoint";
+
+// Overrides how long, in milliseconds, the message channel keeps the
+// messages that was not sent yet when the node is stopping. -1 means forever.
+const char kMessageChannelLinger[] = "message-channel-linger";
+
 // Overrides the default port used for commands delivery.
 const char kMessageChannelPort[] = "message-channel-port";
 
+// Sets the size, in bytes, of the kernel receive buffer of the message
+// channel connections. If not specified the OS default is used.
+const char kMessageChannelReceiveBuffer[] = "message-channel-rcvbuf";
+
+// Sets the size, in bytes, of the kernel send buffer of the message channel
+// connections. If not specified the OS default is used.
+const char kMessageChannelSendBuffer[] = "message-channel-sndbuf";
+
+// Sends an error back to the sender of a request that has expired before
+// it was delivered, so the sender does not need to wait for its own
+// timeout. If not specified the expired requests are dropped silently.
+const char kNotifyExpired[] = "notify-expired";
+
+// Enables the listener for the clients that does not use zeromq and sets
+// the port where it accepts connections. The clients send length-prefixed
+// RubyMessagePackets over plain TCP.
+const char kPacketListenerPort[] = "packet-listener-port";
+
+// Specifies the name of the fact, such as "account", whose value is the
+// partition key of the requests sent to the partitioned services. The fact
+// is not matched against the facts of the services. If not specified the
+// fact is named "partition-key".
+const char kPartitionFact[] = "partition-fact";
+
+// Sets how long, in milliseconds, a batch of received messages that is not
+// full could wait for more messages before it is routed. This switch trades
+// latency for throughput under bursty load. If not specified the messages
+// are routed as soon as they are received.
+const char kRoutingBatchDelay[] = "routing-batch-delay";
+
+// Sets the maximum number of received messages that are routed together.
+// The messages of a batch that has the same facts are routed by a single
+// lookup. If not specified at most 64 messages are routed together.
+const char kRoutingBatchSize[] = "routing-batch-size";
+
+// Sets the number of threads that parses and routes the messages received
+// from the message channel. This switch is useful on machines with many
+// cores, where a single thread could not keep up with the message rate. If
+// not specified the messages are routed by the message receiver thread.
+const char kRoutingWorkers[] = "routing-workers";
+
 // Specifies the aaddress of the service tracker.
 const char kServiceTrackerAddress[] = "service-tracker-address";
 
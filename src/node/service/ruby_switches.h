@@ -13,7 +13,29 @@ namespace switches {
 // All switches in alphabetical order. The switches should be documented
 // alongside the definition of their values in the .cc file.
 
+extern const char kAdmissionBytesRate[];
+extern const char kAdmissionControlPeers[];
+extern const char kAdmissionFact[];
+extern const char kAdmissionMessagesRate[];
+extern const char kDisableSharedMemory[];
+extern const char kEvictUnresponsive[];
+extern const char kIoThreadPolicy[];
+extern const char kIoThreads[];
+extern const char kMailboxMaxBytes[];
+extern const char kMailboxMaxMessages[];
+extern const char kMailboxOverflowPolicy[];
+extern const char kMessageChannelHighWaterMark[];
+extern const char kMessageChannelIpcEndpoint[];
+extern const char kMessageChannelLinger[];
 extern const char kMessageChannelPort[];
+extern const char kMessageChannelReceiveBuffer[];
+extern const char kMessageChannelSendBuffer[];
+extern const char kNotifyExpired[];
+extern const char kPacketListenerPort[];
+extern const char kPartitionFact[];
+extern const char kRoutingBatchDelay[];
+extern const char kRoutingBatchSize[];
+extern const char kRoutingWorkers[];
 extern const char kServiceTrackerAddress[];
 extern const char kWaitDebugger[];
 extern const char kLaunchDebug[];
@@ -20,7 +20,38 @@ namespace node {
 
 static const int kVersionNumber = 1;
 
-ServicesDatabase::ServicesDatabase() {
+uint32 GetServiceFactHash(const ServiceFact& fact) {
+  return node::Hash(base::StringPrintf("%s=%s", fact.first.data(),
+    fact.second.data()));
+}
+
+ServiceTable::ServiceTable() {
+}
+
+ServiceTable::~ServiceTable() {
+}
+
+bool ServiceTable::Find(const std::vector<uint32>& fact_hashes,
+  ServicesMetadataSet* services) const {
+  DCHECK(services);
+  std::vector<int> service_ids;
+  if (fact_hashes.empty() || !fact_index_.Find(&fact_hashes[0],
+    fact_hashes.size(), &service_ids)) {
+    return false;
+  }
+
+  for (size_t i = 0; i < service_ids.size(); ++i) {
+    std::map<int, scoped_refptr<ServiceMetadata> >::const_iterator service =
+      services_.find(service_ids[i]);
+    if (service != services_.end()) {
+      services->push_back(service->second);
+    }
+  }
+  return services->size() > 0;
+}
+
+ServicesDatabase::ServicesDatabase()
+  : table_(new ServiceTable()) {
 }
 
 ServicesDatabase::~ServicesDatabase() {
@@ -77,6 +108,46 @@ bool ServicesDatabase::Open(const FilePath& db_name) {
     return false;
   }
 
+  return LoadServices();
+}
+
+bool ServicesDatabase::LoadServices() {
+  scoped_refptr<ServiceTable> table(new ServiceTable());
+  sql::Statement services(db_->GetUniqueStatement(
+    "SELECT id, name, language_runtime_type, working_dir, arguments "
+    "FROM services"));
+  while (services.Step()) {
+    scoped_refptr<ServiceMetadata> service(new ServiceMetadata());
+    service->set_service_id(services.ColumnInt(0));
+    service->set_service_name(services.ColumnString(1));
+    service->set_language_runtime_type(
+      static_cast<LanguageRuntimeType>(services.ColumnInt(2)));
+    service->set_service_working_dir(services.ColumnString(3));
+    service->set_arguments(services.ColumnString(4));
+    table->services_[service->service_id()] = service;
+  }
+
+  // The facts are read in the order of their services, so the posting lists
+  // of the index are built by appending to them.
+  sql::Statement facts(db_->GetUniqueStatement(
+    "SELECT service_id, hash_code FROM facts ORDER BY service_id"));
+  std::vector<uint32> fact_hashes;
+  int service_id = 0;
+  while (facts.Step()) {
+    if (!fact_hashes.empty() && facts.ColumnInt(0) != service_id) {
+      table->fact_index_.Add(service_id, fact_hashes);
+      fact_hashes.clear();
+    }
+    service_id = facts.ColumnInt(0);
+    fact_hashes.push_back(static_cast<uint32>(facts.ColumnInt(1)));
+  }
+  if (!fact_hashes.empty()) {
+    table->fact_index_.Add(service_id, fact_hashes);
+  }
+
+  VLOG(1) << "Loaded " << table->services_.size() << " services, "
+          << table->fact_index_.size() << " of them with facts";
+  table_ = table;
   return true;
 }
 
@@ -116,55 +187,15 @@ bool ServicesDatabase::GetServicesMetadata(const ServiceFactSet& facts,
   DCHECK(services);
   DCHECK(facts.size());
 
-  int facts_size = facts.size();
-
-  uint32 first_service_fact_hash = GetServiceFactHash(facts[0]);
-
-  // First get all the services that has the first fact.
-  sql::Statement s(db_->GetCachedStatement(SQL_FROM_HERE,
-    "SELECT service_id FROM facts WHERE hash_code = ?"));
-  s.BindInt(0, first_service_fact_hash);
-
-  std::set<int> services_found;
-  if (s.Step()) {
-    do {
-      services_found.insert(s.ColumnInt(0));
-    } while (s.Step());
-
-    // Check if each of the found services contains the others facts.
-    std::string cmd("SELECT DISTINCT s.id, name, language_runtime_type, working_dir, arguments "
-                    "FROM services s "
-                    "INNER JOIN facts f on f.service_id = s.id "
-                    "WHERE service_id = ? and hash_code in (");
-
-    cmd += base::IntToString(first_service_fact_hash);
-    for (int i = 1; i< facts_size; ++i) {
-      cmd += "," +  base::IntToString(GetServiceFactHash(facts[i]));
-    }
-    cmd += ")";
-
-    sql::Statement statement(db_->GetCachedStatement(SQL_FROM_HERE, cmd.c_str()));
-    for (std::set<int>::iterator k = services_found.begin();
-          k != services_found.end(); ++k) {
-      statement.BindInt(0, *k);
-      if (!statement.Step()) {
-        LOG(ERROR) << db_->GetErrorMessage();
-        return false;
-      }
-
-      scoped_refptr<ServiceMetadata> service(new ServiceMetadata());
-      service->set_service_id(statement.ColumnInt(0));
-      service->set_service_name(statement.ColumnString(1));
-      service->set_language_runtime_type(
-        static_cast<LanguageRuntimeType>(statement.ColumnInt(2)));
-      service->set_service_working_dir(statement.ColumnString(3));
-      service->set_arguments(statement.ColumnString(4));
-
-      services->push_back(service);
-      statement.Reset();
-    }
+  // The services that has all the facts are found by the in-memory index,
+  // which is kept in sync with the database.
+  std::vector<uint32> fact_hashes;
+  fact_hashes.reserve(facts.size());
+  for (ServiceFactSet::const_iterator fact = facts.begin();
+    fact != facts.end(); ++fact) {
+    fact_hashes.push_back(GetServiceFactHash(*fact));
   }
-  return services->size() > 0;
+  return table_->Find(fact_hashes, services);
 }
 
 bool ServicesDatabase::Add(const ServiceFactSet& facts,
@@ -188,27 +219,86 @@ bool ServicesDatabase::Add(const ServiceFactSet& facts,
     return false;
   }
 
+  int service_id = static_cast<int>(db_->GetLastInsertRowId());
   std::string insert("INSERT INTO facts (hash_code, service_id) VALUES (?,");
-  insert += base::IntToString(db_->GetLastInsertRowId());
+  insert += base::IntToString(service_id);
   insert += ")";
 
+  std::vector<uint32> fact_hashes;
   sql::Statement s(db_->GetUniqueStatement(insert.c_str()));
   for (ServiceFactSet::const_iterator fact = facts.begin();
     fact != facts.end(); ++fact) {
-    s.BindInt(0, GetServiceFactHash(facts[0]));
+    fact_hashes.push_back(GetServiceFactHash(*fact));
+    s.BindInt(0, fact_hashes.back());
     if (!s.Run()) {
       return false;
     }
     s.Reset();
   }
 
-  return transaction.Commit();
+  if (!transaction.Commit()) {
+    return false;
+  }
+
+  // The in-memory copy is replaced only after the service is really
+  // registered. The tables that was given out are left untouched.
+  scoped_refptr<ServiceMetadata> service(new ServiceMetadata());
+  service->set_service_id(service_id);
+  service->set_service_name(metadata->service_name());
+  service->set_language_runtime_type(metadata->language_runtime_type());
+  service->set_service_working_dir(metadata->service_working_dir());
+  service->set_arguments(metadata->arguments());
+
+  scoped_refptr<ServiceTable> table(new ServiceTable());
+  table->services_ = table_->services_;
+  table->fact_index_ = table_->fact_index_;
+  table->services_[service_id] = service;
+  table->fact_index_.Add(service_id, fact_hashes);
+  table_ = table;
+  return true;
 }
 
-uint32 ServicesDatabase::GetServiceFactHash(const std::pair<std::string,
-  std::string> fact) {
-  return node::Hash(base::StringPrintf("%s=%s", fact.first.data(),
-    fact.second.data()));
+bool ServicesDatabase::Delete(const ServiceFactSet& facts) {
+  DCHECK(facts.size());
+  ServicesMetadataSet services;
+  if (!GetServicesMetadata(facts, &services)) {
+    return true;
+  }
+
+  // Scope the removal in a transaction, so a service can't be partially
+  // unregistered.
+  sql::Transaction transaction(db_.get());
+  transaction.Begin();
+
+  sql::Statement delete_facts(db_->GetCachedStatement(SQL_FROM_HERE,
+    "DELETE FROM facts WHERE service_id = ?"));
+  sql::Statement delete_service(db_->GetCachedStatement(SQL_FROM_HERE,
+    "DELETE FROM services WHERE id = ?"));
+  for (ServicesMetadataSet::iterator service = services.begin();
+    service != services.end(); ++service) {
+    delete_facts.BindInt(0, service->get()->service_id());
+    delete_service.BindInt(0, service->get()->service_id());
+    if (!delete_facts.Run() || !delete_service.Run()) {
+      return false;
+    }
+    delete_facts.Reset();
+    delete_service.Reset();
+  }
+
+  if (!transaction.Commit()) {
+    return false;
+  }
+
+  scoped_refptr<ServiceTable> table(new ServiceTable());
+  table->services_ = table_->services_;
+  table->fact_index_ = table_->fact_index_;
+  for (ServicesMetadataSet::iterator service = services.begin();
+    service != services.end(); ++service) {
+    table->fact_index_.Remove(service->get()->service_id());
+    table->services_.erase(service->get()->service_id());
+  }
+  table_ = table;
+  return true;
 }
 
 sql::Connection* ServicesDatabase::CreateDB(const FilePath& db_name) {
@@ -6,6 +6,7 @@
 #define NODE_SERVICE_SERVICES_DATABASE_H_
 #pragma once
 
+#include <map>
 #include <vector>
 #include <string>
 
@@ -15,6 +16,7 @@
 #include <base/memory/scoped_ptr.h>
 #include <base/memory/ref_counted.h>
 
+#include "node/service/fact_index.h"
 #include "node/service/service_metadata.h"
 
 namespace sql {
@@ -32,6 +34,39 @@ typedef std::pair<std::string, std::string> ServiceFact;
 typedef std::vector<ServiceFact> ServiceFactSet;
 typedef std::vector<scoped_refptr<ServiceMetadata> > ServicesMetadataSet;
 
+// Gets the hash that identifies |fact| in the services database.
+uint32 GetServiceFactHash(const ServiceFact& fact);
+
+// An in-memory copy of the registered services and of the index of their
+// facts. A table is never changed once it is published by the services
+// database, a new table is created each time a service is registered or
+// unregistered instead. So, a table could be read by any number of threads
+// without locks.
+class ServiceTable : public base::RefCountedThreadSafe<ServiceTable> {
+ public:
+  ServiceTable();
+
+  // Gets the metadata for the services that has all the facts whose hashes
+  // are |fact_hashes|. Returns true if at least one service is found.
+  bool Find(const std::vector<uint32>& fact_hashes,
+    ServicesMetadataSet* services) const;
+
+ private:
+  friend class base::RefCountedThreadSafe<ServiceTable>;
+  friend class ServicesDatabase;
+
+  ~ServiceTable();
+
+  // The services keyed by their IDs.
+  std::map<int, scoped_refptr<ServiceMetadata> > services_;
+  FactIndex fact_index_;
+
+  DISALLOW_COPY_AND_ASSIGN(ServiceTable);
+};
+
+// The services database is stored by sqlite, but the facts and the metadata
+// of the registered services are also kept in memory, so the services that
+// matches a set of facts are found without querying the database.
 class ServicesDatabase {
  public:
   ServicesDatabase();
@@ -43,9 +78,9 @@ class ServicesDatabase {
 
   // Services metadata ------------------------------------------------------
 
-  // Gets the metadata for the services that has the given facts. Returns true
-  // if we have metadata for at least one service associated with the given
-  // facts.
+  // Gets the metadata for the services that has all the given facts. Returns
+  // true if we have metadata for at least one service associated with the
+  // given facts.
   bool GetServicesMetadata(const ServiceFactSet& facts,
     ServicesMetadataSet* medatada);
 
@@ -64,6 +99,11 @@ class ServicesDatabase {
   // Delete all the services that matches the given facts.
   bool Delete(const ServiceFactSet& facts);
 
+  // Gets the in-memory copy of the registered services. The returned table
+  // does not see the services that are registered or unregistered after
+  // this is called.
+  scoped_refptr<ServiceTable> table() const { return table_; }
+
  private:
   // Creates the services table, returning true if the table already exists
   // or was successfully created.
@@ -73,13 +113,19 @@ class ServicesDatabase {
   // or was successfully created.
   bool InitServicesFactsTable();
 
-  uint32 GetServiceFactHash(const std::pair<std::string, std::string> fact);
+  // Loads the facts and the metadata of the registered services into
+  // memory.
+  bool LoadServices();
 
   sql::Connection* CreateDB(const FilePath& db_name);
 
   scoped_ptr<sql::Connection> db_;
   sql::MetaTable meta_table_;
 
+  // The in-memory copy of the registered services. It is replaced by a new
+  // table each time the services change.
+  scoped_refptr<ServiceTable> table_;
+
   DISALLOW_COPY_AND_ASSIGN(ServicesDatabase);
 };
 
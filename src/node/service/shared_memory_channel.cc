@@ -0,0 +1,157 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+
+#include "node/service/shared_memory_channel.h"
+
+#include <string.h>
+
+#include <base/logging.h>
+#include <ruby_protos.pb.h>
+
+namespace node {
+
+namespace rp = ::ruby::protocol;
+namespace subtle = ::base::subtle;
+
+namespace {
+
+// The layout of a descriptor frame.
+struct Descriptor {
+  // Always zero, which is not a valid protobuf tag.
+  uint8 kind;
+  uint8 reserved[3];
+  uint32 position;
+  uint32 size;
+};
+
+COMPILE_ASSERT(sizeof(Descriptor) == SharedMemoryChannel::kDescriptorSize,
+  descriptor_size_mismatch);
+
+}  // namespace
+
+class SharedMemoryChannel::SlotMessage : public zmq::Message {
+ public:
+  SlotMessage(void* data, int size, uint32 position)
+    : zmq::Message(data, size, NULL, NULL),
+      position_(position) {
+  }
+
+  uint32 position() const { return position_; }
+
+ protected:
+  virtual ~SlotMessage() {}
+
+ private:
+  uint32 position_;
+
+  DISALLOW_COPY_AND_ASSIGN(SlotMessage);
+};
+
+SharedMemoryChannel::SharedMemoryChannel() {
+}
+
+SharedMemoryChannel::~SharedMemoryChannel() {
+}
+
+bool SharedMemoryChannel::Create(const std::string& name, uint32 capacity) {
+  if (!outbound_.Create(name + ".node", capacity) ||
+    !inbound_.Create(name + ".host", capacity)) {
+    return false;
+  }
+  name_ = name;
+  return true;
+}
+
+scoped_refptr<zmq::Message> SharedMemoryChannel::AllocatePacket(int size) {
+  DCHECK(size > 0);
+  uint32 position;
+  void* slot = outbound_.Reserve(static_cast<uint32>(size), &position);
+  if (!slot) {
+    return NULL;
+  }
+  return new SlotMessage(slot, size, position);
+}
+
+scoped_refptr<zmq::Message> SharedMemoryChannel::CommitPacket(
+  zmq::Message* slot) {
+  DCHECK(slot);
+  SlotMessage* slot_message = static_cast<SlotMessage*>(slot);
+  outbound_.Commit(slot_message->position(),
+    static_cast<uint32>(slot_message->size()));
+
+  scoped_refptr<zmq::Message> frame(new zmq::Message(kDescriptorSize));
+  Descriptor* descriptor = static_cast<Descriptor*>(frame->mutable_data());
+  memset(descriptor, 0, sizeof(Descriptor));
+  descriptor->position = slot_message->position();
+  descriptor->size = static_cast<uint32>(slot_message->size());
+  return frame;
+}
+
+// static
+bool SharedMemoryChannel::IsDescriptor(zmq::Message* frame) {
+  return frame->size() == static_cast<size_t>(kDescriptorSize) &&
+    static_cast<const Descriptor*>(frame->mutable_data())->kind == 0;
+}
+
+bool SharedMemoryChannel::ReadPacket(zmq::Message* frame,
+  rp::RubyMessagePacket* packet) {
+  DCHECK(IsDescriptor(frame));
+  const Descriptor* descriptor =
+    static_cast<const Descriptor*>(frame->mutable_data());
+
+  // The ring checks that the record lies inside its published part, so the
+  // parser never reads past the mapping whatever the host wrote there.
+  uint32 size = descriptor->size;
+  const void* record = inbound_.Peek(descriptor->position, size);
+  if (!record) {
+    LOG(WARNING) << "The shared memory descriptor does not match a record "
+                 << "of the ring " << name_;
+    return false;
+  }
+
+  // The packet is parsed in place, the ring space is reused only after the
+  // parsing is done.
+  bool parsed = packet->ParseFromArray(record, static_cast<int>(size));
+  inbound_.Release();
+  return parsed;
+}
+
+SharedMemoryChannelMap::SharedMemoryChannelMap()
+  : size_(0) {
+}
+
+SharedMemoryChannelMap::~SharedMemoryChannelMap() {
+}
+
+void SharedMemoryChannelMap::Add(const std::string& route,
+  SharedMemoryChannel* channel) {
+  DCHECK(channel);
+  base::AutoLock lock(lock_);
+  channels_[route] = channel;
+  subtle::Release_Store(&size_, static_cast<subtle::Atomic32>(
+    channels_.size()));
+}
+
+void SharedMemoryChannelMap::Remove(const std::string& route) {
+  base::AutoLock lock(lock_);
+  channels_.erase(route);
+  subtle::Release_Store(&size_, static_cast<subtle::Atomic32>(
+    channels_.size()));
+}
+
+scoped_refptr<SharedMemoryChannel> SharedMemoryChannelMap::Find(
+  const std::string& route) {
+  if (!subtle::Acquire_Load(&size_)) {
+    return NULL;
+  }
+
+  base::AutoLock lock(lock_);
+  ChannelMap::iterator channel = channels_.find(route);
+  if (channel == channels_.end()) {
+    return NULL;
+  }
+  return channel->second;
+}
+
+}  // namespace node
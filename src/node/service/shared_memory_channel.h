@@ -0,0 +1,132 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+
+#ifndef NODE_SERVICE_SHARED_MEMORY_CHANNEL_H_
+#define NODE_SERVICE_SHARED_MEMORY_CHANNEL_H_
+#pragma once
+
+#include <map>
+#include <string>
+
+#include <base/atomicops.h>
+#include <base/basictypes.h>
+#include <base/memory/ref_counted.h>
+#include <base/synchronization/lock.h>
+
+#include "node/service/shared_memory_ring.h"
+#include "node/zeromq/message.h"
+
+namespace ruby {
+namespace protocol {
+class RubyMessagePacket;
+}
+}
+
+namespace node {
+
+// A SharedMemoryChannel carries large message packets between the node and
+// a service host that runs on the same machine, without copying them
+// through the kernel. It owns two shared memory rings: one that is written
+// by the node and read by the host, and another one that is written by the
+// host and read by the node.
+//
+// The packets are written in place into a ring and only a small descriptor
+// is sent over the message channel socket, in place of the packet frame:
+//
+//   [DESTINATION ADDRESS][EMPTY FRAME][DESCRIPTOR]
+//
+// A descriptor is a kDescriptorSize bytes frame whose first byte is zero,
+// followed by the position and the size of the ring record, in the native
+// byte order. A zero byte is not a valid protobuf tag, so a descriptor is
+// never mistaken by a serialized RubyMessagePacket.
+//
+// The rings are used only by the message receiver thread. The channel is
+// reference counted so the control loop could create it and hand it to the
+// receiver through a SharedMemoryChannelMap.
+class SharedMemoryChannel
+  : public base::RefCountedThreadSafe<SharedMemoryChannel> {
+ public:
+  // The size of a descriptor frame.
+  static const int kDescriptorSize = 12;
+
+  SharedMemoryChannel();
+
+  // Creates the rings of the channel. The ring written by the node is named
+  // |name| + ".node" and the ring written by the host is named |name| +
+  // ".host". Each ring has at least |capacity| bytes.
+  bool Create(const std::string& name, uint32 capacity);
+
+  // Reserves a ring slot for a packet of |size| bytes and returns a message
+  // that wraps it, or NULL if the ring is full. The packet should be written
+  // into the message data and the message passed to CommitPacket() before
+  // another slot is reserved.
+  scoped_refptr<zmq::Message> AllocatePacket(int size);
+
+  // Publishes the packet written into |slot| to the host and returns the
+  // descriptor frame that should be sent in place of the packet frame.
+  scoped_refptr<zmq::Message> CommitPacket(zmq::Message* slot);
+
+  // Returns true if |frame| is a descriptor frame.
+  static bool IsDescriptor(zmq::Message* frame);
+
+  // Parses the packet described by the descriptor |frame| from the ring
+  // written by the host, and releases its ring space along with the space
+  // of the older packets, whose descriptors was lost. Returns false if the
+  // descriptor does not match a packet of the ring or the packet could not
+  // be parsed.
+  bool ReadPacket(zmq::Message* frame,
+    ruby::protocol::RubyMessagePacket* packet);
+
+  const std::string& name() const { return name_; }
+  uint32 capacity() const { return outbound_.capacity(); }
+
+ private:
+  friend class base::RefCountedThreadSafe<SharedMemoryChannel>;
+
+  // A message that wraps a slot of the ring written by the node.
+  class SlotMessage;
+
+  ~SharedMemoryChannel();
+
+  std::string name_;
+  SharedMemoryRing outbound_;
+  SharedMemoryRing inbound_;
+
+  DISALLOW_COPY_AND_ASSIGN(SharedMemoryChannel);
+};
+
+// Maps the routes of the service hosts to their shared memory channels.
+// This class is thread safe.
+class SharedMemoryChannelMap {
+ public:
+  SharedMemoryChannelMap();
+  ~SharedMemoryChannelMap();
+
+  // Associates |channel| with |route|, replacing the previous channel.
+  void Add(const std::string& route, SharedMemoryChannel* channel);
+
+  // Removes the channel associated with |route|, if any.
+  void Remove(const std::string& route);
+
+  // Gets the channel associated with |route|, or NULL if there is no
+  // channel associated with it.
+  scoped_refptr<SharedMemoryChannel> Find(const std::string& route);
+
+ private:
+  typedef std::map<std::string, scoped_refptr<SharedMemoryChannel> >
+    ChannelMap;
+
+  base::Lock lock_;
+  ChannelMap channels_;
+
+  // The number of channels in the map. Allows Find() to skip the lock when
+  // no host uses shared memory, which is the common case.
+  base::subtle::Atomic32 size_;
+
+  DISALLOW_COPY_AND_ASSIGN(SharedMemoryChannelMap);
+};
+
+}  // namespace node
+
+#endif  // NODE_SERVICE_SHARED_MEMORY_CHANNEL_H_
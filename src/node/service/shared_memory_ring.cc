@@ -0,0 +1,196 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+
+#include "node/service/shared_memory_ring.h"
+
+#include <base/logging.h>
+
+namespace node {
+
+namespace subtle = ::base::subtle;
+
+namespace {
+
+// Identifies a initialized ring segment.
+const uint32 kRingMagic = 0x52534852;  // "RHSR"
+
+// The record size that marks the end of the usable space of the ring. The
+// next record starts at the beginning of the ring.
+const uint32 kWrapMarker = 0xFFFFFFFF;
+
+// The smallest and the greatest capacity of a ring.
+const uint32 kMinCapacity = 4096;
+const uint32 kMaxCapacity = 1U << 30;
+
+uint32 RoundUpToPowerOfTwo(uint32 value) {
+  uint32 power = kMinCapacity;
+  while (power < value && power < kMaxCapacity) {
+    power <<= 1;
+  }
+  return power;
+}
+
+}  // namespace
+
+// The producer and the consumer positions are kept in distinct cache lines,
+// so the two sides does not invalidate each other caches.
+struct SharedMemoryRing::Header {
+  uint32 magic;
+  uint32 capacity;
+  char padding0[56];
+  subtle::Atomic32 write_position;
+  char padding1[60];
+  subtle::Atomic32 read_position;
+  char padding2[60];
+};
+
+SharedMemoryRing::SharedMemoryRing()
+  : header_(NULL),
+    records_(NULL),
+    capacity_(0),
+    next_position_(0) {
+}
+
+SharedMemoryRing::~SharedMemoryRing() {
+  // The segment is removed from the system, so a segment that was abandoned
+  // does not outlive the node. The peer keeps its mapping, if any.
+  shared_memory_.Close();
+  if (!name_.empty()) {
+    shared_memory_.Delete(name_);
+  }
+}
+
+bool SharedMemoryRing::Create(const std::string& name, uint32 capacity) {
+  DCHECK(!header_);
+  capacity = RoundUpToPowerOfTwo(capacity);
+  uint32 segment_size = sizeof(Header) + capacity;
+  if (!shared_memory_.CreateNamed(name, false, segment_size) ||
+    !shared_memory_.Map(segment_size)) {
+    LOG(ERROR) << "The shared memory segment " << name
+               << " could not be created.";
+    return false;
+  }
+
+  name_ = name;
+  capacity_ = capacity;
+  header_ = static_cast<Header*>(shared_memory_.memory());
+  records_ = reinterpret_cast<char*>(header_ + 1);
+
+  header_->capacity = capacity_;
+  subtle::NoBarrier_Store(&header_->write_position, 0);
+  subtle::NoBarrier_Store(&header_->read_position, 0);
+
+  // The magic is published last, so the peer does not see a partially
+  // initialized header.
+  subtle::MemoryBarrier();
+  header_->magic = kRingMagic;
+  return true;
+}
+
+// static
+uint32 SharedMemoryRing::GetRecordSize(uint32 size) {
+  return (kRecordHeaderSize + size + 7) & ~7U;
+}
+
+void* SharedMemoryRing::Reserve(uint32 size, uint32* position) {
+  DCHECK(header_);
+  DCHECK(position);
+
+  uint32 record_size = GetRecordSize(size);
+  if (record_size > capacity_) {
+    return NULL;
+  }
+
+  uint32 write = static_cast<uint32>(
+    subtle::NoBarrier_Load(&header_->write_position));
+  uint32 read = static_cast<uint32>(
+    subtle::Acquire_Load(&header_->read_position));
+
+  // A record never wraps around the end of the ring, the space that is left
+  // at the end is skipped when it is too small for the record.
+  uint32 offset = write & (capacity_ - 1);
+  uint32 skip = 0;
+  if (offset + record_size > capacity_) {
+    skip = capacity_ - offset;
+  }
+  if ((write - read) + skip + record_size > capacity_) {
+    return NULL;
+  }
+
+  if (skip) {
+    *reinterpret_cast<uint32*>(records_ + offset) = kWrapMarker;
+    offset = 0;
+  }
+  *position = write + skip;
+  return records_ + offset + kRecordHeaderSize;
+}
+
+void SharedMemoryRing::Commit(uint32 position, uint32 size) {
+  DCHECK(header_);
+  uint32 offset = position & (capacity_ - 1);
+  *reinterpret_cast<uint32*>(records_ + offset) = size;
+  subtle::Release_Store(&header_->write_position,
+    static_cast<subtle::Atomic32>(position + GetRecordSize(size)));
+}
+
+bool SharedMemoryRing::GetRecordExtent(uint32 position, uint32 available,
+  uint32* extent, uint32* size) const {
+  // The record header is read only once, since the producer could change it
+  // while it is checked.
+  uint32 offset = position & (capacity_ - 1);
+  uint32 record_size = *reinterpret_cast<volatile uint32*>(records_ + offset);
+  if (record_size == kWrapMarker) {
+    *extent = capacity_ - offset;
+  } else if (record_size > capacity_ - offset - kRecordHeaderSize) {
+    return false;
+  } else {
+    *extent = GetRecordSize(record_size);
+  }
+  *size = record_size;
+  return *extent <= available;
+}
+
+const void* SharedMemoryRing::Peek(uint32 position, uint32 size) {
+  DCHECK(header_);
+
+  // The positions are differences of unsigned counters, so a position that
+  // was already released is as far from |read| as one that was never
+  // published. The records and the wrap markers are aligned to 8 bytes.
+  uint32 read = static_cast<uint32>(
+    subtle::NoBarrier_Load(&header_->read_position));
+  uint32 write = static_cast<uint32>(
+    subtle::Acquire_Load(&header_->write_position));
+  uint32 available = write - read;
+  if (available > capacity_ || position - read >= available ||
+    (position & 7) != 0) {
+    return NULL;
+  }
+
+  // The records that are older than |position| are crossed one by one, so
+  // a position that falls inside one of them is rejected.
+  uint32 extent, record_size;
+  while (read != position) {
+    if (!GetRecordExtent(read, available, &extent, &record_size) ||
+      extent > position - read) {
+      return NULL;
+    }
+    read += extent;
+    available -= extent;
+  }
+
+  if (!GetRecordExtent(position, available, &extent, &record_size) ||
+    record_size == kWrapMarker || record_size != size) {
+    return NULL;
+  }
+  next_position_ = position + extent;
+  return records_ + (position & (capacity_ - 1)) + kRecordHeaderSize;
+}
+
+void SharedMemoryRing::Release() {
+  DCHECK(header_);
+  subtle::Release_Store(&header_->read_position,
+    static_cast<subtle::Atomic32>(next_position_));
+}
+
+}  // namespace node
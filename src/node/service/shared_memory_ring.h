@@ -0,0 +1,127 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+
+#ifndef NODE_SERVICE_SHARED_MEMORY_RING_H_
+#define NODE_SERVICE_SHARED_MEMORY_RING_H_
+#pragma once
+
+#include <string>
+
+#include <base/atomicops.h>
+#include <base/basictypes.h>
+#include <base/shared_memory.h>
+
+namespace node {
+
+// A SharedMemoryRing is a single-producer single-consumer ring buffer of
+// variable sized records that lives in a named shared memory segment, so the
+// producer and the consumer could live in different processes.
+//
+// The segment layout is:
+//
+//   [Header][Records]
+//
+// The header holds the capacity of the ring and the producer and consumer
+// positions, each one in its own cache line. Positions are byte counters
+// that are never reset, the offset of a record inside the ring is its
+// position modulo the capacity. Each record is preceded by a 8 bytes record
+// header that contains the record size, and is padded to a multiple of 8
+// bytes. A record never wraps around the end of the ring; when it does not
+// fit at the end, a wrap marker is written and the record is written at the
+// beginning of the ring.
+//
+// The producer writes a record in place:
+//   void* slot = ring.Reserve(size, &position);
+//   ...fill |slot| with |size| bytes...
+//   ring.Commit(position, size);
+//
+// And the consumer reads it in place, at the position and size that the
+// producer has sent along with it:
+//   const void* record = ring.Peek(position, size);
+//   ...use |record|...
+//   ring.Release();
+//
+// The records are written in order, but the messages that carries their
+// positions could be lost or reordered after that: the node drops them when
+// a mailbox overflows or a packet expires, zeromq drops them silently at
+// the high water mark, and the lanes send the packets of a higher priority
+// before the older ones of a lower priority. So the consumer never waits
+// for the oldest record; reading a record releases every record older than
+// it, whose messages was lost or are late. A late message finds its record
+// already released and is rejected, so a lost message costs only its own
+// record and never blocks the ones that follows it.
+//
+// The header of each record is written by the peer process, so the
+// consumer checks that every record it crosses lies inside the published
+// part of the ring before it is used.
+class SharedMemoryRing {
+ public:
+  // The size of the header that precedes each record.
+  static const uint32 kRecordHeaderSize = 8;
+
+  SharedMemoryRing();
+  ~SharedMemoryRing();
+
+  // Creates a ring whose records area has at least |capacity| bytes in the
+  // shared memory segment named |name|. The capacity is rounded up to a
+  // power of two. Returns false if the segment could not be created or
+  // mapped.
+  bool Create(const std::string& name, uint32 capacity);
+
+  // Reserves a slot of |size| bytes for the next record and returns a pointer
+  // to it, or NULL if the ring does not have enough free space. |position|
+  // receives the position of the record, which must be passed to Commit().
+  // Only one slot could be reserved at a time. Must be called only by the
+  // producer.
+  void* Reserve(uint32 size, uint32* position);
+
+  // Publishes the record that was reserved at |position|. |size| must not be
+  // greater than the reserved size. Must be called only by the producer.
+  void Commit(uint32 position, uint32 size);
+
+  // Returns a pointer to the record at |position|, or NULL if there is no
+  // record of |size| bytes there: the record was already released, was
+  // not published yet or the ring is corrupt. Must be called only by the
+  // consumer.
+  const void* Peek(uint32 position, uint32 size);
+
+  // Releases the record that was returned by the last call to Peek() and
+  // the records that are older than it, making their space available to
+  // the producer. Must be called only by the consumer.
+  void Release();
+
+  // The size of the records area.
+  uint32 capacity() const { return capacity_; }
+
+  const std::string& name() const { return name_; }
+
+ private:
+  struct Header;
+
+  // Returns the space used by a record of |size| bytes, including its
+  // header and padding.
+  static uint32 GetRecordSize(uint32 size);
+
+  // Gets the space used by the record or the wrap marker at |position|,
+  // which should be part of the |available| bytes that was published by the
+  // producer. Returns false if it does not fit in them or crosses the end
+  // of the ring. |size| receives the size of the record, or kWrapMarker.
+  bool GetRecordExtent(uint32 position, uint32 available, uint32* extent,
+    uint32* size) const;
+
+  base::SharedMemory shared_memory_;
+  std::string name_;
+  Header* header_;
+  char* records_;
+  uint32 capacity_;
+
+  // The position that follows the record returned by the last Peek().
+  uint32 next_position_;
+
+  DISALLOW_COPY_AND_ASSIGN(SharedMemoryRing);
+};
+
+}  // namespace node
+
+#endif  // NODE_SERVICE_SHARED_MEMORY_RING_H_
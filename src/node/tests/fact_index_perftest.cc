@@ -0,0 +1,157 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+//
+// Measures how long the FactIndex takes to find the services of a query
+// when a large number of services is registered. Each service has a unique
+// name and shares its tenant, region and runtime with the other services,
+// so the queries range from the ones that match a single service to the
+// ones that match thousands of them. The services found by each query are
+// checked against a plain intersection of the facts of every service.
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <base/basictypes.h>
+#include <base/logging.h>
+#include <base/string_number_conversions.h>
+
+#include "node/service/fact_index.h"
+#include "node/service/hash.h"
+#include "node/tests/perf_test.h"
+
+namespace node {
+namespace perf_test {
+
+namespace {
+
+// The number of indexed services.
+const int kServices = 100000;
+
+// The number of distinct values of the shared facts. The counts are
+// coprimes, so every combination of them is used by some service.
+const int kTenants = 1000;
+const int kRegions = 7;
+const int kRuntimes = 3;
+
+// The number of distinct queries of each kind, the number of them whose
+// services are checked, and the number of times each one is run.
+const int kQueries = 512;
+const size_t kCheckedQueries = 64;
+const int kRounds = 50;
+
+uint32 GetFactHash(const std::string& name, const std::string& value) {
+  return Hash(name + "=" + value);
+}
+
+uint32 GetNameFact(int service_id) {
+  return GetFactHash("service-name", "service-" +
+    base::IntToString(service_id));
+}
+
+uint32 GetTenantFact(int service_id) {
+  return GetFactHash("tenant", base::IntToString(service_id % kTenants));
+}
+
+uint32 GetRegionFact(int service_id) {
+  return GetFactHash("region", base::IntToString(service_id % kRegions));
+}
+
+uint32 GetRuntimeFact(int service_id) {
+  return GetFactHash("runtime", base::IntToString(service_id % kRuntimes));
+}
+
+// A query is a set of facts, stored as their hashes.
+typedef std::vector<uint32> Query;
+
+// Finds the services that has all the facts of |query| by checking every
+// service, which is what the index should answer.
+std::vector<int> FindServices(const std::vector<std::vector<uint32> >& facts,
+  const Query& query) {
+  std::vector<int> service_ids;
+  for (size_t i = 0; i < facts.size(); ++i) {
+    bool matches = true;
+    for (size_t j = 0; matches && j < query.size(); ++j) {
+      matches = std::find(facts[i].begin(), facts[i].end(), query[j]) !=
+        facts[i].end();
+    }
+    if (matches) {
+      service_ids.push_back(static_cast<int>(i));
+    }
+  }
+  return service_ids;
+}
+
+// Runs each one of the |queries| |kRounds| times. Returns false if the
+// index does not find the services that was expected for one of the
+// checked queries.
+bool MeasureQueries(const std::string& trace, const FactIndex& index,
+  const std::vector<std::vector<uint32> >& facts,
+  const std::vector<Query>& queries) {
+  std::vector<int> service_ids;
+  size_t found = 0;
+  for (size_t i = 0; i < queries.size(); ++i) {
+    index.Find(&queries[i][0], queries[i].size(), &service_ids);
+    if (i < kCheckedQueries &&
+      service_ids != FindServices(facts, queries[i])) {
+      LOG(ERROR) << "The index has not found the services of a "
+                 << trace << " query.";
+      return false;
+    }
+    found += service_ids.size();
+  }
+
+  PerfTimer timer;
+  for (int round = 0; round < kRounds; ++round) {
+    for (size_t i = 0; i < queries.size(); ++i) {
+      index.Find(&queries[i][0], queries[i].size(), &service_ids);
+    }
+  }
+  PrintTimePerOperation("fact_index", trace, timer.Elapsed(),
+    static_cast<int64>(kRounds) * queries.size());
+  PrintResult("fact_index", trace + "_services",
+    static_cast<double>(found) / queries.size(), "services/query");
+  return true;
+}
+
+}  // namespace
+
+bool FactIndexPerfTest() {
+  // The facts of each service, indexed by its ID.
+  std::vector<std::vector<uint32> > facts(kServices);
+  FactIndex index;
+  for (int i = 0; i < kServices; ++i) {
+    facts[i].push_back(GetNameFact(i));
+    facts[i].push_back(GetTenantFact(i));
+    facts[i].push_back(GetRegionFact(i));
+    facts[i].push_back(GetRuntimeFact(i));
+    index.Add(i, facts[i]);
+  }
+
+  // A query for a service by its name and runtime matches a single
+  // service, the runtime list is galloped.
+  std::vector<Query> by_name(kQueries);
+  // A query for the services of a tenant in a region matches about fourteen
+  // services, the region list is galloped.
+  std::vector<Query> by_tenant(kQueries);
+  // A query for the services of a region and runtime matches thousands of
+  // services, the lists are merged.
+  std::vector<Query> by_region(kQueries);
+  for (int i = 0; i < kQueries; ++i) {
+    int service_id = (i * 7919) % kServices;
+    by_name[i].push_back(GetNameFact(service_id));
+    by_name[i].push_back(GetRuntimeFact(service_id));
+    by_tenant[i].push_back(GetTenantFact(service_id));
+    by_tenant[i].push_back(GetRegionFact(service_id));
+    by_region[i].push_back(GetRegionFact(service_id));
+    by_region[i].push_back(GetRuntimeFact(service_id));
+  }
+
+  return MeasureQueries("name_runtime", index, facts, by_name) &&
+    MeasureQueries("tenant_region", index, facts, by_tenant) &&
+    MeasureQueries("region_runtime", index, facts, by_region);
+}
+
+}  // namespace perf_test
+}  // namespace node
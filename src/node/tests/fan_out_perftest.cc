@@ -0,0 +1,103 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+//
+// Measures the cost of sending a packet to many instances. The node creates
+// the frame of a packet once and shares it with every destination, it used
+// to create a frame for each one of them. The copy of the serialized bytes
+// is what each destination costed at least, the serialization itself is not
+// counted.
+
+// Should be included first to avoid conflicts with the "windows.h" indirectly
+// included by the base headers.
+#include <zmq.h>
+
+#include <string.h>
+
+#include <vector>
+
+#include <base/logging.h>
+#include <base/memory/ref_counted.h>
+#include <base/string_number_conversions.h>
+
+#include "node/tests/perf_test.h"
+#include "node/zeromq/message.h"
+
+namespace node {
+namespace perf_test {
+
+namespace {
+
+// The size of a typical packet, which is not stored inline by zeromq.
+const int kPacketSize = 512;
+
+// The number of packets that is sent to every destination.
+const int kPackets = 20000;
+
+// The number of instances that the packets are broadcasted to.
+const int kInstanceCounts[] = { 1, 10, 100 };
+
+// Creates the frame of the packet for each one of the destinations, like a
+// packet that is serialized for each one of them.
+bool MeasureCopy(const std::vector<char>& packet, int instances) {
+  std::vector<scoped_refptr<zmq::Message> > frames(instances);
+  PerfTimer timer;
+  for (int i = 0; i < kPackets; ++i) {
+    for (int j = 0; j < instances; ++j) {
+      frames[j] = new zmq::Message(kPacketSize);
+      memcpy(frames[j]->mutable_data(), &packet[0], kPacketSize);
+    }
+  }
+  PrintTimePerOperation("fan_out", "copy_" + base::IntToString(instances),
+    timer.Elapsed(), kPackets);
+  return true;
+}
+
+// Creates the frame of the packet once and shares it with the other
+// destinations.
+bool MeasureShare(const std::vector<char>& packet, int instances) {
+  std::vector<scoped_refptr<zmq::Message> > frames(instances);
+  PerfTimer timer;
+  for (int i = 0; i < kPackets; ++i) {
+    frames[0] = new zmq::Message(kPacketSize);
+    memcpy(frames[0]->mutable_data(), &packet[0], kPacketSize);
+    for (int j = 1; j < instances; ++j) {
+      frames[j] = frames[0]->Share();
+      if (!frames[j]) {
+        LOG(ERROR) << "The packet frame could not be shared.";
+        return false;
+      }
+    }
+  }
+  PrintTimePerOperation("fan_out", "share_" + base::IntToString(instances),
+    timer.Elapsed(), kPackets);
+
+  // Every destination should see the bytes of the packet.
+  for (int j = 0; j < instances; ++j) {
+    if (frames[j]->size() != static_cast<size_t>(kPacketSize) ||
+      memcmp(frames[j]->mutable_data(), &packet[0], kPacketSize) != 0) {
+      LOG(ERROR) << "A shared frame does not match the packet.";
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+bool FanOutPerfTest() {
+  std::vector<char> packet(kPacketSize);
+  for (int i = 0; i < kPacketSize; ++i) {
+    packet[i] = static_cast<char>(i);
+  }
+
+  bool succeeded = true;
+  for (size_t i = 0; i < arraysize(kInstanceCounts); ++i) {
+    succeeded &= MeasureCopy(packet, kInstanceCounts[i]);
+    succeeded &= MeasureShare(packet, kInstanceCounts[i]);
+  }
+  return succeeded;
+}
+
+}  // namespace perf_test
+}  // namespace node
@@ -0,0 +1,134 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+//
+// Measures how the load balancer scales with the number of threads that
+// share it. Each thread does what a routing worker does for every request
+// and reply of a balanced service: chooses an instance, accounts the request
+// and correlates its reply. Those are the only routing steps that write
+// state shared by the workers, the routes themselves are read from an
+// immutable snapshot. The routing workers themselves are measured by the
+// routing_workers test.
+
+#include <string>
+#include <vector>
+
+#include <base/logging.h>
+#include <base/memory/ref_counted.h>
+#include <base/string_number_conversions.h>
+#include <base/threading/platform_thread.h>
+
+#include "node/service/load_balancer.h"
+#include "node/tests/perf_test.h"
+
+namespace node {
+namespace perf_test {
+
+namespace {
+
+// The number of instances of the balanced service.
+const int kInstances = 8;
+
+// The number of requests that each thread keeps waiting for a reply, and
+// the number of times each thread sends and receives them.
+const int kInFlight = 64;
+const int kRounds = 4000;
+
+// The number of routing threads that are measured.
+const int kThreadCounts[] = { 1, 2, 4, 8 };
+
+class RoutingThread : public base::PlatformThread::Delegate {
+ public:
+  RoutingThread(ServiceRoutes* routes, LoadBalancer* balancer, int index)
+    : routes_(routes),
+      balancer_(balancer),
+      seed_(static_cast<uint32>(index) * 2654435761U | 1),
+      requester_("client-" + base::IntToString(index)),
+      request_ids_(kInFlight),
+      chosen_(kInFlight) {
+    for (int i = 0; i < kInFlight; ++i) {
+      request_ids_[i] = base::IntToString(i);
+    }
+  }
+
+  virtual void ThreadMain() {
+    for (int round = 0; round < kRounds; ++round) {
+      base::TimeTicks now = base::TimeTicks::Now();
+      for (int i = 0; i < kInFlight; ++i) {
+        chosen_[i] = routes_->Choose(kLeastOutstandingRouting, std::string(),
+          &seed_);
+        balancer_->OnRequestSent(chosen_[i], requester_, request_ids_[i],
+          now);
+      }
+
+      now = base::TimeTicks::Now();
+      for (int i = 0; i < kInFlight; ++i) {
+        balancer_->OnReplyReceived(chosen_[i]->address(), requester_,
+          request_ids_[i], now);
+      }
+    }
+  }
+
+ private:
+  ServiceRoutes* routes_;
+  LoadBalancer* balancer_;
+  uint32 seed_;
+  std::string requester_;
+  std::vector<std::string> request_ids_;
+  std::vector<RouteStats*> chosen_;
+
+  DISALLOW_COPY_AND_ASSIGN(RoutingThread);
+};
+
+}  // namespace
+
+bool LoadBalancerPerfTest() {
+  scoped_refptr<ServiceRoutes> routes(
+    new ServiceRoutes(kLeastOutstandingRouting, NULL));
+  for (int i = 0; i < kInstances; ++i) {
+    routes->Add(new RouteStats("instance-" + base::IntToString(i)));
+  }
+
+  bool succeeded = true;
+  for (size_t i = 0; i < arraysize(kThreadCounts); ++i) {
+    int threads_count = kThreadCounts[i];
+    LoadBalancer balancer;
+    std::vector<RoutingThread*> threads(threads_count);
+    std::vector<base::PlatformThreadHandle> handles(threads_count);
+    for (int j = 0; j < threads_count; ++j) {
+      threads[j] = new RoutingThread(routes.get(), &balancer, j);
+    }
+
+    PerfTimer timer;
+    for (int j = 0; j < threads_count; ++j) {
+      if (!base::PlatformThread::Create(0, threads[j], &handles[j])) {
+        LOG(ERROR) << "The routing thread could not be created.";
+        return false;
+      }
+    }
+    for (int j = 0; j < threads_count; ++j) {
+      base::PlatformThread::Join(handles[j]);
+    }
+    base::TimeDelta elapsed = timer.Elapsed();
+
+    for (int j = 0; j < threads_count; ++j) {
+      delete threads[j];
+    }
+
+    int64 requests = static_cast<int64>(threads_count) * kRounds * kInFlight;
+    PrintThroughput("load_balancer",
+      "threads_" + base::IntToString(threads_count), elapsed, requests);
+
+    // Every request should have been correlated with its reply.
+    if (balancer.has_pending_requests() ||
+      balancer.replies_count() != requests) {
+      LOG(ERROR) << "The replies of " << threads_count << " threads was "
+                 << "not correlated with their requests.";
+      succeeded = false;
+    }
+  }
+  return succeeded;
+}
+
+}  // namespace perf_test
+}  // namespace node
@@ -0,0 +1,157 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+//
+// Compares the MessagePool with the heap, for the sizes of the frames that
+// are routed by the node, and the messages created through it with the raw
+// zeromq messages.
+
+// Should be included first to avoid conflicts with the "windows.h" indirectly
+// included by the base headers.
+#include <zmq.h>
+
+#include <vector>
+
+#include <base/memory/ref_counted.h>
+#include <base/string_number_conversions.h>
+
+#include "node/tests/perf_test.h"
+#include "node/zeromq/message.h"
+#include "node/zeromq/message_pool.h"
+
+namespace node {
+namespace perf_test {
+
+namespace {
+
+// The number of blocks that are alive at once, which is about the number of
+// frames that are queued by the node under load, and the number of times
+// they are allocated and released.
+const int kLiveBlocks = 256;
+const int kRounds = 4000;
+
+// The number of blocks that are alive at once when the cache is checked,
+// which fits the cache of every size class.
+const int kSteadyLiveBlocks = 32;
+
+// The sizes of a delimiter, an identity, a typical packet and a large
+// payload.
+const size_t kSizes[] = { 0, 17, 512, 32 * 1024 };
+
+void MeasurePool(size_t size) {
+  zmq::MessagePool* pool = zmq::MessagePool::Current();
+  std::vector<void*> blocks(kLiveBlocks);
+
+  // Warms up the cache of the size class, like a node that is running for a
+  // while.
+  for (int i = 0; i < kLiveBlocks; ++i) {
+    blocks[i] = pool->Allocate(size);
+  }
+  for (int i = 0; i < kLiveBlocks; ++i) {
+    zmq::MessagePool::Free(blocks[i]);
+  }
+
+  PerfTimer timer;
+  for (int round = 0; round < kRounds; ++round) {
+    for (int i = 0; i < kLiveBlocks; ++i) {
+      blocks[i] = pool->Allocate(size);
+    }
+    for (int i = 0; i < kLiveBlocks; ++i) {
+      zmq::MessagePool::Free(blocks[i]);
+    }
+  }
+  PrintTimePerOperation("message_pool", "pool_" + base::IntToString(
+    static_cast<int>(size)), timer.Elapsed(),
+    static_cast<int64>(kRounds) * kLiveBlocks);
+}
+
+void MeasureHeap(size_t size) {
+  std::vector<char*> blocks(kLiveBlocks);
+  PerfTimer timer;
+  for (int round = 0; round < kRounds; ++round) {
+    for (int i = 0; i < kLiveBlocks; ++i) {
+      blocks[i] = new char[size ? size : 1];
+    }
+    for (int i = 0; i < kLiveBlocks; ++i) {
+      delete[] blocks[i];
+    }
+  }
+  PrintTimePerOperation("message_pool", "heap_" + base::IntToString(
+    static_cast<int>(size)), timer.Elapsed(),
+    static_cast<int64>(kRounds) * kLiveBlocks);
+}
+
+void MeasureMessages(int size) {
+  std::vector<scoped_refptr<zmq::Message> > messages(kLiveBlocks);
+  PerfTimer timer;
+  for (int round = 0; round < kRounds; ++round) {
+    for (int i = 0; i < kLiveBlocks; ++i) {
+      messages[i] = new zmq::Message(size);
+    }
+    for (int i = 0; i < kLiveBlocks; ++i) {
+      messages[i] = NULL;
+    }
+  }
+  PrintTimePerOperation("message_pool", "message_" + base::IntToString(size),
+    timer.Elapsed(), static_cast<int64>(kRounds) * kLiveBlocks);
+}
+
+void MeasureRawMessages(int size) {
+  std::vector<zmq_msg_t> messages(kLiveBlocks);
+  PerfTimer timer;
+  for (int round = 0; round < kRounds; ++round) {
+    for (int i = 0; i < kLiveBlocks; ++i) {
+      zmq_msg_init_size(&messages[i], size);
+    }
+    for (int i = 0; i < kLiveBlocks; ++i) {
+      zmq_msg_close(&messages[i]);
+    }
+  }
+  PrintTimePerOperation("message_pool", "raw_message_" +
+    base::IntToString(size), timer.Elapsed(),
+    static_cast<int64>(kRounds) * kLiveBlocks);
+}
+
+}  // namespace
+
+bool MessagePoolPerfTest() {
+  for (size_t i = 0; i < arraysize(kSizes); ++i) {
+    MeasurePool(kSizes[i]);
+    MeasureHeap(kSizes[i]);
+  }
+  for (size_t i = 1; i < arraysize(kSizes); ++i) {
+    MeasureMessages(static_cast<int>(kSizes[i]));
+    MeasureRawMessages(static_cast<int>(kSizes[i]));
+  }
+
+  // Once the cache is warm, the blocks of the pooled sizes should never be
+  // allocated from the heap again, while no more blocks are alive than the
+  // smallest cache holds.
+  zmq::MessagePool* pool = zmq::MessagePool::Current();
+  zmq::MessagePool::Stats before = pool->GetStats();
+  std::vector<void*> blocks(kSteadyLiveBlocks);
+  for (int round = 0; round < kRounds; ++round) {
+    for (size_t i = 0; i < arraysize(kSizes); ++i) {
+      for (int j = 0; j < kSteadyLiveBlocks; ++j) {
+        blocks[j] = pool->Allocate(kSizes[i]);
+      }
+      for (int j = 0; j < kSteadyLiveBlocks; ++j) {
+        zmq::MessagePool::Free(blocks[j]);
+      }
+    }
+  }
+  zmq::MessagePool::Stats after = pool->GetStats();
+  bool succeeded = true;
+  for (int i = 0; i < zmq::MessagePool::kNumberOfSizeClasses; ++i) {
+    int64 misses = after.classes[i].misses - before.classes[i].misses;
+    PrintResult("message_pool", "steady_misses_class_" + base::IntToString(i),
+      static_cast<double>(misses), "blocks");
+    if (misses) {
+      succeeded = false;
+    }
+  }
+  return succeeded;
+}
+
+}  // namespace perf_test
+}  // namespace node
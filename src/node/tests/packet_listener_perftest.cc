@@ -0,0 +1,273 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+//
+// Compares the two ways a client could send requests to the node: the
+// plain TCP connections of the PacketListener and the zeromq message
+// channel, whose ROUTER socket is used by the hosts. A message receiver that
+// listens on both is run, and a client of each kind sends bursts of the
+// same requests to a service through it over the loopback. The service is
+// reached through the message channel in both cases, so the difference is
+// the cost of receiving and routing the requests of each path.
+
+#include "build/build_config.h"
+
+#if defined(OS_WIN)
+#include <winsock2.h>
+#else
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+// Should be included before the base headers to avoid conflicts with the
+// "windows.h" they indirectly includes.
+#include <zmq.h>
+
+#include <string.h>
+
+#include <string>
+
+#include <base/logging.h>
+#include <base/memory/ref_counted.h>
+#include <base/string_number_conversions.h>
+#include <base/threading/platform_thread.h>
+
+#include "node/service/message_receiver.h"
+#include "node/tests/perf_test.h"
+#include "node/tests/receiver_perf_test.h"
+#include "node/zeromq/message.h"
+#include "node/zeromq/socket.h"
+
+namespace node {
+namespace perf_test {
+
+namespace {
+
+// The ports of the message channel and of the packet listener.
+const int kMessageChannelPort = 18560;
+const int kPacketListenerPort = 18561;
+
+// The size of the payload of each request.
+const int kPayloadSize = 256;
+
+// The number of bursts that is sent through each path.
+const int kBursts = 200;
+
+// The number of requests that is sent back to back in a burst. A burst of
+// a single request shows the latency of each path, the larger ones shows
+// its throughput.
+const int kBurstSizes[] = { 1, 64 };
+
+// How long a request waits to be routed before the path fails.
+const int kReceiveTimeoutMs = 5000;
+
+// Sends the requests of a measure through one of the paths.
+class RequestSender {
+ public:
+  virtual ~RequestSender() {}
+
+  virtual bool Send(zmq::Message* frame) = 0;
+};
+
+// Sends the requests through a zeromq socket connected to the message
+// channel of the node.
+class ChannelSender : public RequestSender {
+ public:
+  explicit ChannelSender(zmq::Socket* client) : client_(client) {}
+
+  virtual bool Send(zmq::Message* frame) OVERRIDE {
+    return SendRequest(client_, frame);
+  }
+
+ private:
+  zmq::Socket* client_;
+
+  DISALLOW_COPY_AND_ASSIGN(ChannelSender);
+};
+
+// Sends the requests through a plain TCP connection to the packet listener
+// of the node. The frames of the requests are already framed as the
+// listener expects, since their size fields are set.
+class ListenerSender : public RequestSender {
+ public:
+  ListenerSender() : socket_(-1) {}
+
+  virtual ~ListenerSender() {
+    Close();
+  }
+
+  // Connects to the packet listener that listens on |port| of the loopback
+  // interface. Returns false if the connection could not be established.
+  bool Connect(int port) {
+    DCHECK_EQ(socket_, -1);
+#if defined(OS_WIN)
+    SOCKET native_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (native_socket == INVALID_SOCKET) {
+      return false;
+    }
+    socket_ = static_cast<int>(native_socket);
+#else
+    socket_ = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (socket_ < 0) {
+      return false;
+    }
+#endif
+
+    // The requests are written as soon as they are sent, like zeromq does.
+    int no_delay = 1;
+    setsockopt(socket_, IPPROTO_TCP, TCP_NODELAY,
+      reinterpret_cast<const char*>(&no_delay), sizeof(no_delay));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(static_cast<uint16>(port));
+    if (connect(socket_, reinterpret_cast<struct sockaddr*>(&address),
+      sizeof(address)) != 0) {
+      Close();
+      return false;
+    }
+    return true;
+  }
+
+  void Close() {
+    if (socket_ == -1) {
+      return;
+    }
+#if defined(OS_WIN)
+    closesocket(static_cast<SOCKET>(socket_));
+#else
+    close(socket_);
+#endif
+    socket_ = -1;
+  }
+
+  virtual bool Send(zmq::Message* frame) OVERRIDE {
+    const char* data = static_cast<const char*>(frame->mutable_data());
+    size_t size = frame->size();
+    while (size > 0) {
+      int sent = send(socket_, data, static_cast<int>(size), 0);
+      if (sent <= 0) {
+        return false;
+      }
+      data += sent;
+      size -= sent;
+    }
+    return true;
+  }
+
+ private:
+  int socket_;
+
+  DISALLOW_COPY_AND_ASSIGN(ListenerSender);
+};
+
+bool MeasureBursts(const std::string& trace, RequestSender* sender,
+  zmq::Socket* service, int burst_size) {
+  scoped_refptr<zmq::Message> request(CreateRequest("1", kPayloadSize));
+  base::TimeDelta bursts_time;
+  PerfTimer timer;
+  for (int i = 0; i < kBursts; ++i) {
+    base::TimeTicks burst_start = base::TimeTicks::HighResNow();
+    for (int j = 0; j < burst_size; ++j) {
+      scoped_refptr<zmq::Message> frame(request->Share());
+      if (!frame || !sender->Send(frame.get())) {
+        LOG(ERROR) << "The request could not be sent.";
+        return false;
+      }
+    }
+    for (int j = 0; j < burst_size; ++j) {
+      if (!ReceiveRequest(service, kReceiveTimeoutMs, NULL)) {
+        LOG(ERROR) << "The request was not routed to the service.";
+        return false;
+      }
+    }
+    bursts_time += base::TimeTicks::HighResNow() - burst_start;
+  }
+  base::TimeDelta elapsed = timer.Elapsed();
+
+  std::string burst_trace(trace + "_burst_" + base::IntToString(burst_size));
+  PrintThroughput("packet_listener", burst_trace, elapsed,
+    static_cast<int64>(kBursts) * burst_size);
+  PrintResult("packet_listener", burst_trace + "_latency",
+    bursts_time.InMicroseconds() / static_cast<double>(kBursts), "us");
+  return true;
+}
+
+bool MeasurePath(const std::string& trace, RequestSender* sender,
+  zmq::Socket* service) {
+  for (size_t i = 0; i < arraysize(kBurstSizes); ++i) {
+    if (!MeasureBursts(trace, sender, service, kBurstSizes[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+bool PacketListenerPerfTest() {
+  ReceiverTestEnvironment environment;
+  if (!environment.Init()) {
+    return false;
+  }
+
+  zmq::Context* context = environment.context();
+  MessageReceiver receiver(context, environment.router());
+  receiver.set_message_channel_port(kMessageChannelPort);
+  receiver.set_packet_listener_port(kPacketListenerPort);
+
+  ReceiverThread receiver_thread(&receiver);
+  if (!receiver_thread.Start()) {
+    return false;
+  }
+
+  std::string endpoint(GetLoopbackEndpoint(kMessageChannelPort));
+  bool succeeded;
+  {
+    zmq::Socket service(context->CreateSocket(zmq::kDealer));
+    zmq::Socket client(context->CreateSocket(zmq::kDealer));
+    succeeded = service.SetLinger(0) && client.SetLinger(0) &&
+      service.SetIdentity(kTestServiceAddress) &&
+      service.Connect(endpoint.c_str()) && client.Connect(endpoint.c_str());
+    if (!succeeded || !WaitForService(&client, &service)) {
+      LOG(ERROR) << "The service could not be reached through the node.";
+      succeeded = false;
+    }
+
+    if (succeeded) {
+      ChannelSender channel_sender(&client);
+      succeeded = MeasurePath("router", &channel_sender, &service);
+    }
+
+    // The connection is accepted by the receiver thread, so the first
+    // request also waits for the listener to watch it.
+    ListenerSender listener_sender;
+    if (succeeded) {
+      scoped_refptr<zmq::Message> request(CreateRequest("0", 0));
+      succeeded = listener_sender.Connect(kPacketListenerPort) &&
+        listener_sender.Send(request.get()) &&
+        ReceiveRequest(&service, kReceiveTimeoutMs, NULL);
+      if (!succeeded) {
+        LOG(ERROR) << "The service could not be reached through the packet "
+          << "listener.";
+      }
+    }
+
+    if (succeeded) {
+      succeeded = MeasurePath("listener", &listener_sender, &service);
+    }
+    listener_sender.Close();
+    client.Close();
+    service.Close();
+  }
+
+  receiver_thread.Stop();
+  return succeeded;
+}
+
+}  // namespace perf_test
+}  // namespace node
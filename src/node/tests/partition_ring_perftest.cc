@@ -0,0 +1,127 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+//
+// Measures how many partition keys move when an instance joins or leaves a
+// partitioned service, and how long it takes to find the owner of a key.
+// The routes are changed the way the routing snapshots change them, by
+// copying the previous routes and adding or removing one instance. Only the
+// keys of the instance that has joined or left should move.
+
+#include <string>
+#include <vector>
+
+#include <base/logging.h>
+#include <base/memory/ref_counted.h>
+#include <base/string_number_conversions.h>
+
+#include "node/service/load_balancer.h"
+#include "node/tests/perf_test.h"
+
+namespace node {
+namespace perf_test {
+
+namespace {
+
+// The number of instances that are running before one joins or leaves, and
+// the number of partition keys that are routed.
+const int kInstances = 5;
+const int kKeys = 100000;
+
+// The instance that leaves the service.
+const int kLeavingInstance = 2;
+
+std::string GetInstanceAddress(int index) {
+  return "instance-" + base::IntToString(index);
+}
+
+// Gets the address of the instance that owns each one of |keys|.
+std::vector<std::string> GetOwners(ServiceRoutes* routes,
+  const std::vector<std::string>& keys) {
+  std::vector<std::string> owners(keys.size());
+  uint32 seed = 1;
+  for (size_t i = 0; i < keys.size(); ++i) {
+    owners[i] = routes->Choose(kPartitionedRouting, keys[i], &seed)->address();
+  }
+  return owners;
+}
+
+// Counts the keys whose owners in |before| and |after| differ. Returns false
+// if a key has moved from or to an instance other than |address|, which is
+// the one that has joined or left.
+bool CountMovedKeys(const std::vector<std::string>& before,
+  const std::vector<std::string>& after, const std::string& address,
+  int* moved) {
+  *moved = 0;
+  for (size_t i = 0; i < before.size(); ++i) {
+    if (before[i] == after[i]) {
+      continue;
+    }
+    if (before[i] != address && after[i] != address) {
+      LOG(ERROR) << "A key has moved between two instances that was running "
+                 << "before and after " << address << " changed.";
+      return false;
+    }
+    ++*moved;
+  }
+  return true;
+}
+
+void PrintMovedKeys(const std::string& trace, int moved) {
+  PrintResult("partition_ring", trace + "_moved_keys",
+    moved * 100.0 / kKeys, "%");
+}
+
+}  // namespace
+
+bool PartitionRingPerfTest() {
+  std::vector<std::string> keys(kKeys);
+  for (int i = 0; i < kKeys; ++i) {
+    keys[i] = "account-" + base::IntToString(i);
+  }
+
+  scoped_refptr<ServiceRoutes> routes(
+    new ServiceRoutes(kPartitionedRouting, NULL));
+  for (int i = 0; i < kInstances; ++i) {
+    routes->Add(new RouteStats(GetInstanceAddress(i)));
+  }
+  std::vector<std::string> owners(GetOwners(routes.get(), keys));
+
+  std::string joining(GetInstanceAddress(kInstances));
+  scoped_refptr<ServiceRoutes> joined(
+    new ServiceRoutes(kPartitionedRouting, routes.get()));
+  joined->Add(new RouteStats(joining));
+  int moved;
+  if (!CountMovedKeys(owners, GetOwners(joined.get(), keys), joining,
+    &moved)) {
+    return false;
+  }
+  PrintMovedKeys("join", moved);
+
+  std::string leaving(GetInstanceAddress(kLeavingInstance));
+  scoped_refptr<ServiceRoutes> left(
+    new ServiceRoutes(kPartitionedRouting, routes.get()));
+  left->Remove(leaving);
+  std::vector<std::string> left_owners(GetOwners(left.get(), keys));
+  if (!CountMovedKeys(owners, left_owners, leaving, &moved)) {
+    return false;
+  }
+  for (int i = 0; i < kKeys; ++i) {
+    if (left_owners[i] == leaving) {
+      LOG(ERROR) << "A key is still owned by the instance that has left.";
+      return false;
+    }
+  }
+  PrintMovedKeys("leave", moved);
+
+  PerfTimer timer;
+  uint32 seed = 1;
+  for (int i = 0; i < kKeys; ++i) {
+    routes->Choose(kPartitionedRouting, keys[i], &seed);
+  }
+  PrintTimePerOperation("partition_ring", "lookup", timer.Elapsed(), kKeys);
+  return true;
+}
+
+}  // namespace perf_test
+}  // namespace node
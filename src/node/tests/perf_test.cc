@@ -0,0 +1,34 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+
+#include "node/tests/perf_test.h"
+
+#include <stdio.h>
+
+namespace node {
+namespace perf_test {
+
+void PrintResult(const std::string& measurement, const std::string& trace,
+  double value, const std::string& units) {
+  printf("*RESULT %s: %s= %.3f %s\n", measurement.c_str(), trace.c_str(),
+    value, units.c_str());
+  fflush(stdout);
+}
+
+void PrintTimePerOperation(const std::string& measurement,
+  const std::string& trace, base::TimeDelta elapsed, int64 operations) {
+  double nanoseconds = static_cast<double>(elapsed.InMicroseconds()) * 1000;
+  PrintResult(measurement, trace,
+    operations ? nanoseconds / operations : 0, "ns/op");
+}
+
+void PrintThroughput(const std::string& measurement, const std::string& trace,
+  base::TimeDelta elapsed, int64 operations) {
+  double seconds = elapsed.InSecondsF();
+  PrintResult(measurement, trace,
+    seconds > 0 ? operations / seconds : 0, "ops/s");
+}
+
+}  // namespace perf_test
+}  // namespace node
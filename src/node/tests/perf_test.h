@@ -0,0 +1,64 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+
+#ifndef NODE_TESTS_PERF_TEST_H_
+#define NODE_TESTS_PERF_TEST_H_
+#pragma once
+
+#include <string>
+
+#include <base/basictypes.h>
+#include <base/time.h>
+
+namespace node {
+namespace perf_test {
+
+// Prints the result of a measurement as a line like:
+//
+//   *RESULT message_pool: allocate_64= 12.5 ns/op
+//
+// which is easy to collect from the output of several runs.
+void PrintResult(const std::string& measurement, const std::string& trace,
+  double value, const std::string& units);
+
+// Prints the time spent by each one of |operations| operations that took
+// |elapsed| overall, in nanoseconds per operation.
+void PrintTimePerOperation(const std::string& measurement,
+  const std::string& trace, base::TimeDelta elapsed, int64 operations);
+
+// Prints the number of |operations| done in |elapsed|, per second.
+void PrintThroughput(const std::string& measurement, const std::string& trace,
+  base::TimeDelta elapsed, int64 operations);
+
+// Measures the time elapsed since it was created.
+class PerfTimer {
+ public:
+  PerfTimer() : begin_(base::TimeTicks::HighResNow()) {}
+
+  base::TimeDelta Elapsed() const {
+    return base::TimeTicks::HighResNow() - begin_;
+  }
+
+ private:
+  base::TimeTicks begin_;
+
+  DISALLOW_COPY_AND_ASSIGN(PerfTimer);
+};
+
+// The performance tests, each one prints its results through PrintResult()
+// and returns false if the code it measures does not behave as expected.
+bool FactIndexPerfTest();
+bool FanOutPerfTest();
+bool LoadBalancerPerfTest();
+bool MessagePoolPerfTest();
+bool PacketListenerPerfTest();
+bool PartitionRingPerfTest();
+bool RoutingBatchPerfTest();
+bool RoutingWorkersPerfTest();
+bool SocketOptionsPerfTest();
+
+}  // namespace perf_test
+}  // namespace node
+
+#endif  // NODE_TESTS_PERF_TEST_H_
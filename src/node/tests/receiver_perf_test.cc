@@ -0,0 +1,183 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+
+// Should be included first to avoid conflicts with the "windows.h" indirectly
+// included by the base headers.
+#include <zmq.h>
+
+#include "node/tests/receiver_perf_test.h"
+
+#include <utility>
+
+#include <base/file_path.h>
+#include <base/logging.h>
+#include <base/string_number_conversions.h>
+#include <ruby_protos.pb.h>
+
+#include "node/service/constants.h"
+#include "node/service/message_receiver.h"
+#include "node/service/service_metadata.h"
+#include "node/zeromq/message.h"
+
+namespace node {
+namespace perf_test {
+
+namespace rp = ::ruby::protocol;
+
+const char kTestServiceName[] = "receiver-perftest";
+const char kTestServiceAddress[] = "receiver-perftest-instance";
+
+ReceiverTestEnvironment::ReceiverTestEnvironment() {
+}
+
+ReceiverTestEnvironment::~ReceiverTestEnvironment() {
+}
+
+bool ReceiverTestEnvironment::Init() {
+  if (!temp_dir_.CreateUniqueTempDir()) {
+    LOG(ERROR) << "The temporary directory could not be created.";
+    return false;
+  }
+
+  if (!services_db_.Open(temp_dir_.path().Append(kServicesDatabaseFilename))
+    || !routing_db_.Open()) {
+    LOG(ERROR) << "The databases could not be opened.";
+    return false;
+  }
+
+  if (!context_.Open(1)) {
+    LOG(ERROR) << "The zeromq context could not be opened.";
+    return false;
+  }
+
+  router_.reset(new MessageRouter(&services_db_, &routing_db_));
+  scoped_refptr<ServiceMetadata> metadata(new ServiceMetadata());
+  metadata->set_service_name(kTestServiceName);
+  ServiceFactSet facts;
+  facts.push_back(std::make_pair(kServiceNameFact, kTestServiceName));
+  if (!router_->AddService(facts, metadata.get()) ||
+    !router_->AddRoute(kTestServiceAddress, facts, kTcpTransport,
+      kBroadcastRouting)) {
+    LOG(ERROR) << "The route to the service could not be added.";
+    return false;
+  }
+  return true;
+}
+
+ReceiverThread::ReceiverThread(MessageReceiver* receiver)
+  : receiver_(receiver),
+    started_(false) {
+  DCHECK(receiver);
+}
+
+ReceiverThread::~ReceiverThread() {
+  Stop();
+}
+
+bool ReceiverThread::Start() {
+  DCHECK(!started_);
+  if (!receiver_->Bind()) {
+    LOG(ERROR) << "The message receiver could not be bound.";
+    return false;
+  }
+  if (!base::PlatformThread::Create(0, this, &handle_)) {
+    LOG(ERROR) << "The receiver thread could not be created.";
+    return false;
+  }
+  started_ = true;
+  return true;
+}
+
+void ReceiverThread::Stop() {
+  if (!started_) {
+    return;
+  }
+  receiver_->Stop();
+  base::PlatformThread::Join(handle_);
+  started_ = false;
+}
+
+void ReceiverThread::ThreadMain() {
+  receiver_->Run();
+}
+
+std::string GetLoopbackEndpoint(int port) {
+  return "tcp://127.0.0.1:" + base::IntToString(port);
+}
+
+scoped_refptr<zmq::Message> CreateRequest(const std::string& id,
+  int payload_size) {
+  rp::RubyMessagePacket packet;
+  rp::RubyMessage* message = packet.mutable_message();
+  message->set_id(id);
+  message->set_type(1);
+  message->set_message(std::string(payload_size, 'x'));
+
+  rp::RubyMessageHeader* header = packet.mutable_header();
+  ruby::KeyValuePair* fact = header->add_facts();
+  fact->set_key(kServiceNameFact);
+  fact->set_value(kTestServiceName);
+  header->set_size(message->ByteSize());
+  packet.set_header_size(header->ByteSize());
+  packet.set_size(packet.ByteSize());
+
+  int size = packet.ByteSize();
+  scoped_refptr<zmq::Message> frame(new zmq::Message(size));
+  packet.SerializeToArray(frame->mutable_data(), size);
+  return frame;
+}
+
+bool GetRequestId(const zmq::Socket::MessageParts& parts, std::string* id) {
+  DCHECK(id);
+  rp::RubyMessagePacket packet;
+  if (parts.empty() || !parts.back() ||
+    !packet.ParseFromArray(parts.back()->mutable_data(),
+      parts.back()->size())) {
+    return false;
+  }
+  *id = packet.message().id();
+  return true;
+}
+
+bool SendRequest(zmq::Socket* client, zmq::Message* frame) {
+  scoped_refptr<zmq::Message> frames[2] = { NULL, frame };
+  return client->Send(zmq::Envelope(frames, arraysize(frames)),
+    zmq::kNoFlags);
+}
+
+bool ReceiveRequest(zmq::Socket* service, int timeout_ms,
+  zmq::Socket::MessageParts* parts) {
+  base::TimeTicks deadline = base::TimeTicks::Now() +
+    base::TimeDelta::FromMilliseconds(timeout_ms);
+  zmq::Socket::MessageParts received;
+  while (!service->Receive(&received, zmq::kNoBlock)) {
+    if (base::TimeTicks::Now() >= deadline) {
+      return false;
+    }
+    base::PlatformThread::YieldCurrentThread();
+  }
+  if (parts) {
+    parts->swap(received);
+  }
+  return true;
+}
+
+bool WaitForService(zmq::Socket* client, zmq::Socket* service) {
+  scoped_refptr<zmq::Message> request(CreateRequest("0", 0));
+  for (int i = 0; i < 50; ++i) {
+    if (!SendRequest(client, request->Share().get())) {
+      return false;
+    }
+    if (ReceiveRequest(service, 100, NULL)) {
+      // Drains the requests that was sent while the service was connecting.
+      while (ReceiveRequest(service, 100, NULL)) {
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace perf_test
+}  // namespace node
@@ -0,0 +1,119 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+
+#ifndef NODE_TESTS_RECEIVER_PERF_TEST_H_
+#define NODE_TESTS_RECEIVER_PERF_TEST_H_
+#pragma once
+
+#include <string>
+
+#include <base/basictypes.h>
+#include <base/compiler_specific.h>
+#include <base/memory/ref_counted.h>
+#include <base/memory/scoped_ptr.h>
+#include <base/scoped_temp_dir.h>
+#include <base/threading/platform_thread.h>
+
+#include "node/service/message_router.h"
+#include "node/service/routing_database.h"
+#include "node/service/services_database.h"
+#include "node/zeromq/context.h"
+#include "node/zeromq/socket.h"
+
+namespace zmq {
+class Message;
+}
+
+namespace node {
+class MessageReceiver;
+
+namespace perf_test {
+
+// The service that receives the requests of the tests that measures a
+// message receiver, and the address of its single instance.
+extern const char kTestServiceName[];
+extern const char kTestServiceAddress[];
+
+// The databases, the zeromq context and the message router that are shared
+// by the message receivers of a test. The requests to the test service are
+// routed to its instance as if it had announced itself.
+class ReceiverTestEnvironment {
+ public:
+  ReceiverTestEnvironment();
+  ~ReceiverTestEnvironment();
+
+  // Opens the databases and the context and adds the route to the test
+  // service. Returns false if any of them fails.
+  bool Init();
+
+  zmq::Context* context() { return &context_; }
+  MessageRouter* router() { return router_.get(); }
+
+ private:
+  ScopedTempDir temp_dir_;
+  ServicesDatabase services_db_;
+  RoutingDatabase routing_db_;
+  zmq::Context context_;
+  scoped_ptr<MessageRouter> router_;
+
+  DISALLOW_COPY_AND_ASSIGN(ReceiverTestEnvironment);
+};
+
+// Runs a message receiver on its own thread, like the node does.
+class ReceiverThread : public base::PlatformThread::Delegate {
+ public:
+  explicit ReceiverThread(MessageReceiver* receiver);
+  virtual ~ReceiverThread();
+
+  // Binds the receiver and starts running it. Returns false if the receiver
+  // could not be bound or the thread could not be created.
+  bool Start();
+
+  // Stops the receiver and waits for its thread to finish. Called by the
+  // destructor when the thread is still running.
+  void Stop();
+
+  // base::PlatformThread::Delegate implementation.
+  virtual void ThreadMain() OVERRIDE;
+
+ private:
+  MessageReceiver* receiver_;
+  base::PlatformThreadHandle handle_;
+  bool started_;
+
+  DISALLOW_COPY_AND_ASSIGN(ReceiverThread);
+};
+
+// Gets the endpoint of the message channel that is bound to |port| of the
+// loopback interface.
+std::string GetLoopbackEndpoint(int port);
+
+// Creates the frame of a request to the test service whose ID is |id| and
+// whose payload has |payload_size| bytes.
+scoped_refptr<zmq::Message> CreateRequest(const std::string& id,
+  int payload_size);
+
+// Gets the ID of the request that was received in |parts|. Returns false if
+// the request could not be parsed.
+bool GetRequestId(const zmq::Socket::MessageParts& parts, std::string* id);
+
+// Sends |frame| through |client| as a request, which is an empty frame
+// followed by the packet.
+bool SendRequest(zmq::Socket* client, zmq::Message* frame);
+
+// Waits for a request to be routed to |service| and stores its frames into
+// |parts|, which could be NULL. Returns false if no request arrives in
+// |timeout_ms| milliseconds.
+bool ReceiveRequest(zmq::Socket* service, int timeout_ms,
+  zmq::Socket::MessageParts* parts);
+
+// Sends requests until the service receives one, since the router drops
+// the requests that are routed before the service is connected to it. The
+// requests that was sent while the service was connecting are drained.
+bool WaitForService(zmq::Socket* client, zmq::Socket* service);
+
+}  // namespace perf_test
+}  // namespace node
+
+#endif  // NODE_TESTS_RECEIVER_PERF_TEST_H_
@@ -0,0 +1,154 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+//
+// Measures how the --routing-batch-size and --routing-batch-delay switches
+// trade the latency of the messages for the throughput of the node. A
+// message receiver is run with each one of the measured settings, and a
+// client sends bursts of requests to a service through it. The client and
+// the service talk with the receiver over the loopback, like the hosts that
+// run in the same machine as the node.
+
+// Should be included first to avoid conflicts with the "windows.h" indirectly
+// included by the base headers.
+#include <zmq.h>
+
+#include <string>
+
+#include <base/logging.h>
+#include <base/memory/ref_counted.h>
+#include <base/string_number_conversions.h>
+#include <base/threading/platform_thread.h>
+
+#include "node/service/message_receiver.h"
+#include "node/tests/perf_test.h"
+#include "node/tests/receiver_perf_test.h"
+#include "node/zeromq/message.h"
+#include "node/zeromq/socket.h"
+
+namespace node {
+namespace perf_test {
+
+namespace {
+
+// The port of the first receiver, each setting uses the next one.
+const int kFirstPort = 18520;
+
+// The size of the payload of each request.
+const int kPayloadSize = 256;
+
+// The number of bursts that is sent for each setting.
+const int kBursts = 200;
+
+// The number of requests that is sent back to back in a burst. A burst of
+// a single request shows the latency that the delay adds to a node that is
+// not loaded, the larger ones shows what the batching saves.
+const int kBurstSizes[] = { 1, 64 };
+
+// How long a request waits to be routed before the setting fails.
+const int kReceiveTimeoutMs = 5000;
+
+struct BatchSettings {
+  int size;
+  int delay_ms;
+};
+
+// The default setting comes first.
+const BatchSettings kBatchSettings[] = {
+  { 64, 0 },
+  { 1, 0 },
+  { 16, 0 },
+  { 256, 0 },
+  { 64, 1 },
+  { 256, 5 },
+};
+
+bool MeasureBursts(const std::string& trace, zmq::Socket* client,
+  zmq::Socket* service, int burst_size) {
+  scoped_refptr<zmq::Message> request(CreateRequest("1", kPayloadSize));
+  base::TimeDelta bursts_time;
+  PerfTimer timer;
+  for (int i = 0; i < kBursts; ++i) {
+    base::TimeTicks burst_start = base::TimeTicks::HighResNow();
+    for (int j = 0; j < burst_size; ++j) {
+      scoped_refptr<zmq::Message> frame(request->Share());
+      if (!frame || !SendRequest(client, frame.get())) {
+        LOG(ERROR) << "The request could not be sent.";
+        return false;
+      }
+    }
+    for (int j = 0; j < burst_size; ++j) {
+      if (!ReceiveRequest(service, kReceiveTimeoutMs, NULL)) {
+        LOG(ERROR) << "The request was not routed to the service.";
+        return false;
+      }
+    }
+    bursts_time += base::TimeTicks::HighResNow() - burst_start;
+  }
+  base::TimeDelta elapsed = timer.Elapsed();
+
+  std::string burst_trace(trace + "_burst_" + base::IntToString(burst_size));
+  PrintThroughput("routing_batch", burst_trace, elapsed,
+    static_cast<int64>(kBursts) * burst_size);
+  PrintResult("routing_batch", burst_trace + "_latency",
+    bursts_time.InMicroseconds() / static_cast<double>(kBursts), "us");
+  return true;
+}
+
+bool MeasureSettings(zmq::Context* context, MessageRouter* router,
+  const BatchSettings& settings, int port) {
+  MessageReceiver receiver(context, router);
+  receiver.set_message_channel_port(port);
+  receiver.set_batch_size(settings.size);
+  receiver.set_batch_delay(
+    base::TimeDelta::FromMilliseconds(settings.delay_ms));
+
+  ReceiverThread receiver_thread(&receiver);
+  if (!receiver_thread.Start()) {
+    return false;
+  }
+
+  std::string endpoint(GetLoopbackEndpoint(port));
+  bool succeeded;
+  {
+    zmq::Socket service(context->CreateSocket(zmq::kDealer));
+    zmq::Socket client(context->CreateSocket(zmq::kDealer));
+    succeeded = service.SetLinger(0) && client.SetLinger(0) &&
+      service.SetIdentity(kTestServiceAddress) &&
+      service.Connect(endpoint.c_str()) && client.Connect(endpoint.c_str());
+    if (!succeeded || !WaitForService(&client, &service)) {
+      LOG(ERROR) << "The service could not be reached through the node.";
+      succeeded = false;
+    }
+
+    std::string trace("size_" + base::IntToString(settings.size) +
+      "_delay_" + base::IntToString(settings.delay_ms));
+    for (size_t i = 0; succeeded && i < arraysize(kBurstSizes); ++i) {
+      succeeded = MeasureBursts(trace, &client, &service, kBurstSizes[i]);
+    }
+    client.Close();
+    service.Close();
+  }
+
+  receiver_thread.Stop();
+  return succeeded;
+}
+
+}  // namespace
+
+bool RoutingBatchPerfTest() {
+  ReceiverTestEnvironment environment;
+  if (!environment.Init()) {
+    return false;
+  }
+
+  bool succeeded = true;
+  for (size_t i = 0; i < arraysize(kBatchSettings); ++i) {
+    succeeded &= MeasureSettings(environment.context(), environment.router(),
+      kBatchSettings[i], kFirstPort + static_cast<int>(i));
+  }
+  return succeeded;
+}
+
+}  // namespace perf_test
+}  // namespace node
@@ -0,0 +1,155 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+//
+// Measures how the throughput of the node scales with the --routing-workers
+// switch. A message receiver is run with each one of the measured number of
+// workers, and several clients sends bursts of requests to a service through
+// it. The workers are chosen by the identity of the sender, so each client
+// has its own identity to spread the requests over the workers, like the
+// hosts that is connected to a loaded node.
+
+// Should be included first to avoid conflicts with the "windows.h" indirectly
+// included by the base headers.
+#include <zmq.h>
+
+#include <string>
+
+#include <base/logging.h>
+#include <base/memory/ref_counted.h>
+#include <base/memory/scoped_vector.h>
+#include <base/string_number_conversions.h>
+#include <base/threading/platform_thread.h>
+
+#include "node/service/message_receiver.h"
+#include "node/tests/perf_test.h"
+#include "node/tests/receiver_perf_test.h"
+#include "node/zeromq/message.h"
+#include "node/zeromq/socket.h"
+
+namespace node {
+namespace perf_test {
+
+namespace {
+
+// The port of the first receiver, each number of workers uses the next one.
+const int kFirstPort = 18540;
+
+// The number of routing workers of each receiver. A receiver with no
+// workers routes the requests on its own thread and is measured first, as
+// the base line.
+const int kRoutingWorkers[] = { 0, 1, 2, 4, 8 };
+
+// The number of clients that sends requests at the same time.
+const int kClients = 8;
+
+// The size of the payload of each request.
+const int kPayloadSize = 256;
+
+// The number of bursts that each client sends for each number of workers.
+const int kBursts = 100;
+
+// The number of requests that each client sends back to back in a burst.
+const int kBurstSize = 64;
+
+// How long a request waits to be routed before the measure fails.
+const int kReceiveTimeoutMs = 5000;
+
+bool MeasureBursts(const std::string& trace,
+  const ScopedVector<zmq::Socket>& clients, zmq::Socket* service) {
+  scoped_refptr<zmq::Message> request(CreateRequest("1", kPayloadSize));
+  int requests_per_burst = kBurstSize * static_cast<int>(clients.size());
+  base::TimeDelta bursts_time;
+  PerfTimer timer;
+  for (int i = 0; i < kBursts; ++i) {
+    base::TimeTicks burst_start = base::TimeTicks::HighResNow();
+    for (int j = 0; j < kBurstSize; ++j) {
+      for (size_t k = 0; k < clients.size(); ++k) {
+        scoped_refptr<zmq::Message> frame(request->Share());
+        if (!frame || !SendRequest(clients[k], frame.get())) {
+          LOG(ERROR) << "The request could not be sent.";
+          return false;
+        }
+      }
+    }
+    for (int j = 0; j < requests_per_burst; ++j) {
+      if (!ReceiveRequest(service, kReceiveTimeoutMs, NULL)) {
+        LOG(ERROR) << "The request was not routed to the service.";
+        return false;
+      }
+    }
+    bursts_time += base::TimeTicks::HighResNow() - burst_start;
+  }
+  base::TimeDelta elapsed = timer.Elapsed();
+
+  PrintThroughput("routing_workers", trace, elapsed,
+    static_cast<int64>(kBursts) * requests_per_burst);
+  PrintResult("routing_workers", trace + "_burst_latency",
+    bursts_time.InMicroseconds() / static_cast<double>(kBursts), "us");
+  return true;
+}
+
+bool MeasureWorkers(zmq::Context* context, MessageRouter* router,
+  int workers, int port) {
+  MessageReceiver receiver(context, router);
+  receiver.set_message_channel_port(port);
+  receiver.set_routing_workers(workers);
+
+  ReceiverThread receiver_thread(&receiver);
+  if (!receiver_thread.Start()) {
+    return false;
+  }
+
+  std::string endpoint(GetLoopbackEndpoint(port));
+  bool succeeded;
+  {
+    zmq::Socket service(context->CreateSocket(zmq::kDealer));
+    succeeded = service.SetLinger(0) &&
+      service.SetIdentity(kTestServiceAddress) &&
+      service.Connect(endpoint.c_str());
+
+    ScopedVector<zmq::Socket> clients;
+    for (int i = 0; succeeded && i < kClients; ++i) {
+      zmq::Socket* client =
+        new zmq::Socket(context->CreateSocket(zmq::kDealer));
+      clients.push_back(client);
+      std::string identity("routing-workers-client-" + base::IntToString(i));
+      succeeded = client->SetLinger(0) &&
+        client->SetIdentity(identity) &&
+        client->Connect(endpoint.c_str()) &&
+        WaitForService(client, &service);
+    }
+    if (!succeeded) {
+      LOG(ERROR) << "The service could not be reached through the node.";
+    } else {
+      succeeded = MeasureBursts("workers_" + base::IntToString(workers),
+        clients, &service);
+    }
+    for (size_t i = 0; i < clients.size(); ++i) {
+      clients[i]->Close();
+    }
+    service.Close();
+  }
+
+  receiver_thread.Stop();
+  return succeeded;
+}
+
+}  // namespace
+
+bool RoutingWorkersPerfTest() {
+  ReceiverTestEnvironment environment;
+  if (!environment.Init()) {
+    return false;
+  }
+
+  bool succeeded = true;
+  for (size_t i = 0; i < arraysize(kRoutingWorkers); ++i) {
+    succeeded &= MeasureWorkers(environment.context(), environment.router(),
+      kRoutingWorkers[i], kFirstPort + static_cast<int>(i));
+  }
+  return succeeded;
+}
+
+}  // namespace perf_test
+}  // namespace node
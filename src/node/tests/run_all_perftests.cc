@@ -0,0 +1,71 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+//
+// Runs the performance tests of the node. The tests whose names are given
+// in the command line are run, or all of them if no name is given:
+//
+//   node_perftests [test_name...]
+//
+
+#include <stdio.h>
+#include <string.h>
+
+#include <base/at_exit.h>
+#include <base/basictypes.h>
+#include <base/command_line.h>
+
+#include "node/tests/perf_test.h"
+
+namespace {
+
+struct PerfTest {
+  const char* name;
+  bool (*run)();
+};
+
+const PerfTest kPerfTests[] = {
+  { "fact_index", node::perf_test::FactIndexPerfTest },
+  { "fan_out", node::perf_test::FanOutPerfTest },
+  { "load_balancer", node::perf_test::LoadBalancerPerfTest },
+  { "message_pool", node::perf_test::MessagePoolPerfTest },
+  { "packet_listener", node::perf_test::PacketListenerPerfTest },
+  { "partition_ring", node::perf_test::PartitionRingPerfTest },
+  { "routing_batch", node::perf_test::RoutingBatchPerfTest },
+  { "routing_workers", node::perf_test::RoutingWorkersPerfTest },
+  { "socket_options", node::perf_test::SocketOptionsPerfTest },
+};
+
+bool ShouldRun(const char* name, int argc, char** argv) {
+  if (argc < 2) {
+    return true;
+  }
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], name) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  base::AtExitManager exit_manager;
+  CommandLine::Init(argc, argv);
+
+  int failures = 0;
+  for (size_t i = 0; i < arraysize(kPerfTests); ++i) {
+    const PerfTest& test = kPerfTests[i];
+    if (!ShouldRun(test.name, argc, argv)) {
+      continue;
+    }
+    printf("[ RUN      ] %s\n", test.name);
+    bool succeeded = test.run();
+    printf("[ %s ] %s\n", succeeded ? "      OK" : " FAILED ", test.name);
+    if (!succeeded) {
+      ++failures;
+    }
+  }
+  return failures ? 1 : 0;
+}
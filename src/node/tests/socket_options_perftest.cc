@@ -0,0 +1,218 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+//
+// Measures how the options of the message channel socket, which are set by
+// the --message-channel-hwm, --message-channel-sndbuf and
+// --message-channel-rcvbuf switches, affects the throughput, the tail
+// latency and the losses of the node. Each option is swept on its own from
+// the defaults of the node. A client sends windows of requests to a service
+// through a message receiver over the loopback; the requests that exceeds
+// the high water mark of the router are silently dropped by zeromq, so the
+// requests that does not arrive within a timeout are counted as lost.
+
+// Should be included first to avoid conflicts with the "windows.h" indirectly
+// included by the base headers.
+#include <zmq.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <base/logging.h>
+#include <base/memory/ref_counted.h>
+#include <base/string_number_conversions.h>
+#include <base/threading/platform_thread.h>
+
+#include "node/service/constants.h"
+#include "node/service/message_receiver.h"
+#include "node/tests/perf_test.h"
+#include "node/tests/receiver_perf_test.h"
+#include "node/zeromq/message.h"
+#include "node/zeromq/socket.h"
+
+namespace node {
+namespace perf_test {
+
+namespace {
+
+// The port of the first receiver, each setting uses the next one.
+const int kFirstPort = 18580;
+
+// The size of the payload of each request, large enough for the kernel
+// buffers to fill up during a window.
+const int kPayloadSize = 1024;
+
+// The number of requests that is sent back to back before waiting for them
+// to arrive, and the number of windows sent for each setting.
+const int kWindowSize = 1000;
+const int kWindows = 20;
+
+// How long the service waits for the next request of a window before the
+// remaining ones are considered lost.
+const int kLossTimeoutMs = 200;
+
+// The options of the message channel. A buffer size of zero keeps the size
+// chosen by the system.
+struct ChannelSettings {
+  int64 high_water_mark;
+  int64 send_buffer_size;
+  int64 receive_buffer_size;
+};
+
+// The defaults of the node comes first, each one of the others changes a
+// single option.
+const ChannelSettings kChannelSettings[] = {
+  { kMessageChannelHighWaterMark, 0, 0 },
+  { 100, 0, 0 },
+  { 1000, 0, 0 },
+  { 100000, 0, 0 },
+  { kMessageChannelHighWaterMark, 64 * 1024, 0 },
+  { kMessageChannelHighWaterMark, 1024 * 1024, 0 },
+  { kMessageChannelHighWaterMark, 0, 64 * 1024 },
+  { kMessageChannelHighWaterMark, 0, 1024 * 1024 },
+};
+
+// Gets the latency below which |per_mille| of the sorted |latencies| are.
+int64 GetPercentile(const std::vector<int64>& latencies, int per_mille) {
+  DCHECK(!latencies.empty());
+  size_t index = latencies.size() * per_mille / 1000;
+  return latencies[std::min(index, latencies.size() - 1)];
+}
+
+bool MeasureWindows(const std::string& trace, zmq::Socket* client,
+  zmq::Socket* service) {
+  // The requests are identified by their sequence number, which is used to
+  // find when they was sent. They are created up front so the client sends
+  // them as fast as a host that has them queued.
+  const int requests_count = kWindowSize * kWindows;
+  std::vector<scoped_refptr<zmq::Message> > requests;
+  requests.reserve(requests_count);
+  for (int i = 0; i < requests_count; ++i) {
+    requests.push_back(CreateRequest(base::IntToString(i), kPayloadSize));
+  }
+
+  std::vector<base::TimeTicks> sent_times(requests_count);
+  std::vector<int64> latencies;
+  latencies.reserve(requests_count);
+  base::TimeTicks start = base::TimeTicks::HighResNow();
+  base::TimeTicks last_received = start;
+  for (int i = 0; i < kWindows; ++i) {
+    for (int j = 0; j < kWindowSize; ++j) {
+      int sequence = i * kWindowSize + j;
+      sent_times[sequence] = base::TimeTicks::HighResNow();
+      if (!SendRequest(client, requests[sequence].get())) {
+        LOG(ERROR) << "The request could not be sent.";
+        return false;
+      }
+    }
+
+    // The requests of a previous window that arrives late are accounted
+    // too, so a window ends when as many requests as it sent arrives.
+    zmq::Socket::MessageParts parts;
+    for (int j = 0; j < kWindowSize; ++j) {
+      if (!ReceiveRequest(service, kLossTimeoutMs, &parts)) {
+        break;
+      }
+      last_received = base::TimeTicks::HighResNow();
+      std::string id;
+      int sequence;
+      if (!GetRequestId(parts, &id) || !base::StringToInt(id, &sequence) ||
+        sequence < 0 || sequence >= requests_count) {
+        LOG(ERROR) << "The service received an unknown request.";
+        return false;
+      }
+      latencies.push_back(
+        (last_received - sent_times[sequence]).InMicroseconds());
+    }
+  }
+
+  if (latencies.empty()) {
+    LOG(ERROR) << "No request was routed to the service.";
+    return false;
+  }
+
+  // The time spent waiting for the lost requests is not accounted.
+  PrintThroughput("socket_options", trace, last_received - start,
+    static_cast<int64>(latencies.size()));
+
+  std::sort(latencies.begin(), latencies.end());
+  PrintResult("socket_options", trace + "_p50",
+    static_cast<double>(GetPercentile(latencies, 500)), "us");
+  PrintResult("socket_options", trace + "_p99",
+    static_cast<double>(GetPercentile(latencies, 990)), "us");
+  PrintResult("socket_options", trace + "_p999",
+    static_cast<double>(GetPercentile(latencies, 999)), "us");
+
+  int64 lost = requests_count - static_cast<int64>(latencies.size());
+  PrintResult("socket_options", trace + "_lost",
+    lost * 100.0 / requests_count, "%");
+  return true;
+}
+
+bool MeasureSettings(zmq::Context* context, MessageRouter* router,
+  const ChannelSettings& settings, int port) {
+  zmq::SocketOptions options;
+  options.set_high_water_mark(settings.high_water_mark);
+  options.set_linger(kMessageChannelLinger);
+  if (settings.send_buffer_size > 0) {
+    options.set_send_buffer_size(settings.send_buffer_size);
+  }
+  if (settings.receive_buffer_size > 0) {
+    options.set_receive_buffer_size(settings.receive_buffer_size);
+  }
+
+  MessageReceiver receiver(context, router);
+  receiver.set_message_channel_port(port);
+  receiver.set_message_channel_options(options);
+
+  ReceiverThread receiver_thread(&receiver);
+  if (!receiver_thread.Start()) {
+    return false;
+  }
+
+  std::string endpoint(GetLoopbackEndpoint(port));
+  bool succeeded;
+  {
+    zmq::Socket service(context->CreateSocket(zmq::kDealer));
+    zmq::Socket client(context->CreateSocket(zmq::kDealer));
+    succeeded = service.SetLinger(0) && client.SetLinger(0) &&
+      service.SetIdentity(kTestServiceAddress) &&
+      service.Connect(endpoint.c_str()) && client.Connect(endpoint.c_str());
+    if (!succeeded || !WaitForService(&client, &service)) {
+      LOG(ERROR) << "The service could not be reached through the node.";
+      succeeded = false;
+    }
+
+    if (succeeded) {
+      std::string trace("hwm_" + base::Int64ToString(settings.high_water_mark)
+        + "_sndbuf_" + base::Int64ToString(settings.send_buffer_size)
+        + "_rcvbuf_" + base::Int64ToString(settings.receive_buffer_size));
+      succeeded = MeasureWindows(trace, &client, &service);
+    }
+    client.Close();
+    service.Close();
+  }
+
+  receiver_thread.Stop();
+  return succeeded;
+}
+
+}  // namespace
+
+bool SocketOptionsPerfTest() {
+  ReceiverTestEnvironment environment;
+  if (!environment.Init()) {
+    return false;
+  }
+
+  bool succeeded = true;
+  for (size_t i = 0; i < arraysize(kChannelSettings); ++i) {
+    succeeded &= MeasureSettings(environment.context(), environment.router(),
+      kChannelSettings[i], kFirstPort + static_cast<int>(i));
+  }
+  return succeeded;
+}
+
+}  // namespace perf_test
+}  // namespace node
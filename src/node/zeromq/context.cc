@@ -9,6 +9,7 @@
 #include "node/zeromq/context.h"
 
 #include <base/logging.h>
+#include <base/sys_info.h>
 
 #include "node/zeromq/socket.h"
 
@@ -46,9 +47,14 @@ void Context::SocketRef::Close() {
   context_ = NULL; // The context may be getting deleted.
 }
 
+const int Context::kMaxIoThreads;
+
 Context::Context()
   : zmq_context_(NULL),
-    is_terminating_(false) {
+    is_terminating_(false),
+    io_threads_(0),
+    io_thread_policy_(kSharedIoThreads),
+    next_io_thread_(0) {
 }
 
 Context::~Context() {
@@ -61,16 +67,50 @@ bool Context::Open(int io_threads) {
     return false;
   }
 
+  DCHECK_GE(io_threads, 0);
+  DCHECK_LE(io_threads, kMaxIoThreads);
+
   is_terminating_ = false;
   zmq_context_ = zmq_init(io_threads);
   if (zmq_context_ == NULL) {
-    OnZeromqError(*static_cast<int*>(zmq_context_), NULL);
+    OnZeromqError(zmq_errno(), NULL);
     Close();
     return false;
   }
+  io_threads_ = io_threads;
   return true;
 }
 
+// static
+int Context::GetDefaultIoThreads() {
+  // Use half of the processors for network I/O and leave the others to the
+  // threads that process the messages.
+  int io_threads = base::SysInfo::NumberOfProcessors() / 2;
+  if (io_threads < 1) {
+    return 1;
+  }
+  return io_threads > kMaxIoThreads ? kMaxIoThreads : io_threads;
+}
+
+uint64 Context::GetIoThreadMask(int io_thread) const {
+  DCHECK_GE(io_thread, 0);
+  DCHECK_LT(io_thread, io_threads_);
+  return static_cast<uint64>(1) << io_thread;
+}
+
+uint64 Context::NextSocketAffinity() {
+  if (io_thread_policy_ == kSharedIoThreads || io_threads_ <= 1) {
+    return 0;
+  }
+
+  // The counter wraps around to negative values after 2^31 sockets, so it
+  // is taken as unsigned to keep the index within the I/O threads.
+  uint32 io_thread = static_cast<uint32>(
+    base::subtle::NoBarrier_AtomicIncrement(&next_io_thread_, 1)) - 1;
+  return GetIoThreadMask(
+    static_cast<int>(io_thread % static_cast<uint32>(io_threads_)));
+}
+
 void Context::Close() {
   // zmq_term() needs all open sockets to be finalized. Assert that the client
   // has relesead all socket.
@@ -90,6 +130,7 @@ void Context::Close() {
     zmq_term(zmq_context_);
     zmq_context_ = NULL;
   }
+  io_threads_ = 0;
 }
 
 scoped_refptr<Context::SocketRef> Context::CreateSocket(SocketType socket_type) {
@@ -102,6 +143,12 @@ scoped_refptr<Context::SocketRef> Context::CreateSocket(SocketType socket_type)
     DLOG(ERROR) << "Socket creation error " << GetErrorMessage();
     return new SocketRef(this, NULL);
   }
+
+  uint64_t affinity = NextSocketAffinity();
+  if (affinity &&
+    zmq_setsockopt(socket, ZMQ_AFFINITY, &affinity, sizeof(affinity)) != 0) {
+    DLOG(WARNING) << "Socket affinity could not be set " << GetErrorMessage();
+  }
   return new SocketRef(this, socket);
 }
 
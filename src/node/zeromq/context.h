@@ -8,6 +8,7 @@
 #include <vector>
 #include <set>
 
+#include <base/atomicops.h>
 #include <base/basictypes.h>
 #include <base/memory/scoped_ptr.h>
 #include <base/memory/ref_counted.h>
@@ -23,7 +24,9 @@ enum SocketType {
   kRequest = 3,
   kReply = 4,
   kDealer = 5,
-  kRouter = 6
+  kRouter = 6,
+  kPull = 7,
+  kPush = 8
 };
 
 // Possible values for error in ErrorDelegate.OnError(). These should match
@@ -70,6 +73,24 @@ class Context {
   class SocketRef; // Forward declaration, see real one below.
 
  public:
+  // Possible values for set_io_thread_policy(). The policy defines how the
+  // sockets created by CreateSocket() are mapped to the context I/O threads.
+  enum IoThreadPolicy {
+    // Sockets are not pinned. The connections of every socket are spread
+    // among all the I/O threads, which is what a socket with many peers,
+    // such as a ROUTER, usually needs.
+    kSharedIoThreads = 0,
+
+    // Each socket is pinned to a single I/O thread, which are assigned in a
+    // round-robin fashion. This isolates sockets from each other when there
+    // are many sockets with a few peers each.
+    kRoundRobinIoThreads = 1
+  };
+
+  // The maximum number of I/O threads that can be addressed by the I/O
+  // thread affinity mask.
+  static const int kMaxIoThreads = 64;
+
   // Creates a nes instance of the Context class. The context should be
   // initialized by calling Open([io_threads]). Any opened sockets
   // will be closed when this context is deleted.
@@ -92,6 +113,26 @@ class Context {
   // messaging you may set this to zero, otherwise set it to at least one.
   bool Open(int io_threads);
 
+  // Returns the number of I/O threads that is suitable for the machine we are
+  // running on. This is based on the number of processors and leaves room
+  // for the application threads.
+  static int GetDefaultIoThreads();
+
+  // Returns the number of I/O threads of the context. This is zero if the
+  // context is not opened.
+  int io_threads() const { return io_threads_; }
+
+  // Sets the policy used to assign I/O threads to the sockets created from
+  // now on. The default is kSharedIoThreads.
+  void set_io_thread_policy(IoThreadPolicy policy) {
+    io_thread_policy_ = policy;
+  }
+  IoThreadPolicy io_thread_policy() const { return io_thread_policy_; }
+
+  // Returns the affinity mask that selects only the I/O thread |io_thread|,
+  // which should be in the range [0, io_threads()).
+  uint64 GetIoThreadMask(int io_thread) const;
+
   // Returns true if the context has been sucessfully opened.
   bool is_open() const { return !!zmq_context_; }
 
@@ -115,6 +156,10 @@ class Context {
   // endpoint with Socket::Connect(), or at least one endpoint must be created
   // for accepting incoming connections with Socket::Bind().
   //
+  // The socket I/O thread affinity is set accordingly to the current I/O
+  // thread policy. It could be overriden by calling Socket::SetAffinity()
+  // before binding or connecting the socket.
+  //
   // If an socket could not be created, because of an error, an invalid, inert
   // SocketRef is returned (and the code will crash on debug. The caller must
   // deal with this eventuallity, by correctly handling the return of an inert
@@ -187,9 +232,20 @@ class Context {
   // return value is the error code reflected back to the client code.
   int OnZeromqError(int err, Socket* socket);
 
+  // Returns the affinity mask for a new socket accordingly to the current
+  // I/O thread policy.
+  uint64 NextSocketAffinity();
+
   void* zmq_context_;
   bool is_terminating_;
 
+  int io_threads_;
+  IoThreadPolicy io_thread_policy_;
+
+  // The I/O thread that will be assigned to the next socket when the policy
+  // is kRoundRobinIoThreads. Sockets could be created from any thread.
+  base::subtle::Atomic32 next_io_thread_;
+
   // A list of all SocketReds we've given out. Each ref must register with
   // us when it's created or destroyed. This allows us to potentially close
   // any open sockets on closing/destruction.
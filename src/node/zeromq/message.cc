@@ -6,35 +6,59 @@
 // included by the "message.h"
 #include <zmq.h>
 
+#include <new>
+
 #include "node/zeromq/message.h"
 
 #include <base/logging.h>
 
+#include "node/zeromq/message_pool.h"
 #include "node/zeromq/zmq_structs.h"
 
 namespace zmq {
 
 Message::Message()
   : data_(NULL) {
-  message_ = new zmq_msg_t();
+  message_ = new (MessagePool::Current()->Allocate(sizeof(zmq_msg_t)))
+    zmq_msg_t();
   zmq_msg_init(message_);
 }
 
 Message::Message(int size) {
   DCHECK(size > 0);
-  data_ = new char[size];
-  message_ = new zmq_msg_t();
-  AddRef(); // Released in ReleaseMessage()
-  zmq_msg_init_data(message_, data_, size, ReleaseMessage, this);
+  MessagePool* pool = MessagePool::Current();
+  data_ = pool->Allocate(size);
+  message_ = new (pool->Allocate(sizeof(zmq_msg_t))) zmq_msg_t();
+  zmq_msg_init_data(message_, data_, size, FreeData, NULL);
+}
+
+Message::Message(void* data, int size, ReleaseCallback release, void* hint)
+  : data_(data) {
+  DCHECK(data);
+  DCHECK(size > 0);
+  message_ = new (MessagePool::Current()->Allocate(sizeof(zmq_msg_t)))
+    zmq_msg_t();
+  zmq_msg_init_data(message_, data_, size, release, hint);
 }
 
 Message::~Message() {
+  // Drops our reference to the data, which is released by zeromq when it is
+  // no longer referenced by other messages.
   zmq_msg_close(message_);
-  delete[] data_;
-  delete message_;
+  MessagePool::Free(message_);
   data_ = NULL;
 }
 
+// static
+void* Message::operator new(size_t size) {
+  return MessagePool::Current()->Allocate(size);
+}
+
+// static
+void Message::operator delete(void* block) {
+  MessagePool::Free(block);
+}
+
 size_t Message::size() {
   return zmq_msg_size(message_);
 }
@@ -43,9 +67,44 @@ void* Message::mutable_data() {
   return zmq_msg_data(message_);
 }
 
+scoped_refptr<Message> Message::Share() {
+  // zeromq reference counts the message content, the copy does not copy the
+  // data, except for the very small messages that are stored inline.
+  scoped_refptr<Message> shared(new Message());
+  if (zmq_msg_copy(shared->message_, message_) != 0) {
+    LOG(ERROR) << "The message could not be shared: "
+               << zmq_strerror(zmq_errno());
+    return NULL;
+  }
+  return shared;
+}
+
+scoped_refptr<Message> Message::Slice(int offset, int size) {
+  DCHECK(offset >= 0);
+  DCHECK(size > 0);
+  DCHECK(static_cast<size_t>(offset + size) <= this->size());
+
+  // The slice wraps a part of the data referenced by |holder|, which is
+  // released only when zeromq no longer needs the slice. The data should be
+  // taken from |holder|, since the very small messages are copied by
+  // Share().
+  scoped_refptr<Message> holder = Share();
+  if (!holder) {
+    return NULL;
+  }
+  holder->AddRef();  // Released in ReleaseSliced()
+  return new Message(static_cast<char*>(holder->mutable_data()) + offset,
+    size, ReleaseSliced, holder.get());
+}
+
+// static
+void Message::FreeData(void* data, void* hint) {
+  MessagePool::Free(data);
+}
+
 // static
-void Message::ReleaseMessage(void* data, void* hint) {
+void Message::ReleaseSliced(void* data, void* hint) {
   static_cast<Message*>(hint)->Release();
 }
 
-}  // namespace zmq
\ No newline at end of file
+}  // namespace zmq
@@ -23,7 +23,8 @@ struct zmq_msg_t;
 //
 // Altough Messages are RefcountedThreadSafe, they are not intended to be
 // used as a shared buffer, not should they be used simultaneously accross
-// threads. The fact that they are reference counted is an implementation
+// threads (see Share() for the supported way of sending the same data more
+// than once). The fact that they are reference counted is an implementation
 // detail for allowing them to outlive zeromq asynchrounous operations. In
 // particular the Send() operation that could be effectivated at some unknown
 // time.
@@ -55,11 +56,44 @@ struct zmq_msg_t;
 // from must remain alive. Using reference counting we can add a reference to
 // the Message and make sure it is not destroyed until after send the operation
 // has completed.
+//
+// ---------------------------
+// Memory
+// ---------------------------
+//
+// The Message object, the raw zeromq message and the data buffer are all
+// allocated from the MessagePool of the calling thread and returned to it
+// when they are released, so steady state traffic does not hit the heap.
+//
+// The data buffer is reference counted by zeromq, independently of the
+// Message object, and is released when the last message that references it
+// is released or sent. This allows the same buffer to be referenced by
+// several messages (see Share() and Slice()) and buffers that are not owned
+// by the message to be wrapped (see the ReleaseCallback constructor).
 class Message : public base::RefCountedThreadSafe<Message> {
  public:
+  // Called when the buffer wrapped by a message is no longer referenced by
+  // any message. |data| is the wrapped buffer and |hint| is the value that
+  // was given to the message constructor. This could be called from any
+  // thread, including the zeromq I/O threads.
+  typedef void (*ReleaseCallback)(void* data, void* hint);
+
   Message();
   explicit Message(int size);
 
+  // Creates a message that wraps the |size| bytes buffer pointed by |data|,
+  // which is owned by the caller, without copying it. |release| is called
+  // with |data| and |hint| when the buffer is no longer referenced. If
+  // |release| is NULL the caller must keep the buffer alive while the
+  // message, or any message that shares its data, is alive or queued on a
+  // socket.
+  Message(void* data, int size, ReleaseCallback release, void* hint);
+
+  // Messages are created and destroyed at a very high rate, so they are
+  // allocated from the MessagePool instead of the heap.
+  static void* operator new(size_t size);
+  static void operator delete(void* block);
+
   // The underlying buffer size.
   size_t size();
   
@@ -68,6 +102,21 @@ class Message : public base::RefCountedThreadSafe<Message> {
     return std::string(static_cast<char*>(mutable_data()), size());
   }
 
+  // Creates a message that references the same data as this message, so the
+  // data could be sent to more than one peer without being copied. Each
+  // message is sent independently and the data is released only when all
+  // the messages that reference it are released. The data should not be
+  // modified after it is shared and the message should not be shared after
+  // it is sent. Returns NULL if zeromq could not share the data.
+  scoped_refptr<Message> Share();
+
+  // Creates a message that references the |size| bytes of the data of this
+  // message that starts at |offset|, without copying them. The data is kept
+  // alive while the slice is alive or queued on a socket, even if this
+  // message is released or sent. The sliced bytes should not be modified.
+  // Returns NULL if zeromq could not share the data.
+  scoped_refptr<Message> Slice(int offset, int size);
+
  protected:
   friend class base::RefCountedThreadSafe<Message>;
   friend class Socket;
@@ -75,41 +124,26 @@ class Message : public base::RefCountedThreadSafe<Message> {
   // A pointer to the raw zeromq message.
   zmq_msg_t* message() { return message_; }
 
-  // Only allow derived classes to specify data_.
-  // In all other cases, we own data_, and must delete it at destruction time.
-  // Message(void* data, int size);
-
   virtual ~Message();
 
+  // The buffer the message was created with, or NULL for the messages that
+  // are filled by the Socket.
   void* data_;
 
  private:
-  // Release the message referenced by the |hint| argument. This method is
-  // called by zeromq library once the message buffer is no longer required. We
-  // just decrement the reference count of the message referenced by |hint|,
-  // the resources are freed by the destructor.
-  static void ReleaseMessage(void* data, void* hint);
+  // Returns a buffer allocated by Message(int) to the MessagePool. This
+  // method is called by the zeromq library once the buffer is no longer
+  // referenced by any message.
+  static void FreeData(void* data, void* hint);
+
+  // Releases the message referenced by |hint|, which keeps alive the data
+  // of a slice.
+  static void ReleaseSliced(void* data, void* hint);
 
   // The raw zeromq message.
   zmq_msg_t* message_;
 };
 
-// This class allows the creation of a temporary Message that doesn't really
-// own the underlying buffer. This is used strictly by the Socket::Receive().
-// ZeroMQ does not provide a way to do zero-copy on receive, the library
-// delivers us a buffer that we can store as long as we wish, but it will not
-// write data directly into application buffer.
-/*class WrappedMessage : public Message {
- protected:
-  // Sockets accesses WrapperMessage(char*, int) which we don't want to
-  // expose to everybody.
-  friend class Socket;
-
-  WrappedMessage(const void* data, int size);
-
-  virtual ~WrappedMessage();
-};*/
-
 }  // namespace zmq
 
 #endif  // NODE_ZEROMQ_MESSAGE_H_
\ No newline at end of file
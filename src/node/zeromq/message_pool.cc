@@ -0,0 +1,159 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+
+#include "node/zeromq/message_pool.h"
+
+#include <string.h>
+
+#include <base/lazy_instance.h>
+#include <base/logging.h>
+#include <base/threading/thread_local.h>
+
+namespace zmq {
+
+namespace {
+
+// The usable size of the blocks of each size class.
+const size_t kBlockSizes[MessagePool::kNumberOfSizeClasses] = {
+  64,         // kObjectClass
+  256,        // kIdentityClass
+  8 * 1024,   // kPacketClass
+  64 * 1024   // kLargeClass
+};
+
+// The maximum number of blocks that a pool keeps cached for each size class.
+const int kMaxCachedBlocks[MessagePool::kNumberOfSizeClasses] = {
+  4096,       // kObjectClass
+  2048,       // kIdentityClass
+  512,        // kPacketClass
+  32          // kLargeClass
+};
+
+base::LazyInstance<base::ThreadLocalPointer<MessagePool> >
+  g_current_pool(base::LINKER_INITIALIZED);
+
+}  // namespace
+
+// The header is padded to keep the block memory aligned to 16 bytes.
+struct MessagePool::BlockHeader {
+  MessagePool* pool;
+  size_t size;
+  SizeClass size_class;
+  char padding[16 - (sizeof(MessagePool*) + sizeof(size_t) +
+    sizeof(SizeClass)) % 16];
+
+  void* block() { return reinterpret_cast<char*>(this) + sizeof(*this); }
+
+  static BlockHeader* FromBlock(void* block) {
+    return reinterpret_cast<BlockHeader*>(
+      static_cast<char*>(block) - sizeof(BlockHeader));
+  }
+};
+
+MessagePool::MessagePool() {
+  memset(free_lists_, 0, sizeof(free_lists_));
+  memset(&stats_, 0, sizeof(stats_));
+}
+
+MessagePool::~MessagePool() {
+  // Pools are leaked on purpose, see the class comments.
+  NOTREACHED();
+}
+
+// static
+MessagePool* MessagePool::Current() {
+  MessagePool* pool = g_current_pool.Pointer()->Get();
+  if (!pool) {
+    pool = new MessagePool();
+    g_current_pool.Pointer()->Set(pool);
+  }
+  return pool;
+}
+
+// static
+MessagePool::SizeClass MessagePool::GetSizeClass(size_t size) {
+  for (int i = 0; i < kNumberOfSizeClasses; ++i) {
+    if (size <= kBlockSizes[i]) {
+      return static_cast<SizeClass>(i);
+    }
+  }
+  return kUnpooledClass;
+}
+
+void* MessagePool::Allocate(size_t size) {
+  SizeClass size_class = GetSizeClass(size);
+  if (size_class == kUnpooledClass) {
+    BlockHeader* header = reinterpret_cast<BlockHeader*>(
+      new char[sizeof(BlockHeader) + size]);
+    header->pool = NULL;
+    header->size = size;
+    header->size_class = kUnpooledClass;
+    {
+      base::AutoLock lock(lock_);
+      ++stats_.unpooled;
+    }
+    return header->block();
+  }
+
+  {
+    base::AutoLock lock(lock_);
+    FreeBlock* free_block = free_lists_[size_class];
+    if (free_block) {
+      free_lists_[size_class] = free_block->next;
+      ++stats_.classes[size_class].hits;
+      --stats_.classes[size_class].cached;
+      return free_block;
+    }
+    ++stats_.classes[size_class].misses;
+  }
+
+  BlockHeader* header = reinterpret_cast<BlockHeader*>(
+    new char[sizeof(BlockHeader) + kBlockSizes[size_class]]);
+  header->pool = this;
+  header->size = kBlockSizes[size_class];
+  header->size_class = size_class;
+  return header->block();
+}
+
+// static
+void MessagePool::Free(void* block) {
+  if (!block) {
+    return;
+  }
+
+  BlockHeader* header = BlockHeader::FromBlock(block);
+  if (header->size_class == kUnpooledClass) {
+    delete[] reinterpret_cast<char*>(header);
+    return;
+  }
+  header->pool->Recycle(header);
+}
+
+// static
+size_t MessagePool::GetBlockSize(void* block) {
+  DCHECK(block);
+  return BlockHeader::FromBlock(block)->size;
+}
+
+void MessagePool::Recycle(BlockHeader* header) {
+  SizeClass size_class = header->size_class;
+  {
+    base::AutoLock lock(lock_);
+    if (stats_.classes[size_class].cached < kMaxCachedBlocks[size_class]) {
+      FreeBlock* free_block = static_cast<FreeBlock*>(header->block());
+      free_block->next = free_lists_[size_class];
+      free_lists_[size_class] = free_block;
+      ++stats_.classes[size_class].cached;
+      return;
+    }
+  }
+  delete[] reinterpret_cast<char*>(header);
+}
+
+MessagePool::Stats MessagePool::GetStats() {
+  base::AutoLock lock(lock_);
+  return stats_;
+}
+
+}  // namespace zmq
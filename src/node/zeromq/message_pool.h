@@ -0,0 +1,115 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+
+#ifndef NODE_ZEROMQ_MESSAGE_POOL_H_
+#define NODE_ZEROMQ_MESSAGE_POOL_H_
+#pragma once
+
+#include <base/basictypes.h>
+#include <base/synchronization/lock.h>
+
+namespace zmq {
+
+// A MessagePool recycles the memory blocks used by the Message class: the
+// Message object itself, the raw zeromq message structure and the data
+// buffer that is handed to zeromq by the Message(int size) constructor.
+//
+// Blocks are grouped into size classes. A request is served from the
+// smallest class that can hold it; requests larger than the biggest class
+// are served directly by the heap and are never cached.
+//
+//   kObjectClass     Message objects and zmq_msg_t structures. This is all
+//                    that is needed by empty delimiter frames and by the
+//                    frames filled by Socket::Receive().
+//   kIdentityClass   Socket identities and other small frames.
+//   kPacketClass     Typical ruby message packets.
+//   kLargeClass      Large service payloads.
+//
+// There is one pool per thread, see Current(). A block always goes back to
+// the pool that allocated it, even when it is released on another thread,
+// which happens when zeromq calls Message::FreeData() from one of its
+// I/O threads. The per pool lock is therefore almost never contended.
+//
+// Pools are never destroyed, since blocks handed out by a pool may outlive
+// the thread that created it. The amount of memory retained by a pool is
+// bounded by the per class cache limits.
+class MessagePool {
+ public:
+  enum SizeClass {
+    kObjectClass = 0,
+    kIdentityClass,
+    kPacketClass,
+    kLargeClass,
+    kNumberOfSizeClasses,
+
+    // Blocks that was allocated directly from the heap.
+    kUnpooledClass = kNumberOfSizeClasses
+  };
+
+  // Allocation statistics for a single size class.
+  struct ClassStats {
+    // Number of allocations served from the cache.
+    int64 hits;
+
+    // Number of allocations that needed a fresh block from the heap.
+    int64 misses;
+
+    // Number of blocks that are currently cached by the pool.
+    int cached;
+  };
+
+  struct Stats {
+    ClassStats classes[kNumberOfSizeClasses];
+
+    // Number of allocations that was too large to be pooled.
+    int64 unpooled;
+  };
+
+  // Returns the pool associated with the calling thread, creating it if
+  // necessary.
+  static MessagePool* Current();
+
+  // Allocates a block of at least |size| bytes. The block must be released
+  // through Free(), which may be called from any thread.
+  void* Allocate(size_t size);
+
+  // Returns a block obtained from Allocate() to the pool that allocated it.
+  // It is safe to call this with a NULL pointer.
+  static void Free(void* block);
+
+  // Returns the usable size of a block obtained from Allocate().
+  static size_t GetBlockSize(void* block);
+
+  // Returns a snapshot of the allocation statistics of this pool.
+  Stats GetStats();
+
+ private:
+  // The header that precedes each block returned by Allocate().
+  struct BlockHeader;
+
+  // A cached block. The link is stored in the block memory itself.
+  struct FreeBlock {
+    FreeBlock* next;
+  };
+
+  MessagePool();
+  ~MessagePool();
+
+  // Returns the smallest size class that can hold |size| bytes, or
+  // kUnpooledClass if no size class is big enough.
+  static SizeClass GetSizeClass(size_t size);
+
+  // Caches |header| or frees it if the cache for its class is full.
+  void Recycle(BlockHeader* header);
+
+  base::Lock lock_;
+  FreeBlock* free_lists_[kNumberOfSizeClasses];
+  Stats stats_;
+
+  DISALLOW_COPY_AND_ASSIGN(MessagePool);
+};
+
+}  // namespace zmq
+
+#endif  // NODE_ZEROMQ_MESSAGE_POOL_H_
@@ -0,0 +1,316 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+
+#define ZMQ_OK 0
+
+// Should be included first to avoid conflicts with the "windows.h" indirectly
+// included by the "poller.h"
+#include <zmq.h>
+
+#include "node/zeromq/poller.h"
+
+#include <base/logging.h>
+#include <base/stringprintf.h>
+
+#include "node/zeromq/context.h"
+#include "node/zeromq/socket.h"
+#include "node/zeromq/zmq_structs.h"
+
+namespace zmq {
+
+namespace {
+
+// zmq_poll() timeouts are expressed in microseconds by zeromq 2.x and in
+// milliseconds by later versions.
+long ToPollTimeout(base::TimeDelta timeout) {
+#if ZMQ_VERSION_MAJOR < 3
+  return static_cast<long>(timeout.InMicroseconds());
+#else
+  return static_cast<long>(timeout.InMillisecondsRoundedUp());
+#endif
+}
+
+// The shortest interval of a repeating timer. A timer that repeats at no
+// interval would be due again as soon as it runs, and RunTimers() would
+// never return.
+const int kMinTimerIntervalMs = 1;
+
+}  // namespace
+
+struct Poller::PollItems : public std::vector<zmq_pollitem_t> {};
+
+Poller::Poller(Context* context)
+  : context_(context),
+    wakeup_pending_(0),
+    quit_called_(0),
+    wakeup_delegate_(NULL),
+    poll_items_(new PollItems()),
+    poll_items_dirty_(true),
+    next_timer_id_(1) {
+  DCHECK(context);
+
+  // The wakeup channel is a pair of inproc sockets. The reader must be bound
+  // before the writer connects to it.
+  std::string endpoint(base::StringPrintf("inproc://zmq-poller-%p", this));
+  wakeup_reader_.reset(new Socket(context_->CreateSocket(kExclusivePair)));
+  wakeup_writer_.reset(new Socket(context_->CreateSocket(kExclusivePair)));
+  if (!wakeup_reader_->Bind(endpoint) ||
+    !wakeup_writer_->Connect(endpoint.c_str())) {
+    LOG(ERROR) << "The poller wakeup channel could not be created.";
+  }
+}
+
+Poller::~Poller() {
+  wakeup_writer_->Close();
+  wakeup_reader_->Close();
+}
+
+void Poller::WatchSocket(Socket* socket, int events, Watcher* watcher) {
+  DCHECK(socket);
+  Watch(socket, 0, events, watcher);
+}
+
+void Poller::StopWatchingSocket(Socket* socket) {
+  StopWatching(socket, 0);
+}
+
+void Poller::WatchFileDescriptor(int fd, int events, Watcher* watcher) {
+  Watch(NULL, fd, events, watcher);
+}
+
+void Poller::StopWatchingFileDescriptor(int fd) {
+  StopWatching(NULL, fd);
+}
+
+Poller::Registration* Poller::FindRegistration(Socket* socket, int fd) {
+  for (Registrations::iterator i = registrations_.begin();
+    i != registrations_.end(); ++i) {
+    if (i->socket == socket && (socket || i->fd == fd)) {
+      return &(*i);
+    }
+  }
+  return NULL;
+}
+
+void Poller::Watch(Socket* socket, int fd, int events, Watcher* watcher) {
+  DCHECK(watcher);
+  DCHECK(events);
+  Registration* registration = FindRegistration(socket, fd);
+  if (!registration) {
+    Registration new_registration;
+    new_registration.socket = socket;
+    new_registration.fd = fd;
+    registrations_.push_back(new_registration);
+    registration = &registrations_.back();
+  }
+  registration->events = events;
+  registration->watcher = watcher;
+  poll_items_dirty_ = true;
+}
+
+void Poller::StopWatching(Socket* socket, int fd) {
+  for (Registrations::iterator i = registrations_.begin();
+    i != registrations_.end(); ++i) {
+    if (i->socket == socket && (socket || i->fd == fd)) {
+      registrations_.erase(i);
+      poll_items_dirty_ = true;
+      return;
+    }
+  }
+}
+
+int Poller::AddTimer(base::TimeDelta delay, bool repeating,
+  TimerDelegate* delegate) {
+  DCHECK(delegate);
+  if (repeating) {
+    DCHECK(delay > base::TimeDelta());
+    base::TimeDelta min_interval =
+      base::TimeDelta::FromMilliseconds(kMinTimerIntervalMs);
+    if (delay < min_interval) {
+      delay = min_interval;
+    }
+  }
+
+  Timer timer;
+  timer.id = next_timer_id_++;
+  timer.deadline = base::TimeTicks::Now() + delay;
+  timer.interval = delay;
+  timer.repeating = repeating;
+  timer.delegate = delegate;
+
+  active_timers_[timer.id] = timer;
+  timers_.push(timer);
+  return timer.id;
+}
+
+void Poller::CancelTimer(int timer_id) {
+  // The timer is discarded when it reaches the top of the queue.
+  active_timers_.erase(timer_id);
+}
+
+void Poller::Run() {
+  while (!base::subtle::Acquire_Load(&quit_called_)) {
+    if (!RunOnce(base::TimeDelta::FromSeconds(1))) {
+      break;
+    }
+  }
+}
+
+bool Poller::RunOnce(base::TimeDelta max_wait) {
+  if (poll_items_dirty_) {
+    BuildPollItems();
+  }
+
+  // Do not sleep past the next timer deadline.
+  base::TimeDelta timeout = max_wait;
+  if (!timers_.empty()) {
+    base::TimeDelta until_next_timer =
+      timers_.top().deadline - base::TimeTicks::Now();
+    if (until_next_timer < timeout) {
+      timeout = until_next_timer;
+    }
+  }
+  if (timeout < base::TimeDelta()) {
+    timeout = base::TimeDelta();
+  }
+
+  PollItems& poll_items = *poll_items_;
+  int ready = zmq_poll(&poll_items[0], static_cast<int>(poll_items.size()),
+    ToPollTimeout(timeout));
+  if (ready < 0) {
+    if (zmq_errno() == ETERM) {
+      return false;
+    }
+    // Interrupted by a signal, just try again.
+    return zmq_errno() == EINTR;
+  }
+
+  if (ready > 0) {
+    if (poll_items[0].revents & ZMQ_POLLIN) {
+      DrainWakeups();
+    }
+
+    // Snapshot the ready items, since the watchers could change the
+    // registrations while they are notified.
+    std::vector<zmq_pollitem_t> ready_items;
+    for (size_t i = 1; i < poll_items.size(); ++i) {
+      if (poll_items[i].revents) {
+        ready_items.push_back(poll_items[i]);
+      }
+    }
+
+    for (size_t i = 0; i < ready_items.size(); ++i) {
+      Socket* socket = NULL;
+      int fd = static_cast<int>(ready_items[i].fd);
+      if (ready_items[i].socket) {
+        for (Registrations::iterator j = registrations_.begin();
+          j != registrations_.end(); ++j) {
+          if (j->socket &&
+            j->socket->ref_->socket() == ready_items[i].socket) {
+            socket = j->socket;
+            break;
+          }
+        }
+
+        // The socket was unregistered by a previous watcher.
+        if (!socket) {
+          continue;
+        }
+      }
+
+      Registration* registration = FindRegistration(socket, fd);
+      if (!registration) {
+        continue;
+      }
+      if (socket) {
+        registration->watcher->OnSocketReady(socket, ready_items[i].revents);
+      } else {
+        registration->watcher->OnFileDescriptorReady(fd,
+          ready_items[i].revents);
+      }
+    }
+  }
+
+  RunTimers();
+  return true;
+}
+
+void Poller::Wakeup() {
+  // Only one wakeup message needs to be in flight.
+  if (base::subtle::NoBarrier_CompareAndSwap(&wakeup_pending_, 0, 1) != 0) {
+    return;
+  }
+
+  base::AutoLock lock(wakeup_lock_);
+  wakeup_writer_->Send(kNoBlock);
+}
+
+void Poller::Quit() {
+  base::subtle::Release_Store(&quit_called_, 1);
+  Wakeup();
+}
+
+void Poller::BuildPollItems() {
+  PollItems& poll_items = *poll_items_;
+  poll_items.resize(registrations_.size() + 1);
+
+  zmq_pollitem_t& wakeup_item = poll_items[0];
+  wakeup_item.socket = wakeup_reader_->ref_->socket();
+  wakeup_item.fd = 0;
+  wakeup_item.events = ZMQ_POLLIN;
+  wakeup_item.revents = 0;
+
+  for (size_t i = 0; i < registrations_.size(); ++i) {
+    const Registration& registration = registrations_[i];
+    zmq_pollitem_t& item = poll_items[i + 1];
+    item.socket = registration.socket
+      ? registration.socket->ref_->socket()
+      : NULL;
+    item.fd = registration.fd;
+    item.events = static_cast<short>(registration.events);
+    item.revents = 0;
+  }
+  poll_items_dirty_ = false;
+}
+
+void Poller::RunTimers() {
+  base::TimeTicks now = base::TimeTicks::Now();
+  while (!timers_.empty() && timers_.top().deadline <= now) {
+    Timer timer = timers_.top();
+    timers_.pop();
+
+    // Skip cancelled timers and stale entries of rescheduled ones.
+    std::map<int, Timer>::iterator active = active_timers_.find(timer.id);
+    if (active == active_timers_.end() ||
+      active->second.deadline != timer.deadline) {
+      continue;
+    }
+
+    if (timer.repeating) {
+      timer.deadline = now + timer.interval;
+      active->second.deadline = timer.deadline;
+      timers_.push(timer);
+    } else {
+      active_timers_.erase(active);
+    }
+    timer.delegate->OnTimer(timer.id);
+  }
+}
+
+void Poller::DrainWakeups() {
+  // Clear the pending flag before draining, so a Wakeup() that races with
+  // us results in a new message.
+  base::subtle::Release_Store(&wakeup_pending_, 0);
+
+  Socket::MessageParts parts;
+  while (wakeup_reader_->Receive(&parts, kNoBlock)) {
+    parts.clear();
+  }
+
+  if (wakeup_delegate_) {
+    wakeup_delegate_->OnWakeup();
+  }
+}
+
+}  // namespace zmq
@@ -0,0 +1,207 @@
+// Copyright (c) 2010 Nohros Systems Inc. All rights reserved
+// Use of this source code is governed by BSD-style license that can be found
+// in the LICENCE file.
+
+#ifndef NODE_ZEROMQ_POLLER_H_
+#define NODE_ZEROMQ_POLLER_H_
+#pragma once
+
+#include <map>
+#include <queue>
+#include <vector>
+
+#include <base/atomicops.h>
+#include <base/basictypes.h>
+#include <base/memory/scoped_ptr.h>
+#include <base/synchronization/lock.h>
+#include <base/time.h>
+
+namespace zmq {
+
+class Context;
+class Socket;
+struct zmq_pollitem_t;
+
+// Possible values for events in Poller::Watch(). These should match the
+// values in zmq.h
+enum PollEvents {
+  kPollIn = 1,
+  kPollOut = 2,
+  kPollError = 4
+};
+
+// A Poller is a reactor that waits for events on several zeromq sockets and
+// raw file descriptors at once, using zmq_poll(). It also runs a queue of
+// timers and can be woken up from any thread, so a single thread can service
+// all the sockets of a component, its heartbeats and timeouts, and still be
+// stopped promptly.
+//
+// All the methods but Wakeup() and Quit() must be called from the thread
+// that runs the poller.
+//
+// Normal usage:
+//   zmq::Poller poller(context);
+//   poller.WatchSocket(socket, zmq::kPollIn, this);
+//   poller.AddTimer(base::TimeDelta::FromSeconds(1), true, this);
+//   poller.Run();  // Returns after Quit() is called from any thread.
+class Poller {
+ public:
+  // Receives notifications about sockets and file descriptors readiness.
+  class Watcher {
+   public:
+    // Called when |socket| has one or more of the watched |events| pending.
+    virtual void OnSocketReady(Socket* socket, int events) {}
+
+    // Called when |fd| has one or more of the watched |events| pending.
+    virtual void OnFileDescriptorReady(int fd, int events) {}
+
+   protected:
+    virtual ~Watcher() {}
+  };
+
+  // Receives notifications about expired timers.
+  class TimerDelegate {
+   public:
+    // Called when the timer identified by |timer_id| expires.
+    virtual void OnTimer(int timer_id) = 0;
+
+   protected:
+    virtual ~TimerDelegate() {}
+  };
+
+  // Receives a notification each time the poller is woken up through
+  // Wakeup(). This allows other threads to hand work to the poller thread.
+  class WakeupDelegate {
+   public:
+    // Called on the poller thread after one or more calls to Wakeup().
+    virtual void OnWakeup() = 0;
+
+   protected:
+    virtual ~WakeupDelegate() {}
+  };
+
+  // Creates a poller whose wakeup channel is created within |context|. The
+  // context must be opened and must outlive the poller.
+  explicit Poller(Context* context);
+  ~Poller();
+
+  // Starts watching |socket| for |events|, which is a combination of the
+  // PollEvents flags. Watching a socket that is already watched replaces
+  // its events and watcher.
+  void WatchSocket(Socket* socket, int events, Watcher* watcher);
+  void StopWatchingSocket(Socket* socket);
+
+  // Starts watching the native socket or file descriptor |fd| for |events|.
+  void WatchFileDescriptor(int fd, int events, Watcher* watcher);
+  void StopWatchingFileDescriptor(int fd);
+
+  // Schedules |delegate| to be called after |delay|. If |repeating| is
+  // true the timer is rescheduled after each run, until it is cancelled,
+  // and |delay| should be positive; a shorter one is raised to a
+  // millisecond. Returns an ID that can be used to cancel the timer.
+  int AddTimer(base::TimeDelta delay, bool repeating,
+    TimerDelegate* delegate);
+  void CancelTimer(int timer_id);
+
+  // Waits for and dispatches events until Quit() is called or the context
+  // is terminated.
+  void Run();
+
+  // Runs a single iteration of the event loop, waiting at most |max_wait|
+  // for an event to happen. Returns false if the poller could not wait for
+  // events, because the context was terminated.
+  bool RunOnce(base::TimeDelta max_wait);
+
+  // Wakes up the thread that is waiting for events. This method could be
+  // called from any thread.
+  void Wakeup();
+
+  // Sets the object that is notified when the poller is woken up. It could
+  // be NULL, in which case the wakeups only interrupts the wait.
+  void set_wakeup_delegate(WakeupDelegate* delegate) {
+    wakeup_delegate_ = delegate;
+  }
+
+  // Causes Run() to return as soon as possible. Quit could be called from
+  // any thread, before or during Run. If called before Run, Run will return
+  // imediately when called.
+  void Quit();
+
+ private:
+  // A registered socket or file descriptor.
+  struct Registration {
+    Socket* socket;
+    int fd;
+    int events;
+    Watcher* watcher;
+  };
+
+  struct Timer {
+    int id;
+    base::TimeTicks deadline;
+    base::TimeDelta interval;
+    bool repeating;
+    TimerDelegate* delegate;
+  };
+
+  // Orders the timers queue by deadline, earliest first.
+  struct TimerLater {
+    bool operator()(const Timer& a, const Timer& b) const {
+      return a.deadline > b.deadline;
+    }
+  };
+
+  typedef std::vector<Registration> Registrations;
+  typedef std::priority_queue<Timer, std::vector<Timer>, TimerLater>
+    TimerQueue;
+
+  // Returns the registration for |socket| or |fd|, or NULL if not found.
+  Registration* FindRegistration(Socket* socket, int fd);
+  void Watch(Socket* socket, int fd, int events, Watcher* watcher);
+  void StopWatching(Socket* socket, int fd);
+
+  // Rebuilds the zmq_poll() items from the registrations.
+  void BuildPollItems();
+
+  // Runs the expired timers.
+  void RunTimers();
+
+  // Drains the wakeup socket and notifies the wakeup delegate.
+  void DrainWakeups();
+
+  Context* context_;
+
+  // The wakeup channel. |wakeup_reader_| is watched as the first poll item
+  // and |wakeup_writer_| is written by Wakeup() under |wakeup_lock_|.
+  scoped_ptr<Socket> wakeup_reader_;
+  scoped_ptr<Socket> wakeup_writer_;
+  base::Lock wakeup_lock_;
+  WakeupDelegate* wakeup_delegate_;
+
+  // Set when a wakeup is pending, so concurrent Wakeup() calls are
+  // coalesced into a single message.
+  base::subtle::Atomic32 wakeup_pending_;
+  base::subtle::Atomic32 quit_called_;
+
+  // The items given to zmq_poll(), which are rebuilt from the registrations
+  // when they change. They are defined by the implementation file, since
+  // zmq_pollitem_t could not be completed here.
+  struct PollItems;
+
+  Registrations registrations_;
+  scoped_ptr<PollItems> poll_items_;
+  bool poll_items_dirty_;
+
+  TimerQueue timers_;
+
+  // The timers that are scheduled, indexed by ID. A timer that is popped
+  // from |timers_| and not found here has been cancelled.
+  std::map<int, Timer> active_timers_;
+  int next_timer_id_;
+
+  DISALLOW_COPY_AND_ASSIGN(Poller);
+};
+
+}  // namespace zmq
+
+#endif  // NODE_ZEROMQ_POLLER_H_
@@ -17,6 +17,19 @@
 
 namespace zmq {
 
+SocketOptions::SocketOptions()
+  : high_water_mark_(0),
+    send_buffer_size_(0),
+    receive_buffer_size_(0),
+    affinity_(0),
+    linger_(-1),
+    has_high_water_mark_(false),
+    has_send_buffer_size_(false),
+    has_receive_buffer_size_(false),
+    has_affinity_(false),
+    has_linger_(false) {
+}
+
 Socket::Socket(scoped_refptr<Context::SocketRef> ref)
   : ref_(ref) {
 }
@@ -60,28 +73,196 @@ bool Socket::Send(SocketFlags flags) {
   return ok;
 }
 
+bool Socket::Send(const Envelope& envelope, SocketFlags flags) {
+  return CheckError(SendEnvelope(envelope, flags)) == ZMQ_OK;
+}
+
+size_t Socket::SendBatch(const Envelope* envelopes, size_t count,
+  SocketFlags flags) {
+  DCHECK(envelopes || !count);
+  for (size_t i = 0; i < count; ++i) {
+    int err = SendEnvelope(envelopes[i], flags);
+    if (err != ZMQ_OK) {
+      CheckError(err);
+      return i;
+    }
+  }
+  return count;
+}
+
+int Socket::SendEnvelope(const Envelope& envelope, SocketFlags flags) {
+  DCHECK(envelope.frames_count);
+  DCHECK(!(flags & kSendMore));
+  if (!is_valid()) {
+    return -1;
+  }
+
+  void* socket = ref_->socket();
+  size_t last_frame = envelope.frames_count - 1;
+  for (size_t i = 0; i <= last_frame; ++i) {
+    // Once the first frame is queued the others are always queued along
+    // with it, by blocking if necessary, so a full socket could never split
+    // the message.
+    int frame_flags = (i == 0) ? flags : (flags & ~kNoBlock);
+    if (i != last_frame) {
+      frame_flags |= kSendMore;
+    }
+    Message* message = envelope.frames[i].get();
+    int err;
+    if (message) {
+      err = zmq_send(socket, message->message(), frame_flags);
+    } else {
+      zmq_msg_t empty;
+      zmq_msg_init(&empty);
+      err = zmq_send(socket, &empty, frame_flags);
+      zmq_msg_close(&empty);
+    }
+
+    // Only the first frame could be refused because the socket is full. A
+    // later frame fails only when the socket could no longer be used, the
+    // context was terminated for example, and the partial message is
+    // discarded along with the socket.
+    if (err != ZMQ_OK) {
+      return err;
+    }
+  }
+  return ZMQ_OK;
+}
+
 bool Socket::Receive(MessageParts* parts, SocketFlags flags) {
   DCHECK(parts);
   bool has_more = true;
-  size_t more_size;
   do {
     // Get the next message part from socket.
-    Message* message = new Message();
-    if (CheckError(
-      zmq_recv(ref_->socket(), message->message(), flags)) != ZMQ_OK) {
+    scoped_refptr<Message> message(new Message());
+    if (ReceivePart(message, flags, &has_more) != ZMQ_OK) {
       return false;
     }
     parts->push_back(message);
-
-    // Check if the message is a multipart message.
-    int err = zmq_getsockopt(ref_->socket(), ZMQ_RCVMORE, &has_more, &more_size);
-    if (CheckError(err) != ZMQ_OK) {
-      return false;
-    }
   } while (has_more);
   return true;
 }
 
+bool Socket::ReceiveBatch(int max_messages, MessageBatch* batch,
+  SocketFlags flags) {
+  DCHECK(batch);
+  DCHECK_GT(max_messages, 0);
+
+  size_t first_message = batch->size();
+  for (int i = 0; i < max_messages; ++i) {
+    // Only the first message is allowed to block, the others should be
+    // received only if they are already queued on the socket.
+    SocketFlags part_flags = (i == 0) ? flags : kNoBlock;
+    bool has_more = true;
+    do {
+      scoped_refptr<Message> message(new Message());
+      if (ReceivePart(message, part_flags, &has_more) != ZMQ_OK) {
+        batch->DiscardPartialMessage();
+        return batch->size() > first_message;
+      }
+      batch->AddFrame(message);
+
+      // The parts of a multi-part message are delivered atomically, once the
+      // first part is received the others are already available.
+      part_flags = kNoBlock;
+    } while (has_more);
+    batch->EndMessage();
+  }
+  return true;
+}
+
+int Socket::ReceivePart(Message* message, SocketFlags flags,
+  bool* has_more) {
+  int err = zmq_recv(ref_->socket(), message->message(), flags);
+  if (err != ZMQ_OK) {
+    if ((flags & kNoBlock) && zmq_errno() == EAGAIN) {
+      return err;
+    }
+    return CheckError(err);
+  }
+
+  // Check if the message is a multipart message.
+#if ZMQ_VERSION_MAJOR < 3
+  int64_t more;
+#else
+  int more;
+#endif
+  size_t more_size = sizeof(more);
+  err = zmq_getsockopt(ref_->socket(), ZMQ_RCVMORE, &more, &more_size);
+  if (err != ZMQ_OK) {
+    return CheckError(err);
+  }
+  *has_more = more != 0;
+  return ZMQ_OK;
+}
+
+bool Socket::SetHighWaterMark(int64 messages) {
+  DCHECK_GE(messages, 0);
+#if ZMQ_VERSION_MAJOR < 3
+  uint64_t hwm = static_cast<uint64_t>(messages);
+  return SetOption(ZMQ_HWM, &hwm, sizeof(hwm));
+#else
+  int hwm = static_cast<int>(messages);
+  return SetOption(ZMQ_SNDHWM, &hwm, sizeof(hwm)) &&
+    SetOption(ZMQ_RCVHWM, &hwm, sizeof(hwm));
+#endif
+}
+
+bool Socket::SetSendBufferSize(int64 bytes) {
+  DCHECK_GE(bytes, 0);
+#if ZMQ_VERSION_MAJOR < 3
+  uint64_t size = static_cast<uint64_t>(bytes);
+#else
+  int size = static_cast<int>(bytes);
+#endif
+  return SetOption(ZMQ_SNDBUF, &size, sizeof(size));
+}
+
+bool Socket::SetReceiveBufferSize(int64 bytes) {
+  DCHECK_GE(bytes, 0);
+#if ZMQ_VERSION_MAJOR < 3
+  uint64_t size = static_cast<uint64_t>(bytes);
+#else
+  int size = static_cast<int>(bytes);
+#endif
+  return SetOption(ZMQ_RCVBUF, &size, sizeof(size));
+}
+
+bool Socket::SetAffinity(uint64 io_threads_mask) {
+  uint64_t affinity = io_threads_mask;
+  return SetOption(ZMQ_AFFINITY, &affinity, sizeof(affinity));
+}
+
+bool Socket::SetLinger(int milliseconds) {
+  DCHECK_GE(milliseconds, -1);
+  return SetOption(ZMQ_LINGER, &milliseconds, sizeof(milliseconds));
+}
+
+bool Socket::SetIdentity(const std::string& identity) {
+  DCHECK(!identity.empty());
+  return SetOption(ZMQ_IDENTITY, identity.data(), identity.size());
+}
+
+bool Socket::SetOptions(const SocketOptions& options) {
+  return
+    (!options.has_high_water_mark() ||
+      SetHighWaterMark(options.high_water_mark())) &&
+    (!options.has_send_buffer_size() ||
+      SetSendBufferSize(options.send_buffer_size())) &&
+    (!options.has_receive_buffer_size() ||
+      SetReceiveBufferSize(options.receive_buffer_size())) &&
+    (!options.has_affinity() || SetAffinity(options.affinity())) &&
+    (!options.has_linger() || SetLinger(options.linger()));
+}
+
+bool Socket::SetOption(int option, const void* value, size_t size) {
+  if (!is_valid()) {
+    return false;
+  }
+  return CheckError(
+    zmq_setsockopt(ref_->socket(), option, value, size)) == ZMQ_OK;
+}
+
 int Socket::CheckError(int err) {
   // Don't add DCHECKs here OnZeromqError() already has them.
   if (err != ZMQ_OK && is_valid()) {
@@ -90,4 +271,21 @@ int Socket::CheckError(int err) {
   return err;
 }
 
+MessageBatch::MessageBatch() {
+}
+
+MessageBatch::~MessageBatch() {
+}
+
+void MessageBatch::Clear() {
+  // clear() does not release the vectors storage.
+  frames_.clear();
+  boundaries_.clear();
+}
+
+void MessageBatch::DiscardPartialMessage() {
+  size_t complete_frames = boundaries_.empty() ? 0 : boundaries_.back();
+  frames_.resize(complete_frames);
+}
+
 }  // namespace zmq
\ No newline at end of file
@@ -6,6 +6,9 @@
 #define NODE_ZEROMQ_SOCKET_H_
 
 #include <string>
+#include <vector>
+
+#include <base/basictypes.h>
 #include <base/memory/ref_counted.h>
 
 #include "node/zeromq/context.h"
@@ -20,6 +23,87 @@ enum SocketFlags {
   kSendMore = 2,
 };
 
+class MessageBatch;
+
+// A set of options that should be applied to a socket. Only the options that
+// was explicitly set are applied, the others keeps the zeromq defaults.
+// SocketOptions are used to carry per endpoint tuning from the command line
+// to the code that creates the socket.
+class SocketOptions {
+ public:
+  SocketOptions();
+
+  // The maximum number of outstanding messages that zeromq queues in memory
+  // for each peer, for both sending and receiving.
+  bool has_high_water_mark() const { return has_high_water_mark_; }
+  int64 high_water_mark() const { return high_water_mark_; }
+  void set_high_water_mark(int64 messages) {
+    high_water_mark_ = messages;
+    has_high_water_mark_ = true;
+  }
+
+  // The size of the kernel send buffer, in bytes.
+  bool has_send_buffer_size() const { return has_send_buffer_size_; }
+  int64 send_buffer_size() const { return send_buffer_size_; }
+  void set_send_buffer_size(int64 bytes) {
+    send_buffer_size_ = bytes;
+    has_send_buffer_size_ = true;
+  }
+
+  // The size of the kernel receive buffer, in bytes.
+  bool has_receive_buffer_size() const { return has_receive_buffer_size_; }
+  int64 receive_buffer_size() const { return receive_buffer_size_; }
+  void set_receive_buffer_size(int64 bytes) {
+    receive_buffer_size_ = bytes;
+    has_receive_buffer_size_ = true;
+  }
+
+  // A bit mask of the context I/O threads that should handle the
+  // connections of the socket.
+  bool has_affinity() const { return has_affinity_; }
+  uint64 affinity() const { return affinity_; }
+  void set_affinity(uint64 io_threads_mask) {
+    affinity_ = io_threads_mask;
+    has_affinity_ = true;
+  }
+
+  // How long, in milliseconds, pending messages are kept after the socket
+  // is closed. -1 means forever and 0 discards them imediately.
+  bool has_linger() const { return has_linger_; }
+  int linger() const { return linger_; }
+  void set_linger(int milliseconds) {
+    linger_ = milliseconds;
+    has_linger_ = true;
+  }
+
+ private:
+  int64 high_water_mark_;
+  int64 send_buffer_size_;
+  int64 receive_buffer_size_;
+  uint64 affinity_;
+  int linger_;
+
+  bool has_high_water_mark_;
+  bool has_send_buffer_size_;
+  bool has_receive_buffer_size_;
+  bool has_affinity_;
+  bool has_linger_;
+};
+
+// An Envelope is a span of frames that should be sent as a single multi-part
+// message. A NULL frame is sent as an empty frame, which is what is
+// usually needed for the delimiter frame of an envelope.
+struct Envelope {
+  Envelope() : frames(NULL), frames_count(0) {}
+  Envelope(const scoped_refptr<Message>* frames, size_t frames_count)
+    : frames(frames),
+      frames_count(frames_count) {
+  }
+
+  const scoped_refptr<Message>* frames;
+  size_t frames_count;
+};
+
 // Normal usage:
 //   zmq::Socket socket(context_.CreateSocket(...))
 //
@@ -96,6 +180,29 @@ class Socket {
   // Send a empty message on a socket.
   bool Send(SocketFlags flags);
 
+  // Send all the frames of |envelope| as a single multi-part message. The
+  // ZMQ_SNDMORE flag is set for all the frames but the last one and must not
+  // be specified in |flags|.
+  //
+  // When ZMQ_NOBLOCK is specified and the message cannot be queued, nothing
+  // is sent. ZMQ_NOBLOCK applies only to the first frame: once it is queued
+  // the remaining frames are sent without it, so they are never refused
+  // because the socket is full and the peer never receives a part of the
+  // message. A later frame could still fail if the socket is no longer
+  // usable, e.g. the context was terminated, and then the partial message
+  // is never delivered. Errors are reported to the error delegate only once
+  // per call.
+  bool Send(const Envelope& envelope, SocketFlags flags);
+
+  // Sends the |count| envelopes pointed by |envelopes| back to back, as if
+  // Send(envelope, flags) was called for each one of them. Stops on the
+  // first envelope that could not be sent and returns the number of
+  // envelopes that was successfully sent. The envelope that could not be
+  // sent is not partially sent, unless the socket is no longer usable, see
+  // Send().
+  size_t SendBatch(const Envelope* envelopes, size_t count,
+    SocketFlags flags);
+
   // Receive all the parts os a message from a socket. The Socket::Receive()
   // function shall receive all the parts of a multi-part message from a socket
   // and store it in |pairs|. If there are no messages available the
@@ -110,25 +217,146 @@ class Socket {
   //     Specifies that the operation should be performed in non-blocking mode.
   //     If there are no messages available on the specified socket, the
   //     Socket::Receive() function shall fail and |message| should contain no
-  //     data.
+  //     data. This failure is not reported to the error delegate.
   //
   // Refer to zeromq docs for a detailed description.
   bool Receive(MessageParts* parts, SocketFlags flags);
 
+  // Receive up to |max_messages| multi-part messages from a socket. The
+  // first message is received accordingly to |flags|, so the call blocks
+  // until a message arrives unless ZMQ_NOBLOCK is specified. The messages
+  // that are already queued on the socket are then received without
+  // blocking, until the queue is drained or |max_messages| are received.
+  //
+  // The received messages are appended to |batch|, which is not cleared
+  // before receiving. Returns true if at least one message was received.
+  // The errors that happens after the first message is received, other than
+  // EAGAIN, are reported to the error delegate, but does not cause this
+  // method to fail.
+  bool ReceiveBatch(int max_messages, MessageBatch* batch, SocketFlags flags);
+
+  // Socket options ---------------------------------------------------------
+  //
+  // Options should be set before Bind() or Connect(), since most of them
+  // only affects the connections that are established after they are set.
+
+  // Sets the high water mark, which is the maximum number of outstanding
+  // messages that zeromq queues in memory for any single peer. When the mark
+  // is reached, the socket blocks or drops messages depending on its type.
+  // Zero means no limit.
+  bool SetHighWaterMark(int64 messages);
+
+  // Sets the size of the underlying kernel transmit and receive buffers, in
+  // bytes. Zero means the OS default.
+  bool SetSendBufferSize(int64 bytes);
+  bool SetReceiveBufferSize(int64 bytes);
+
+  // Sets the I/O thread affinity for the connections created by subsequent
+  // Bind() and Connect() calls. |io_threads_mask| is a bit mask where the
+  // lowest bit corresponds to the first context I/O thread. Zero distributes
+  // the connections among all the I/O threads.
+  bool SetAffinity(uint64 io_threads_mask);
+
+  // Sets how long pending messages are kept in memory after the socket is
+  // closed. -1 means forever and 0 discards them imediately. This also
+  // affects how long Context::Close() could block.
+  bool SetLinger(int milliseconds);
+
+  // Sets the identity of the socket, which is the address that a router
+  // socket uses to reach it. Should be set before Connect().
+  bool SetIdentity(const std::string& identity);
+
+  // Applies all the options that was set on |options|. Stops at the first
+  // option that fails to be set.
+  bool SetOptions(const SocketOptions& options);
+
   // Returns true if the socket can be used.
   bool is_valid() const { return ref_->is_valid(); }
 
  private:
+  // The poller needs the raw zeromq socket to wait for its events.
+  friend class Poller;
+
   // This is intended to check for errors and report them to the context
   // object. It takes a zeromq error code, and returns the same code.
   int CheckError(int err);
 
+  // Sets the socket option |option| to the value pointed by |value|.
+  bool SetOption(int option, const void* value, size_t size);
+
+  // Queues all the frames of |envelope| without reporting errors. Returns
+  // ZMQ_OK on success.
+  int SendEnvelope(const Envelope& envelope, SocketFlags flags);
+
+  // Receives a single message part into |message|. Returns ZMQ_OK on success
+  // and sets |has_more| to true if further message parts follows. The EAGAIN
+  // error of a non-blocking receive is expected and is not reported to the
+  // error delegate.
+  int ReceivePart(Message* message, SocketFlags flags, bool* has_more);
+
   // The actual zeromq socket. This pointer is guarantee non-NULL.
   scoped_refptr<Context::SocketRef> ref_;
 
   DISALLOW_COPY_AND_ASSIGN(Socket);
 };
 
+// A MessageBatch holds the multi-part messages received by a single call to
+// Socket::ReceiveBatch(). The frames of all messages are stored in a single
+// flat buffer and the frame boundaries of each message are recorded, so a
+// batch can be cleared and reused without releasing its storage.
+//
+// Normal usage:
+//   zmq::MessageBatch batch;
+//   while (socket.ReceiveBatch(kMaxMessages, &batch, zmq::kNoFlags)) {
+//     for (size_t i = 0; i < batch.size(); ++i) {
+//       Process(batch.frames(i), batch.frames_count(i));
+//     }
+//     batch.Clear();
+//   }
+class MessageBatch {
+ public:
+  MessageBatch();
+  ~MessageBatch();
+
+  // The number of messages in the batch.
+  size_t size() const { return boundaries_.size(); }
+  bool empty() const { return boundaries_.empty(); }
+
+  // Returns a pointer to the first frame of the message at |index|. The
+  // remaining frames of the message follows it.
+  const scoped_refptr<Message>* frames(size_t index) const {
+    return &frames_[index == 0 ? 0 : boundaries_[index - 1]];
+  }
+
+  // Returns the number of frames of the message at |index|.
+  size_t frames_count(size_t index) const {
+    return boundaries_[index] - (index == 0 ? 0 : boundaries_[index - 1]);
+  }
+
+  // Releases the messages contained in the batch, but keeps the storage
+  // allocated for the next receive.
+  void Clear();
+
+ private:
+  friend class Socket;
+
+  // Appends a frame to the message that is beign received.
+  void AddFrame(Message* message) { frames_.push_back(message); }
+
+  // Marks the end of the message that is beign received.
+  void EndMessage() { boundaries_.push_back(frames_.size()); }
+
+  // Discards the frames that was appended after the last complete message.
+  void DiscardPartialMessage();
+
+  Socket::MessageParts frames_;
+
+  // The index of the frame that follows the last frame of each message.
+  std::vector<size_t> boundaries_;
+
+  DISALLOW_COPY_AND_ASSIGN(MessageBatch);
+};
+
 }  // namespace zmq
 
 #endif  // NODE_ZEROMQ_SOCKET_H_
\ No newline at end of file
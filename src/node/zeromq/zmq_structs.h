@@ -11,4 +11,5 @@
 // be visible to the the users of the "message.h" header file.
 namespace zmq {
   struct zmq_msg_t : public ::zmq_msg_t {};
+  struct zmq_pollitem_t : public ::zmq_pollitem_t {};
 }
\ No newline at end of file
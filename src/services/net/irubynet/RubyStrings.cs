@@ -32,6 +32,13 @@ namespace Nohros.Ruby
     /// </summary>
     public const string kServiceNameFact = "service";
 
+    /// <summary>
+    /// The value of the <see cref="kServiceNameFact"/> fact of the ruby
+    /// service node. Messages sent with this fact are processed by the node
+    /// itself.
+    /// </summary>
+    public const string kNodeServiceName = "ruby";
+
     /// <summary>
     /// Message ID fact.
     /// </summary>
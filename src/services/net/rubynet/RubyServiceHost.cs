@@ -156,6 +156,13 @@ namespace Nohros.Ruby
       AnnounceMessage.Builder builder = new AnnounceMessage.Builder()
         .AddRangeFacts(KeyValuePairs.FromKeyValuePairs(facts));
 
+      // Let the node know how we are connected to it, so it could tell the
+      // local and remote instances apart.
+      var channel = ruby_message_sender_ as RubyMessageChannel;
+      if (channel != null) {
+        builder.SetTransport(channel.Transport);
+      }
+
       RubyMessage message = new RubyMessage.Builder()
         .SetToken("node-announce")
         .SetType((int) NodeMessageType.kNodeAnnounce)
@@ -1,9 +1,12 @@
 ﻿using System;
 using System.Threading;
 using System.Collections.Generic;
+using System.Net;
+using Google.ProtocolBuffers;
 using Nohros.Concurrent;
 using R = Nohros.Resources;
 using Nohros.Ruby.Protocol;
+using Nohros.Ruby.Protocol.Control;
 using ZMQ;
 using ZmqSocket = ZMQ.Socket;
 
@@ -18,14 +21,53 @@ namespace Nohros.Ruby
   {
     const string kClassName = "Nohros.Ruby.RubyMessageChannel";
     const string kSenderChannelEndpoint = "inproc://ruby-multiplex-channel";
+    const string kHelloToken = "host-hello";
+    const string kCreditToken = "node-credit";
+
+    // The time, in milliseconds, to wait for the node to reply to the hello
+    // message sent when the channel is opened.
+    const int kHelloTimeout = 1000;
+
+    // The size, in bytes, of the shared memory rings that is asked to a
+    // local node.
+    const int kSharedMemorySize = 4 * 1024 * 1024;
+
+    // The number of packets that is processed before granting the node the
+    // credits to send the same number of packets. The node sends up to a
+    // thousand packets to a host that has announced a service before it
+    // grants credits, so this should not be above that.
+    const int kCreditBatch = 250;
+
+    // How long, in microseconds, the multiplexer thread waits for a packet
+    // before it checks if the packets that are processed by the other
+    // threads has earned the node more credits.
+    const long kCreditPollTimeout = 100 * 1000;
+
+    static readonly byte[] true_byte_array_ = new byte[] {1};
+    static readonly byte[] false_byte_array_ = new byte[] {0};
 
     readonly Context context_;
     readonly string endpoint_;
     readonly List<ListenerExecutorPair> listeners_;
     readonly IRubyLogger logger_;
     volatile bool channel_is_opened_;
+    volatile TransportType transport_;
     Thread io_multiplexer_thread_;
 
+    // The shared memory channel that the node created for us, if any. It is
+    // used only by the multiplexer thread. The large packets are written
+    // into it only after the node says that it is reading from it.
+    SharedMemoryChannel shared_memory_;
+    bool shared_memory_writable_;
+
+    // The number of packets that took a credit of the node and whose
+    // processing has finished, which is updated by the threads of the
+    // executors, and the number of them that was granted back to the node,
+    // which is used only by the multiplexer thread, since it owns the
+    // socket.
+    long processed_packets_;
+    long granted_packets_;
+
     #region .ctor
     /// <summary>
     /// Initializes a new instance of the <see cref="RubyMessageChannel"/>
@@ -44,9 +86,22 @@ namespace Nohros.Ruby
       listeners_ = new List<ListenerExecutorPair>();
       logger_ = RubyLogger.ForCurrentProcess;
       endpoint_ = endpoint;
+      transport_ = TransportType.kTransportTcp;
     }
     #endregion
 
+    /// <summary>
+    /// Gets the transport that is used to talk with the service node.
+    /// </summary>
+    /// <remarks>
+    /// The channel switches to the ipc endpoint of the node when the node
+    /// is running on the same machine and it accepts ipc connections. The
+    /// value is known only after the channel is opened.
+    /// </remarks>
+    public TransportType Transport {
+      get { return transport_; }
+    }
+
     /// <inheritdoc/>
     public void Dispose() {
       Close(0);
@@ -146,27 +201,268 @@ namespace Nohros.Ruby
       var inproc_socket = context_.Socket(SocketType.REP);
       inproc_socket.Bind(kSenderChannelEndpoint);
 
-      var ipc_socket = context_.Socket(SocketType.DEALER);
-      ipc_socket.Connect(endpoint_);
+      ZmqSocket ipc_socket = ConnectToNode();
 
       var items = new[] {
         inproc_socket.CreatePollItem(IOMultiPlex.POLLIN),
         ipc_socket.CreatePollItem(IOMultiPlex.POLLIN)
       };
-      items[0].PollInHandler += (socket, revents) => Proxy(socket, ipc_socket);
+      items[0].PollInHandler +=
+        (socket, revents) => Forward(socket, ipc_socket);
       items[1].PollInHandler += (socket, revents) => OnMessageReceived(socket);
 
+      try {
+        while (channel_is_opened_) {
+          try {
+            context_.Poll(items, kCreditPollTimeout);
+          } catch (ZMQ.Exception e) {
+            // Prevent the normal context termination to raise an exception.
+            if (e.Errno == (int) ERRNOS.ETERM) {
+              return;
+            }
+            throw;
+          }
+          GrantCredits(ipc_socket);
+        }
+      } finally {
+        if (shared_memory_ != null) {
+          shared_memory_.Dispose();
+          shared_memory_ = null;
+        }
+      }
+    }
+
+    /// <summary>
+    /// Gets a packet from the <paramref name="inproc_socket"/> socket and
+    /// sends it to the node through the <paramref name="ipc_socket"/>
+    /// socket, replying with the status of the send operation.
+    /// </summary>
+    /// <remarks>
+    /// The large packets are written into the shared memory channel, when
+    /// there is one, and only their descriptors are sent through the socket.
+    /// </remarks>
+    void Forward(ZmqSocket inproc_socket, ZmqSocket ipc_socket) {
+      byte[] response = false_byte_array_;
+      try {
+        Queue<byte[]> parts = inproc_socket.RecvAll();
+        while (parts.Count > 1) {
+          parts.Dequeue();
+        }
+        byte[] packet = parts.Dequeue();
+        if (shared_memory_writable_ &&
+          packet.Length >= SharedMemoryChannel.kMinPacketSize) {
+          // The packet goes through the socket when the ring is full.
+          packet = shared_memory_.WritePacket(packet) ?? packet;
+        }
+        if (SendPacket(ipc_socket, packet) == SendStatus.Sent) {
+          response = true_byte_array_;
+        }
+      } catch (System.Exception e) {
+        logger_.Error(
+          string.Format(R.StringResources.Log_MethodThrowsException,
+            "Forward", kClassName), e);
+      }
+      try {
+        inproc_socket.Send(response);
+      } catch {
+        // there is nothing we can do if the send operation over the inproc
+        // socket fails.
+      }
+    }
+
+    /// <summary>
+    /// Sends <paramref name="packet"/> to the node through
+    /// <paramref name="socket"/>.
+    /// </summary>
+    /// <remarks>
+    /// The node receives the messages as [SENDER][EMPTY FRAME][PACKET], so
+    /// the packet is preceded by an empty frame.
+    /// </remarks>
+    static SendStatus SendPacket(ZmqSocket socket, byte[] packet) {
+      socket.SendMore(new byte[0]);
+      return socket.Send(packet);
+    }
+
+    /// <summary>
+    /// Connects to the message channel of the service node.
+    /// </summary>
+    /// <remarks>
+    /// The channel is connected to the configured endpoint. When that
+    /// endpoint is a TCP endpoint of the local machine the node is asked
+    /// for its ipc endpoint and the channel is reconnected to it, which
+    /// avoids the TCP stack for every message. A local node is also asked
+    /// for a shared memory channel, through the socket that is kept.
+    /// </remarks>
+    ZmqSocket ConnectToNode() {
+      var socket = context_.Socket(SocketType.DEALER);
+      socket.Connect(endpoint_);
+      transport_ = TransportType.kTransportTcp;
+      if (endpoint_.StartsWith("ipc://", StringComparison.OrdinalIgnoreCase)) {
+        transport_ = TransportType.kTransportIpc;
+      } else if (!IsLocalTcpEndpoint(endpoint_)) {
+        return socket;
+      }
+
+      if (transport_ == TransportType.kTransportTcp) {
+        HelloMessage hello = Hello(socket, new HelloMessage.Builder().Build());
+        if (hello != null && hello.HasIpcEndpoint) {
+          socket = Reconnect(socket, hello.IpcEndpoint);
+        }
+      }
+      OpenSharedMemory(socket);
+      return socket;
+    }
+
+    /// <summary>
+    /// Connects a new socket to the ipc <paramref name="endpoint"/> of the
+    /// node and closes <paramref name="socket"/>.
+    /// </summary>
+    /// <returns>
+    /// The new socket or <paramref name="socket"/> if the new socket could
+    /// not be connected.
+    /// </returns>
+    ZmqSocket Reconnect(ZmqSocket socket, string endpoint) {
+      var ipc_socket = context_.Socket(SocketType.DEALER);
+      try {
+        ipc_socket.Connect(endpoint);
+      } catch (ZMQ.Exception e) {
+        logger_.Warn("The ipc endpoint " + endpoint
+          + " of the node could not be used. Using " + endpoint_ + ".", e);
+        ipc_socket.Dispose();
+        return socket;
+      }
+      socket.Dispose();
+      transport_ = TransportType.kTransportIpc;
+
+      // The node sees the new socket as a new host.
+      granted_packets_ = Interlocked.Read(ref processed_packets_);
+      return ipc_socket;
+    }
+
+    /// <summary>
+    /// Asks the node for a shared memory channel, opens it and tells the
+    /// node that it could start using it.
+    /// </summary>
+    /// <remarks>
+    /// The channel is read as soon as it is opened, since the node could
+    /// start writing into it before its confirmation arrives. It is written
+    /// only after the node confirms that it is reading from it.
+    /// </remarks>
+    void OpenSharedMemory(ZmqSocket socket) {
+      HelloMessage hello = Hello(socket, new HelloMessage.Builder()
+        .SetSharedMemorySize(kSharedMemorySize)
+        .Build());
+      if (hello == null || !hello.HasSharedMemoryName) {
+        return;
+      }
+
+      string name = hello.SharedMemoryName;
+      shared_memory_ = SharedMemoryChannel.Open(name);
+      if (shared_memory_ == null) {
+        logger_.Warn("The shared memory channel " + name
+          + " could not be opened.");
+        return;
+      }
+
+      hello = Hello(socket, new HelloMessage.Builder()
+        .SetSharedMemoryName(name)
+        .Build());
+      shared_memory_writable_ = hello != null && hello.HasSharedMemoryName &&
+        hello.SharedMemoryName == name;
+    }
+
+    /// <summary>
+    /// Sends a hello message to the node through the given socket and waits
+    /// for its reply.
+    /// </summary>
+    /// <returns>
+    /// The hello message sent by the node or <c>null</c> if the node does
+    /// not reply in time.
+    /// </returns>
+    HelloMessage Hello(ZmqSocket socket, HelloMessage request) {
+      RubyMessage message = RubyMessages.CreateMessage(
+        (int) NodeMessageType.kNodeHello, request.ToByteArray(), kHelloToken);
+      RubyMessagePacket packet = RubyMessages.CreateMessagePacket(message,
+        new[] {
+          new KeyValuePair<string, string>(RubyStrings.kServiceNameFact,
+            RubyStrings.kNodeServiceName)
+        });
+      SendPacket(socket, packet.ToByteArray());
+
+      DateTime deadline = DateTime.Now.AddMilliseconds(kHelloTimeout);
       while (channel_is_opened_) {
+        int timeout = (int) (deadline - DateTime.Now).TotalMilliseconds;
+        if (timeout <= 0) {
+          break;
+        }
+
+        // The messages that arrive before the reply are dispatched as usual.
+        byte[] data = socket.Recv(timeout);
+        if (data == null) {
+          break;
+        }
+        if (data.Length == 0) {
+          continue;
+        }
         try {
-          context_.Poll(items);
-        } catch (ZMQ.Exception e) {
-          // Prevent the normal context termination to raise an exception.
-          if (e.Errno == (int) ERRNOS.ETERM) {
-            return;
+          RubyMessagePacket reply = ParsePacket(data);
+          if (reply == null) {
+            OnPacketProcessed();
+            continue;
+          }
+          if (reply.Message.Type == (int) NodeMessageType.kNodeHello) {
+            return HelloMessage.ParseFrom(reply.Message.Message);
           }
-          throw;
+          Dispatch(reply);
+        } catch (System.Exception e) {
+          logger_.Error(
+            string.Format(R.StringResources.Log_MethodThrowsException,
+              "Hello", kClassName), e);
         }
       }
+      logger_.Warn("The node did not reply to the hello message. Using "
+        + endpoint_ + ".");
+      return null;
+    }
+
+    /// <summary>
+    /// Gets a value indicating if <paramref name="endpoint"/> is a TCP
+    /// endpoint of the local machine.
+    /// </summary>
+    static bool IsLocalTcpEndpoint(string endpoint) {
+      const string kTcpScheme = "tcp://";
+      if (!endpoint.StartsWith(kTcpScheme,
+        StringComparison.OrdinalIgnoreCase)) {
+        return false;
+      }
+
+      string host = endpoint.Substring(kTcpScheme.Length);
+      int port_separator = host.LastIndexOf(':');
+      if (port_separator >= 0) {
+        host = host.Substring(0, port_separator);
+      }
+
+      if (string.Compare(host, "localhost",
+        StringComparison.OrdinalIgnoreCase) == 0) {
+        return true;
+      }
+
+      IPAddress address;
+      if (!IPAddress.TryParse(host, out address)) {
+        return false;
+      }
+      if (IPAddress.IsLoopback(address)) {
+        return true;
+      }
+      try {
+        foreach (IPAddress local in Dns.GetHostAddresses(Dns.GetHostName())) {
+          if (local.Equals(address)) {
+            return true;
+          }
+        }
+      } catch (System.Net.Sockets.SocketException) {
+      }
+      return false;
     }
 
     /// <summary>
@@ -176,13 +472,14 @@ namespace Nohros.Ruby
     void OnMessageReceived(Socket socket) {
       try {
         // Receive the message and dispatch it to the registered listeners.
+        // A packet that could not be read took a credit all the same.
         byte[] message = socket.Recv();
         if (message.Length > 0) {
-          RubyMessagePacket packet = RubyMessagePacket.ParseFrom(message);
-          for (int i = 0, j = listeners_.Count; i < j; i++) {
-            ListenerExecutorPair pair = listeners_[i];
-            pair.Executor.Execute(
-              () => pair.Listener.OnMessagePacketReceived(packet));
+          RubyMessagePacket packet = ParsePacket(message);
+          if (packet != null) {
+            Dispatch(packet);
+          } else {
+            OnPacketProcessed();
           }
         }
       } catch (System.Exception e) {
@@ -191,5 +488,121 @@ namespace Nohros.Ruby
             "GetMessage", kClassName), e);
       }
     }
+
+    /// <summary>
+    /// Accounts a packet that took a credit of the node and whose processing
+    /// has finished.
+    /// </summary>
+    /// <remarks>
+    /// This method could be called by any thread.
+    /// </remarks>
+    void OnPacketProcessed() {
+      Interlocked.Increment(ref processed_packets_);
+    }
+
+    /// <summary>
+    /// Grants the node, through <paramref name="socket"/>, the credits of
+    /// the packets that was processed since the last grant, when there is
+    /// enough of them.
+    /// </summary>
+    /// <remarks>
+    /// The credits are granted only after the packets are processed, so the
+    /// packets that wait for the listeners count against the window of the
+    /// node and the queues of the host could not grow without bound.
+    /// </remarks>
+    void GrantCredits(ZmqSocket socket) {
+      long processed = Interlocked.Read(ref processed_packets_);
+      long ungranted = processed - granted_packets_;
+      if (ungranted < kCreditBatch) {
+        return;
+      }
+
+      CreditMessage credit = new CreditMessage.Builder()
+        .SetMessages((int) Math.Min(ungranted, int.MaxValue))
+        .Build();
+      RubyMessage message = RubyMessages.CreateMessage(
+        (int) NodeMessageType.kNodeCredit, credit.ToByteArray(), kCreditToken);
+      RubyMessagePacket packet = RubyMessages.CreateMessagePacket(message,
+        new[] {
+          new KeyValuePair<string, string>(RubyStrings.kServiceNameFact,
+            RubyStrings.kNodeServiceName)
+        });
+      if (SendPacket(socket, packet.ToByteArray()) == SendStatus.Sent) {
+        granted_packets_ = processed;
+      }
+    }
+
+    /// <summary>
+    /// Parses the packet that was received in <paramref name="frame"/>,
+    /// reading it from the shared memory channel when the frame is a
+    /// descriptor.
+    /// </summary>
+    /// <returns>
+    /// The parsed packet or <c>null</c> if the descriptor or the packet is
+    /// not valid.
+    /// </returns>
+    RubyMessagePacket ParsePacket(byte[] frame) {
+      if (SharedMemoryChannel.IsDescriptor(frame)) {
+        byte[] packet = shared_memory_ != null
+          ? shared_memory_.ReadPacket(frame)
+          : null;
+        if (packet == null) {
+          logger_.Warn("The received shared memory packet is not valid.");
+          return null;
+        }
+        frame = packet;
+      }
+      try {
+        return RubyMessagePacket.ParseFrom(frame);
+      } catch (InvalidProtocolBufferException e) {
+        logger_.Warn("The received packet is not valid.", e);
+        return null;
+      }
+    }
+
+    /// <summary>
+    /// Dispatches <paramref name="packet"/> to the registered listeners.
+    /// </summary>
+    /// <remarks>
+    /// A packet that took a credit is processed when every listener has
+    /// finished with it. The control packets are sent by the node without
+    /// taking a credit, so they are not accounted.
+    /// </remarks>
+    void Dispatch(RubyMessagePacket packet) {
+      bool took_credit = !IsControlPacket(packet);
+      int pending_listeners = listeners_.Count;
+      if (took_credit && pending_listeners == 0) {
+        OnPacketProcessed();
+        return;
+      }
+
+      for (int i = 0, j = listeners_.Count; i < j; i++) {
+        ListenerExecutorPair pair = listeners_[i];
+        pair.Executor.Execute(() => {
+          try {
+            pair.Listener.OnMessagePacketReceived(packet);
+          } finally {
+            if (took_credit &&
+              Interlocked.Decrement(ref pending_listeners) == 0) {
+              OnPacketProcessed();
+            }
+          }
+        });
+      }
+    }
+
+    /// <summary>
+    /// Gets a value indicating if <paramref name="packet"/> is a control
+    /// packet, which the node sends without taking a credit.
+    /// </summary>
+    /// <remarks>
+    /// The control priority is reserved to the packets that the node
+    /// builds, the node lowers the priority of the packets that the peers
+    /// send with it.
+    /// </remarks>
+    static bool IsControlPacket(RubyMessagePacket packet) {
+      return packet.HasHeader &&
+        packet.Header.Priority == MessagePriority.kControlPriority;
+    }
   }
 }
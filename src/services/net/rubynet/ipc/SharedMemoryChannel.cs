@@ -0,0 +1,140 @@
+﻿using System;
+using System.IO;
+
+namespace Nohros.Ruby
+{
+  /// <summary>
+  /// The host side of the shared memory channel that the service node
+  /// creates for a local service host to exchange large packets.
+  /// </summary>
+  /// <remarks>
+  /// The channel owns two rings: the one named [name].node is written by the
+  /// node and read by the host, and the one named [name].host is written by
+  /// the host and read by the node. The packets are written into a ring and
+  /// only a small descriptor is sent over the message channel socket, in
+  /// place of the packet. A descriptor is a <see cref="kDescriptorSize"/>
+  /// bytes frame whose first byte is zero, followed by the position and the
+  /// size of the ring record, in the native byte order.
+  /// <para>
+  /// The channel should be used by a single thread.
+  /// </para>
+  /// </remarks>
+  internal class SharedMemoryChannel : IDisposable
+  {
+    /// <summary>
+    /// The size of a descriptor frame.
+    /// </summary>
+    public const int kDescriptorSize = 12;
+
+    /// <summary>
+    /// The smallest packet, in bytes, that is worth sending through shared
+    /// memory. It is the same threshold that is used by the node.
+    /// </summary>
+    public const int kMinPacketSize = 16 * 1024;
+
+    readonly SharedMemoryRing inbound_;
+    readonly string name_;
+    readonly SharedMemoryRing outbound_;
+
+    #region .ctor
+    SharedMemoryChannel(string name, SharedMemoryRing inbound,
+      SharedMemoryRing outbound) {
+      name_ = name;
+      inbound_ = inbound;
+      outbound_ = outbound;
+    }
+    #endregion
+
+    /// <summary>
+    /// Opens the rings of the channel named <paramref name="name"/>.
+    /// </summary>
+    /// <returns>
+    /// The opened channel or <c>null</c> if the rings could not be opened.
+    /// </returns>
+    public static SharedMemoryChannel Open(string name) {
+      SharedMemoryRing inbound = null, outbound = null;
+      try {
+        inbound = SharedMemoryRing.Open(name + ".node");
+        outbound = SharedMemoryRing.Open(name + ".host");
+      } catch (IOException) {
+      } catch (UnauthorizedAccessException) {
+      }
+
+      if (inbound == null || outbound == null) {
+        if (inbound != null) {
+          inbound.Dispose();
+        }
+        if (outbound != null) {
+          outbound.Dispose();
+        }
+        return null;
+      }
+      return new SharedMemoryChannel(name, inbound, outbound);
+    }
+
+    /// <summary>
+    /// Gets a value indicating if <paramref name="frame"/> is a descriptor.
+    /// </summary>
+    /// <remarks>
+    /// A zero byte is not a valid protobuf tag, so a descriptor is never
+    /// mistaken by a serialized packet.
+    /// </remarks>
+    public static bool IsDescriptor(byte[] frame) {
+      return frame.Length == kDescriptorSize && frame[0] == 0;
+    }
+
+    /// <summary>
+    /// Reads the packet described by <paramref name="descriptor"/> from the
+    /// ring written by the node, releasing the older packets whose
+    /// descriptors was lost.
+    /// </summary>
+    /// <returns>
+    /// The packet bytes or <c>null</c> if the descriptor does not match a
+    /// packet of the ring.
+    /// </returns>
+    public byte[] ReadPacket(byte[] descriptor) {
+      uint position = BitConverter.ToUInt32(descriptor, 4);
+      uint size = BitConverter.ToUInt32(descriptor, 8);
+      return inbound_.Read(position, size);
+    }
+
+    /// <summary>
+    /// Writes <paramref name="packet"/> into the ring written by the host.
+    /// </summary>
+    /// <returns>
+    /// The descriptor that should be sent in place of the packet, or
+    /// <c>null</c> if the ring is full.
+    /// </returns>
+    public byte[] WritePacket(byte[] packet) {
+      uint position;
+      if (!outbound_.Write(packet, out position)) {
+        return null;
+      }
+      var descriptor = new byte[kDescriptorSize];
+      Buffer.BlockCopy(BitConverter.GetBytes(position), 0, descriptor, 4, 4);
+      Buffer.BlockCopy(BitConverter.GetBytes((uint) packet.Length), 0,
+        descriptor, 8, 4);
+      return descriptor;
+    }
+
+    /// <summary>
+    /// Gets the name of the channel.
+    /// </summary>
+    public string Name {
+      get { return name_; }
+    }
+
+    /// <summary>
+    /// Gets the size of each ring of the channel.
+    /// </summary>
+    public uint Capacity {
+      get { return outbound_.Capacity; }
+    }
+
+    /// <inheritdoc/>
+    public void Dispose() {
+      inbound_.Dispose();
+      outbound_.Dispose();
+    }
+  }
+}
@@ -0,0 +1,234 @@
+﻿using System;
+using System.IO.MemoryMappedFiles;
+using System.Threading;
+
+namespace Nohros.Ruby
+{
+  /// <summary>
+  /// The host side of a single-producer single-consumer ring buffer that
+  /// lives in a named shared memory segment created by the service node.
+  /// </summary>
+  /// <remarks>
+  /// The layout of the segment is defined by the node (see
+  /// node/service/shared_memory_ring.h):
+  /// <para>
+  /// [Header][Records]
+  /// </para>
+  /// <para>
+  /// The header holds a magic number, the capacity of the ring and the
+  /// producer and consumer positions, each one in its own cache line. The
+  /// positions are byte counters that are never reset. Each record is
+  /// preceded by a 8 bytes record header that contains the record size and
+  /// is padded to a multiple of 8 bytes. A record never wraps around the end
+  /// of the ring, a wrap marker is written at the end instead.
+  /// </para>
+  /// <para>
+  /// The descriptors that carries the positions of the records could be lost
+  /// or reordered after the records are written, so the consumer never waits
+  /// for the oldest record. Reading a record releases every record that is
+  /// older than it, and a descriptor that arrives after a newer one finds
+  /// its record already released.
+  /// </para>
+  /// </remarks>
+  internal class SharedMemoryRing : IDisposable
+  {
+    const int kRingMagic = 0x52534852;
+    const uint kWrapMarker = 0xFFFFFFFF;
+    const int kRecordHeaderSize = 8;
+
+    // The offsets of the fields of the ring header.
+    const int kCapacityOffset = 4;
+    const int kWritePositionOffset = 64;
+    const int kReadPositionOffset = 128;
+    const int kHeaderSize = 192;
+
+    readonly MemoryMappedFile file_;
+    readonly MemoryMappedViewAccessor view_;
+    readonly uint capacity_;
+
+    #region .ctor
+    SharedMemoryRing(MemoryMappedFile file, MemoryMappedViewAccessor view,
+      uint capacity) {
+      file_ = file;
+      view_ = view;
+      capacity_ = capacity;
+    }
+    #endregion
+
+    /// <summary>
+    /// Opens the ring that lives in the shared memory segment named
+    /// <paramref name="name"/>.
+    /// </summary>
+    /// <returns>
+    /// The opened ring or <c>null</c> if the segment does not contain a
+    /// valid ring.
+    /// </returns>
+    public static SharedMemoryRing Open(string name) {
+      MemoryMappedFile file = MemoryMappedFile.OpenExisting(name,
+        MemoryMappedFileRights.ReadWrite);
+      MemoryMappedViewAccessor view = file.CreateViewAccessor();
+
+      // The magic is published by the node after the rest of the header.
+      int magic = view.ReadInt32(0);
+      Thread.MemoryBarrier();
+      uint capacity = view.ReadUInt32(kCapacityOffset);
+      if (magic != kRingMagic || capacity == 0 ||
+        (capacity & (capacity - 1)) != 0 ||
+        view.Capacity < kHeaderSize + (long) capacity) {
+        view.Dispose();
+        file.Dispose();
+        return null;
+      }
+      return new SharedMemoryRing(file, view, capacity);
+    }
+
+    /// <summary>
+    /// Writes <paramref name="data"/> as the next record of the ring. Must be
+    /// called only by the producer.
+    /// </summary>
+    /// <returns>
+    /// <c>true</c> if the record was written, <c>false</c> if the ring does
+    /// not have enough free space.
+    /// </returns>
+    public bool Write(byte[] data, out uint position) {
+      unchecked {
+        position = 0;
+        uint size = (uint) data.Length;
+        uint record_size = GetRecordSize(size);
+        if (record_size > capacity_) {
+          return false;
+        }
+
+        uint write = view_.ReadUInt32(kWritePositionOffset);
+        uint read = view_.ReadUInt32(kReadPositionOffset);
+        Thread.MemoryBarrier();
+
+        // A record never wraps around the end of the ring, the space that is
+        // left at the end is skipped when it is too small for the record.
+        uint offset = write & (capacity_ - 1);
+        uint skip = 0;
+        if (offset + record_size > capacity_) {
+          skip = capacity_ - offset;
+        }
+        if ((write - read) + skip + record_size > capacity_) {
+          return false;
+        }
+
+        if (skip != 0) {
+          view_.Write(kHeaderSize + offset, kWrapMarker);
+          offset = 0;
+        }
+        view_.WriteArray(kHeaderSize + offset + kRecordHeaderSize, data, 0,
+          data.Length);
+        view_.Write(kHeaderSize + offset, size);
+        position = write + skip;
+
+        // The record is published only after it is fully written.
+        Thread.MemoryBarrier();
+        view_.Write(kWritePositionOffset, position + record_size);
+        return true;
+      }
+    }
+
+    /// <summary>
+    /// Reads the record at <paramref name="position"/> and releases its space
+    /// along with the space of the records that are older than it. Must be
+    /// called only by the consumer.
+    /// </summary>
+    /// <returns>
+    /// The record data, or <c>null</c> if the ring does not have a record of
+    /// <paramref name="size"/> bytes at <paramref name="position"/>: the
+    /// record was already released, was not published yet or the ring is
+    /// corrupt.
+    /// </returns>
+    public byte[] Read(uint position, uint size) {
+      unchecked {
+        uint read = view_.ReadUInt32(kReadPositionOffset);
+        uint write = view_.ReadUInt32(kWritePositionOffset);
+        Thread.MemoryBarrier();
+
+        // The positions are differences of unsigned counters, so a position
+        // that was already released is as far from the read position as one
+        // that was never published.
+        uint available = write - read;
+        if (available > capacity_ || position - read >= available ||
+          (position & 7) != 0) {
+          return null;
+        }
+
+        // The records that are older than the position are crossed one by
+        // one, so a position that falls inside one of them is rejected.
+        uint extent, record_size;
+        while (read != position) {
+          if (!GetRecordExtent(read, available, out extent,
+            out record_size) || extent > position - read) {
+            return null;
+          }
+          read += extent;
+          available -= extent;
+        }
+
+        if (!GetRecordExtent(position, available, out extent,
+          out record_size) || record_size == kWrapMarker ||
+          record_size != size) {
+          return null;
+        }
+        var data = new byte[size];
+        view_.ReadArray(
+          kHeaderSize + (position & (capacity_ - 1)) + kRecordHeaderSize,
+          data, 0, (int) size);
+
+        // The space is reused by the producer only after it is read.
+        Thread.MemoryBarrier();
+        view_.Write(kReadPositionOffset, position + extent);
+        return data;
+      }
+    }
+
+    /// <summary>
+    /// Gets the size of the records area.
+    /// </summary>
+    public uint Capacity {
+      get { return capacity_; }
+    }
+
+    /// <inheritdoc/>
+    public void Dispose() {
+      view_.Dispose();
+      file_.Dispose();
+    }
+
+    /// <summary>
+    /// Gets the space used by the record or the wrap marker at
+    /// <paramref name="position"/>, which should be part of the
+    /// <paramref name="available"/> bytes that was published by the
+    /// producer.
+    /// </summary>
+    /// <returns>
+    /// <c>false</c> if the record does not fit in the available bytes or
+    /// crosses the end of the ring.
+    /// </returns>
+    bool GetRecordExtent(uint position, uint available, out uint extent,
+      out uint size) {
+      unchecked {
+        uint offset = position & (capacity_ - 1);
+        size = view_.ReadUInt32(kHeaderSize + offset);
+        if (size == kWrapMarker) {
+          extent = capacity_ - offset;
+        } else if (size > capacity_ - offset - (uint) kRecordHeaderSize) {
+          extent = 0;
+          return false;
+        } else {
+          extent = GetRecordSize(size);
+        }
+        return extent <= available;
+      }
+    }
+
+    static uint GetRecordSize(uint size) {
+      unchecked {
+        return ((uint) kRecordHeaderSize + size + 7) & ~7U;
+      }
+    }
+  }
+}